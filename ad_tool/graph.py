@@ -1,77 +1,137 @@
-#!/usr/bin/env python
+#!/usr/bin/env python3
 #
 # Library for generate the plots
 #
+# Plots capture files (driver/linux/capfile.h) through the picad module of
+# the host library, and the old .dat files (one value per line) by
+# converting them first.  Only the min, max and mean of each column of the
+# plot are read, from the summary of the file, so a plot of hours of
+# samples takes no longer than one of a few.
+#
+#   graph.py [-w columns] [-p position] [-T from:to] [-o image] file
+#
+# -T takes seconds after the first sample, or sample indexes if the rate
+# the file was taken at is not known.
+# Without matplotlib the columns are printed instead.
+#
 
-from scitools.std import *
-from scitools.easyviz import *
-
-class plt(object):
-    
-    """ Wrapper class to subplot/plot method in scitool pkg.
-    This function is to create specific A/D plots."""
-
-    def __init__(self,probes,measure="voltage",enablegrid=True):
-        """ Init function """
-
-    
-
-        # Set interactive mode on
-        setp(interactive=True)
-
-        # Create the figure
-        fig = figure()
+import getopt
+import math
+import os
+import sys
+import tempfile
 
-        # Set X variable 'time' in zero
-        xtime = 0
-    
-        self.ylabel('voltage (mV)')
-        # Enable/Disable grid
-        if enablegrid:
-            grid('on')
+import picad
 
-    def show_plot(self):
-        show()
+class plt(object):
 
+    """ A/D plots of a capture file: a band from min to max and the mean
+    of one scan position over some columns """
 
+    def __init__(self, path, columns=1000, measure="voltage", enablegrid=True):
+        """ Init function """
+        self.capture = picad.CaptureFile(path)
+        self.info = self.capture.info()
+        self.columns = columns
+        self.measure = measure
+        self.enablegrid = enablegrid
+
+    def columns_of(self, position=0, start=None, stop=None):
+        """ (x, min, max, mean) of each column, in the units of the file; x
+        is seconds after the first sample, or the sample index if the rate
+        is not known, and so are start and stop """
+        info = self.info
+        first, end = info['first_sample'], info['end_sample']
+        if info['rate'] > 0:
+            t0 = self.capture.time_of(first) if info['samples'] else 0
+            if start is not None:
+                first = self.capture.sample_at(t0 + int(start * 1e9))
+            if stop is not None:
+                end = self.capture.sample_at(t0 + int(stop * 1e9))
+        else:
+            first = int(start) if start is not None else first
+            end = int(stop) if stop is not None else end
+        level, buckets = self.capture.plot(first, end, position, self.columns)
+
+        gain, offset = info['gains'][position], info['offsets'][position]
+        out = []
+        for i, b in enumerate(buckets):
+            x = first + (end - first) * i / max(self.columns, 1)
+            if info['rate'] > 0:
+                x = (x - info['first_sample']) / info['rate']
+            if b is None:
+                out.append((x, math.nan, math.nan, math.nan))
+            else:
+                out.append((x, offset + gain * b[0], offset + gain * b[1],
+                            offset + gain * b[2]))
+        return out
+
+    def show_plot(self, position=0, start=None, stop=None, image=None):
+        """ plot one scan position, or print its columns without matplotlib """
+        data = self.columns_of(position, start, stop)
+        try:
+            import matplotlib
+            if image:
+                matplotlib.use('Agg')
+            import matplotlib.pyplot as pyplot
+        except ImportError:
+            for t, low, high, mean in data:
+                print('%.6g %.10g %.10g %.10g' % (t, low, high, mean))
+            return
+
+        t = [d[0] for d in data]
+        pyplot.fill_between(t, [d[1] for d in data], [d[2] for d in data],
+                            color='0.8', step='post')
+        pyplot.step(t, [d[3] for d in data], 'b-', where='post')
+        pyplot.xlabel('time (sec)' if self.info['rate'] > 0 else 'sample')
+        pyplot.ylabel(self.measure)
+        pyplot.title('AN%d' % self.info['channels'][position])
+        if self.enablegrid:
+            pyplot.grid(True)
+        if image:
+            pyplot.savefig(image)
+        else:
+            pyplot.show()
+
+def from_dat(path, gain=0.001):
+    """ a .dat file as a temporary capture file, as 'captool -c' does """
+    values = []
+    for line in open(path):
+        line = line.strip()
+        if line and not line.startswith('#'):
+            values.append(float(line))
+    low = math.floor(min(values or [0]) / gain) * gain
+    samples = bytearray()
+    for v in values:
+        samples += int(math.floor((v - low) / gain + 0.5)).to_bytes(2, sys.byteorder)
+    fd, capture = tempfile.mkstemp(suffix='.cap')
+    os.close(fd)
+    writer = picad.CaptureWriter(capture, gains=[gain], offsets=[low])
+    if values:
+        writer.append(0, 0, memoryview(samples).cast('H'))
+    writer.close()
+    return capture
 
 if __name__ == "__main__":
 
-
-
-
-    import pdb; pdb.set_trace()
-
-    setp(interactive=False)
-    a = figure()
-    
-    t = linspace(0,1,51)
-    y1 = sin(2*pi*t)
-    y2 = cos(2*pi*3*t)
-    
-    subplot(3,1,1)
-    plot(t, y1, 'ro-')
-    hold('on')
-    plot(t, y2, 'b--')
-    title('This is the title')
-    ylabel('voltage (mV)')
-    axis([0, 1, -1.5, 1.5])
-    
-    raw_input("press enter")
-#
-#    subplot(3,1,2)
-#    plot(t, y1+y2, 'm:')
-#    axis([0, 1, -3, 3])
-#    grid('on')
-#    xlabel('time (sec)')
-#    ylabel('voltage (mV)')
-#
-#    subplot(3,1,3)
-#    plot(t, y1+y2, 'm:')
-#    axis([0, 1, -3, 3])
-#    grid('on')
-#    xlabel('time (sec)')
-#    ylabel('voltage (mV)')
-#
-#    show()
-#
+    opts, args = getopt.getopt(sys.argv[1:], 'w:p:T:o:')
+    opts = dict(opts)
+    if len(args) != 1:
+        sys.stderr.write('usage: graph.py [-w columns] [-p position] '
+                         '[-T from:to] [-o image] file\n')
+        sys.exit(2)
+
+    path = args[0]
+    if path.endswith('.dat'):
+        path = from_dat(path)
+    try:
+        start = stop = None
+        if '-T' in opts:
+            start, stop = [float(v) for v in opts['-T'].split(':')]
+        p = plt(path, int(opts.get('-w', 1000)))
+        p.show_plot(int(opts.get('-p', 0)), start, stop, opts.get('-o'))
+    finally:
+        if path != args[0]:
+            for f in (path, path + '.lod'):
+                if os.path.exists(f):
+                    os.remove(f)
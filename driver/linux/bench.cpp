@@ -0,0 +1,491 @@
+/*   bench.cpp - Throughput and latency of the path from the board to the
+ *               consumers.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * bench [-d transport] [-r hz] [-s ch[:acqt],...] [-t seconds]
+ *       [-n transfers,...] [-p packets,...] [-c consumers,...] [-b blocks]
+ *       [-q pings] [-j]
+ *
+ * Streams for some seconds with every combination of the transfers kept
+ * queued (-n), the packets per transfer (-p) and the RING_BLOCK consumers
+ * of the SampleRing (-c), and prints for each run:
+ *
+ *   samples/s      taken by the consumers, sustained over the run
+ *   lost           packets lost on the bus, samples dropped by the board
+ *                  and blocks not published because the ring was full
+ *   transfer       latency from the frame the first sample of a transfer
+ *                  was queued in to the completion of the transfer
+ *   consumer       the same to a consumer having the block in hand
+ *   cpu            host CPU time (user and system) per million samples
+ *
+ * Latencies are the 50th, 90th and 99th percentiles and the highest, in
+ * ms, on the host clock.  The frame a sample was queued in is taken to
+ * the host clock from the start of the run: the first packet received is
+ * put at the time the start request was sent, and every frame after it
+ * 1 ms later.  So they are no finer than the frame, and may read high by
+ * the round trip of the start request.  Before the runs -q pings time the
+ * one sample per request exchange of main.c: a packet to EP1 OUT, a
+ * conversion of the scan list and the answer on EP1 IN.
+ *
+ * The transport is any one CreateTransport() takes: "usb" for the board,
+ * "virtual:0" for the ceiling of the host side (the VirtualDevice then
+ * runs as fast as it is read).  With "virtual" the device model runs in
+ * the process and its CPU time is counted too; "unix:path", to a vdevice,
+ * leaves it out.  "virtual:0" gets no latencies (nan): its frames come
+ * faster than the host's clock goes.
+ *
+ * -j prints one JSON object a line instead of a table, for keeping the
+ * results from one release to the next.
+ **/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "picad.h"
+
+/**
+ * How early, in ms, a packet may seem to arrive before its frame: the
+ * frame counts whole ms
+ **/
+static const double LATE_SLACK = 2;
+
+static double Now()
+{
+  using namespace std::chrono;
+  return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * CpuTime() -  User and system time of the process, in s
+ **/
+static double CpuTime()
+{
+  struct rusage u;
+
+  getrusage(RUSAGE_SELF, &u);
+  return u.ru_utime.tv_sec + u.ru_stime.tv_sec +
+         (u.ru_utime.tv_usec + u.ru_stime.tv_usec) / 1e6;
+}
+
+/**
+ * Percentiles - 50th, 90th, 99th and highest of some measures
+ **/
+struct Percentiles {
+  Percentiles() : p50(NAN), p90(NAN), p99(NAN), max(NAN) {}
+  explicit Percentiles(std::vector<double> v) : Percentiles()
+  {
+    if (v.empty())
+      return;
+    std::sort(v.begin(), v.end());
+    p50 = At(v, 0.50);
+    p90 = At(v, 0.90);
+    p99 = At(v, 0.99);
+    max = v.back();
+  }
+  static double At(const std::vector<double> &v, double p)
+  {
+    return v[std::min(v.size(), (size_t) ceil(p * v.size())) - 1];
+  }
+
+  double p50, p90, p99, max;
+};
+
+/**
+ * BoardClock - Frames of the board on the host clock, for one run
+ *
+ * The Reader thread marks the frame of the first packet, before any
+ * consumer sees it.
+ **/
+struct BoardClock {
+  BoardClock() : origin(0), first(0), marked(false) {}
+
+  void Mark(uint32_t frame)
+  {
+    if (!marked) {
+      first = frame;
+      marked = true;
+    }
+  }
+  /* Host time, in ms, of a frame after the first */
+  double Host(uint32_t frame) const
+  {
+    return origin + (int32_t) (frame - first);
+  }
+
+  double origin;                /* ms, when the start request was sent */
+  uint32_t first;
+  std::atomic<bool> marked;
+};
+
+/**
+ * Consumer - A RING_BLOCK reader of its own thread, looking at every sample
+ *
+ * The first one also checks the stream and times the blocks.
+ **/
+struct Consumer {
+  Consumer(picad::SampleRing &ring, const BoardClock &clock, bool check)
+    : reader(ring, picad::RING_BLOCK), clock(clock), check(check), stop(false),
+      samples(0), sum(0)
+  {
+    if (check)
+      latency.reserve(1 << 20);
+  }
+  ~Consumer() { Stop(); }
+
+  void Start() { thread = std::thread(&Consumer::Run, this); }
+  void Stop()
+  {
+    stop = true;
+    if (thread.joinable())
+      thread.join();
+  }
+
+  void Run()
+  {
+    const picad::SampleBlock *b;
+    double now;
+    unsigned int i;
+
+    for (;;) {
+      if ((b = reader.Acquire(stop ? 0 : 100)) == 0) {
+        if (stop)
+          break;                /* And nothing left in the ring */
+        continue;
+      }
+      for (i = 0; i < b->header.count; i++)
+        sum += b->samples[i];
+      samples += b->header.count;
+      if (check) {
+        now = Now();
+        checker.Check(b->header, now);
+        if (latency.size() < latency.capacity())
+          latency.push_back(now * 1000 - clock.Host(b->header.frame));
+      }
+      reader.Release();
+    }
+  }
+
+  picad::RingReader reader;
+  const BoardClock &clock;
+  picad::StreamChecker checker;
+  bool check;
+  std::thread thread;
+  volatile bool stop;
+  unsigned long long samples;
+  unsigned long long sum;       /* So the samples are really read */
+  std::vector<double> latency;  /* ms, arrival less conversion */
+};
+
+/**
+ * Result - What one run measured
+ **/
+struct Result {
+  unsigned int transfers, packets, consumers;
+  double seconds;
+  unsigned long long samples;
+  unsigned long lostPackets, lostSamples, overflows;
+  Percentiles transfer, consumer;
+  double cpu;                   /* ms per million samples */
+};
+
+/**
+ * Run() -      Stream for some seconds with one set of options
+ **/
+static Result Run(picad::Device &device, const picad::Reader::Options &options,
+                  unsigned int consumers, size_t blocks, double seconds)
+{
+  picad::SampleRing ring(blocks);
+  picad::Consumer publish = ring.GetConsumer();
+  std::vector<std::unique_ptr<Consumer> > readers;
+  std::vector<double> transfer;
+  BoardClock clock;
+  double start, cpu, least;
+  Result r;
+  unsigned int i;
+
+  transfer.reserve(1 << 20);
+  picad::Reader reader(device, [&](const uint8_t *data, size_t len) {
+    /* First packet of the transfer: its frame, low byte first */
+    uint32_t frame;
+
+    if (len >= 10) {
+      frame = data[6] | data[7] << 8 | data[8] << 16 | (uint32_t) data[9] << 24;
+      clock.Mark(frame);
+      if (transfer.size() < transfer.capacity())
+        transfer.push_back(Now() * 1000 - clock.Host(frame));
+    }
+    publish(data, len);
+  }, options);
+
+  for (i = 0; i < consumers; i++) {
+    readers.push_back(std::unique_ptr<Consumer>(new Consumer(ring, clock,
+                                                             i == 0)));
+    readers.back()->Start();
+  }
+  reader.Start();
+  clock.origin = Now() * 1000;
+  device.Start();
+  start = Now();
+  cpu = CpuTime();
+  std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+  r.seconds = Now() - start;    /* Nothing is converted after the stop */
+  device.Stop();
+  reader.Stop();
+  for (i = 0; i < consumers; i++)
+    readers[i]->Stop();
+  cpu = CpuTime() - cpu;
+
+  Consumer &c = *readers[0];
+  r.transfers = options.transfers;
+  r.packets = options.packetsPerTransfer;
+  r.consumers = consumers;
+  r.samples = c.samples;
+  r.overflows = ring.Overflows();
+  /* Blocks the ring had no room for are sequence gaps to the checker too */
+  r.lostPackets = c.checker.lostPackets - std::min(c.checker.lostPackets, r.overflows);
+  r.lostSamples = c.checker.lostSamples;
+  /* A packet in before its frame had come: the board's clock is not real */
+  least = HUGE_VAL;
+  for (i = 0; i < transfer.size(); i++)
+    least = std::min(least, transfer[i]);
+  for (i = 0; i < c.latency.size(); i++)
+    least = std::min(least, c.latency[i]);
+  if (least > -LATE_SLACK) {
+    r.transfer = Percentiles(transfer);
+    r.consumer = Percentiles(c.latency);
+  }
+  r.cpu = r.samples ? cpu * 1e3 / (r.samples / 1e6) : NAN;
+  if (reader.LastError())
+    fprintf(stderr, "bench: %s\n", picad::Error("EP1 IN", reader.LastError()).what());
+  return r;
+}
+
+/**
+ * Ping() -     Time the one sample per request exchange, in us
+ **/
+static Percentiles Ping(picad::Device &device, unsigned int count)
+{
+  std::vector<double> times;
+  uint8_t request = 'A', answer[picad::PACKET_BYTES];
+  double t;
+  unsigned int i;
+
+  for (i = 0; i < count; i++) {
+    t = Now();
+    device.BulkWrite(&request, 1);
+    device.BulkRead(answer, sizeof(answer));
+    times.push_back((Now() - t) * 1e6);
+  }
+  return Percentiles(times);
+}
+
+/**
+ * ParseList() -        "a,b,c" to numbers
+ **/
+static std::vector<unsigned int> ParseList(const char *arg)
+{
+  std::vector<unsigned int> v;
+  const char *p = arg;
+  char *end;
+  long n;
+
+  do {
+    n = strtol(p, &end, 0);
+    if (end == p || n <= 0 || (*end && *end != ',')) {
+      fprintf(stderr, "bench: bad list '%s'\n", arg);
+      exit(2);
+    }
+    v.push_back((unsigned int) n);
+    p = end + 1;
+  } while (*end);
+  return v;
+}
+
+/**
+ * ParseScan() -        "ch[:acqt],..." to scan list entries, as capture does
+ **/
+static std::vector<uint8_t> ParseScan(const char *arg)
+{
+  std::vector<uint8_t> entries;
+  const char *p = arg;
+  char *end;
+  long ch, acqt;
+
+  do {
+    ch = strtol(p, &end, 0);
+    acqt = 1;
+    if (end != p && *end == ':')
+      acqt = strtol(end + 1, &end, 0);
+    if (end == p || ch < 0 || ch > 12 || acqt < 0 || acqt > 7 ||
+        (*end && *end != ',')) {
+      fprintf(stderr, "bench: bad scan list '%s'\n", arg);
+      exit(2);
+    }
+    entries.push_back((uint8_t) (ch | (acqt << 4)));
+    p = end + 1;
+  } while (*end);
+  return entries;
+}
+
+static void Usage()
+{
+  fprintf(stderr, "usage: bench [-d transport] [-r hz] [-s ch[:acqt],...]"
+                  " [-t seconds] [-n transfers,...] [-p packets,...]"
+                  " [-c consumers,...] [-b blocks] [-q pings] [-j]\n");
+  exit(2);
+}
+
+static void PrintJsonValue(const char *name, double v)
+{
+  if (isnan(v))
+    printf("\"%s\": null", name);
+  else
+    printf("\"%s\": %.3f", name, v);
+}
+
+static void PrintJson(const char *name, const Percentiles &p)
+{
+  printf(", \"%s\": {", name);
+  PrintJsonValue("p50", p.p50);
+  printf(", ");
+  PrintJsonValue("p90", p.p90);
+  printf(", ");
+  PrintJsonValue("p99", p.p99);
+  printf(", ");
+  PrintJsonValue("max", p.max);
+  printf("}");
+}
+
+int main(int argc, char **argv)
+{
+  std::vector<unsigned int> transfers(1, 8), packets(1, 4), consumers(1, 1);
+  picad::Reader::Options options;
+  std::vector<uint8_t> scan;
+  const char *spec = "usb";
+  unsigned long rate = 0, blocks = 1024;
+  unsigned int pings = 100, n, p, c;
+  double seconds = 2;
+  bool json = false;
+  int ch;
+
+  while ((ch = getopt(argc, argv, "d:r:s:t:n:p:c:b:q:j")) != -1) {
+    switch (ch) {
+    case 'd': spec = optarg; break;
+    case 'r': rate = strtoul(optarg, 0, 0); break;
+    case 's': scan = ParseScan(optarg); break;
+    case 't': seconds = atof(optarg); break;
+    case 'n': transfers = ParseList(optarg); break;
+    case 'p': packets = ParseList(optarg); break;
+    case 'c': consumers = ParseList(optarg); break;
+    case 'b': blocks = strtoul(optarg, 0, 0); break;
+    case 'q': pings = atoi(optarg); break;
+    case 'j': json = true; break;
+    default: Usage();
+    }
+  }
+  if (optind != argc || seconds <= 0)
+    Usage();
+
+  try {
+    std::unique_ptr<picad::Transport> transport = picad::CreateTransport(spec);
+    picad::Device device(*transport);
+    picad::RateInfo reached;
+    std::string serial;
+
+    device.Open();
+    try {
+      serial = device.GetSerial();
+    } catch (const picad::Error &) {
+    }
+    if (!scan.empty())
+      device.SetScan(scan);
+    device.SetRate(rate);
+    reached = device.GetRate();
+
+    if (json)
+      printf("{\"transport\": \"%s\", \"serial\": \"%s\", \"rate\": %.3f, "
+             "\"highest\": %.3f, \"scan\": %zu",
+             spec, serial.c_str(), reached.reached, reached.highest,
+             std::max(scan.size(), (size_t) 1));
+    else
+      printf("%s, serial number %s, %s%.3f samples/s (highest %.3f)\n", spec,
+             serial.c_str(), rate ? "" : "untimed, ",
+             rate ? reached.reached : reached.highest, reached.highest);
+    if (pings) {
+      Percentiles rtt = Ping(device, pings);
+      if (json) {
+        printf(", \"pings\": %u", pings);
+        PrintJson("round_trip_us", rtt);
+      } else {
+        printf("round trip EP1 OUT -> A/D -> EP1 IN: %.0f %.0f %.0f %.0f us"
+               " (p50 p90 p99 max, %u pings)\n",
+               rtt.p50, rtt.p90, rtt.p99, rtt.max, pings);
+      }
+    }
+    if (json)
+      printf("}\n");
+    else
+      printf("\n%5s %5s %5s %12s %8s %8s %8s %27s %27s %9s\n", "xfers",
+             "pkts", "cons", "samples/s", "pkt lost", "dropped", "ring",
+             "transfer ms p50/90/99/max", "consumer ms p50/90/99/max",
+             "cpu ms/M");
+    fflush(stdout);
+
+    for (n = 0; n < transfers.size(); n++)
+      for (p = 0; p < packets.size(); p++)
+        for (c = 0; c < consumers.size(); c++) {
+          options.transfers = transfers[n];
+          options.packetsPerTransfer = packets[p];
+          Result r = Run(device, options, consumers[c], blocks, seconds);
+          if (json) {
+            printf("{\"transport\": \"%s\", \"transfers\": %u, \"packets\": %u, "
+                   "\"consumers\": %u, \"seconds\": %.3f, \"samples\": %llu, "
+                   "\"samples_per_s\": %.1f, \"packets_lost\": %lu, "
+                   "\"samples_dropped\": %lu, \"ring_overflows\": %lu",
+                   spec, r.transfers, r.packets, r.consumers, r.seconds,
+                   r.samples, r.samples / r.seconds, r.lostPackets,
+                   r.lostSamples, r.overflows);
+            PrintJson("transfer_latency_ms", r.transfer);
+            PrintJson("consumer_latency_ms", r.consumer);
+            printf(", \"cpu_ms_per_msample\": %.3f}\n", r.cpu);
+          } else {
+            printf("%5u %5u %5u %12.0f %8lu %8lu %8lu %6.1f %6.1f %6.1f %6.1f"
+                   " %6.1f %6.1f %6.1f %6.1f %9.1f\n",
+                   r.transfers, r.packets, r.consumers, r.samples / r.seconds,
+                   r.lostPackets, r.lostSamples, r.overflows,
+                   r.transfer.p50, r.transfer.p90, r.transfer.p99, r.transfer.max,
+                   r.consumer.p50, r.consumer.p90, r.consumer.p99, r.consumer.max,
+                   r.cpu);
+          }
+          fflush(stdout);
+        }
+    device.Close();
+  } catch (const picad::Error &e) {
+    fprintf(stderr, "bench: %s\n", e.what());
+    return 2;
+  }
+  return 0;
+}
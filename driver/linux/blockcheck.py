@@ -0,0 +1,50 @@
+#!/usr/bin/env python3
+#
+# Views of a Block kept past its release, on the virtual device: the slot
+# stays held and the samples seen do not change ('make check-python').
+#
+
+import picad
+import sys
+import time
+
+def refused(release):
+    """ whether release() raises BufferError """
+    try:
+        release()
+    except BufferError:
+        return True
+    return False
+
+def kept(view):
+    """ whether the samples of a view stay as they are while the stream
+    goes on filling the ring """
+    samples = view.tolist()
+    time.sleep(0.2)
+    return view.tolist() == samples
+
+dev = picad.Device('virtual')
+dev.open()
+dev.set_rate(20000)
+reader = dev.reader()
+dev.start()
+
+block = reader.acquire(1500)
+view = memoryview(block)
+ok = refused(block.release) and refused(lambda: reader.acquire(0))
+ok = kept(view) and ok
+view.release()
+ok = block.release() and ok
+
+# a callback keeping a view stops, and stop() raises BufferError
+views = []
+reader.start(lambda b: views.append(memoryview(b)))
+time.sleep(0.2)
+ok = refused(reader.stop) and len(views) == 1 and kept(views[0]) and ok
+views[0].release()
+
+dev.stop()
+dev.close()
+if not ok:
+    sys.stderr.write('blockcheck: a block view changed or was released\n')
+sys.exit(0 if ok else 1)
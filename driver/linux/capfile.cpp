@@ -0,0 +1,651 @@
+/*   capfile.cpp - Chunked binary capture files.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cmath>
+#include "capfile.h"
+
+namespace picad {
+
+static const char HEADER_MAGIC[] = "PICADCAP";
+static const char CHUNK_MAGIC[] = "CHNK";
+static const char TRAILER_MAGIC[] = "PICADIDX";
+
+static void Put(uint8_t *p, uint64_t value, int n)
+{
+  while (n--) {
+    *p++ = (uint8_t) value;
+    value >>= 8;
+  }
+}
+
+static uint64_t Get(const uint8_t *p, int n)
+{
+  uint64_t v = 0;
+
+  while (n--)
+    v = (v << 8) | p[n];
+  return v;
+}
+
+static void PutDouble(uint8_t *p, double value)
+{
+  uint64_t v;
+
+  memcpy(&v, &value, 8);
+  Put(p, v, 8);
+}
+
+static double GetDouble(const uint8_t *p)
+{
+  uint64_t v = Get(p, 8);
+  double value;
+
+  memcpy(&value, &v, 8);
+  return value;
+}
+
+/**
+ * Crc32() -    CRC-32 (IEEE 802.3) of len bytes, going on from crc
+ *
+ * Start with crc 0.
+ **/
+static uint32_t Crc32(uint32_t crc, const uint8_t *p, size_t len)
+{
+  static uint32_t table[256];
+  static std::once_flag made;
+
+  std::call_once(made, []() {
+    uint32_t c;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+      c = i;
+      for (j = 0; j < 8; j++)
+        c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+  });
+
+  crc = ~crc;
+  while (len--)
+    crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+static size_t Capacity(size_t chunkBytes)
+{
+  return (chunkBytes - CAPTURE_CHUNK_HEADER_BYTES) / 2;
+}
+
+static void PutEntry(uint8_t *p, const CaptureChunk &c)
+{
+  Put(p, c.first, 8);
+  Put(p + 8, (uint64_t) c.time, 8);
+  Put(p + 16, c.count, 4);
+  p[20] = c.position;
+  p[21] = c.flags;
+}
+
+static CaptureChunk GetEntry(const uint8_t *p)
+{
+  CaptureChunk c;
+
+  c.first = Get(p, 8);
+  c.time = (int64_t) Get(p + 8, 8);
+  c.count = (uint32_t) Get(p + 16, 4);
+  c.position = p[20];
+  c.flags = p[21];
+  return c;
+}
+
+CaptureInfo::CaptureInfo()
+  : rate(0), startTime(0), positions(1)
+{
+  unsigned int i;
+
+  for (i = 0; i < CAPTURE_MAX_POSITIONS; i++) {
+    channel[i] = i;
+    gain[i] = 1;
+    offset[i] = 0;
+  }
+}
+
+/**
+ * PutHeader(), GetHeader() -   The file header, see capfile.h
+ *
+ * GetHeader() throws if it is not a header it can read.
+ **/
+static void PutHeader(uint8_t *h, const CaptureInfo &info, size_t chunkBytes)
+{
+  unsigned int i;
+
+  memset(h, 0, CAPTURE_HEADER_BYTES);
+  memcpy(h, HEADER_MAGIC, 8);
+  Put(h + 8, CAPTURE_VERSION, 2);
+  Put(h + 10, CAPTURE_HEADER_BYTES, 2);
+  Put(h + 12, chunkBytes, 4);
+  PutDouble(h + 16, info.rate);
+  Put(h + 24, (uint64_t) info.startTime, 8);
+  h[32] = (uint8_t) info.positions;
+  for (i = 0; i < CAPTURE_MAX_POSITIONS; i++) {
+    h[36 + i] = info.channel[i];
+    PutDouble(h + 72 + 16 * i, info.gain[i]);
+    PutDouble(h + 80 + 16 * i, info.offset[i]);
+  }
+  memcpy(h + 52, info.serial.data(), std::min(info.serial.size(), SERIAL_MAX));
+  Put(h + 508, Crc32(0, h, 508), 4);
+}
+
+static void GetHeader(const uint8_t *h, size_t len, const std::string &path,
+                      CaptureInfo &info, size_t &chunkBytes)
+{
+  unsigned int i;
+
+  if (len < CAPTURE_HEADER_BYTES || memcmp(h, HEADER_MAGIC, 8) != 0)
+    throw Error(path + ": not a capture file");
+  if (Get(h + 8, 2) != CAPTURE_VERSION ||
+      Get(h + 10, 2) != CAPTURE_HEADER_BYTES)
+    throw Error(path + ": capture file version not supported");
+  if (Get(h + 508, 4) != Crc32(0, h, 508))
+    throw Error(path + ": capture file header damaged");
+  chunkBytes = (size_t) Get(h + 12, 4);
+  info.rate = GetDouble(h + 16);
+  info.startTime = (int64_t) Get(h + 24, 8);
+  info.positions = h[32];
+  if (chunkBytes <= CAPTURE_CHUNK_HEADER_BYTES || info.positions == 0 ||
+      info.positions > CAPTURE_MAX_POSITIONS)
+    throw Error(path + ": capture file header damaged");
+  for (i = 0; i < CAPTURE_MAX_POSITIONS; i++) {
+    info.channel[i] = h[36 + i];
+    info.gain[i] = GetDouble(h + 72 + 16 * i);
+    info.offset[i] = GetDouble(h + 80 + 16 * i);
+  }
+  info.serial.assign((const char *) h + 52,
+                     strnlen((const char *) h + 52, SERIAL_MAX));
+}
+
+/**
+ * CaptureWriter() -    Make a new capture file, replacing any old one
+ * @chunkBytes:         Bytes of every chunk, its header included
+ **/
+CaptureWriter::CaptureWriter(const std::string &path, const CaptureInfo &info,
+                             size_t chunkBytes)
+  : path(path), fd(-1), info(info), chunkBytes(chunkBytes), samples(0)
+{
+  uint8_t h[CAPTURE_HEADER_BYTES];
+
+  if (info.positions == 0 || info.positions > CAPTURE_MAX_POSITIONS)
+    throw Error(path + ": bad number of scan positions");
+  if (chunkBytes < CAPTURE_CHUNK_HEADER_BYTES + 2 || chunkBytes % 2 ||
+      chunkBytes > 0x40000000)
+    throw Error(path + ": bad chunk size");
+  fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    throw Error(path + ": " + strerror(errno));
+  chunk.assign(chunkBytes, 0);
+  current.count = 0;
+  summary.reset(new SummaryPyramid(info.positions));
+  PutHeader(h, info, chunkBytes);
+  try {
+    Write(h, sizeof(h), 0);
+    Flush();
+  } catch (const Error &) {
+    close(fd);
+    throw;
+  }
+}
+
+/**
+ * CaptureWriter() -    Go on with an existing capture file
+ **/
+CaptureWriter::CaptureWriter(const std::string &path)
+  : path(path), fd(-1), chunkBytes(0), samples(0)
+{
+  {
+    CaptureReader reader(path);
+    size_t k;
+
+    info = reader.Info();
+    chunkBytes = reader.ChunkBytes();
+    for (k = 0; k < reader.Chunks(); k++)
+      index.push_back(reader.Chunk(k));
+    samples = reader.Samples();
+    summary.reset(new SummaryPyramid(reader.Summary()));
+  }
+  fd = open(path.c_str(), O_RDWR);
+  if (fd < 0)
+    throw Error(path + ": " + strerror(errno));
+  if (ftruncate(fd, CAPTURE_HEADER_BYTES + index.size() * chunkBytes) < 0) {
+    int e = errno;
+    close(fd);
+    throw Error(path + ": " + strerror(e));
+  }
+  chunk.assign(chunkBytes, 0);
+  current.count = 0;
+}
+
+CaptureWriter::~CaptureWriter()
+{
+  try {
+    Close();
+  } catch (const Error &) {
+  }
+}
+
+void CaptureWriter::Write(const uint8_t *data, size_t len, uint64_t offset)
+{
+  ssize_t n;
+
+  while (len) {
+    n = pwrite(fd, data, len, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      throw Error(path + ": " + strerror(errno));
+    data += n;
+    len -= n;
+    offset += n;
+  }
+}
+
+/**
+ * CaptureWriter::Append() -    Add consecutive samples
+ * @first:                      Index of the first one
+ * @position:                   Its scan position
+ * @time:                       When it was taken, ns since the epoch
+ * @flags:                      CAPTURE_DROPPED, CAPTURE_RESTART
+ *
+ * Samples that do not follow the ones before, or that carry flags, start
+ * a new chunk.  The time of the chunks after the first one the samples go
+ * to is worked out from the rate, if there is one.
+ **/
+void CaptureWriter::Append(uint64_t first, uint8_t position,
+                           const uint16_t *data, size_t count, int64_t time,
+                           uint8_t flags)
+{
+  size_t capacity = Capacity(chunkBytes), n, i;
+  uint8_t *p;
+
+  if (fd < 0)
+    throw Error(path + ": capture file closed");
+  summary->Add(first, position, data, count);
+  while (count) {
+    if (current.count &&
+        (flags || first != current.first + current.count))
+      Seal();
+    if (current.count == 0) {
+      current.first = first;
+      current.time = time;
+      current.position = position;
+      current.flags = flags;
+    }
+    n = std::min(count, capacity - current.count);
+    p = &chunk[CAPTURE_CHUNK_HEADER_BYTES + 2 * current.count];
+    for (i = 0; i < n; i++, p += 2)
+      Put(p, data[i], 2);
+    current.count += n;
+    samples += n;
+    if (current.count == capacity)
+      Seal();
+
+    data += n;
+    count -= n;
+    first += n;
+    position = (uint8_t) ((position + n) % info.positions);
+    if (info.rate > 0)
+      time += (int64_t) (n * 1e9 / info.rate);
+    flags = 0;
+  }
+}
+
+/**
+ * CaptureWriter::Seal() -      Write the chunk being filled, if any
+ **/
+void CaptureWriter::Seal()
+{
+  size_t data = 2 * current.count;
+  uint32_t crc;
+
+  if (current.count == 0)
+    return;
+  memcpy(&chunk[0], CHUNK_MAGIC, 4);
+  Put(&chunk[4], index.size(), 4);
+  Put(&chunk[8], current.first, 8);
+  Put(&chunk[16], (uint64_t) current.time, 8);
+  Put(&chunk[24], current.count, 4);
+  chunk[28] = current.position;
+  chunk[29] = current.flags;
+  chunk[30] = chunk[31] = 0;
+  crc = Crc32(0, &chunk[0], 32);
+  crc = Crc32(crc, &chunk[CAPTURE_CHUNK_HEADER_BYTES], data);
+  Put(&chunk[32], crc, 4);
+  memset(&chunk[CAPTURE_CHUNK_HEADER_BYTES + data], 0,
+         chunkBytes - CAPTURE_CHUNK_HEADER_BYTES - data);
+  Write(&chunk[0], chunkBytes, CAPTURE_HEADER_BYTES + index.size() * chunkBytes);
+  index.push_back(current);
+  current.count = 0;
+}
+
+/**
+ * CaptureWriter::Flush() -     Write what was given and wait for the disk
+ **/
+void CaptureWriter::Flush()
+{
+  Seal();
+  if (fdatasync(fd) < 0)
+    throw Error(path + ": " + strerror(errno));
+}
+
+/**
+ * CaptureWriter::Close() -     Flush, add the index and write the summary,
+ *                              no-op if closed
+ **/
+void CaptureWriter::Close()
+{
+  std::vector<uint8_t> tail;
+  uint8_t *t;
+  size_t k;
+  int r;
+
+  if (fd < 0)
+    return;
+  try {
+    Seal();
+    tail.assign(index.size() * CAPTURE_INDEX_ENTRY_BYTES + CAPTURE_TRAILER_BYTES, 0);
+    for (k = 0; k < index.size(); k++)
+      PutEntry(&tail[k * CAPTURE_INDEX_ENTRY_BYTES], index[k]);
+    t = &tail[index.size() * CAPTURE_INDEX_ENTRY_BYTES];
+    memcpy(t, TRAILER_MAGIC, 8);
+    Put(t + 8, index.size(), 8);
+    Put(t + 16, Crc32(0, &tail[0], tail.size() - 8), 4);
+    Write(&tail[0], tail.size(), CAPTURE_HEADER_BYTES + index.size() * chunkBytes);
+    r = fdatasync(fd);
+  } catch (const Error &) {
+    close(fd);
+    fd = -1;
+    throw;
+  }
+  if (close(fd) < 0)
+    r = -1;
+  fd = -1;
+  if (r < 0)
+    throw Error(path + ": " + strerror(errno));
+  summary->Save(path + ".lod", index.size(),
+                index.empty() ? 0 : index.back().first + index.back().count);
+}
+
+/**
+ * CaptureReader() -    Map a capture file and load its index
+ **/
+CaptureReader::CaptureReader(const std::string &path)
+  : path(path), map(0), size(0), chunkBytes(0), samples(0), recovered(false)
+{
+  struct stat st;
+  void *m;
+  int fd;
+  size_t k;
+
+  fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw Error(path + ": " + strerror(errno));
+  if (fstat(fd, &st) < 0) {
+    int e = errno;
+    close(fd);
+    throw Error(path + ": " + strerror(e));
+  }
+  size = st.st_size;
+  if (size < CAPTURE_HEADER_BYTES) {
+    close(fd);
+    throw Error(path + ": not a capture file");
+  }
+  m = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED)
+    throw Error(path + ": " + strerror(errno));
+  map = (const uint8_t *) m;
+
+  try {
+    GetHeader(map, size, path, info, chunkBytes);
+  } catch (const Error &) {
+    munmap(m, size);
+    throw;
+  }
+  if (!LoadIndex()) {
+    ScanChunks();
+    recovered = true;
+  }
+  for (k = 0; k < index.size(); k++)
+    samples += index[k].count;
+}
+
+CaptureReader::~CaptureReader()
+{
+  munmap((void *) map, size);
+}
+
+/**
+ * CaptureReader::LoadIndex() - Take the index written by Close()
+ *
+ * Returns false if there is none, or it does not fit the file.
+ **/
+bool CaptureReader::LoadIndex()
+{
+  const uint8_t *t = map + size - CAPTURE_TRAILER_BYTES, *e;
+  uint64_t n;
+  size_t k;
+
+  if (size < CAPTURE_HEADER_BYTES + CAPTURE_TRAILER_BYTES ||
+      memcmp(t, TRAILER_MAGIC, 8) != 0)
+    return false;
+  n = Get(t + 8, 8);
+  if (n > size / chunkBytes ||
+      size != CAPTURE_HEADER_BYTES + n * (chunkBytes + CAPTURE_INDEX_ENTRY_BYTES) +
+              CAPTURE_TRAILER_BYTES)
+    return false;
+  e = t - n * CAPTURE_INDEX_ENTRY_BYTES;
+  if (Get(t + 16, 4) != Crc32(0, e, t + 16 - e))
+    return false;
+  index.resize(n);
+  for (k = 0; k < n; k++)
+    index[k] = GetEntry(e + k * CAPTURE_INDEX_ENTRY_BYTES);
+  return true;
+}
+
+/**
+ * CaptureReader::ScanChunks() -        Rebuild the index from the chunks
+ *
+ * Takes the chunks in turn up to the first one that is not whole: a
+ * writer that crashed or is still writing leaves the last one torn, or
+ * not there at all.
+ **/
+void CaptureReader::ScanChunks()
+{
+  const uint8_t *p;
+  CaptureChunk c;
+  uint32_t crc;
+  size_t k;
+
+  index.clear();
+  for (k = 0; CAPTURE_HEADER_BYTES + (k + 1) * chunkBytes <= size; k++) {
+    p = map + CAPTURE_HEADER_BYTES + k * chunkBytes;
+    if (memcmp(p, CHUNK_MAGIC, 4) != 0 || Get(p + 4, 4) != k)
+      break;
+    c.first = Get(p + 8, 8);
+    c.time = (int64_t) Get(p + 16, 8);
+    c.count = (uint32_t) Get(p + 24, 4);
+    c.position = p[28];
+    c.flags = p[29];
+    if (c.count == 0 || c.count > Capacity(chunkBytes) ||
+        (k && c.first < index[k - 1].first + index[k - 1].count))
+      break;
+    crc = Crc32(0, p, 32);
+    crc = Crc32(crc, p + CAPTURE_CHUNK_HEADER_BYTES, 2 * c.count);
+    if (Get(p + 32, 4) != crc)
+      break;
+    index.push_back(c);
+  }
+}
+
+uint16_t CaptureReader::Sample(size_t k, uint32_t i) const
+{
+  return (uint16_t) Get(map + CAPTURE_HEADER_BYTES + k * chunkBytes +
+                        CAPTURE_CHUNK_HEADER_BYTES + 2 * i, 2);
+}
+
+/**
+ * CaptureReader::FirstSample(), EndSample() -  Index of the first sample,
+ *                                              and the one after the last
+ **/
+uint64_t CaptureReader::FirstSample() const
+{
+  return index.empty() ? 0 : index.front().first;
+}
+
+uint64_t CaptureReader::EndSample() const
+{
+  return index.empty() ? 0 : index.back().first + index.back().count;
+}
+
+/**
+ * CaptureReader::FindSample() -        Chunk holding a sample
+ *
+ * If the sample is missing, the chunk after it; Chunks() if there is none.
+ **/
+size_t CaptureReader::FindSample(uint64_t sample) const
+{
+  std::vector<CaptureChunk>::const_iterator c;
+
+  c = std::upper_bound(index.begin(), index.end(), sample,
+                       [](uint64_t s, const CaptureChunk &k) { return s < k.first; });
+  if (c != index.begin() && sample < (c - 1)->first + (c - 1)->count)
+    --c;
+  return c - index.begin();
+}
+
+/**
+ * CaptureReader::FindTime() -  Chunk holding the sample taken at a time
+ *
+ * As FindSample().  Without a rate a chunk is taken to last until the
+ * next one starts.
+ **/
+size_t CaptureReader::FindTime(int64_t time) const
+{
+  std::vector<CaptureChunk>::const_iterator c;
+
+  c = std::upper_bound(index.begin(), index.end(), time,
+                       [](int64_t t, const CaptureChunk &k) { return t < k.time; });
+  if (c == index.begin())
+    return 0;
+  --c;
+  if (info.rate > 0 && time >= c->time + (int64_t) (c->count * 1e9 / info.rate))
+    ++c;
+  return c - index.begin();
+}
+
+/**
+ * CaptureReader::SampleAt() -  Index of the first sample taken at or after
+ *                              a time, EndSample() if none
+ **/
+uint64_t CaptureReader::SampleAt(int64_t time) const
+{
+  size_t k = FindTime(time);
+  const CaptureChunk *c;
+  uint64_t s;
+
+  if (k == index.size())
+    return EndSample();
+  c = &index[k];
+  if (info.rate <= 0 || time <= c->time)
+    return c->first;
+  s = (uint64_t) std::ceil((time - c->time) * info.rate / 1e9);
+  return c->first + std::min(s, (uint64_t) c->count);
+}
+
+/**
+ * CaptureReader::TimeOf() -    When a sample was taken, ns since the epoch
+ *
+ * Worked out from the nearest chunk, even for the samples not in the file.
+ **/
+int64_t CaptureReader::TimeOf(uint64_t sample) const
+{
+  const CaptureChunk *c;
+
+  if (index.empty())
+    return info.startTime;
+  c = &index[std::min(FindSample(sample), index.size() - 1)];
+  if (info.rate <= 0)
+    return c->time;
+  return c->time + (int64_t) (((double) sample - (double) c->first) * 1e9 / info.rate);
+}
+
+/**
+ * CaptureReader::PositionOf() -        Scan position of a sample
+ **/
+unsigned int CaptureReader::PositionOf(uint64_t sample) const
+{
+  const CaptureChunk *c;
+  int64_t d;
+
+  if (index.empty())
+    return 0;
+  c = &index[std::min(FindSample(sample), index.size() - 1)];
+  d = (int64_t) (sample - c->first) % (int64_t) info.positions;
+  return (unsigned int) ((c->position + d + info.positions) % info.positions);
+}
+
+/**
+ * CaptureReader::Read() -      Samples first .. first + count - 1
+ *
+ * Missing samples read as CAPTURE_GAP.  Returns how many were read: fewer
+ * than count past EndSample().
+ **/
+size_t CaptureReader::Read(uint64_t first, size_t count, uint16_t *out) const
+{
+  size_t k, n, i, j, done;
+  uint64_t s;
+
+  if (first >= EndSample())
+    return 0;
+  n = (size_t) std::min((uint64_t) count, EndSample() - first);
+  k = FindSample(first);
+  for (done = 0; done < n; ) {
+    s = first + done;
+    while (s >= index[k].first + index[k].count)
+      k++;
+    if (s < index[k].first) {
+      i = (size_t) std::min((uint64_t) (n - done), index[k].first - s);
+      std::fill(out + done, out + done + i, CAPTURE_GAP);
+      done += i;
+      continue;
+    }
+    i = (size_t) std::min((uint64_t) (n - done), index[k].first + index[k].count - s);
+    for (j = 0; j < i; j++)
+      out[done + j] = Sample(k, (uint32_t) (s - index[k].first + j));
+    done += i;
+  }
+  return n;
+}
+
+} /* namespace picad */
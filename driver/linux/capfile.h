@@ -0,0 +1,333 @@
+/*   capfile.h - Chunked binary capture files.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PICAD_CAPFILE_H
+#define PICAD_CAPFILE_H
+
+#include "picad.h"
+
+namespace picad {
+
+/**
+ * Capture file layout.  Numbers are least significant byte first, doubles
+ * in IEEE 754 binary64.
+ *
+ *   header   CAPTURE_HEADER_BYTES
+ *            byte 0..7     "PICADCAP"
+ *            byte 8..9     CAPTURE_VERSION
+ *            byte 10..11   CAPTURE_HEADER_BYTES
+ *            byte 12..15   chunk bytes
+ *            byte 16..23   samples per second, 0 if not known
+ *            byte 24..31   start time, ns since the epoch, 0 if not known
+ *            byte 32       scan positions, 1..CAPTURE_MAX_POSITIONS
+ *            byte 36..51   channel of each position
+ *            byte 52..67   serial number of the board, NUL padded
+ *            byte 72..327  gain and offset of each position, in turn
+ *            byte 508..511 CRC-32 of bytes 0..507
+ *
+ *   chunks   chunk bytes each, chunk k at CAPTURE_HEADER_BYTES + k * chunk
+ *            bytes, written once and never again
+ *            byte 0..3     "CHNK"
+ *            byte 4..7     k
+ *            byte 8..15    index of the first sample
+ *            byte 16..23   time of the first sample, ns since the epoch
+ *            byte 24..27   samples in the chunk
+ *            byte 28       scan position of the first sample
+ *            byte 29       CAPTURE_DROPPED, CAPTURE_RESTART
+ *            byte 32..35   CRC-32 of bytes 0..31 and of the samples
+ *            byte 40..     samples, 16 bits each, consecutive indexes
+ *
+ *   index    written by Close() after the last chunk, one entry per chunk
+ *            byte 0..7     index of the first sample
+ *            byte 8..15    time of the first sample
+ *            byte 16..19   samples
+ *            byte 20       scan position of the first sample
+ *            byte 21       flags
+ *   trailer  the last CAPTURE_TRAILER_BYTES of a closed file
+ *            byte 0..7     "PICADIDX"
+ *            byte 8..15    chunks
+ *            byte 16..19   CRC-32 of the index and of bytes 0..15
+ *
+ * A file that was not closed has no index: the reader rebuilds it from
+ * the chunks and stops at the first one that is not whole.
+ **/
+const uint16_t CAPTURE_VERSION          = 1;
+const size_t   CAPTURE_HEADER_BYTES     = 512;
+const size_t   CAPTURE_CHUNK_HEADER_BYTES = 40;
+const size_t   CAPTURE_INDEX_ENTRY_BYTES  = 24;
+const size_t   CAPTURE_TRAILER_BYTES    = 24;
+const size_t   CAPTURE_CHUNK_BYTES      = 65536;   /* Default */
+const unsigned int CAPTURE_MAX_POSITIONS = 16;
+
+const uint8_t  CAPTURE_DROPPED = 0x01;  /* Samples missing before the chunk */
+const uint8_t  CAPTURE_RESTART = 0x02;  /* New settings from the chunk on */
+
+const uint16_t CAPTURE_GAP = 0xFFFF;    /* Read() value of a missing sample */
+
+/**
+ * Summary of a capture file, kept next to it in file.lod.  Level 0 has a
+ * bucket for every SUMMARY_WIDTH samples of each scan position, that is
+ * SUMMARY_WIDTH * positions sample indexes, each level above one for
+ * every SUMMARY_FANOUT buckets of the level below, up to a level with a
+ * single bucket.  Every bucket has a SummaryBucket per scan position, so
+ * the summary is about 1/32 of the samples whatever the scan list.
+ *
+ *   header   SUMMARY_HEADER_BYTES
+ *            byte 0..7     "PICADLOD"
+ *            byte 8..9     SUMMARY_VERSION
+ *            byte 10       scan positions
+ *            byte 11       levels
+ *            byte 12..15   width of the level 0 buckets
+ *            byte 16..19   fanout
+ *            byte 20..27   chunks of the capture file summarised
+ *            byte 28..35   index after its last sample
+ *   levels   from level 0 up, each one its number of buckets (8 bytes)
+ *            and then the buckets, 16 bytes per position:
+ *            byte 0..1     min
+ *            byte 2..3     max
+ *            byte 4..7     samples
+ *            byte 8..15    sum of the samples
+ *
+ * The file is written whole, to file.lod.tmp, and renamed.
+ **/
+const uint16_t SUMMARY_VERSION      = 1;
+const size_t   SUMMARY_HEADER_BYTES = 64;
+const uint32_t SUMMARY_WIDTH        = 256;
+const uint32_t SUMMARY_FANOUT       = 16;
+
+/**
+ * SummaryBucket - Samples of one scan position in a bucket
+ **/
+struct SummaryBucket {
+  SummaryBucket() : min(0xFFFF), max(0), count(0), sum(0) {}
+
+  void Add(uint16_t sample)
+  {
+    if (sample < min)
+      min = sample;
+    if (sample > max)
+      max = sample;
+    count++;
+    sum += sample;
+  }
+  void Merge(const SummaryBucket &b)
+  {
+    if (b.min < min)
+      min = b.min;
+    if (b.max > max)
+      max = b.max;
+    count += b.count;
+    sum += b.sum;
+  }
+  double Mean() const { return count ? (double) sum / count : 0; }
+
+  uint16_t min;
+  uint16_t max;
+  uint32_t count;               /* 0: no samples, min and max mean nothing */
+  uint64_t sum;
+};
+
+class CaptureReader;
+
+/**
+ * SummaryPyramid - min, max and mean of the samples at several levels
+ *
+ * Built as the samples come, with Add(), in the time it takes to look at
+ * each one once, or from the samples of a capture file.  Buckets are
+ * aligned on the sample indexes: bucket b of a level with buckets of
+ * width w holds the indexes b * w .. (b + 1) * w - 1.  A width of 0
+ * stands for SUMMARY_WIDTH * positions.
+ **/
+class SummaryPyramid {
+ public:
+  explicit SummaryPyramid(unsigned int positions, uint32_t width = 0,
+                          uint32_t fanout = SUMMARY_FANOUT);
+
+  void Add(uint64_t first, uint8_t position, const uint16_t *samples,
+           size_t count);
+  void Add(const CaptureReader &reader);
+
+  void Save(const std::string &path, uint64_t chunks, uint64_t end) const;
+  static std::unique_ptr<SummaryPyramid> Load(const std::string &path,
+                                              uint64_t chunks, uint64_t end);
+
+  unsigned int Positions() const { return positions; }
+  unsigned int Levels() const { return levels.size(); }
+  uint64_t Width(unsigned int level) const;
+  uint64_t Buckets(unsigned int level) const { return levels[level].size() / positions; }
+  const SummaryBucket &Bucket(unsigned int level, uint64_t bucket,
+                              unsigned int position) const
+  {
+    return levels[level][bucket * positions + position];
+  }
+
+ private:
+  void Grow(uint64_t bucket);
+
+  unsigned int positions;
+  uint32_t width, fanout;
+  std::vector<std::vector<SummaryBucket> > levels;
+  std::vector<SummaryBucket> run;       /* Of the bucket being added to */
+};
+
+/**
+ * CaptureInfo - What a capture file says about its samples
+ *
+ * Samples are taken in turn from the positions of the scan list; the value
+ * of a sample at position p is offset[p] + gain[p] * sample.
+ **/
+struct CaptureInfo {
+  CaptureInfo();
+
+  double Value(unsigned int position, uint16_t sample) const
+  {
+    return offset[position] + gain[position] * sample;
+  }
+
+  double rate;                  /* Samples per second, 0 if not known */
+  int64_t startTime;            /* ns since the epoch, 0 if not known */
+  unsigned int positions;
+  uint8_t channel[CAPTURE_MAX_POSITIONS];
+  double gain[CAPTURE_MAX_POSITIONS];
+  double offset[CAPTURE_MAX_POSITIONS];
+  std::string serial;
+};
+
+/**
+ * CaptureChunk - Where a run of consecutive samples is
+ **/
+struct CaptureChunk {
+  uint64_t first;               /* Index of the first sample */
+  int64_t time;                 /* Of the first sample, ns since the epoch */
+  uint32_t count;
+  uint8_t position;             /* Scan position of the first sample */
+  uint8_t flags;                /* CAPTURE_DROPPED, CAPTURE_RESTART */
+};
+
+/**
+ * CaptureWriter - Append samples to a capture file
+ *
+ * Samples are gathered in memory and a chunk is written when it is full,
+ * when the samples given are not the next ones (the chunk then holds
+ * fewer), and on Flush().  Nothing written is written again, so a crash
+ * loses at most the samples not flushed.  Close() adds the index and
+ * writes the SummaryPyramid, built along the way, to file.lod.
+ *
+ * The first constructor makes a new file, the second one goes on with an
+ * existing one, closed or not: whatever follows its last whole chunk is
+ * cut off.  Errors are thrown.
+ **/
+class CaptureWriter {
+ public:
+  CaptureWriter(const std::string &path, const CaptureInfo &info,
+                size_t chunkBytes = CAPTURE_CHUNK_BYTES);
+  explicit CaptureWriter(const std::string &path);
+  ~CaptureWriter();
+
+  void Append(uint64_t first, uint8_t position, const uint16_t *samples,
+              size_t count, int64_t time, uint8_t flags = 0);
+  void Flush();
+  void Close();
+
+  const CaptureInfo &Info() const { return info; }
+  size_t Chunks() const { return index.size(); }
+  uint64_t Samples() const { return samples; }
+
+ private:
+  CaptureWriter(const CaptureWriter &);
+  CaptureWriter &operator=(const CaptureWriter &);
+
+  void Seal();
+  void Write(const uint8_t *data, size_t len, uint64_t offset);
+
+  std::string path;
+  int fd;
+  CaptureInfo info;
+  size_t chunkBytes;
+  std::vector<CaptureChunk> index;
+  std::vector<uint8_t> chunk;   /* Being filled */
+  CaptureChunk current;         /* Its header, count 0 if empty */
+  uint64_t samples;
+  std::unique_ptr<SummaryPyramid> summary;
+};
+
+/**
+ * CaptureReader - Random access to a capture file, through mmap
+ *
+ * The chunk index is loaded (or rebuilt, see Recovered()) when the file
+ * is opened; finding a sample or a time is then a binary search on it and
+ * the samples are read in place.  Chunks are in increasing sample index
+ * and, as given to the writer, time order.
+ *
+ * Plot() gives the min, max and mean of each column of a plot of some
+ * samples from the coarsest level of the summary that still has a bucket
+ * per column, or from the samples when even level 0 is too coarse: its
+ * cost depends on the number of columns, not of samples.  The summary is
+ * file.lod if it is there and up to date, else it is built from the
+ * samples the first time it is needed.
+ **/
+class CaptureReader {
+ public:
+  explicit CaptureReader(const std::string &path);
+  ~CaptureReader();
+
+  const CaptureInfo &Info() const { return info; }
+  size_t ChunkBytes() const { return chunkBytes; }
+  bool Recovered() const { return recovered; }
+
+  size_t Chunks() const { return index.size(); }
+  const CaptureChunk &Chunk(size_t k) const { return index[k]; }
+  uint16_t Sample(size_t k, uint32_t i) const;
+
+  uint64_t FirstSample() const;
+  uint64_t EndSample() const;
+  uint64_t Samples() const { return samples; }
+
+  size_t FindSample(uint64_t sample) const;
+  size_t FindTime(int64_t time) const;
+  uint64_t SampleAt(int64_t time) const;
+  int64_t TimeOf(uint64_t sample) const;
+  unsigned int PositionOf(uint64_t sample) const;
+
+  size_t Read(uint64_t first, size_t count, uint16_t *out) const;
+
+  const SummaryPyramid &Summary() const;
+  int Plot(uint64_t first, uint64_t end, unsigned int position,
+           size_t columns, std::vector<SummaryBucket> &out) const;
+
+ private:
+  CaptureReader(const CaptureReader &);
+  CaptureReader &operator=(const CaptureReader &);
+
+  bool LoadIndex();
+  void ScanChunks();
+
+  std::string path;
+  const uint8_t *map;
+  size_t size;
+  CaptureInfo info;
+  size_t chunkBytes;
+  std::vector<CaptureChunk> index;
+  uint64_t samples;
+  bool recovered;
+  mutable std::unique_ptr<SummaryPyramid> summary;
+};
+
+} /* namespace picad */
+
+#endif /* PICAD_CAPFILE_H */
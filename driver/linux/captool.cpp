@@ -0,0 +1,297 @@
+/*   captool.cpp - Look into capture files, convert the old .dat files.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * captool [-x first:count | -T from:to] [-w columns] [-p position] file
+ * captool -L file
+ * captool -c file.dat [-r hz] [-g gain] [-C channel] [-k chunk] file
+ *
+ * Without options prints what the file says about itself.  -x prints the
+ * values of count samples from index first, -T those taken from from to
+ * to seconds after the start of the file; one value per line, as in the
+ * .dat files, and "nan" for the missing samples.  With -w it prints
+ * instead the min, max and mean of the samples of one scan position (0
+ * by default) in each of that many columns, as a plot would get them
+ * from CaptureReader::Plot().
+ *
+ * -L writes the summary of a file that has none or an old one, as is the
+ * case of a capture that did not end well.
+ *
+ * -c converts a .dat file (ad_tool/example_data.dat): one value per line,
+ * blank lines and lines starting with '#' left out.  The values are
+ * stored as multiples of the gain (0.001 by default) above the lowest
+ * one, so up to that resolution they read back the same.  -r is the
+ * sample rate, if it is known, -C the channel the values came from and -k
+ * the chunk size in bytes.
+ **/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include "capfile.h"
+
+static void Usage()
+{
+  fprintf(stderr, "usage: captool [-x first:count | -T from:to] [-w columns]"
+                  " [-p position] file\n"
+                  "       captool -L file\n"
+                  "       captool -c file.dat [-r hz] [-g gain] [-C channel]"
+                  " [-k chunk] file\n");
+  exit(2);
+}
+
+/**
+ * ParseRange() -       "a:b" to two numbers
+ **/
+static bool ParseRange(const char *arg, double &a, double &b)
+{
+  char *end;
+
+  a = strtod(arg, &end);
+  if (end == arg || *end != ':')
+    return false;
+  arg = end + 1;
+  b = strtod(arg, &end);
+  return end != arg && *end == 0;
+}
+
+/**
+ * Convert() -  A .dat file to a capture file
+ **/
+static int Convert(const char *dat, const char *path, picad::CaptureInfo &info,
+                   size_t chunkBytes)
+{
+  std::vector<double> values;
+  std::vector<uint16_t> samples;
+  char line[256], *p, *end;
+  double v, low;
+  FILE *in;
+  size_t i;
+
+  if ((in = fopen(dat, "r")) == 0) {
+    perror(dat);
+    return 2;
+  }
+  while (fgets(line, sizeof(line), in)) {
+    for (p = line; *p == ' ' || *p == '\t'; p++)
+      ;
+    if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0)
+      continue;
+    v = strtod(p, &end);
+    if (end == p) {
+      fprintf(stderr, "captool: %s: not a number: %s", dat, line);
+      fclose(in);
+      return 2;
+    }
+    values.push_back(v);
+  }
+  fclose(in);
+
+  low = 0;
+  for (i = 0; i < values.size(); i++)
+    low = (i == 0) ? values[i] : std::min(low, values[i]);
+  info.offset[0] = floor(low / info.gain[0]) * info.gain[0];
+  for (i = 0; i < values.size(); i++) {
+    v = floor((values[i] - info.offset[0]) / info.gain[0] + 0.5);
+    if (v >= picad::CAPTURE_GAP) {
+      fprintf(stderr, "captool: %s: values too far apart for a gain of %g\n",
+              dat, info.gain[0]);
+      return 2;
+    }
+    samples.push_back((uint16_t) v);
+  }
+
+  picad::CaptureWriter writer(path, info, chunkBytes);
+  if (!samples.empty())
+    writer.Append(0, 0, &samples[0], samples.size(), info.startTime);
+  writer.Close();
+  printf("%s: %zu samples in %zu chunks\n", path, samples.size(), writer.Chunks());
+  return 0;
+}
+
+/**
+ * Describe() - Print the header and the chunks of a capture file
+ **/
+static void Describe(const picad::CaptureReader &reader)
+{
+  const picad::CaptureInfo &info = reader.Info();
+  unsigned long dropped = 0, restarts = 0;
+  char when[64];
+  time_t t;
+  size_t k;
+  unsigned int i;
+
+  if (info.rate > 0)
+    printf("%g samples/s", info.rate);
+  else
+    printf("rate not known");
+  printf(", serial number %s\n", info.serial.empty() ? "not known" : info.serial.c_str());
+  for (i = 0; i < info.positions; i++)
+    printf("position %u: channel %u, gain %g, offset %g\n", i, info.channel[i],
+           info.gain[i], info.offset[i]);
+  if (info.startTime) {
+    t = (time_t) (info.startTime / 1000000000);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    printf("started %s\n", when);
+  }
+  for (k = 0; k < reader.Chunks(); k++) {
+    dropped += (reader.Chunk(k).flags & picad::CAPTURE_DROPPED) != 0;
+    restarts += (reader.Chunk(k).flags & picad::CAPTURE_RESTART) != 0;
+  }
+  printf("%zu chunks of %zu bytes, %s\n", reader.Chunks(), reader.ChunkBytes(),
+         reader.Recovered() ? "not closed, index rebuilt" : "closed");
+  printf("samples %llu..%llu, %llu in the file, %lu drops, %lu restarts\n",
+         (unsigned long long) reader.FirstSample(),
+         (unsigned long long) reader.EndSample(),
+         (unsigned long long) reader.Samples(), dropped, restarts);
+  if (reader.Chunks())
+    printf("%.3f s from the first sample to the last\n",
+           (reader.TimeOf(reader.EndSample() - 1) - reader.TimeOf(reader.FirstSample())) / 1e9);
+}
+
+/**
+ * Print() -    Values of samples first .. first + count - 1
+ **/
+static void Print(const picad::CaptureReader &reader, uint64_t first, size_t count)
+{
+  const picad::CaptureInfo &info = reader.Info();
+  std::vector<uint16_t> samples(4096);
+  size_t i, n;
+
+  while (count) {
+    n = reader.Read(first, std::min(count, samples.size()), &samples[0]);
+    if (n == 0)
+      break;
+    for (i = 0; i < n; i++) {
+      if (samples[i] == picad::CAPTURE_GAP)
+        printf("nan\n");
+      else
+        printf("%.10g\n", info.Value(reader.PositionOf(first + i), samples[i]));
+    }
+    first += n;
+    count -= n;
+  }
+}
+
+/**
+ * PrintColumns() -     min, max and mean of samples first .. end - 1 in
+ *                      columns
+ **/
+static void PrintColumns(const picad::CaptureReader &reader, uint64_t first,
+                         uint64_t end, unsigned int position, size_t columns)
+{
+  const picad::CaptureInfo &info = reader.Info();
+  std::vector<picad::SummaryBucket> out;
+  size_t i;
+  int level;
+
+  if (position >= info.positions) {
+    fprintf(stderr, "captool: no scan position %u\n", position);
+    exit(2);
+  }
+  level = reader.Plot(first, end, position, columns, out);
+  if (level < 0)
+    printf("# from the samples\n");
+  else
+    printf("# from level %d, %llu samples a bucket\n", level,
+           (unsigned long long) reader.Summary().Width(level));
+  for (i = 0; i < out.size(); i++) {
+    if (out[i].count == 0)
+      printf("nan nan nan\n");
+    else
+      printf("%.10g %.10g %.10g\n", info.Value(position, out[i].min),
+             info.Value(position, out[i].max),
+             info.offset[position] + info.gain[position] * out[i].Mean());
+  }
+}
+
+int main(int argc, char **argv)
+{
+  picad::CaptureInfo info;
+  size_t chunkBytes = picad::CAPTURE_CHUNK_BYTES;
+  const char *dat = 0;
+  double a = 0, b = 0;
+  size_t columns = 0;
+  unsigned int position = 0;
+  bool summarise = false;
+  char mode = 0;
+  int c;
+
+  info.gain[0] = 0.001;
+  while ((c = getopt(argc, argv, "x:T:w:p:Lc:r:g:C:k:")) != -1) {
+    switch (c) {
+    case 'x':
+    case 'T':
+      if (mode || !ParseRange(optarg, a, b) || a < 0 || b < a)
+        Usage();
+      mode = c;
+      break;
+    case 'w': columns = strtoul(optarg, 0, 0); break;
+    case 'p': position = atoi(optarg); break;
+    case 'L': summarise = true; break;
+    case 'c': dat = optarg; break;
+    case 'r': info.rate = atof(optarg); break;
+    case 'g': info.gain[0] = atof(optarg); break;
+    case 'C': info.channel[0] = atoi(optarg); break;
+    case 'k': chunkBytes = strtoul(optarg, 0, 0); break;
+    default: Usage();
+    }
+  }
+  if (optind != argc - 1 || (dat && (mode || summarise)) ||
+      (summarise && mode) || (columns && !mode) || info.gain[0] <= 0)
+    Usage();
+
+  try {
+    if (dat)
+      return Convert(dat, argv[optind], info, chunkBytes);
+
+    picad::CaptureReader reader(argv[optind]);
+    uint64_t first, end;
+    int64_t t0;
+
+    if (summarise) {
+      reader.Summary().Save(std::string(argv[optind]) + ".lod",
+                            reader.Chunks(), reader.EndSample());
+      return 0;
+    }
+    if (mode == 'x') {
+      first = (uint64_t) a;
+      end = first + (uint64_t) b;
+    } else if (mode == 'T') {
+      t0 = reader.Info().startTime ? reader.Info().startTime
+                                   : reader.TimeOf(reader.FirstSample());
+      first = reader.SampleAt(t0 + (int64_t) (a * 1e9));
+      end = reader.SampleAt(t0 + (int64_t) (b * 1e9));
+    } else {
+      Describe(reader);
+      return 0;
+    }
+    if (columns)
+      PrintColumns(reader, first, end, position, columns);
+    else
+      Print(reader, first, (size_t) (end - first));
+  } catch (const picad::Error &e) {
+    fprintf(stderr, "captool: %s\n", e.what());
+    return 2;
+  }
+  return 0;
+}
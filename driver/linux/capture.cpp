@@ -0,0 +1,446 @@
+/*   capture.cpp - Stream the A/D samples to a file.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * capture [-d transport]... [-r hz] [-s ch[:acqt],...] [-t seconds]
+ *         [-n transfers] [-p packets] [-b blocks] [-m monitors] [-o file]
+ *         [-f file] [-H seconds] [-i]
+ * capture [-d transport] -S serial
+ * capture -l
+ *
+ * The transport is "usb" (the default), "virtual[:speed]" or "unix:path",
+ * optionally followed by "@serial", see CreateTransport().  With several
+ * -d the boards stream together in one Session, each one on its own.
+ * The packets of each board are published in a SampleRing of the given
+ * number of blocks.  Its recorder, a RING_BLOCK reader, writes the raw
+ * packets to the file, as received (file.serial, or file.index, with
+ * several boards), or the samples to a capture file (capfile.h, same
+ * names), flushed every second, and checks the stream as it comes in; the
+ * totals are printed at the end and the exit status is 1 if anything was
+ * lost.
+ * Each monitor is a RING_DROP reader in its own thread that follows the
+ * sample range, the way a live display would; -m gives each board that
+ * many.
+ *
+ * What the board itself counted (VR_GET_COUNTERS: FIFO overruns, IN
+ * refused, STALLs, bus resets, suspends, bus errors and the most samples
+ * its FIFO held) is printed with the totals, and with -H every that many
+ * seconds as well, so a drop in throughput can be put next to what
+ * happened on the bus at the time.
+ *
+ * -i streams through the isochronous alternate setting (ALT_ISO): the
+ * bus time is reserved, up to the ISO_RATE the firmware was built for;
+ * a higher -r, or none, runs at ISO_RATE.
+ *
+ * -S stores a new serial number in the board, which it shows once it is
+ * plugged in again, and -l lists the serial numbers of the boards.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include "capfile.h"
+
+/**
+ * Monitor - A RING_DROP reader keeping the sample range, in its own thread
+ **/
+struct Monitor {
+  explicit Monitor(picad::SampleRing &ring)
+    : reader(ring, picad::RING_DROP), stop(false), blocks(0), torn(0),
+      low(0xFFFF), high(0) {}
+  ~Monitor() { Stop(); }
+
+  void Start() { thread = std::thread(&Monitor::Run, this); }
+  void Stop()
+  {
+    stop = true;
+    if (thread.joinable())
+      thread.join();
+  }
+
+  void Run()
+  {
+    const picad::SampleBlock *b;
+    uint16_t l, h;
+    unsigned int i;
+
+    while (!stop) {
+      if ((b = reader.Acquire(100)) == 0)
+        continue;
+      l = 0xFFFF;
+      h = 0;
+      for (i = 0; i < b->header.count; i++) {
+        l = std::min(l, b->samples[i]);
+        h = std::max(h, b->samples[i]);
+      }
+      if (!reader.Release()) {
+        torn++;
+        continue;
+      }
+      blocks++;
+      low = std::min(low, l);
+      high = std::max(high, h);
+    }
+  }
+
+  picad::RingReader reader;
+  std::thread thread;
+  volatile bool stop;
+  unsigned long blocks, torn;
+  uint16_t low, high;
+};
+
+/**
+ * Recorder - The RING_BLOCK reader of one board, and its monitors
+ **/
+struct Recorder {
+  explicit Recorder(picad::SampleRing &ring)
+    : reader(ring, picad::RING_BLOCK), out(0), end(0) {}
+  ~Recorder()
+  {
+    if (out)
+      fclose(out);
+  }
+
+  picad::RingReader reader;
+  picad::StreamChecker checker;
+  FILE *out;
+  std::unique_ptr<picad::CaptureWriter> file;
+  uint64_t end;                 /* Index after the last sample, unwrapped */
+  std::vector<std::unique_ptr<Monitor> > monitors;
+  picad::Counters first;        /* Board counters at the start */
+  picad::Counters last;         /* and at the last -H reading  */
+  uint8_t fifoHigh;
+};
+
+/**
+ * PrintHealth() -      What the board counted between two readings
+ **/
+static void PrintHealth(const picad::Counters &from, const picad::Counters &to,
+                        unsigned int fifoHigh)
+{
+  printf("%lu overruns, %lu IN refused, %lu stalls, %lu resets, %lu suspends, "
+         "%lu bus errors (UEIR 0x%02x), FIFO high-water %u\n",
+         (unsigned long) (to.overruns - from.overruns),
+         (unsigned long) (to.inBusy - from.inBusy),
+         (unsigned long) (to.stalls - from.stalls),
+         (unsigned long) (to.resets - from.resets),
+         (unsigned long) (to.suspends - from.suspends),
+         (unsigned long) (to.errors - from.errors), to.errorBits, fifoHigh);
+}
+
+/**
+ * OutputName() -       File of a board: the name given for a single board,
+ *                      else with the serial number, or the index if the
+ *                      serial number does not tell the board apart
+ **/
+static std::string OutputName(const char *output, picad::Session &session,
+                              size_t board)
+{
+  std::string serial = session.Serial(board);
+  size_t i;
+
+  if (session.Boards() == 1)
+    return output;
+  for (i = 0; i < session.Boards(); i++)
+    if (i != board && session.Serial(i) == serial)
+      serial.clear();
+  return std::string(output) + "." +
+         (serial.empty() ? std::to_string(board) : serial);
+}
+
+static double Now()
+{
+  using namespace std::chrono;
+  return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static int64_t WallClock()
+{
+  using namespace std::chrono;
+  return duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Record() -   Append the samples of a block to the capture file
+ *
+ * The 32 bit sample indexes of the packets are made 64 bit, and the
+ * samples are taken to be from the time they arrived.
+ **/
+static void Record(Recorder &r, const picad::SampleBlock &b, int64_t now)
+{
+  uint64_t first = r.end + (uint32_t) (b.header.index - (uint32_t) r.end);
+  uint8_t flags = 0;
+
+  if (b.header.flags & picad::STREAM_DROPPED)
+    flags |= picad::CAPTURE_DROPPED;
+  if (b.header.flags & picad::STREAM_RESTART)
+    flags |= picad::CAPTURE_RESTART;
+  r.file->Append(first, b.header.first, b.samples, b.header.count, now, flags);
+  r.end = first + b.header.count;
+}
+
+/**
+ * ParseScan() -        "ch[:acqt],..." to scan list entries, acqt 1 (2 TAD)
+ *                      by default
+ **/
+static std::vector<uint8_t> ParseScan(const char *arg)
+{
+  std::vector<uint8_t> entries;
+  const char *p = arg;
+  char *end;
+  long ch, acqt;
+
+  do {
+    ch = strtol(p, &end, 0);
+    acqt = 1;
+    if (end != p && *end == ':')
+      acqt = strtol(end + 1, &end, 0);
+    if (end == p || ch < 0 || ch > 12 || acqt < 0 || acqt > 7 ||
+        (*end && *end != ',')) {
+      fprintf(stderr, "capture: bad scan list '%s'\n", arg);
+      exit(2);
+    }
+    entries.push_back((uint8_t) (ch | (acqt << 4)));
+    p = end + 1;
+  } while (*end);
+  return entries;
+}
+
+static void Usage()
+{
+  fprintf(stderr, "usage: capture [-d transport]... [-r hz] [-s ch[:acqt],...]"
+                  " [-t seconds] [-n transfers] [-p packets] [-b blocks]"
+                  " [-m monitors] [-o file] [-f file] [-H seconds] [-i]\n"
+                  "       capture [-d transport] -S serial\n"
+                  "       capture -l\n");
+  exit(2);
+}
+
+/**
+ * List() -     Print the serial numbers of the boards plugged in
+ **/
+static int List()
+{
+#if defined(PICAD_NO_LIBUSB)
+  fprintf(stderr, "capture: built without libusb\n");
+  return 2;
+#else
+  std::vector<std::string> serials = picad::UsbTransport::Serials();
+  size_t i;
+
+  for (i = 0; i < serials.size(); i++)
+    printf("%s\n", serials[i].empty() ? "(no serial number)" : serials[i].c_str());
+  return 0;
+#endif
+}
+
+/**
+ * Provision() -        Store a serial number in a board
+ **/
+static int Provision(const char *spec, const char *serial)
+{
+  std::unique_ptr<picad::Transport> transport = picad::CreateTransport(spec);
+  picad::Device device(*transport);
+
+  std::string old;
+
+  device.Open();
+  old = device.GetSerial();
+  device.SetSerial(serial);
+  printf("%s: serial number %s, now %s (plug the board in again)\n", spec,
+         old.c_str(), device.GetSerial().c_str());
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  picad::Reader::Options options;
+  std::vector<uint8_t> scan;
+  std::vector<const char *> specs;
+  unsigned long rate = 0, blocks = 1024;
+  unsigned int monitors = 0;
+  double seconds = 1, health = 0, start, now, end, flushed, polled;
+  const char *output = 0, *file = 0, *serial = 0;
+  bool list = false, iso = false;
+  int c;
+
+  while ((c = getopt(argc, argv, "d:r:s:t:n:p:b:m:o:f:S:lH:i")) != -1) {
+    switch (c) {
+    case 'd': specs.push_back(optarg); break;
+    case 'r': rate = strtoul(optarg, 0, 0); break;
+    case 's': scan = ParseScan(optarg); break;
+    case 't': seconds = atof(optarg); break;
+    case 'n': options.transfers = atoi(optarg); break;
+    case 'p': options.packetsPerTransfer = atoi(optarg); break;
+    case 'b': blocks = strtoul(optarg, 0, 0); break;
+    case 'm': monitors = atoi(optarg); break;
+    case 'o': output = optarg; break;
+    case 'f': file = optarg; break;
+    case 'S': serial = optarg; break;
+    case 'l': list = true; break;
+    case 'H': health = atof(optarg); break;
+    case 'i': iso = true; break;
+    default: Usage();
+    }
+  }
+  if (optind != argc || (serial && specs.size() > 1))
+    Usage();
+  if (specs.empty())
+    specs.push_back("usb");
+
+  try {
+    if (list)
+      return List();
+    if (serial)
+      return Provision(specs[0], serial);
+
+    picad::Session session(options, blocks);
+    std::vector<std::unique_ptr<Recorder> > recorders;
+    const picad::SampleBlock *b;
+    picad::Counters counters;
+    unsigned long long bytes;
+    bool lost = false, busy, running = true;
+    size_t i, j;
+
+    for (i = 0; i < specs.size(); i++)
+      session.Add(specs[i]);
+    session.Open();
+    if (!scan.empty())
+      session.SetScan(scan);
+    if (rate)
+      session.SetRate(rate);
+    if (iso)
+      session.SetAltSetting(picad::ALT_ISO);
+
+    for (i = 0; i < session.Boards(); i++) {
+      recorders.push_back(std::unique_ptr<Recorder>(new Recorder(session.Ring(i))));
+      Recorder &r = *recorders.back();
+      if (output) {
+        std::string name = OutputName(output, session, i);
+        if ((r.out = fopen(name.c_str(), "wb")) == 0) {
+          perror(name.c_str());
+          return 2;
+        }
+      }
+      if (file) {
+        picad::CaptureInfo info;
+        info.rate = rate;
+        if (!scan.empty())
+          info.positions = scan.size();
+        for (j = 0; j < scan.size(); j++)
+          info.channel[j] = scan[j] & 0x0F;
+        info.serial = session.Serial(i);
+        info.startTime = WallClock();
+        r.file.reset(new picad::CaptureWriter(OutputName(file, session, i), info));
+      }
+      for (j = 0; j < monitors; j++) {
+        r.monitors.push_back(std::unique_ptr<Monitor>(new Monitor(session.Ring(i))));
+        r.monitors.back()->Start();
+      }
+      r.first = r.last = session.GetDevice(i).GetCounters(true);
+      r.fifoHigh = 0;
+    }
+
+    session.Start();
+    start = flushed = polled = Now();
+    end = start + seconds;
+    while ((now = Now()) < end && running) {
+      busy = false;
+      for (i = 0; i < recorders.size(); i++) {
+        Recorder &r = *recorders[i];
+        while ((b = r.reader.Acquire(0)) != 0) {
+          if (r.out)
+            fwrite(b->raw, 1, b->rawLen, r.out);
+          if (r.file)
+            Record(r, *b, WallClock());
+          r.checker.Check(b->header, now);
+          r.reader.Release();
+          busy = true;
+        }
+        running = running && session.GetReader(i).Running();
+      }
+      if (now - flushed >= 1) {
+        for (i = 0; i < recorders.size(); i++)
+          if (recorders[i]->file)
+            recorders[i]->file->Flush();
+        flushed = now;
+      }
+      if (health > 0 && now - polled >= health) {
+        for (i = 0; i < recorders.size(); i++) {
+          Recorder &r = *recorders[i];
+          counters = session.GetDevice(i).GetCounters(true);
+          r.fifoHigh = std::max(r.fifoHigh, counters.fifoHigh);
+          printf("%.1f s %s: %lu packets, %lu samples dropped, ", now - start,
+                 specs[i], (unsigned long) (counters.packets - r.last.packets),
+                 (unsigned long) (counters.lost - r.last.lost));
+          PrintHealth(r.last, counters, counters.fifoHigh);
+          r.last = counters;
+        }
+        fflush(stdout);
+        polled = now;
+      }
+      if (!busy)
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    session.Stop();
+    now = Now();
+    for (i = 0; i < recorders.size(); i++)
+      if (recorders[i]->file)
+        recorders[i]->file->Close();
+
+    for (i = 0; i < session.Boards(); i++) {
+      Recorder &r = *recorders[i];
+      picad::Reader &reader = session.GetReader(i);
+      picad::SampleRing &ring = session.Ring(i);
+
+      for (j = 0; j < r.monitors.size(); j++)
+        r.monitors[j]->Stop();
+      counters = session.GetDevice(i).GetCounters();
+      r.fifoHigh = std::max(r.fifoHigh, counters.fifoHigh);
+      bytes = reader.Bytes();
+      printf("%s, serial number %s\n", specs[i], session.Serial(i).c_str());
+      printf("%llu bytes in %.2f s, %.0f B/s\n", bytes, now - start,
+             bytes / (now - start));
+      printf("%lu packets, %lu lost, %lu samples dropped, %lu not stream packets\n",
+             r.checker.packets, r.checker.lostPackets, r.checker.lostSamples,
+             ring.Invalid());
+      printf("%lu blocks not published (ring full), max latency %.1f ms\n",
+             ring.Overflows(), r.checker.maxLatency);
+      printf("board: ");
+      PrintHealth(r.first, counters, r.fifoHigh);
+      for (j = 0; j < r.monitors.size(); j++) {
+        Monitor &m = *r.monitors[j];
+        printf("monitor %zu: %lu blocks, %llu skipped, %lu torn, samples %u..%u\n",
+               j, m.blocks, m.reader.Lost(), m.torn, m.low, m.high);
+      }
+      if (reader.LastError())
+        fprintf(stderr, "%s\n", picad::Error("EP1 IN", reader.LastError()).what());
+      lost = lost || r.checker.lostPackets || r.checker.lostSamples ||
+             ring.Overflows() || reader.LastError();
+    }
+    return lost ? 1 : 0;
+  } catch (const picad::Error &e) {
+    fprintf(stderr, "capture: %s\n", e.what());
+    return 2;
+  }
+}
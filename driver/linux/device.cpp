@@ -0,0 +1,282 @@
+/*   device.cpp - Talking to the board through a transport.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include "picad.h"
+
+namespace picad {
+
+/**
+ * Check() -    Throw if a transport call failed
+ **/
+static int Check(int r, const char *what)
+{
+  if (r < 0)
+    throw Error(what, r);
+  return r;
+}
+
+static uint32_t Get(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/**
+ * ValidSerial() -      Whether the firmware takes it as a serial number
+ **/
+bool ValidSerial(const std::string &serial)
+{
+  size_t i;
+
+  if (serial.empty() || serial.size() > SERIAL_MAX)
+    return false;
+  for (i = 0; i < serial.size(); i++)
+    if (serial[i] <= ' ' || serial[i] > '~')
+      return false;
+  return true;
+}
+
+Device::Device(Transport &transport)
+  : transport(transport), timeout(1000)
+{
+}
+
+Device::~Device()
+{
+  Close();
+}
+
+void Device::Open()
+{
+  transport.Open();
+}
+
+void Device::Close()
+{
+  transport.Close();
+}
+
+/**
+ * Device::VendorOut() -        Host to device vendor request
+ **/
+void Device::VendorOut(uint8_t request, uint16_t value, uint16_t index,
+                       const uint8_t *data, uint16_t len)
+{
+  Check(transport.Control(REQUEST_VENDOR_OUT, request, value, index,
+                          const_cast<uint8_t *>(data), len, timeout),
+        "vendor request");
+}
+
+/**
+ * Device::VendorIn() - Device to host vendor request
+ *
+ * Returns the number of bytes received.
+ **/
+size_t Device::VendorIn(uint8_t request, uint16_t value, uint16_t index,
+                        uint8_t *data, uint16_t len)
+{
+  return Check(transport.Control(REQUEST_VENDOR_IN, request, value, index,
+                                 data, len, timeout),
+               "vendor request");
+}
+
+/**
+ * Device::BulkWrite() -        Send a command on EP1 OUT
+ **/
+void Device::BulkWrite(const uint8_t *data, size_t len)
+{
+  if ((size_t) Check(transport.Bulk(EP1_OUT, const_cast<uint8_t *>(data),
+                                    len, timeout), "EP1 OUT") != len)
+    throw Error("EP1 OUT: short write");
+}
+
+/**
+ * Device::BulkRead() - Read an answer on EP1 IN
+ *
+ * Returns the number of bytes received.
+ **/
+size_t Device::BulkRead(uint8_t *data, size_t len)
+{
+  return Check(transport.Bulk(EP1_IN, data, len, timeout), "EP1 IN");
+}
+
+/**
+ * Device::SetRate() -  Conversions per second, 0 for untimed
+ **/
+void Device::SetRate(uint32_t hz)
+{
+  VendorOut(VR_SET_RATE, (uint16_t) hz, (uint16_t) (hz >> 16));
+}
+
+/**
+ * Device::GetRate() -  The rate reached and the highest one possible
+ **/
+RateInfo Device::GetRate()
+{
+  uint8_t d[13];
+  RateInfo rate;
+
+  if (VendorIn(VR_GET_RATE, 0, 0, d, sizeof(d)) < sizeof(d) || d[0] != 'R')
+    throw Error("rate: unexpected answer");
+  rate.cycles = Get(d + 1);
+  rate.reached = Get(d + 5) / 1000.0;
+  rate.highest = Get(d + 9) / 1000.0;
+  return rate;
+}
+
+/**
+ * Device::SetScan() -  Load the scan list (channel | acqt << 4 entries)
+ **/
+void Device::SetScan(const std::vector<uint8_t> &entries)
+{
+  VendorOut(VR_SET_SCAN, 0, 0, &entries[0], (uint16_t) entries.size());
+}
+
+/**
+ * Device::SetDecim() - Decimation mode, and N (k for DECIM_OVERSAMPLE)
+ **/
+void Device::SetDecim(DecimMode mode, uint16_t n)
+{
+  VendorOut(VR_SET_DECIM, mode, n);
+}
+
+void Device::Start()
+{
+  VendorOut(VR_START);
+}
+
+void Device::Stop()
+{
+  VendorOut(VR_STOP);
+}
+
+/**
+ * Device::SetAltSetting() -    ALT_BULK or ALT_ISO, not while streaming
+ *
+ * Packets the board was about to send are lost.
+ **/
+void Device::SetAltSetting(uint8_t alt)
+{
+  Check(transport.SetInterface(alt), "alternate setting");
+}
+
+/**
+ * Device::GetAltSetting() -    The one the board is in (GET_INTERFACE)
+ **/
+uint8_t Device::GetAltSetting()
+{
+  uint8_t alt;
+
+  if (Check(transport.Control(0x81, 10, 0, 0, &alt, 1, timeout),
+            "alternate setting") < 1)
+    throw Error("alternate setting: short answer");
+  return alt;
+}
+
+/**
+ * Device::GetCounters() -      Stream and bus counters, one control
+ *                              transfer
+ * @clearHigh:                  Start the FIFO high-water mark over
+ **/
+Counters Device::GetCounters(bool clearHigh)
+{
+  uint8_t d[COUNTERS_BYTES];
+  Counters c;
+  size_t n;
+
+  std::fill(d, d + sizeof(d), 0);
+  n = VendorIn(VR_GET_COUNTERS, clearHigh, 0, d, sizeof(d));
+  if (n < 8)
+    throw Error("counters: short answer");
+  c.packets = Get(d);
+  c.lost = Get(d + 4);
+  c.overruns = Get(d + 8);
+  c.inBusy = Get(d + 12);
+  c.stalls = Get(d + 16);
+  c.resets = Get(d + 20);
+  c.suspends = Get(d + 24);
+  c.errors = Get(d + 28);
+  c.errorBits = d[32];
+  c.fifoHigh = d[33];
+  return c;
+}
+
+/**
+ * Device::GetProfile() -       Every probe of a profiling build
+ * @clear:                      Start them over once read
+ *
+ * The probes are read in order until the device stalls, so the answer is
+ * empty when the firmware was not built with PROFILE.
+ **/
+std::vector<ProbeStats> Device::GetProfile(bool clear)
+{
+  std::vector<ProbeStats> probes;
+  uint8_t d[12];
+  ProbeStats p;
+  int r;
+
+  while (probes.size() < 0x100) {
+    r = transport.Control(REQUEST_VENDOR_IN, VR_GET_PROFILE, clear,
+                          (uint16_t) probes.size(), d, sizeof(d), timeout);
+    if (r == ERROR_PIPE)
+      break;
+    if (Check(r, "profile") < (int) sizeof(d))
+      throw Error("profile: short answer");
+    p.calls = Get(d);
+    p.total = Get(d + 4);
+    p.min = d[8] | (d[9] << 8);
+    p.max = d[10] | (d[11] << 8);
+    probes.push_back(p);
+  }
+  return probes;
+}
+
+/**
+ * Device::GetSerial() -        Serial number, from its string descriptor
+ **/
+std::string Device::GetSerial()
+{
+  uint8_t d[2 + 2 * SERIAL_MAX];
+  std::string serial;
+  size_t i, n;
+
+  n = Check(transport.Control(0x80, 6, 0x0300 | SERIAL_STRING_INDEX, 0x0409,
+                              d, sizeof(d), timeout), "serial number");
+  if (n < 2 || d[1] != 0x03)
+    throw Error("serial number: not a string descriptor");
+  n = std::min(n, (size_t) d[0]);
+  for (i = 2; i + 1 < n; i += 2)
+    serial += (char) d[i];
+  return serial;
+}
+
+/**
+ * Device::SetSerial() -        Store a new serial number in the EEPROM
+ *
+ * The descriptor changes at once; the operating system only sees the new
+ * number once the board is plugged in again.
+ **/
+void Device::SetSerial(const std::string &serial)
+{
+  if (!ValidSerial(serial))
+    throw Error("not a valid serial number: " + serial);
+  VendorOut(VR_SET_SERIAL, 0, 0, (const uint8_t *) serial.data(),
+            (uint16_t) serial.size());
+}
+
+} /* namespace picad */
@@ -0,0 +1,120 @@
+/*   fwprof.cpp - Print the cycle counts of a profiling build of the
+ *                firmware.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * fwprof [-d transport] [-c] [-f hz]
+ *
+ * Reads every probe of a board running firmware built with 'make
+ * PROFILE=yes' (pic/18f4550/prof.h) and prints, for each, the number of
+ * times it was passed and the shortest, mean and longest instruction
+ * cycles it took, the cost of the probe itself (PROF_EMPTY) taken off,
+ * and the mean in us at an instruction clock of -f hz (12 MHz, the 48 MHz
+ * of the board, by default).  -c starts the probes over once read, so the
+ * next run only shows what happened since.
+ *
+ * Counts are kept in 16 bits: a path longer than 65535 cycles (5.4 ms)
+ * reads short.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "picad.h"
+
+static const char *const probeNames[] = {
+  "ProcessUSBTransactions",
+  "InDataStage",
+  "AdcConvert",
+  "Acquire sample",
+  "(probe)",
+};
+
+static void Usage()
+{
+  fprintf(stderr, "usage: fwprof [-d transport] [-c] [-f hz]\n");
+  exit(2);
+}
+
+/**
+ * Net() -      Cycles less the cost of the probe, not below 0
+ **/
+static double Net(double cycles, double probe)
+{
+  return cycles > probe ? cycles - probe : 0;
+}
+
+int main(int argc, char **argv)
+{
+  const char *spec = "usb";
+  double fcy = 12e6, probe = 0, mean;
+  std::vector<picad::ProbeStats> probes;
+  bool clear = false;
+  size_t i;
+  int c;
+
+  while ((c = getopt(argc, argv, "d:cf:")) != -1) {
+    switch (c) {
+    case 'd': spec = optarg; break;
+    case 'c': clear = true; break;
+    case 'f': fcy = atof(optarg); break;
+    default: Usage();
+    }
+  }
+  if (optind != argc || fcy <= 0)
+    Usage();
+
+  try {
+    std::unique_ptr<picad::Transport> transport = picad::CreateTransport(spec);
+    picad::Device device(*transport);
+
+    device.Open();
+    probes = device.GetProfile(clear);
+  } catch (const picad::Error &e) {
+    fprintf(stderr, "fwprof: %s\n", e.what());
+    return 2;
+  }
+  if (probes.empty()) {
+    fprintf(stderr, "fwprof: %s: not a profiling build of the firmware\n", spec);
+    return 1;
+  }
+
+  if (probes.size() > picad::PROF_EMPTY && probes[picad::PROF_EMPTY].calls)
+    probe = (double) probes[picad::PROF_EMPTY].total /
+            probes[picad::PROF_EMPTY].calls;
+  printf("%-24s %10s %8s %10s %8s %10s\n", "probe", "calls", "min", "mean",
+         "max", "mean us");
+  for (i = 0; i < probes.size(); i++) {
+    const picad::ProbeStats &p = probes[i];
+    const char *name = i < sizeof(probeNames) / sizeof(probeNames[0])
+                       ? probeNames[i] : "?";
+
+    if (i == picad::PROF_EMPTY)
+      continue;
+    if (p.calls == 0) {
+      printf("%-24s %10u %8s %10s %8s %10s\n", name, 0, "-", "-", "-", "-");
+      continue;
+    }
+    mean = Net((double) p.total / p.calls, probe);
+    printf("%-24s %10lu %8.0f %10.1f %8.0f %10.2f\n", name,
+           (unsigned long) p.calls, Net(p.min, probe), mean, Net(p.max, probe),
+           mean / fcy * 1e6);
+  }
+  printf("cycles less %.1f for the probe itself, %g instructions/s\n", probe, fcy);
+  return 0;
+}
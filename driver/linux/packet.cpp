@@ -0,0 +1,142 @@
+/*   packet.cpp - Stream packet decoding and checking.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "picad.h"
+
+namespace picad {
+
+static uint32_t Get(const uint8_t *p, int n)
+{
+  uint32_t v = 0;
+
+  while (n--)
+    v = (v << 8) | p[n];
+  return v;
+}
+
+/**
+ * DecodePacket() -     Decode one stream packet
+ * @data:               Packet as received on EP1 IN
+ * @len:                Its length
+ * @header:             Filled in with the header fields
+ * @samples:            Room for MAX_PACKET_SAMPLES, gets the samples right
+ *                      justified
+ *
+ * Returns false if the packet is not a stream packet or is too short for
+ * the samples it announces.
+ **/
+bool DecodePacket(const uint8_t *data, size_t len, PacketHeader &header,
+                  uint16_t *samples)
+{
+  size_t i, g, n;
+
+  if (len < STREAM_HEADER_BYTES)
+    return false;
+
+  header.format = data[0];
+  header.count = data[1];
+  header.flags = data[2];
+  header.first = data[3];
+  header.sequence = (uint16_t) Get(data + 4, 2);
+  header.frame = Get(data + 6, 4);
+  header.index = Get(data + 10, 4);
+  header.decimMode = 0;
+  header.decimFactor = 1;
+  if (header.count > MAX_PACKET_SAMPLES)
+    return false;
+
+  if (header.format == STREAM_PACKED10) {
+    /* 4 samples in 5 bytes: high 8 bits of each, then the low 2 bits */
+    if ((header.count % 4) ||
+        (len < STREAM_HEADER_BYTES + header.count / 4 * 5))
+      return false;
+    for (g = STREAM_HEADER_BYTES, n = 0; n < header.count; g += 5)
+      for (i = 0; i < 4; i++)
+        samples[n++] = (data[g + i] << 2) | ((data[g + 4] >> (2 * i)) & 0x03);
+    return true;
+  }
+
+  if (header.format == STREAM_WORD16) {
+    if (len < STREAM_HEADER_BYTES + 2 + header.count * 2u)
+      return false;
+    header.decimMode = data[STREAM_HEADER_BYTES];
+    header.decimFactor = data[STREAM_HEADER_BYTES + 1];
+    for (i = 0; i < header.count; i++)
+      samples[i] = (uint16_t) Get(data + STREAM_HEADER_BYTES + 2 + 2 * i, 2);
+    return true;
+  }
+
+  return false;
+}
+
+/**
+ * ParsePacket() -      DecodePacket() into a vector
+ *
+ * @samples is left empty if the packet is not a stream packet.
+ **/
+bool ParsePacket(const uint8_t *data, size_t len, PacketHeader &header,
+                 std::vector<uint16_t> &samples)
+{
+  samples.resize(MAX_PACKET_SAMPLES);
+  if (!DecodePacket(data, len, header, &samples[0])) {
+    samples.clear();
+    return false;
+  }
+  samples.resize(header.count);
+  return true;
+}
+
+StreamChecker::StreamChecker()
+  : packets(0), lostPackets(0), lostSamples(0), maxLatency(0),
+    started(false), sequence(0), next(0), offset(0)
+{
+}
+
+/**
+ * StreamChecker::Check() -     Account for one packet
+ * @header:                     Its header
+ * @now:                        Arrival time, in seconds
+ *
+ * Returns the latency of the packet in ms, see the class comment.
+ **/
+double StreamChecker::Check(const PacketHeader &header, double now)
+{
+  uint16_t missing;
+  double o, latency;
+
+  packets++;
+  if (started) {
+    missing = (uint16_t) (header.sequence - sequence - 1);
+    lostPackets += missing;
+    /* Packets of a stream all carry the same number of samples */
+    lostSamples += header.index - next - (uint32_t) missing * header.count;
+  }
+  started = true;
+  sequence = header.sequence;
+  next = header.index + header.count;
+
+  o = now * 1000.0 - header.frame;
+  if ((packets == 1) || (o < offset))
+    offset = o;
+  latency = o - offset;
+  if (latency > maxLatency)
+    maxLatency = latency;
+  return latency;
+}
+
+} /* namespace picad */
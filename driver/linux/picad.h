@@ -0,0 +1,691 @@
+/*   picad.h - Host library for the PIC18F4550 A/D firmware.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PICAD_H
+#define PICAD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct libusb_context;
+struct libusb_device_handle;
+struct libusb_transfer;
+
+namespace picad {
+
+/**
+ * Device identity and endpoints (pic/18f4550/usb.c)
+ **/
+const uint16_t VENDOR_ID  = 0x04D8;
+const uint16_t PRODUCT_ID = 0x7531;
+const uint8_t  EP1_OUT    = 0x01;
+const uint8_t  EP1_IN     = 0x81;
+const size_t   PACKET_BYTES = 64;
+
+/**
+ * Alternate settings of interface 0 (pic/18f4550/usb.h).  EP1 IN is bulk
+ * in ALT_BULK and isochronous in ALT_ISO, where the bus reserves it one
+ * packet at a fixed interval, sized for the ISO_RATE the firmware was
+ * built with, which caps the rate there.  ALT_ISO has no EP1 OUT, only
+ * the vendor requests on EP0 drive the board there.  Every endpoint
+ * starts over when the setting changes.
+ **/
+const uint8_t  ALT_BULK = 0;
+const uint8_t  ALT_ISO  = 1;
+
+/**
+ * Serial number, string descriptor SERIAL_STRING_INDEX, 1..SERIAL_MAX
+ * printable ASCII characters but space (pic/18f4550/serial.h)
+ **/
+const uint8_t  SERIAL_STRING_INDEX = 3;
+const size_t   SERIAL_MAX = 16;
+const char     SERIAL_DEFAULT[] = "00000000";
+
+bool ValidSerial(const std::string &serial);
+
+/**
+ * EP1 OUT commands (pic/18f4550/stream.h)
+ **/
+const uint8_t STREAM_START = 'S';
+const uint8_t STREAM_STOP  = 'E';
+
+/**
+ * Vendor requests on EP0 (pic/18f4550/vendor.h), bmRequestType
+ * REQUEST_VENDOR_OUT or REQUEST_VENDOR_IN
+ **/
+const uint8_t REQUEST_VENDOR_OUT = 0x40;
+const uint8_t REQUEST_VENDOR_IN  = 0xC0;
+
+enum VendorRequest {
+  VR_SET_RATE       = 0x01,
+  VR_GET_RATE       = 0x02,
+  VR_SET_SCAN       = 0x03,
+  VR_GET_SCAN       = 0x04,
+  VR_SET_ADC_CLOCK  = 0x05,
+  VR_GET_ADC_CLOCK  = 0x06,
+  VR_START          = 0x07,
+  VR_STOP           = 0x08,
+  VR_GET_COUNTERS   = 0x09,
+  VR_SET_DECIM      = 0x0A,
+  VR_GET_DECIM      = 0x0B,
+  VR_SET_SERIAL     = 0x0C,
+  VR_GET_PROFILE    = 0x0D
+};
+
+/**
+ * Decimation modes of VR_SET_DECIM (pic/18f4550/decim.h)
+ **/
+enum DecimMode {
+  DECIM_OFF         = 0,
+  DECIM_BOXCAR      = 1,        /* Mean of N conversions             */
+  DECIM_CIC         = 2,        /* Sum of N conversions              */
+  DECIM_OVERSAMPLE  = 3         /* 4^k conversions for k more bits   */
+};
+
+/**
+ * RateInfo - Answer to VR_GET_RATE (pic/18f4550/rate.h)
+ **/
+struct RateInfo {
+  uint32_t cycles;              /* Instruction cycles per conversion, 0
+                                   when not timed */
+  double reached;               /* Hz */
+  double highest;               /* Hz, what the A/D module can keep up with */
+};
+
+/**
+ * Counters - Answer to VR_GET_COUNTERS, since power up
+ *
+ * Firmware older than the health counters only answers the first two,
+ * the others read 0 then.
+ **/
+struct Counters {
+  uint32_t packets;             /* Stream packets sent                  */
+  uint32_t lost;                /* Samples dropped                      */
+  uint32_t overruns;            /* Times the FIFO filled up             */
+  uint32_t inBusy;              /* IN refused, the SIE still had the BD */
+  uint32_t stalls;              /* STALL handshakes                     */
+  uint32_t resets;              /* Bus resets                           */
+  uint32_t suspends;
+  uint32_t errors;              /* Bus errors (UERRIF)                  */
+  uint8_t errorBits;            /* UEIR bits seen: PID, CRC5, CRC16,
+                                   DFN8, bus timeout, bit stuff (0x80)  */
+  uint8_t fifoHigh;             /* Most samples queued at once          */
+};
+
+const size_t COUNTERS_BYTES = 34;
+
+/**
+ * Probes of a profiling build (pic/18f4550/prof.h)
+ **/
+enum Probe {
+  PROF_USB          = 0,        /* ProcessUSBTransactions()           */
+  PROF_IN_DATA      = 1,        /* InDataStage()                      */
+  PROF_ADC          = 2,        /* AdcConvert(), GO to the result     */
+  PROF_SAMPLE       = 3,        /* Acquire() collecting one result    */
+  PROF_EMPTY        = 4         /* The cost of the probe itself       */
+};
+
+/**
+ * ProbeStats - Answer to VR_GET_PROFILE, in instruction cycles
+ **/
+struct ProbeStats {
+  uint32_t calls;
+  uint32_t total;
+  uint16_t min;                 /* 0xFFFF while calls is 0 */
+  uint16_t max;
+};
+
+/**
+ * Stream packet layout (pic/18f4550/stream.h)
+ **/
+const uint8_t STREAM_PACKED10 = 0x0A;
+const uint8_t STREAM_WORD16   = 0x10;
+const uint8_t STREAM_DROPPED  = 0x01;
+const uint8_t STREAM_RESTART  = 0x02;
+const size_t  STREAM_HEADER_BYTES = 14;
+const size_t  MAX_PACKET_SAMPLES  = 40;  /* 64 - 14 bytes, packed 10 bit */
+
+/**
+ * Error codes returned by the transports.  They have the values of the
+ * libusb ones, so the libusb transport passes them through.
+ **/
+enum ErrorCode {
+  ERROR_IO            = -1,
+  ERROR_INVALID_PARAM = -2,
+  ERROR_ACCESS        = -3,
+  ERROR_NO_DEVICE     = -4,
+  ERROR_NOT_FOUND     = -5,
+  ERROR_BUSY          = -6,
+  ERROR_TIMEOUT       = -7,
+  ERROR_OVERFLOW      = -8,
+  ERROR_PIPE          = -9,     /* Stalled */
+  ERROR_INTERRUPTED   = -10,
+  ERROR_NO_MEM        = -11,
+  ERROR_NOT_SUPPORTED = -12,
+  ERROR_OTHER         = -99
+};
+
+const char *ErrorName(int code);
+
+/**
+ * Error - Failure of a transport call or an unexpected answer
+ * @code:  ERROR_*, 0 when the device answered something wrong
+ **/
+class Error : public std::runtime_error {
+ public:
+  Error(const std::string &what, int code = 0);
+  int code;
+};
+
+/**
+ * PacketHeader - Fields of a stream packet header
+ **/
+struct PacketHeader {
+  uint8_t  format;       /* STREAM_PACKED10 or STREAM_WORD16          */
+  uint8_t  count;        /* Samples in the packet                     */
+  uint8_t  flags;        /* STREAM_DROPPED, STREAM_RESTART            */
+  uint8_t  first;        /* Scan list position of the first sample    */
+  uint16_t sequence;
+  uint32_t frame;        /* USB frame the first sample was queued in  */
+  uint32_t index;        /* Index of the first sample                 */
+  uint8_t  decimMode;    /* STREAM_WORD16 only                        */
+  uint8_t  decimFactor;  /* STREAM_WORD16 only, 1 otherwise           */
+};
+
+bool DecodePacket(const uint8_t *data, size_t len, PacketHeader &header,
+                  uint16_t *samples);
+bool ParsePacket(const uint8_t *data, size_t len, PacketHeader &header,
+                 std::vector<uint16_t> &samples);
+
+/**
+ * StreamChecker - Follow the packet headers of a stream
+ *
+ * Sequence numbers tell packets lost on the bus, sample indexes samples
+ * the device dropped (or threw away on a restart).  Latency is measured
+ * from the frame the first sample was queued in to the arrival of the
+ * packet, above the lowest one seen: the clocks have no common origin.
+ **/
+class StreamChecker {
+ public:
+  StreamChecker();
+  double Check(const PacketHeader &header, double now);
+
+  unsigned long packets;
+  unsigned long lostPackets;
+  unsigned long lostSamples;
+  double maxLatency;             /* ms */
+
+ private:
+  bool started;
+  uint16_t sequence;
+  uint32_t next;
+  double offset;
+};
+
+/**
+ * TransferStatus - How an asynchronous transfer ended (libusb values)
+ **/
+enum TransferStatus {
+  TRANSFER_COMPLETED,
+  TRANSFER_ERROR,
+  TRANSFER_TIMED_OUT,
+  TRANSFER_CANCELLED,
+  TRANSFER_STALL,
+  TRANSFER_NO_DEVICE,
+  TRANSFER_OVERFLOW
+};
+
+/**
+ * Transfer - An asynchronous bulk IN transfer
+ *
+ * Filled in by the caller and given to Transport::Submit(); the callback
+ * is run from Transport::HandleEvents() when it ends, and may submit it
+ * again.  Like a libusb transfer it only completes when the buffer is
+ * full or a short packet arrives.
+ **/
+struct Transfer {
+  Transfer() : endpoint(0), buffer(0), length(0), actual(0),
+               status(TRANSFER_COMPLETED), callback(0), user(0), priv(0) {}
+  uint8_t endpoint;
+  uint8_t *buffer;
+  size_t length;
+  size_t actual;                  /* Bytes received */
+  TransferStatus status;
+  void (*callback)(Transfer *transfer);
+  void *user;
+  void *priv;                     /* Owned by the transport */
+};
+
+/**
+ * An isochronous transfer (EP1 IN in ALT_ISO) has one PACKET_BYTES slot
+ * per service interval.  IsoPackets() is how many a transfer of length
+ * bytes has, ERROR_INVALID_PARAM if not even one.  IsoCompact() puts the
+ * packets received back to back, slot i holding lengths[i] bytes (0 for
+ * an interval lost or with nothing sent), and returns the bytes kept.
+ **/
+int IsoPackets(size_t length);
+size_t IsoCompact(uint8_t *buffer, const size_t *lengths, unsigned int packets);
+
+/**
+ * Transport - Access to the endpoints of one board
+ *
+ * Control() and Bulk() are synchronous and return the number of bytes
+ * moved or an ERROR_* code; Bulk() goes either way, the endpoint address
+ * tells.  Open() throws an Error when there is no board.  Control() and
+ * Bulk() may be called while another thread runs HandleEvents().
+ *
+ * SetInterface() selects an alternate setting of interface 0, with a
+ * SET_INTERFACE request unless the transport has to tell the host side
+ * as well.  In ALT_ISO, EP1 IN is only read through Submit(): Bulk()
+ * may fail with ERROR_NOT_SUPPORTED there.
+ *
+ *   UsbTransport       the board, through libusb
+ *   VirtualTransport   a VirtualDevice in the same process (virtual.h)
+ *   SocketTransport    a VirtualDevice served on a Unix socket (virtual.h)
+ **/
+class Transport {
+ public:
+  virtual ~Transport() {}
+
+  virtual void Open() = 0;
+  virtual void Close() = 0;
+  virtual bool IsOpen() const = 0;
+
+  virtual int Control(uint8_t requestType, uint8_t request, uint16_t value,
+                      uint16_t index, uint8_t *data, uint16_t len,
+                      unsigned int timeout) = 0;
+  virtual int Bulk(uint8_t endpoint, uint8_t *data, size_t len,
+                   unsigned int timeout) = 0;
+  virtual int SetInterface(uint8_t alt);
+
+  virtual int Submit(Transfer *transfer) = 0;
+  virtual int Cancel(Transfer *transfer) = 0;
+  virtual void Release(Transfer *transfer) { (void) transfer; }
+  virtual void HandleEvents(unsigned int timeoutMs) = 0;
+};
+
+/**
+ * UsbTransport - The board, through libusb-1.0
+ *
+ * Opens the board with the given serial number, or with any one if it is
+ * empty: the first one that is not already in use, so several transports
+ * opened in turn get different boards.  Each transport has its own libusb
+ * context, and so its own events.
+ *
+ * In ALT_ISO the transfers of EP1 IN are isochronous, one packet of
+ * PACKET_BYTES per service interval; the packets that came are put back
+ * to back in the buffer, the intervals with nothing to send left out.
+ **/
+class UsbTransport : public Transport {
+ public:
+  UsbTransport(uint16_t vid = VENDOR_ID, uint16_t pid = PRODUCT_ID,
+               const std::string &serial = "");
+  ~UsbTransport();
+
+  static std::vector<std::string> Serials(uint16_t vid = VENDOR_ID,
+                                          uint16_t pid = PRODUCT_ID);
+
+  void Open();
+  void Close();
+  bool IsOpen() const { return handle != 0; }
+
+  int Control(uint8_t requestType, uint8_t request, uint16_t value,
+              uint16_t index, uint8_t *data, uint16_t len, unsigned int timeout);
+  int Bulk(uint8_t endpoint, uint8_t *data, size_t len, unsigned int timeout);
+  int SetInterface(uint8_t alt);
+
+  int Submit(Transfer *transfer);
+  int Cancel(Transfer *transfer);
+  void Release(Transfer *transfer);
+  void HandleEvents(unsigned int timeoutMs);
+
+ private:
+  UsbTransport(const UsbTransport &);
+  UsbTransport &operator=(const UsbTransport &);
+
+  static void Callback(libusb_transfer *transfer);
+
+  uint16_t vid, pid;
+  std::string serial;
+  libusb_context *context;
+  libusb_device_handle *handle;
+  uint8_t alt;
+};
+
+/**
+ * CreateTransport() - Transport named by a string
+ *
+ *   usb[:vid:pid][@serial]     the board (hex ids, 04d8:7531 by default),
+ *                              the one with that serial number if given
+ *   virtual[:speed][@serial]   an in-process VirtualDevice, speed as in
+ *                              VirtualDevice::Options (1 by default)
+ *   unix:path                  a VirtualDevice served on a Unix socket
+ *                              (vdevice)
+ **/
+std::unique_ptr<Transport> CreateTransport(const std::string &spec);
+
+/**
+ * Device - One board, through any transport
+ *
+ * Turns the transport error codes into Error exceptions.  The transport
+ * must outlive the Device.
+ **/
+class Device {
+ public:
+  explicit Device(Transport &transport);
+  ~Device();
+
+  void Open();
+  void Close();
+  bool IsOpen() const { return transport.IsOpen(); }
+
+  void VendorOut(uint8_t request, uint16_t value = 0, uint16_t index = 0,
+                 const uint8_t *data = 0, uint16_t len = 0);
+  size_t VendorIn(uint8_t request, uint16_t value, uint16_t index,
+                  uint8_t *data, uint16_t len);
+  void BulkWrite(const uint8_t *data, size_t len);
+  size_t BulkRead(uint8_t *data, size_t len);
+
+  void SetRate(uint32_t hz);
+  RateInfo GetRate();
+  void SetScan(const std::vector<uint8_t> &entries);
+  void SetDecim(DecimMode mode, uint16_t n);
+  void Start();
+  void Stop();
+  void SetAltSetting(uint8_t alt);
+  uint8_t GetAltSetting();
+  Counters GetCounters(bool clearHigh = false);
+  std::vector<ProbeStats> GetProfile(bool clear = false);
+
+  std::string GetSerial();
+  void SetSerial(const std::string &serial);
+
+  Transport &GetTransport() const { return transport; }
+
+ private:
+  Device(const Device &);
+  Device &operator=(const Device &);
+
+  Transport &transport;
+  unsigned int timeout;          /* ms, for the synchronous calls */
+};
+
+/**
+ * Consumer - Called from the event thread with every completed buffer
+ *
+ * The data is only valid during the call: the buffer goes straight back
+ * to the device.  It holds whole stream packets, PACKET_BYTES each.
+ **/
+typedef std::function<void(const uint8_t *data, size_t len)> Consumer;
+
+/**
+ * Reader - Asynchronous EP1 IN engine
+ *
+ * Keeps several transfers queued at all times, so the host controller
+ * always has a buffer for the device in every frame.  Each one is
+ * resubmitted as soon as the consumer returns.  A thread running the
+ * transport events is started with the reader.
+ **/
+class Reader {
+ public:
+  struct Options {
+    Options() : transfers(8), packetsPerTransfer(4) {}
+    unsigned int transfers;           /* Kept queued              */
+    unsigned int packetsPerTransfer;  /* Latency against overhead */
+  };
+
+  Reader(Device &device, Consumer consumer, const Options &options = Options());
+  ~Reader();
+
+  void Start();
+  void Stop();
+  bool Running() const { return running; }
+
+  unsigned long long Bytes() const { return bytes; }
+  unsigned long Transfers() const { return completed; }
+  int LastError() const { return error; }
+
+ private:
+  Reader(const Reader &);
+  Reader &operator=(const Reader &);
+
+  static void Callback(Transfer *transfer);
+  void Complete(Transfer *transfer);
+  void Events();
+
+  Device &device;
+  Transport &transport;
+  Consumer consumer;
+  Options options;
+  std::vector<Transfer> transfers;
+  std::vector<std::vector<uint8_t> > buffers;
+  std::thread thread;
+  std::mutex lock;
+  unsigned int active;              /* Transfers owned by the transport */
+  std::atomic<bool> running;        /* These four are read by any thread */
+  std::atomic<unsigned long long> bytes;
+  std::atomic<unsigned long> completed;
+  std::atomic<int> error;
+};
+
+/**
+ * BufferQueue - Hand the Reader buffers over to another thread
+ *
+ * GetConsumer() is given to the Reader, Pop() is called by the thread that
+ * processes the data.  Buffers are copied; when more than depth are
+ * waiting the new ones are dropped and counted.
+ **/
+class BufferQueue {
+ public:
+  explicit BufferQueue(size_t depth = 256);
+
+  Consumer GetConsumer();
+  void Push(const uint8_t *data, size_t len);
+  bool Pop(std::vector<uint8_t> &buffer, unsigned int timeoutMs);
+
+  unsigned long Dropped() const { return dropped; }
+
+ private:
+  std::mutex lock;
+  std::condition_variable ready;
+  std::deque<std::vector<uint8_t> > queue;
+  size_t depth;
+  unsigned long dropped;
+};
+
+/**
+ * SampleBlock - One decoded stream packet
+ *
+ * The packet as received is kept in @raw, for the consumers that record
+ * it.
+ **/
+struct SampleBlock {
+  PacketHeader header;
+  uint16_t samples[MAX_PACKET_SAMPLES];   /* header.count of them */
+  uint8_t rawLen;
+  uint8_t raw[PACKET_BYTES];
+};
+
+/**
+ * RingPolicy - What a RingReader gets when it falls a whole ring behind
+ *
+ *   RING_BLOCK         nothing is overwritten under it: the producer does
+ *                      not publish new blocks until it moves on, they are
+ *                      counted in SampleRing::Overflows() and lost for
+ *                      every reader
+ *   RING_DROP          it skips to the newest block, the backlog is lost
+ *   RING_OVERWRITE     it skips to the oldest block still in the ring
+ *
+ * Whatever the policy, the producer never waits.
+ **/
+enum RingPolicy {
+  RING_BLOCK,
+  RING_DROP,
+  RING_OVERWRITE
+};
+
+const unsigned int RING_MAX_READERS = 16;
+
+/**
+ * SampleRing - Lock-free single producer, multiple consumer block ring
+ *
+ * GetConsumer() is given to the Reader: the event thread decodes every
+ * stream packet straight into the next preallocated slot and publishes
+ * it.  Any number of RingReaders, each with its own cursor and policy,
+ * then look at the blocks in place from their own threads.  Packets that
+ * are not stream packets are only counted.
+ *
+ * Each slot carries the sequence number of the block in it, written last
+ * by the producer and checked by the readers before and after they look
+ * at a block, so a reader that is not RING_BLOCK learns when a block was
+ * overwritten under it.
+ **/
+class SampleRing {
+ public:
+  explicit SampleRing(size_t capacity = 1024);
+
+  Consumer GetConsumer();
+  bool Publish(const uint8_t *packet, size_t len);
+
+  size_t Capacity() const { return mask + 1; }
+  unsigned long long Published() const { return head.load(); }
+  unsigned long Overflows() const { return overflows.load(); }
+  unsigned long Invalid() const { return invalid.load(); }
+
+ private:
+  SampleRing(const SampleRing &);
+  SampleRing &operator=(const SampleRing &);
+  friend class RingReader;
+
+  struct Slot {
+    std::atomic<uint64_t> stamp;        /* Sequence + 1, 0 while written */
+    SampleBlock block;
+  };
+
+  /* What the producer knows of a reader, kept here so that it never
+     looks at a RingReader that is going away */
+  struct Gate {
+    std::atomic<int> policy;            /* RingPolicy, -1 if free */
+    std::atomic<uint64_t> cursor;       /* Next block it will look at */
+  };
+
+  std::unique_ptr<Slot[]> slots;
+  uint64_t mask;
+  std::atomic<uint64_t> head;           /* Blocks published */
+  Gate gates[RING_MAX_READERS];
+  std::atomic<unsigned long> overflows;
+  std::atomic<unsigned long> invalid;
+};
+
+/**
+ * RingReader - One consumer of a SampleRing
+ *
+ * Starts at the next block published.  Acquire() gives a view of the next
+ * block, in the ring, and Release() lets it go; they are called in turn by
+ * one thread.  Acquire() waits for a block, polling: the producer holds no
+ * lock to wake it with.
+ **/
+class RingReader {
+ public:
+  RingReader(SampleRing &ring, RingPolicy policy);
+  ~RingReader();
+
+  const SampleBlock *Acquire(unsigned int timeoutMs);
+  bool Release();
+
+  RingPolicy Policy() const { return policy; }
+  unsigned long long Lost() const { return lost; }
+
+ private:
+  RingReader(const RingReader &);
+  RingReader &operator=(const RingReader &);
+
+  SampleRing &ring;
+  RingPolicy policy;
+  unsigned int gate;
+  uint64_t cursor;
+  bool held;
+  unsigned long long lost;
+};
+
+/**
+ * Session - Several boards streaming together
+ *
+ * Each board added has its own transport, Reader, event thread and
+ * SampleRing: the boards share no lock and no thread, so one more board
+ * does not slow the others down.  Boards are opened, set up, started and
+ * stopped in parallel, one thread each, and the settings go to all of
+ * them.  A board is known by its index, in the order it was added, and
+ * by its serial number.
+ **/
+class Session {
+ public:
+  explicit Session(const Reader::Options &options = Reader::Options(),
+                   size_t ringBlocks = 1024);
+  ~Session();
+
+  void Add(const std::string &spec);
+  void Open();
+  void Close();
+
+  void SetRate(uint32_t hz);
+  void SetScan(const std::vector<uint8_t> &entries);
+  void SetAltSetting(uint8_t alt);
+  void Start();
+  void Stop();
+
+  size_t Boards() const { return boards.size(); }
+  Device &GetDevice(size_t board) { return *boards[board]->device; }
+  Reader &GetReader(size_t board) { return *boards[board]->reader; }
+  SampleRing &Ring(size_t board) { return *boards[board]->ring; }
+  const std::string &Serial(size_t board) const { return boards[board]->serial; }
+
+ private:
+  Session(const Session &);
+  Session &operator=(const Session &);
+
+  /* Declared in the order they are built, torn down the other way */
+  struct Board {
+    std::unique_ptr<Transport> transport;
+    std::unique_ptr<Device> device;
+    std::unique_ptr<SampleRing> ring;
+    std::unique_ptr<Reader> reader;
+    std::string spec;
+    std::string serial;
+  };
+
+  void Each(const std::function<void(Board &)> &work);
+
+  Reader::Options options;
+  size_t ringBlocks;
+  std::vector<std::unique_ptr<Board> > boards;
+};
+
+} /* namespace picad */
+
+#endif /* PICAD_H */
@@ -0,0 +1,1360 @@
+/*   picadmodule.cpp - Python bindings of the host library.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * The picad module (make python):
+ *
+ *   Device(spec="usb", blocks=1024, transfers=8, packets=4)
+ *              one board, see CreateTransport() for spec.  open(), close(),
+ *              set_rate(), get_rate(), set_scan(), set_decim(),
+ *              set_alt_setting(), get_alt_setting(), start(), stop(),
+ *              counters(), serial, set_serial(), control() and stats();
+ *              reader() makes a Reader of its SampleRing.
+ *   Reader     a RingReader.  acquire(timeout_ms) waits for the next
+ *              Block (None on timeout), poll() does not wait, iterating
+ *              gives the blocks until the stream stops; start(callback)
+ *              instead calls callback(block) from a thread of its own
+ *              for every block, until stop().
+ *   Block      one SampleBlock, seen in place in the ring: the header
+ *              fields as attributes, and the samples through the buffer
+ *              protocol (format "H"), so numpy.asarray(block) takes no
+ *              copy.  release() hands the slot back, and is done by the
+ *              next acquire() or when the block goes away.  A block taken
+ *              from a callback is released when it returns.  While a
+ *              view of the samples is alive the slot is kept: releasing
+ *              raises BufferError, and a callback keeping one stops.
+ *   CaptureFile, CaptureWriter
+ *              capture files, see capfile.h.
+ *
+ * Errors of the library are raised as picad.Error, with the ERROR_* code
+ * in its code attribute.  Waits and calls to the board let other Python
+ * threads run.
+ **/
+
+#include <Python.h>
+#include <string.h>
+#include "capfile.h"
+
+/**
+ * Unlocked - Let other Python threads run while it is in scope
+ **/
+struct Unlocked {
+  Unlocked() : state(PyEval_SaveThread()) {}
+  ~Unlocked() { PyEval_RestoreThread(state); }
+  PyThreadState *state;
+};
+
+static PyObject *ErrorType;
+
+/**
+ * Raise() -    Set picad.Error from an Error, returns NULL
+ **/
+static PyObject *Raise(const picad::Error &e)
+{
+  PyObject *x, *code;
+
+  x = PyObject_CallFunction(ErrorType, "s", e.what());
+  if (x == NULL)
+    return NULL;
+  code = PyLong_FromLong(e.code);
+  PyObject_SetAttrString(x, "code", code);
+  Py_XDECREF(code);
+  PyErr_SetObject(ErrorType, x);
+  Py_DECREF(x);
+  return NULL;
+}
+
+/**
+ * GetSamples() -       A buffer of 16 bit samples, format "H"
+ **/
+static bool GetSamples(PyObject *o, Py_buffer *view)
+{
+  const char *f;
+
+  if (PyObject_GetBuffer(o, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0)
+    return false;
+  f = view->format ? view->format : "B";
+  if (*f == '<' || *f == '=' || *f == '@')
+    f++;
+  if (view->itemsize != 2 || (strcmp(f, "H") != 0 && strcmp(f, "h") != 0)) {
+    PyBuffer_Release(view);
+    PyErr_SetString(PyExc_TypeError, "a buffer of 16 bit samples is needed");
+    return false;
+  }
+  return true;
+}
+
+/***************************************************************************
+ * Device
+ ***************************************************************************/
+
+struct DeviceObject {
+  PyObject_HEAD
+  picad::Session *session;
+};
+
+static PyTypeObject DeviceType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+static int DeviceInit(DeviceObject *self, PyObject *args, PyObject *kw)
+{
+  static const char *names[] = { "spec", "blocks", "transfers", "packets", NULL };
+  const char *spec = "usb";
+  unsigned long blocks = 1024;
+  picad::Reader::Options options;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "|skII", (char **) names, &spec,
+                                   &blocks, &options.transfers,
+                                   &options.packetsPerTransfer))
+    return -1;
+  try {
+    delete self->session;
+    self->session = 0;
+    self->session = new picad::Session(options, blocks);
+    self->session->Add(spec);
+  } catch (const picad::Error &e) {
+    delete self->session;
+    self->session = 0;
+    Raise(e);
+    return -1;
+  }
+  return 0;
+}
+
+static void DeviceDealloc(DeviceObject *self)
+{
+  if (self->session) {
+    Unlocked u;
+    delete self->session;
+  }
+  Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static picad::Device *Board(DeviceObject *self)
+{
+  if (self->session == 0) {
+    PyErr_SetString(PyExc_ValueError, "device not initialised");
+    return 0;
+  }
+  return &self->session->GetDevice(0);
+}
+
+/**
+ * DeviceCall() -       Run a call on the board with the GIL released
+ **/
+template <typename F>
+static PyObject *DeviceCall(DeviceObject *self, F f)
+{
+  if (Board(self) == 0)
+    return NULL;
+  try {
+    Unlocked u;
+    f(*self->session, self->session->GetDevice(0));
+  } catch (const picad::Error &e) {
+    return Raise(e);
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *DeviceOpen(DeviceObject *self, PyObject *)
+{
+  return DeviceCall(self, [](picad::Session &s, picad::Device &) { s.Open(); });
+}
+
+static PyObject *DeviceClose(DeviceObject *self, PyObject *)
+{
+  return DeviceCall(self, [](picad::Session &s, picad::Device &) { s.Close(); });
+}
+
+static PyObject *DeviceStart(DeviceObject *self, PyObject *)
+{
+  return DeviceCall(self, [](picad::Session &s, picad::Device &) { s.Start(); });
+}
+
+static PyObject *DeviceStop(DeviceObject *self, PyObject *)
+{
+  return DeviceCall(self, [](picad::Session &s, picad::Device &) { s.Stop(); });
+}
+
+static PyObject *DeviceSetRate(DeviceObject *self, PyObject *args)
+{
+  unsigned long hz;
+
+  if (!PyArg_ParseTuple(args, "k", &hz))
+    return NULL;
+  return DeviceCall(self, [hz](picad::Session &, picad::Device &d) {
+    d.SetRate((uint32_t) hz);
+  });
+}
+
+static PyObject *DeviceGetRate(DeviceObject *self, PyObject *)
+{
+  picad::RateInfo rate;
+
+  if (DeviceCall(self, [&rate](picad::Session &, picad::Device &d) {
+        rate = d.GetRate();
+      }) == NULL)
+    return NULL;
+  Py_DECREF(Py_None);
+  return Py_BuildValue("(kdd)", (unsigned long) rate.cycles, rate.reached,
+                       rate.highest);
+}
+
+/**
+ * DeviceSetScan() -    set_scan(entries): channel numbers, taken with an
+ *                      acquisition time of 2 TAD, or (channel, acqt) pairs
+ **/
+static PyObject *DeviceSetScan(DeviceObject *self, PyObject *args)
+{
+  std::vector<uint8_t> entries;
+  PyObject *list, *seq, *item;
+  Py_ssize_t i;
+  int ch, acqt;
+
+  if (!PyArg_ParseTuple(args, "O", &list))
+    return NULL;
+  seq = PySequence_Fast(list, "set_scan() takes a sequence");
+  if (seq == NULL)
+    return NULL;
+  for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+    item = PySequence_Fast_GET_ITEM(seq, i);
+    acqt = 1;
+    if (PyTuple_Check(item) ? !PyArg_ParseTuple(item, "ii", &ch, &acqt)
+                            : (ch = (int) PyLong_AsLong(item)) == -1 && PyErr_Occurred()) {
+      Py_DECREF(seq);
+      return NULL;
+    }
+    if (ch < 0 || ch > 12 || acqt < 0 || acqt > 7) {
+      Py_DECREF(seq);
+      PyErr_SetString(PyExc_ValueError, "channel 0..12, acqt 0..7");
+      return NULL;
+    }
+    entries.push_back((uint8_t) (ch | (acqt << 4)));
+  }
+  Py_DECREF(seq);
+  if (entries.empty()) {
+    PyErr_SetString(PyExc_ValueError, "empty scan list");
+    return NULL;
+  }
+  return DeviceCall(self, [&entries](picad::Session &, picad::Device &d) {
+    d.SetScan(entries);
+  });
+}
+
+static PyObject *DeviceSetDecim(DeviceObject *self, PyObject *args)
+{
+  int mode, n;
+
+  if (!PyArg_ParseTuple(args, "ii", &mode, &n))
+    return NULL;
+  return DeviceCall(self, [mode, n](picad::Session &, picad::Device &d) {
+    d.SetDecim((picad::DecimMode) mode, (uint16_t) n);
+  });
+}
+
+static PyObject *DeviceSetAltSetting(DeviceObject *self, PyObject *args)
+{
+  int alt;
+
+  if (!PyArg_ParseTuple(args, "i", &alt))
+    return NULL;
+  return DeviceCall(self, [alt](picad::Session &, picad::Device &d) {
+    d.SetAltSetting((uint8_t) alt);
+  });
+}
+
+static PyObject *DeviceGetAltSetting(DeviceObject *self, PyObject *)
+{
+  uint8_t alt = 0;
+
+  if (DeviceCall(self, [&alt](picad::Session &, picad::Device &d) {
+        alt = d.GetAltSetting();
+      }) == NULL)
+    return NULL;
+  Py_DECREF(Py_None);
+  return PyLong_FromLong(alt);
+}
+
+static PyObject *DeviceCounters(DeviceObject *self, PyObject *args,
+                                PyObject *kwargs)
+{
+  static const char *keywords[] = { "clear_high", NULL };
+  picad::Counters c;
+  int clearHigh = 0;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|p", (char **) keywords,
+                                   &clearHigh))
+    return NULL;
+  if (DeviceCall(self, [&c, clearHigh](picad::Session &, picad::Device &d) {
+        c = d.GetCounters(clearHigh != 0);
+      }) == NULL)
+    return NULL;
+  Py_DECREF(Py_None);
+  return Py_BuildValue("{s:k,s:k,s:k,s:k,s:k,s:k,s:k,s:k,s:i,s:i}",
+                       "packets", (unsigned long) c.packets,
+                       "lost", (unsigned long) c.lost,
+                       "overruns", (unsigned long) c.overruns,
+                       "in_busy", (unsigned long) c.inBusy,
+                       "stalls", (unsigned long) c.stalls,
+                       "resets", (unsigned long) c.resets,
+                       "suspends", (unsigned long) c.suspends,
+                       "errors", (unsigned long) c.errors,
+                       "error_bits", (int) c.errorBits,
+                       "fifo_high", (int) c.fifoHigh);
+}
+
+static PyObject *DeviceSerial(DeviceObject *self, void *)
+{
+  std::string serial;
+
+  if (DeviceCall(self, [&serial](picad::Session &, picad::Device &d) {
+        serial = d.GetSerial();
+      }) == NULL)
+    return NULL;
+  Py_DECREF(Py_None);
+  return PyUnicode_FromString(serial.c_str());
+}
+
+static PyObject *DeviceSetSerial(DeviceObject *self, PyObject *args)
+{
+  const char *s;
+  std::string serial;
+
+  if (!PyArg_ParseTuple(args, "s", &s))
+    return NULL;
+  serial = s;
+  return DeviceCall(self, [&serial](picad::Session &, picad::Device &d) {
+    d.SetSerial(serial);
+  });
+}
+
+/**
+ * DeviceControl() -    control(request_type, request, value, index, data)
+ *
+ * For an IN request data is the number of bytes wanted and the answer is
+ * returned, for an OUT one it is the bytes to send (or None) and the
+ * number sent is returned.
+ **/
+static PyObject *DeviceControl(DeviceObject *self, PyObject *args)
+{
+  unsigned int type, request, value, index, timeout = 1000;
+  PyObject *data = Py_None;
+  std::vector<uint8_t> buffer;
+  Py_buffer view;
+  picad::Device *d;
+  Py_ssize_t len;
+  int r;
+
+  if (!PyArg_ParseTuple(args, "IIII|OI", &type, &request, &value, &index,
+                        &data, &timeout))
+    return NULL;
+  if ((d = Board(self)) == 0)
+    return NULL;
+  if (type & 0x80) {
+    len = (data == Py_None) ? 64 : PyLong_AsSsize_t(data);
+    if (len < 0 || len > 0xFFFF) {
+      if (!PyErr_Occurred())
+        PyErr_SetString(PyExc_ValueError, "length 0..65535");
+      return NULL;
+    }
+    buffer.resize(len + 1);
+  } else if (data != Py_None) {
+    if (PyObject_GetBuffer(data, &view, PyBUF_SIMPLE) < 0)
+      return NULL;
+    buffer.assign((uint8_t *) view.buf, (uint8_t *) view.buf + view.len);
+    PyBuffer_Release(&view);
+    len = buffer.size();
+    buffer.push_back(0);
+  } else {
+    len = 0;
+    buffer.resize(1);
+  }
+  {
+    Unlocked u;
+    r = d->GetTransport().Control(type, request, value, index, &buffer[0],
+                                  (uint16_t) len, timeout);
+  }
+  if (r < 0)
+    return Raise(picad::Error("control request", r));
+  if (type & 0x80)
+    return PyBytes_FromStringAndSize((const char *) &buffer[0], r);
+  return PyLong_FromLong(r);
+}
+
+static PyObject *DeviceStats(DeviceObject *self, PyObject *)
+{
+  if (Board(self) == 0)
+    return NULL;
+  picad::Reader &reader = self->session->GetReader(0);
+  picad::SampleRing &ring = self->session->Ring(0);
+  return Py_BuildValue("{s:K,s:k,s:K,s:k,s:k,s:i,s:O}",
+                       "bytes", reader.Bytes(),
+                       "transfers", reader.Transfers(),
+                       "published", ring.Published(),
+                       "overflows", ring.Overflows(),
+                       "invalid", ring.Invalid(),
+                       "last_error", reader.LastError(),
+                       "running", reader.Running() ? Py_True : Py_False);
+}
+
+static PyObject *NewReader(DeviceObject *device, picad::RingPolicy policy);
+
+static PyObject *DeviceReader(DeviceObject *self, PyObject *args, PyObject *kw)
+{
+  static const char *names[] = { "policy", NULL };
+  int policy = picad::RING_BLOCK;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "|i", (char **) names, &policy))
+    return NULL;
+  if (Board(self) == 0)
+    return NULL;
+  if (policy < picad::RING_BLOCK || policy > picad::RING_OVERWRITE) {
+    PyErr_SetString(PyExc_ValueError, "not a ring policy");
+    return NULL;
+  }
+  return NewReader(self, (picad::RingPolicy) policy);
+}
+
+static PyMethodDef DeviceMethods[] = {
+  { "open", (PyCFunction) DeviceOpen, METH_NOARGS, "Open the board" },
+  { "close", (PyCFunction) DeviceClose, METH_NOARGS, "Stop and release the board" },
+  { "set_rate", (PyCFunction) DeviceSetRate, METH_VARARGS,
+    "set_rate(hz): conversions per second, 0 for untimed" },
+  { "get_rate", (PyCFunction) DeviceGetRate, METH_NOARGS,
+    "(cycles, reached Hz, highest Hz)" },
+  { "set_scan", (PyCFunction) DeviceSetScan, METH_VARARGS,
+    "set_scan(entries): channels, or (channel, acqt) pairs" },
+  { "set_decim", (PyCFunction) DeviceSetDecim, METH_VARARGS,
+    "set_decim(mode, n): DECIM_* mode and N (k for DECIM_OVERSAMPLE)" },
+  { "set_alt_setting", (PyCFunction) DeviceSetAltSetting, METH_VARARGS,
+    "set_alt_setting(alt): ALT_BULK or ALT_ISO, not while streaming" },
+  { "get_alt_setting", (PyCFunction) DeviceGetAltSetting, METH_NOARGS,
+    "The alternate setting the board is in" },
+  { "start", (PyCFunction) DeviceStart, METH_NOARGS, "Start streaming" },
+  { "stop", (PyCFunction) DeviceStop, METH_NOARGS, "Stop streaming" },
+  { "counters", (PyCFunction) DeviceCounters, METH_VARARGS | METH_KEYWORDS,
+    "counters(clear_high=False): dict of the board counters since power up"
+    " (VR_GET_COUNTERS); clear_high starts the FIFO high-water mark over" },
+  { "set_serial", (PyCFunction) DeviceSetSerial, METH_VARARGS,
+    "set_serial(serial): store a new serial number in the EEPROM" },
+  { "control", (PyCFunction) DeviceControl, METH_VARARGS,
+    "control(request_type, request, value, index, data=None, timeout=1000)" },
+  { "stats", (PyCFunction) DeviceStats, METH_NOARGS,
+    "Counters of the Reader and of the SampleRing" },
+  { "reader", (PyCFunction) DeviceReader, METH_VARARGS | METH_KEYWORDS,
+    "reader(policy=RING_BLOCK): a new Reader of the stream" },
+  { NULL }
+};
+
+static PyGetSetDef DeviceGetSet[] = {
+  { (char *) "serial", (getter) DeviceSerial, NULL,
+    (char *) "Serial number, from the board", NULL },
+  { NULL }
+};
+
+/***************************************************************************
+ * Reader and Block
+ ***************************************************************************/
+
+struct BlockObject;
+
+struct ReaderObject {
+  PyObject_HEAD
+  DeviceObject *device;
+  picad::RingReader *reader;
+  BlockObject *held;            /* Block holding the slot, not a reference */
+  std::thread *thread;
+  std::atomic<bool> stop;       /* Set by stop() and by the thread itself */
+  PyObject *callback;
+  PyObject *error;              /* Raised by the callback, for stop() */
+};
+
+struct BlockObject {
+  PyObject_HEAD
+  ReaderObject *reader;         /* NULL once released */
+  const picad::SampleBlock *block;
+  picad::PacketHeader header;
+  Py_ssize_t length;            /* Shape of the buffer views */
+  Py_ssize_t exports;
+  bool torn;
+};
+
+static PyTypeObject ReaderType = { PyVarObject_HEAD_INIT(NULL, 0) };
+static PyTypeObject BlockType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+static PyObject *NewReader(DeviceObject *device, picad::RingPolicy policy)
+{
+  ReaderObject *self = PyObject_New(ReaderObject, &ReaderType);
+
+  if (self == NULL)
+    return NULL;
+  self->reader = 0;
+  self->held = 0;
+  self->thread = 0;
+  self->stop = false;
+  self->callback = 0;
+  self->error = 0;
+  Py_INCREF(device);
+  self->device = device;
+  try {
+    self->reader = new picad::RingReader(device->session->Ring(0), policy);
+  } catch (const picad::Error &e) {
+    Py_DECREF(self);
+    return Raise(e);
+  }
+  return (PyObject *) self;
+}
+
+static PyObject *NewBlock(ReaderObject *reader, const picad::SampleBlock *b)
+{
+  BlockObject *self = PyObject_New(BlockObject, &BlockType);
+
+  if (self == NULL)
+    return NULL;
+  Py_INCREF(reader);
+  self->reader = reader;
+  self->block = b;
+  self->header = b->header;
+  self->length = b->header.count;
+  self->exports = 0;
+  self->torn = false;
+  reader->held = self;
+  return (PyObject *) self;
+}
+
+/**
+ * BlockRelease() -     Hand the slot back
+ *
+ * Not while a view of the samples is alive, as the producer would write
+ * under it: returns -1 with BufferError set, the slot still held.  A
+ * block of a reader that is not RING_BLOCK may have been overwritten
+ * while it was looked at: it is then marked torn.
+ **/
+static int BlockRelease(BlockObject *self)
+{
+  ReaderObject *reader = self->reader;
+
+  if (reader == 0)
+    return 0;
+  if (self->exports) {
+    PyErr_SetString(PyExc_BufferError,
+                    "block still viewed, its slot cannot be handed back");
+    return -1;
+  }
+  self->torn = !reader->reader->Release();
+  self->block = 0;
+  self->reader = 0;
+  reader->held = 0;
+  Py_DECREF(reader);
+  return 0;
+}
+
+static void BlockDealloc(BlockObject *self)
+{
+  BlockRelease(self);           /* No view left, they hold a reference */
+  PyObject_Del(self);
+}
+
+static const uint16_t *BlockSamples(BlockObject *self)
+{
+  return self->block ? self->block->samples : 0;
+}
+
+static int BlockGetBuffer(BlockObject *self, Py_buffer *view, int flags)
+{
+  const uint16_t *samples = BlockSamples(self);
+
+  if (samples == 0) {
+    PyErr_SetString(PyExc_ValueError, "block released");
+    view->obj = NULL;
+    return -1;
+  }
+  if (PyBuffer_FillInfo(view, (PyObject *) self, (void *) samples,
+                        self->header.count * 2, 1, flags) < 0)
+    return -1;
+  view->itemsize = 2;
+  view->format = (flags & PyBUF_FORMAT) ? (char *) "H" : NULL;
+  view->ndim = 1;
+  view->shape = (flags & PyBUF_ND) ? &self->length : NULL;
+  view->strides = (flags & PyBUF_STRIDES) ? &view->itemsize : NULL;
+  self->exports++;
+  return 0;
+}
+
+static void BlockReleaseBuffer(BlockObject *self, Py_buffer *)
+{
+  self->exports--;
+}
+
+static Py_ssize_t BlockLength(BlockObject *self)
+{
+  return BlockSamples(self) ? self->header.count : 0;
+}
+
+static PyObject *BlockItem(BlockObject *self, Py_ssize_t i)
+{
+  const uint16_t *samples = BlockSamples(self);
+
+  if (samples == 0 || i < 0 || i >= self->header.count) {
+    PyErr_SetString(PyExc_IndexError, "sample index out of range");
+    return NULL;
+  }
+  return PyLong_FromLong(samples[i]);
+}
+
+static PyObject *BlockReleaseMethod(BlockObject *self, PyObject *)
+{
+  if (BlockRelease(self) < 0)
+    return NULL;
+  return PyBool_FromLong(!self->torn);
+}
+
+static PyObject *BlockEnter(BlockObject *self, PyObject *)
+{
+  Py_INCREF(self);
+  return (PyObject *) self;
+}
+
+static PyObject *BlockExit(BlockObject *self, PyObject *)
+{
+  if (BlockRelease(self) < 0)
+    return NULL;
+  Py_RETURN_FALSE;
+}
+
+static PyObject *BlockField(BlockObject *self, void *which)
+{
+  const picad::PacketHeader &h = self->header;
+
+  switch ((intptr_t) which) {
+  case 0: return PyLong_FromLong(h.format);
+  case 1: return PyLong_FromLong(h.count);
+  case 2: return PyLong_FromLong(h.flags);
+  case 3: return PyLong_FromLong(h.first);
+  case 4: return PyLong_FromLong(h.sequence);
+  case 5: return PyLong_FromUnsignedLong(h.frame);
+  case 6: return PyLong_FromUnsignedLong(h.index);
+  case 7: return PyLong_FromLong(h.decimMode);
+  case 8: return PyLong_FromLong(h.decimFactor);
+  }
+  return PyBool_FromLong(self->torn);
+}
+
+static PyMethodDef BlockMethods[] = {
+  { "release", (PyCFunction) BlockReleaseMethod, METH_NOARGS,
+    "Hand the slot back; False if the block was overwritten meanwhile" },
+  { "__enter__", (PyCFunction) BlockEnter, METH_NOARGS, NULL },
+  { "__exit__", (PyCFunction) BlockExit, METH_VARARGS, NULL },
+  { NULL }
+};
+
+static PyGetSetDef BlockGetSet[] = {
+  { (char *) "format", (getter) BlockField, NULL, NULL, (void *) 0 },
+  { (char *) "count", (getter) BlockField, NULL, NULL, (void *) 1 },
+  { (char *) "flags", (getter) BlockField, NULL, NULL, (void *) 2 },
+  { (char *) "first", (getter) BlockField, NULL,
+    (char *) "Scan position of the first sample", (void *) 3 },
+  { (char *) "sequence", (getter) BlockField, NULL, NULL, (void *) 4 },
+  { (char *) "frame", (getter) BlockField, NULL, NULL, (void *) 5 },
+  { (char *) "index", (getter) BlockField, NULL,
+    (char *) "Index of the first sample", (void *) 6 },
+  { (char *) "decim_mode", (getter) BlockField, NULL, NULL, (void *) 7 },
+  { (char *) "decim_factor", (getter) BlockField, NULL, NULL, (void *) 8 },
+  { (char *) "torn", (getter) BlockField, NULL,
+    (char *) "Overwritten while it was looked at", (void *) 9 },
+  { NULL }
+};
+
+static PyBufferProcs BlockBuffer;
+static PySequenceMethods BlockSequence;
+
+/**
+ * ReaderStopThread() - End the callback thread, if any
+ **/
+static void ReaderStopThread(ReaderObject *self)
+{
+  if (self->thread == 0)
+    return;
+  self->stop = true;
+  {
+    Unlocked u;
+    self->thread->join();
+  }
+  delete self->thread;
+  self->thread = 0;
+  Py_CLEAR(self->callback);
+}
+
+static void ReaderDealloc(ReaderObject *self)
+{
+  ReaderStopThread(self);
+  if (self->held)
+    BlockRelease(self->held);
+  delete self->reader;
+  Py_XDECREF(self->error);
+  Py_XDECREF(self->device);
+  PyObject_Del(self);
+}
+
+/**
+ * ReaderWait() -       Acquire() a block, in slices so that Ctrl-C works
+ * @timeoutMs:          -1 to wait until the stream stops
+ *
+ * Returns a new Block, Py_None or NULL with an exception set.
+ **/
+static PyObject *ReaderWait(ReaderObject *self, long timeoutMs)
+{
+  const picad::SampleBlock *b = 0;
+  unsigned int slice;
+
+  if (self->thread) {
+    PyErr_SetString(PyExc_RuntimeError, "reader running a callback");
+    return NULL;
+  }
+  if (self->held && BlockRelease(self->held) < 0)
+    return NULL;
+  for (;;) {
+    slice = (timeoutMs < 0 || timeoutMs > 100) ? 100 : (unsigned int) timeoutMs;
+    {
+      Unlocked u;
+      b = self->reader->Acquire(slice);
+    }
+    if (b)
+      return NewBlock(self, b);
+    if (timeoutMs >= 0 && (timeoutMs -= slice) <= 0)
+      break;
+    if (timeoutMs < 0 && !self->device->session->GetReader(0).Running())
+      break;
+    if (PyErr_CheckSignals() < 0)
+      return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *ReaderAcquire(ReaderObject *self, PyObject *args)
+{
+  long timeoutMs = 1000;
+
+  if (!PyArg_ParseTuple(args, "|l", &timeoutMs))
+    return NULL;
+  return ReaderWait(self, timeoutMs < 0 ? 0 : timeoutMs);
+}
+
+static PyObject *ReaderPoll(ReaderObject *self, PyObject *)
+{
+  return ReaderWait(self, 0);
+}
+
+static PyObject *ReaderNext(ReaderObject *self)
+{
+  PyObject *b = ReaderWait(self, -1);
+
+  if (b == Py_None) {
+    Py_DECREF(b);
+    return NULL;                /* StopIteration */
+  }
+  return b;
+}
+
+/**
+ * ReaderRun() -        The callback thread
+ *
+ * An exception of the callback stops it, and so does a view of the block
+ * kept past its return; stop() raises it.
+ **/
+static void ReaderRun(ReaderObject *self)
+{
+  const picad::SampleBlock *b;
+  PyGILState_STATE gil;
+  PyObject *block, *r, *type, *value, *trace;
+
+  while (!self->stop) {
+    if ((b = self->reader->Acquire(100)) == 0)
+      continue;
+    gil = PyGILState_Ensure();
+    block = NewBlock(self, b);
+    r = block ? PyObject_CallFunctionObjArgs(self->callback, block, NULL) : NULL;
+    if (block) {
+      if (r && BlockRelease((BlockObject *) block) < 0)
+        Py_CLEAR(r);
+      Py_DECREF(block);
+    }
+    if (r == NULL) {
+      PyErr_Fetch(&type, &value, &trace);
+      PyErr_NormalizeException(&type, &value, &trace);
+      Py_XDECREF(type);
+      Py_XDECREF(trace);
+      Py_XDECREF(self->error);
+      self->error = value;
+      self->stop = true;
+    }
+    Py_XDECREF(r);
+    PyGILState_Release(gil);
+  }
+}
+
+static PyObject *ReaderStart(ReaderObject *self, PyObject *args)
+{
+  PyObject *callback;
+
+  if (!PyArg_ParseTuple(args, "O", &callback))
+    return NULL;
+  if (!PyCallable_Check(callback)) {
+    PyErr_SetString(PyExc_TypeError, "start() takes a callable");
+    return NULL;
+  }
+  ReaderStopThread(self);
+  if (self->held && BlockRelease(self->held) < 0)
+    return NULL;
+  Py_CLEAR(self->error);
+  Py_INCREF(callback);
+  self->callback = callback;
+  self->stop = false;
+  self->thread = new std::thread(ReaderRun, self);
+  Py_RETURN_NONE;
+}
+
+static PyObject *ReaderStop(ReaderObject *self, PyObject *)
+{
+  PyObject *error;
+
+  ReaderStopThread(self);
+  if (self->error) {
+    error = self->error;
+    self->error = 0;
+    PyErr_SetObject((PyObject *) Py_TYPE(error), error);
+    Py_DECREF(error);
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *ReaderLost(ReaderObject *self, void *)
+{
+  return PyLong_FromUnsignedLongLong(self->reader->Lost());
+}
+
+static PyObject *ReaderRunning(ReaderObject *self, void *)
+{
+  return PyBool_FromLong(self->thread && !self->stop);
+}
+
+static PyMethodDef ReaderMethods[] = {
+  { "acquire", (PyCFunction) ReaderAcquire, METH_VARARGS,
+    "acquire(timeout_ms=1000): the next Block, None on timeout" },
+  { "poll", (PyCFunction) ReaderPoll, METH_NOARGS,
+    "The next Block if there is one, else None" },
+  { "start", (PyCFunction) ReaderStart, METH_VARARGS,
+    "start(callback): call callback(block) for every block, from a thread" },
+  { "stop", (PyCFunction) ReaderStop, METH_NOARGS,
+    "Stop the callback thread, raising what the callback raised" },
+  { NULL }
+};
+
+static PyGetSetDef ReaderGetSet[] = {
+  { (char *) "lost", (getter) ReaderLost, NULL,
+    (char *) "Blocks skipped when it fell behind", NULL },
+  { (char *) "running", (getter) ReaderRunning, NULL,
+    (char *) "A callback thread is running", NULL },
+  { NULL }
+};
+
+/***************************************************************************
+ * CaptureFile and CaptureWriter
+ ***************************************************************************/
+
+struct CaptureFileObject {
+  PyObject_HEAD
+  picad::CaptureReader *reader;
+};
+
+static PyTypeObject CaptureFileType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+static int CaptureFileInit(CaptureFileObject *self, PyObject *args, PyObject *)
+{
+  const char *path;
+
+  if (!PyArg_ParseTuple(args, "s", &path))
+    return -1;
+  delete self->reader;
+  self->reader = 0;
+  try {
+    self->reader = new picad::CaptureReader(path);
+  } catch (const picad::Error &e) {
+    Raise(e);
+    return -1;
+  }
+  return 0;
+}
+
+static void CaptureFileDealloc(CaptureFileObject *self)
+{
+  delete self->reader;
+  Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static picad::CaptureReader *Capture(CaptureFileObject *self)
+{
+  if (self->reader == 0)
+    PyErr_SetString(PyExc_ValueError, "capture file not opened");
+  return self->reader;
+}
+
+static PyObject *InfoTuple(const double *v, unsigned int n)
+{
+  PyObject *t = PyTuple_New(n);
+  unsigned int i;
+
+  for (i = 0; t && i < n; i++)
+    PyTuple_SET_ITEM(t, i, PyFloat_FromDouble(v[i]));
+  return t;
+}
+
+static PyObject *CaptureFileInfo(CaptureFileObject *self, PyObject *)
+{
+  picad::CaptureReader *r = Capture(self);
+  PyObject *channels;
+  unsigned int i;
+
+  if (r == 0)
+    return NULL;
+  const picad::CaptureInfo &info = r->Info();
+  channels = PyTuple_New(info.positions);
+  for (i = 0; channels && i < info.positions; i++)
+    PyTuple_SET_ITEM(channels, i, PyLong_FromLong(info.channel[i]));
+  return Py_BuildValue("{s:d,s:L,s:N,s:N,s:N,s:s,s:k,s:K,s:K,s:K,s:O}",
+                       "rate", info.rate,
+                       "start_time", (long long) info.startTime,
+                       "channels", channels,
+                       "gains", InfoTuple(info.gain, info.positions),
+                       "offsets", InfoTuple(info.offset, info.positions),
+                       "serial", info.serial.c_str(),
+                       "chunks", (unsigned long) r->Chunks(),
+                       "first_sample", (unsigned long long) r->FirstSample(),
+                       "end_sample", (unsigned long long) r->EndSample(),
+                       "samples", (unsigned long long) r->Samples(),
+                       "recovered", r->Recovered() ? Py_True : Py_False);
+}
+
+/**
+ * CaptureFileRead() -  read(first, count): the samples, as a bytearray of
+ *                      native 16 bit words (numpy.frombuffer(b, "u2"))
+ **/
+static PyObject *CaptureFileRead(CaptureFileObject *self, PyObject *args)
+{
+  picad::CaptureReader *r = Capture(self);
+  unsigned long long first;
+  Py_ssize_t count;
+  PyObject *out;
+  size_t n;
+
+  if (r == 0 || !PyArg_ParseTuple(args, "Kn", &first, &count))
+    return NULL;
+  if (count < 0) {
+    PyErr_SetString(PyExc_ValueError, "negative count");
+    return NULL;
+  }
+  if ((uint64_t) count > r->EndSample() - std::min((uint64_t) first, r->EndSample()))
+    count = r->EndSample() - std::min((uint64_t) first, r->EndSample());
+  out = PyByteArray_FromStringAndSize(NULL, count * 2);
+  if (out == NULL)
+    return NULL;
+  {
+    Unlocked u;
+    n = r->Read(first, count, (uint16_t *) PyByteArray_AS_STRING(out));
+  }
+  if (PyByteArray_Resize(out, n * 2) < 0) {
+    Py_DECREF(out);
+    return NULL;
+  }
+  return out;
+}
+
+static PyObject *CaptureFileSampleAt(CaptureFileObject *self, PyObject *args)
+{
+  picad::CaptureReader *r = Capture(self);
+  long long t;
+
+  if (r == 0 || !PyArg_ParseTuple(args, "L", &t))
+    return NULL;
+  return PyLong_FromUnsignedLongLong(r->SampleAt(t));
+}
+
+static PyObject *CaptureFileTimeOf(CaptureFileObject *self, PyObject *args)
+{
+  picad::CaptureReader *r = Capture(self);
+  unsigned long long s;
+
+  if (r == 0 || !PyArg_ParseTuple(args, "K", &s))
+    return NULL;
+  return PyLong_FromLongLong(r->TimeOf(s));
+}
+
+static PyObject *CaptureFilePositionOf(CaptureFileObject *self, PyObject *args)
+{
+  picad::CaptureReader *r = Capture(self);
+  unsigned long long s;
+
+  if (r == 0 || !PyArg_ParseTuple(args, "K", &s))
+    return NULL;
+  return PyLong_FromLong(r->PositionOf(s));
+}
+
+/**
+ * CaptureFilePlot() -  plot(first, end, position, columns): the level
+ *                      used (-1: the samples) and a list with a (min, max,
+ *                      mean) tuple per column, None if it has no samples
+ **/
+static PyObject *CaptureFilePlot(CaptureFileObject *self, PyObject *args)
+{
+  picad::CaptureReader *r = Capture(self);
+  std::vector<picad::SummaryBucket> out;
+  unsigned long long first, end;
+  unsigned int position;
+  Py_ssize_t columns, i;
+  PyObject *list, *item;
+  int level;
+
+  if (r == 0 || !PyArg_ParseTuple(args, "KKIn", &first, &end, &position, &columns))
+    return NULL;
+  if (columns < 0 || position >= r->Info().positions) {
+    PyErr_SetString(PyExc_ValueError, "bad position or columns");
+    return NULL;
+  }
+  {
+    Unlocked u;
+    level = r->Plot(first, end, position, columns, out);
+  }
+  if ((list = PyList_New(columns)) == NULL)
+    return NULL;
+  for (i = 0; i < columns; i++) {
+    if (out[i].count == 0) {
+      Py_INCREF(Py_None);
+      item = Py_None;
+    } else {
+      item = Py_BuildValue("(iid)", out[i].min, out[i].max, out[i].Mean());
+    }
+    PyList_SET_ITEM(list, i, item);
+  }
+  return Py_BuildValue("(iN)", level, list);
+}
+
+static PyMethodDef CaptureFileMethods[] = {
+  { "info", (PyCFunction) CaptureFileInfo, METH_NOARGS,
+    "What the file says about its samples" },
+  { "read", (PyCFunction) CaptureFileRead, METH_VARARGS,
+    "read(first, count): samples as a bytearray, CAPTURE_GAP where missing" },
+  { "sample_at", (PyCFunction) CaptureFileSampleAt, METH_VARARGS,
+    "sample_at(ns): first sample taken at or after a time" },
+  { "time_of", (PyCFunction) CaptureFileTimeOf, METH_VARARGS,
+    "time_of(sample): when it was taken, ns since the epoch" },
+  { "position_of", (PyCFunction) CaptureFilePositionOf, METH_VARARGS,
+    "position_of(sample): its scan position" },
+  { "plot", (PyCFunction) CaptureFilePlot, METH_VARARGS,
+    "plot(first, end, position, columns): (level, [(min, max, mean)...])" },
+  { NULL }
+};
+
+struct CaptureWriterObject {
+  PyObject_HEAD
+  picad::CaptureWriter *writer;
+};
+
+static PyTypeObject CaptureWriterType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+/**
+ * CaptureWriterInit() -        CaptureWriter(path, rate=0, channels=(0,),
+ *                              gains=None, offsets=None, serial="",
+ *                              start_time=0, chunk_bytes=65536), or
+ *                              CaptureWriter(path, append=True)
+ **/
+static int CaptureWriterInit(CaptureWriterObject *self, PyObject *args, PyObject *kw)
+{
+  static const char *names[] = { "path", "rate", "channels", "gains", "offsets",
+                                 "serial", "start_time", "chunk_bytes",
+                                 "append", NULL };
+  const char *path, *serial = "";
+  PyObject *channels = NULL, *gains = NULL, *offsets = NULL, *seq;
+  PyObject *lists[3];
+  double *values[3];
+  long long start = 0;
+  Py_ssize_t chunkBytes = picad::CAPTURE_CHUNK_BYTES, i, n;
+  int append = 0, l;
+  picad::CaptureInfo info;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "s|dOOOsLnp", (char **) names,
+                                   &path, &info.rate, &channels, &gains,
+                                   &offsets, &serial, &start, &chunkBytes,
+                                   &append))
+    return -1;
+  info.serial = serial;
+  info.startTime = start;
+  lists[0] = channels;
+  lists[1] = gains;
+  lists[2] = offsets;
+  values[1] = info.gain;
+  values[2] = info.offset;
+  for (l = 0; l < 3; l++) {
+    if (lists[l] == NULL || lists[l] == Py_None)
+      continue;
+    if ((seq = PySequence_Fast(lists[l], "a sequence is needed")) == NULL)
+      return -1;
+    n = PySequence_Fast_GET_SIZE(seq);
+    if (n == 0 || n > (Py_ssize_t) picad::CAPTURE_MAX_POSITIONS) {
+      Py_DECREF(seq);
+      PyErr_SetString(PyExc_ValueError, "1 to 16 scan positions");
+      return -1;
+    }
+    if (l == 0)
+      info.positions = n;
+    for (i = 0; i < n; i++) {
+      PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+      if (l == 0)
+        info.channel[i] = (uint8_t) PyLong_AsLong(item);
+      else
+        values[l][i] = PyFloat_AsDouble(item);
+    }
+    Py_DECREF(seq);
+    if (PyErr_Occurred())
+      return -1;
+  }
+
+  delete self->writer;
+  self->writer = 0;
+  try {
+    if (append)
+      self->writer = new picad::CaptureWriter(path);
+    else
+      self->writer = new picad::CaptureWriter(path, info, chunkBytes);
+  } catch (const picad::Error &e) {
+    Raise(e);
+    return -1;
+  }
+  return 0;
+}
+
+static void CaptureWriterDealloc(CaptureWriterObject *self)
+{
+  delete self->writer;
+  Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+/**
+ * CaptureWriterAppend() -      append(first, position, samples, time=0,
+ *                              flags=0), samples any buffer of 16 bit
+ *                              words, a Block among them
+ **/
+static PyObject *CaptureWriterAppend(CaptureWriterObject *self, PyObject *args)
+{
+  unsigned long long first;
+  unsigned int position, flags = 0;
+  long long t = 0;
+  PyObject *samples;
+  Py_buffer view;
+
+  if (self->writer == 0) {
+    PyErr_SetString(PyExc_ValueError, "capture file not opened");
+    return NULL;
+  }
+  if (!PyArg_ParseTuple(args, "KIO|LI", &first, &position, &samples, &t, &flags))
+    return NULL;
+  if (!GetSamples(samples, &view))
+    return NULL;
+  try {
+    self->writer->Append(first, (uint8_t) position, (const uint16_t *) view.buf,
+                         view.len / 2, t, (uint8_t) flags);
+  } catch (const picad::Error &e) {
+    PyBuffer_Release(&view);
+    return Raise(e);
+  }
+  PyBuffer_Release(&view);
+  Py_RETURN_NONE;
+}
+
+static PyObject *CaptureWriterFlush(CaptureWriterObject *self, PyObject *)
+{
+  try {
+    if (self->writer)
+      self->writer->Flush();
+  } catch (const picad::Error &e) {
+    return Raise(e);
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *CaptureWriterClose(CaptureWriterObject *self, PyObject *)
+{
+  try {
+    if (self->writer)
+      self->writer->Close();
+  } catch (const picad::Error &e) {
+    return Raise(e);
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *CaptureWriterSamples(CaptureWriterObject *self, void *)
+{
+  return PyLong_FromUnsignedLongLong(self->writer ? self->writer->Samples() : 0);
+}
+
+static PyMethodDef CaptureWriterMethods[] = {
+  { "append", (PyCFunction) CaptureWriterAppend, METH_VARARGS,
+    "append(first, position, samples, time=0, flags=0)" },
+  { "flush", (PyCFunction) CaptureWriterFlush, METH_NOARGS,
+    "Write what was given and wait for the disk" },
+  { "close", (PyCFunction) CaptureWriterClose, METH_NOARGS,
+    "Flush, add the index and the summary" },
+  { NULL }
+};
+
+static PyGetSetDef CaptureWriterGetSet[] = {
+  { (char *) "samples", (getter) CaptureWriterSamples, NULL, NULL, NULL },
+  { NULL }
+};
+
+/***************************************************************************
+ * Module
+ ***************************************************************************/
+
+static PyObject *Serials(PyObject *, PyObject *)
+{
+#if defined(PICAD_NO_LIBUSB)
+  PyErr_SetString(PyExc_NotImplementedError, "built without libusb");
+  return NULL;
+#else
+  std::vector<std::string> serials;
+  PyObject *list;
+  size_t i;
+
+  {
+    Unlocked u;
+    serials = picad::UsbTransport::Serials();
+  }
+  if ((list = PyList_New(serials.size())) == NULL)
+    return NULL;
+  for (i = 0; i < serials.size(); i++)
+    PyList_SET_ITEM(list, i, PyUnicode_FromString(serials[i].c_str()));
+  return list;
+#endif
+}
+
+static PyMethodDef ModuleMethods[] = {
+  { "serials", Serials, METH_NOARGS,
+    "Serial numbers of the boards plugged in" },
+  { NULL }
+};
+
+static PyModuleDef Module = {
+  PyModuleDef_HEAD_INIT, "picad",
+  "Host library of the PIC18F4550 A/D firmware", -1, ModuleMethods
+};
+
+static bool Ready(PyObject *module, PyTypeObject *type, const char *name,
+                  size_t size, const char *doc)
+{
+  type->tp_name = name;
+  type->tp_basicsize = size;
+  type->tp_doc = doc;
+  if (type->tp_flags == 0)
+    type->tp_flags = Py_TPFLAGS_DEFAULT;
+  if (PyType_Ready(type) < 0)
+    return false;
+  Py_INCREF(type);
+  return PyModule_AddObject(module, strrchr(name, '.') + 1, (PyObject *) type) == 0;
+}
+
+PyMODINIT_FUNC PyInit_picad(void)
+{
+  PyObject *m = PyModule_Create(&Module);
+
+  if (m == NULL)
+    return NULL;
+
+  ErrorType = PyErr_NewException("picad.Error", PyExc_RuntimeError, NULL);
+  Py_INCREF(ErrorType);
+  PyModule_AddObject(m, "Error", ErrorType);
+
+  DeviceType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE;
+  DeviceType.tp_new = PyType_GenericNew;
+  DeviceType.tp_init = (initproc) DeviceInit;
+  DeviceType.tp_dealloc = (destructor) DeviceDealloc;
+  DeviceType.tp_methods = DeviceMethods;
+  DeviceType.tp_getset = DeviceGetSet;
+
+  ReaderType.tp_dealloc = (destructor) ReaderDealloc;
+  ReaderType.tp_iter = PyObject_SelfIter;
+  ReaderType.tp_iternext = (iternextfunc) ReaderNext;
+  ReaderType.tp_methods = ReaderMethods;
+  ReaderType.tp_getset = ReaderGetSet;
+
+  BlockBuffer.bf_getbuffer = (getbufferproc) BlockGetBuffer;
+  BlockBuffer.bf_releasebuffer = (releasebufferproc) BlockReleaseBuffer;
+  BlockSequence.sq_length = (lenfunc) BlockLength;
+  BlockSequence.sq_item = (ssizeargfunc) BlockItem;
+  BlockType.tp_dealloc = (destructor) BlockDealloc;
+  BlockType.tp_as_buffer = &BlockBuffer;
+  BlockType.tp_as_sequence = &BlockSequence;
+  BlockType.tp_methods = BlockMethods;
+  BlockType.tp_getset = BlockGetSet;
+
+  CaptureFileType.tp_new = PyType_GenericNew;
+  CaptureFileType.tp_init = (initproc) CaptureFileInit;
+  CaptureFileType.tp_dealloc = (destructor) CaptureFileDealloc;
+  CaptureFileType.tp_methods = CaptureFileMethods;
+
+  CaptureWriterType.tp_new = PyType_GenericNew;
+  CaptureWriterType.tp_init = (initproc) CaptureWriterInit;
+  CaptureWriterType.tp_dealloc = (destructor) CaptureWriterDealloc;
+  CaptureWriterType.tp_methods = CaptureWriterMethods;
+  CaptureWriterType.tp_getset = CaptureWriterGetSet;
+
+  if (!Ready(m, &DeviceType, "picad.Device", sizeof(DeviceObject),
+             "Device(spec='usb', blocks=1024, transfers=8, packets=4)") ||
+      !Ready(m, &ReaderType, "picad.Reader", sizeof(ReaderObject),
+             "A reader of the stream, from Device.reader()") ||
+      !Ready(m, &BlockType, "picad.Block", sizeof(BlockObject),
+             "One stream packet, its samples seen in place") ||
+      !Ready(m, &CaptureFileType, "picad.CaptureFile", sizeof(CaptureFileObject),
+             "CaptureFile(path)") ||
+      !Ready(m, &CaptureWriterType, "picad.CaptureWriter",
+             sizeof(CaptureWriterObject),
+             "CaptureWriter(path, rate=0, channels=(0,), gains=None, "
+             "offsets=None, serial='', start_time=0, chunk_bytes=65536, "
+             "append=False)")) {
+    Py_DECREF(m);
+    return NULL;
+  }
+
+  PyModule_AddIntConstant(m, "RING_BLOCK", picad::RING_BLOCK);
+  PyModule_AddIntConstant(m, "RING_DROP", picad::RING_DROP);
+  PyModule_AddIntConstant(m, "RING_OVERWRITE", picad::RING_OVERWRITE);
+  PyModule_AddIntConstant(m, "STREAM_DROPPED", picad::STREAM_DROPPED);
+  PyModule_AddIntConstant(m, "STREAM_RESTART", picad::STREAM_RESTART);
+  PyModule_AddIntConstant(m, "ALT_BULK", picad::ALT_BULK);
+  PyModule_AddIntConstant(m, "ALT_ISO", picad::ALT_ISO);
+  PyModule_AddIntConstant(m, "DECIM_OFF", picad::DECIM_OFF);
+  PyModule_AddIntConstant(m, "DECIM_BOXCAR", picad::DECIM_BOXCAR);
+  PyModule_AddIntConstant(m, "DECIM_CIC", picad::DECIM_CIC);
+  PyModule_AddIntConstant(m, "DECIM_OVERSAMPLE", picad::DECIM_OVERSAMPLE);
+  PyModule_AddIntConstant(m, "CAPTURE_DROPPED", picad::CAPTURE_DROPPED);
+  PyModule_AddIntConstant(m, "CAPTURE_RESTART", picad::CAPTURE_RESTART);
+  PyModule_AddIntConstant(m, "CAPTURE_GAP", picad::CAPTURE_GAP);
+  PyModule_AddIntConstant(m, "VENDOR_ID", picad::VENDOR_ID);
+  PyModule_AddIntConstant(m, "PRODUCT_ID", picad::PRODUCT_ID);
+  return m;
+}
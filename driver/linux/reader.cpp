@@ -0,0 +1,218 @@
+/*   reader.cpp - Asynchronous EP1 IN engine.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * A single synchronous read leaves the endpoint without a buffer from the
+ * moment it completes until the next one is submitted, and the device
+ * NAKs for the rest of the frame.  Here every transfer goes back to the
+ * transport from its own completion callback, so while the consumer runs the other
+ * transfers are still queued in the host controller.
+ **/
+
+#include <chrono>
+#include "picad.h"
+
+namespace picad {
+
+Reader::Reader(Device &device, Consumer consumer, const Options &options)
+  : device(device), transport(device.GetTransport()), consumer(consumer), options(options), active(0),
+    running(false), bytes(0), completed(0), error(0)
+{
+  if (options.transfers == 0 || options.packetsPerTransfer == 0)
+    throw Error("Reader: at least one transfer of one packet");
+}
+
+Reader::~Reader()
+{
+  Stop();
+  for (size_t i = 0; i < transfers.size(); i++)
+    transport.Release(&transfers[i]);
+}
+
+/**
+ * Reader::Start() -    Queue every transfer and start the event thread
+ *
+ * The device must already be open; streaming is started separately
+ * (Device::Start()), before or after.
+ **/
+void Reader::Start()
+{
+  size_t size = options.packetsPerTransfer * PACKET_BYTES;
+  unsigned int i;
+  int r;
+
+  if (running)
+    return;
+  if (!device.IsOpen())
+    throw Error("Reader: device not open");
+
+  if (transfers.empty()) {
+    transfers.resize(options.transfers);    /* Never moved again */
+    buffers.resize(options.transfers, std::vector<uint8_t>(size));
+  }
+
+  error = 0;
+  running = true;
+  for (i = 0; i < transfers.size(); i++) {
+    transfers[i].endpoint = EP1_IN;
+    transfers[i].buffer = &buffers[i][0];
+    transfers[i].length = size;
+    transfers[i].callback = Callback;
+    transfers[i].user = this;
+    r = transport.Submit(&transfers[i]);
+    if (r < 0) {
+      Stop();
+      throw Error("EP1 IN submit", r);
+    }
+    std::lock_guard<std::mutex> hold(lock);
+    active++;
+  }
+  thread = std::thread(&Reader::Events, this);
+}
+
+/**
+ * Reader::Stop() -     Cancel the transfers and wait for all of them
+ *
+ * Data already received is still handed to the consumer.
+ **/
+void Reader::Stop()
+{
+  size_t i;
+
+  if (!running && !thread.joinable())
+    return;
+  running = false;
+  for (i = 0; i < transfers.size(); i++)
+    transport.Cancel(&transfers[i]);        /* Fails for idle ones */
+
+  if (thread.joinable())
+    thread.join();
+  else
+    Events();           /* Start() failed half way, reap here */
+}
+
+/**
+ * Reader::Events() -   Event thread: run the callbacks until stopped
+ **/
+void Reader::Events()
+{
+  for (;;) {
+    {
+      std::lock_guard<std::mutex> hold(lock);
+      if (active == 0)
+        break;
+    }
+    transport.HandleEvents(100);
+  }
+}
+
+void Reader::Callback(Transfer *transfer)
+{
+  static_cast<Reader *>(transfer->user)->Complete(transfer);
+}
+
+/**
+ * Reader::Complete() - A transfer is back from the transport
+ *
+ * Runs in the event thread.  Completed and timed out transfers are handed
+ * over with whatever they hold and submitted again; errors, cancellation
+ * and a lost device retire the transfer.
+ **/
+void Reader::Complete(Transfer *transfer)
+{
+  bool again = false;
+
+  switch (transfer->status) {
+  case TRANSFER_COMPLETED:
+  case TRANSFER_TIMED_OUT:
+  case TRANSFER_CANCELLED:
+    if (transfer->actual > 0) {
+      bytes += transfer->actual;
+      consumer(transfer->buffer, transfer->actual);
+    }
+    completed++;
+    again = running && (transfer->status != TRANSFER_CANCELLED);
+    break;
+  case TRANSFER_NO_DEVICE:
+    error = ERROR_NO_DEVICE;
+    running = false;
+    break;
+  case TRANSFER_STALL:
+    error = ERROR_PIPE;
+    break;
+  case TRANSFER_OVERFLOW:
+    error = ERROR_OVERFLOW;
+    break;
+  default:
+    error = ERROR_IO;
+    break;
+  }
+
+  if (again && transport.Submit(transfer) == 0)
+    return;
+
+  std::lock_guard<std::mutex> hold(lock);
+  active--;
+}
+
+BufferQueue::BufferQueue(size_t depth)
+  : depth(depth), dropped(0)
+{
+}
+
+/**
+ * BufferQueue::GetConsumer() - The Consumer to give to a Reader
+ **/
+Consumer BufferQueue::GetConsumer()
+{
+  return [this](const uint8_t *data, size_t len) { Push(data, len); };
+}
+
+void BufferQueue::Push(const uint8_t *data, size_t len)
+{
+  {
+    std::lock_guard<std::mutex> hold(lock);
+    if (queue.size() >= depth) {
+      dropped++;
+      return;
+    }
+    queue.push_back(std::vector<uint8_t>(data, data + len));
+  }
+  ready.notify_one();
+}
+
+/**
+ * BufferQueue::Pop() - Take the oldest buffer
+ * @buffer:             Replaced by it
+ * @timeoutMs:          How long to wait for one
+ *
+ * Returns false if none came in time.
+ **/
+bool BufferQueue::Pop(std::vector<uint8_t> &buffer, unsigned int timeoutMs)
+{
+  std::unique_lock<std::mutex> hold(lock);
+
+  if (!ready.wait_for(hold, std::chrono::milliseconds(timeoutMs),
+                      [this] { return !queue.empty(); }))
+    return false;
+  buffer.swap(queue.front());
+  queue.pop_front();
+  return true;
+}
+
+} /* namespace picad */
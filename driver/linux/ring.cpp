@@ -0,0 +1,198 @@
+/*   ring.cpp - Lock-free ring of decoded sample blocks.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include "picad.h"
+
+namespace picad {
+
+const int GATE_FREE     = -1;
+const int GATE_RESERVED = -2;           /* Taken, cursor not set yet */
+
+/**
+ * SampleRing() -       Preallocate the slots
+ * @capacity:           Blocks, rounded up to a power of two
+ **/
+SampleRing::SampleRing(size_t capacity)
+  : mask(1), head(0), overflows(0), invalid(0)
+{
+  size_t i;
+
+  while (mask + 1 < capacity)
+    mask = (mask << 1) | 1;
+  slots.reset(new Slot[mask + 1]);
+  for (i = 0; i <= mask; i++)
+    slots[i].stamp.store(0);
+  for (i = 0; i < RING_MAX_READERS; i++) {
+    gates[i].policy.store(GATE_FREE);
+    gates[i].cursor.store(0);
+  }
+}
+
+/**
+ * SampleRing::GetConsumer() -  Publish every packet of the Reader buffers
+ **/
+Consumer SampleRing::GetConsumer()
+{
+  return [this](const uint8_t *data, size_t len) {
+    size_t i, n;
+
+    for (i = 0; i < len; i += n) {
+      n = std::min(len - i, PACKET_BYTES);
+      Publish(data + i, n);
+    }
+  };
+}
+
+/**
+ * SampleRing::Publish() -      Decode a packet into the next slot
+ *
+ * Only called by the producer.  Returns false if the packet is not a
+ * stream packet, or if a RING_BLOCK reader still needs the slot; the
+ * packet is then counted and thrown away.  Never waits.
+ **/
+bool SampleRing::Publish(const uint8_t *packet, size_t len)
+{
+  uint64_t s = head.load(std::memory_order_relaxed);
+  Slot &slot = slots[s & mask];
+  unsigned int i;
+
+  for (i = 0; i < RING_MAX_READERS; i++)
+    if (gates[i].policy.load(std::memory_order_acquire) == RING_BLOCK &&
+        s - gates[i].cursor.load(std::memory_order_acquire) > mask) {
+      overflows.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+  /* The readers lapped by this block see stamp 0 and let it go */
+  slot.stamp.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  if (!DecodePacket(packet, len, slot.block.header, slot.block.samples)) {
+    invalid.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  slot.block.rawLen = (uint8_t) std::min(len, PACKET_BYTES);
+  memcpy(slot.block.raw, packet, slot.block.rawLen);
+  slot.stamp.store(s + 1, std::memory_order_release);
+  head.store(s + 1, std::memory_order_release);
+  return true;
+}
+
+/**
+ * RingReader() -       Take a free gate of the ring
+ *
+ * Throws an Error when the ring already has RING_MAX_READERS readers.
+ **/
+RingReader::RingReader(SampleRing &ring, RingPolicy policy)
+  : ring(ring), policy(policy), gate(0), cursor(0), held(false), lost(0)
+{
+  int expected;
+
+  for (gate = 0; gate < RING_MAX_READERS; gate++) {
+    expected = GATE_FREE;
+    if (ring.gates[gate].policy.compare_exchange_strong(expected, GATE_RESERVED))
+      break;
+  }
+  if (gate == RING_MAX_READERS)
+    throw Error("too many ring readers");
+  cursor = ring.head.load(std::memory_order_acquire);
+  ring.gates[gate].cursor.store(cursor, std::memory_order_release);
+  ring.gates[gate].policy.store(policy, std::memory_order_release);
+}
+
+RingReader::~RingReader()
+{
+  ring.gates[gate].policy.store(GATE_FREE, std::memory_order_release);
+}
+
+/**
+ * RingReader::Acquire() -      View the next block
+ * @timeoutMs:                  How long to wait for one
+ *
+ * Returns 0 if none came in time.  The block stays in the ring: it is
+ * only valid until Release(), which tells whether it was overwritten
+ * meanwhile (never for RING_BLOCK).  A block still held is released
+ * first.
+ **/
+const SampleBlock *RingReader::Acquire(unsigned int timeoutMs)
+{
+  using namespace std::chrono;
+  steady_clock::time_point deadline;
+  unsigned int spins = 0, pause = 10;
+  uint64_t h, skip;
+
+  if (held)
+    Release();
+  for (;;) {
+    h = ring.head.load(std::memory_order_acquire);
+    if (cursor < h) {
+      if (h - cursor <= ring.mask + 1 &&
+          ring.slots[cursor & ring.mask].stamp.load(std::memory_order_acquire) == cursor + 1) {
+        held = true;
+        return &ring.slots[cursor & ring.mask].block;
+      }
+      /* Lapped, which only happens to RING_DROP and RING_OVERWRITE; if
+         the producer got ahead since head was read, read it again */
+      skip = (policy == RING_DROP) ? h - 1 : h - ring.mask;
+      if (skip > cursor) {
+        lost += skip - cursor;
+        cursor = skip;
+        ring.gates[gate].cursor.store(cursor, std::memory_order_release);
+      }
+      continue;
+    }
+
+    /* Nothing new: spin a little, then sleep longer and longer */
+    if (spins == 0)
+      deadline = steady_clock::now() + milliseconds(timeoutMs);
+    else if (steady_clock::now() >= deadline)
+      return 0;
+    if (++spins < 64) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(microseconds(pause));
+      pause = std::min(pause * 2, 1000u);
+    }
+  }
+}
+
+/**
+ * RingReader::Release() -      Done with the block of Acquire()
+ *
+ * Returns false if the producer overwrote it while it was looked at: what
+ * was read from it must be thrown away, and the block is counted lost.
+ **/
+bool RingReader::Release()
+{
+  bool intact;
+
+  if (!held)
+    return true;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  intact = ring.slots[cursor & ring.mask].stamp.load(std::memory_order_relaxed) == cursor + 1;
+  if (!intact)
+    lost++;
+  held = false;
+  cursor++;
+  ring.gates[gate].cursor.store(cursor, std::memory_order_release);
+  return intact;
+}
+
+} /* namespace picad */
@@ -0,0 +1,163 @@
+/*   session.cpp - Several boards streaming together.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <exception>
+#include "picad.h"
+
+namespace picad {
+
+Session::Session(const Reader::Options &options, size_t ringBlocks)
+  : options(options), ringBlocks(ringBlocks)
+{
+}
+
+Session::~Session()
+{
+  try {
+    Close();
+  } catch (const Error &) {
+  }
+}
+
+/**
+ * Session::Add() -     One more board, see CreateTransport() for the spec
+ *
+ * Nothing is opened yet.
+ **/
+void Session::Add(const std::string &spec)
+{
+  std::unique_ptr<Board> board(new Board);
+
+  board->spec = spec;
+  board->transport = CreateTransport(spec);
+  board->device.reset(new Device(*board->transport));
+  board->ring.reset(new SampleRing(ringBlocks));
+  board->reader.reset(new Reader(*board->device, board->ring->GetConsumer(),
+                                 options));
+  boards.push_back(std::move(board));
+}
+
+/**
+ * Session::Each() -    Do the same work on every board, in parallel
+ *
+ * Waits for all of them, then throws the Error of the first board that
+ * failed, naming it.
+ **/
+void Session::Each(const std::function<void(Board &)> &work)
+{
+  std::vector<std::thread> threads;
+  std::vector<std::exception_ptr> errors(boards.size());
+  size_t i;
+
+  for (i = 0; i < boards.size(); i++) {
+    threads.push_back(std::thread([&, i]() {
+      try {
+        work(*boards[i]);
+      } catch (const Error &e) {
+        Error named(boards[i]->spec + ": " + e.what());
+        named.code = e.code;
+        errors[i] = std::make_exception_ptr(named);
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    }));
+  }
+  for (i = 0; i < threads.size(); i++)
+    threads[i].join();
+  for (i = 0; i < errors.size(); i++)
+    if (errors[i])
+      std::rethrow_exception(errors[i]);
+}
+
+/**
+ * Session::Open() -    Open every board and read its serial number
+ *
+ * If one cannot be opened they are all closed again.
+ **/
+void Session::Open()
+{
+  try {
+    Each([](Board &board) {
+      board.device->Open();
+      try {
+        board.serial = board.device->GetSerial();
+      } catch (const Error &) {
+        board.serial.clear();             /* Firmware without one */
+      }
+    });
+  } catch (...) {
+    Close();
+    throw;
+  }
+}
+
+void Session::Close()
+{
+  Each([](Board &board) {
+    board.reader->Stop();
+    board.device->Close();
+  });
+}
+
+void Session::SetRate(uint32_t hz)
+{
+  Each([hz](Board &board) { board.device->SetRate(hz); });
+}
+
+void Session::SetScan(const std::vector<uint8_t> &entries)
+{
+  Each([&entries](Board &board) { board.device->SetScan(entries); });
+}
+
+void Session::SetAltSetting(uint8_t alt)
+{
+  Each([alt](Board &board) { board.device->SetAltSetting(alt); });
+}
+
+/**
+ * Session::Start() -   Start every Reader, then every board
+ *
+ * The boards are started last and together, so their streams begin as
+ * close in time as the bus allows.
+ **/
+void Session::Start()
+{
+  Each([](Board &board) { board.reader->Start(); });
+  Each([](Board &board) { board.device->Start(); });
+}
+
+/**
+ * Session::Stop() -    Stop every board, then every Reader
+ *
+ * The Readers are stopped even if a board could not be told to stop.
+ **/
+void Session::Stop()
+{
+  std::exception_ptr error;
+
+  try {
+    Each([](Board &board) { board.device->Stop(); });
+  } catch (...) {
+    error = std::current_exception();
+  }
+  Each([](Board &board) { board.reader->Stop(); });
+  if (error)
+    std::rethrow_exception(error);
+}
+
+} /* namespace picad */
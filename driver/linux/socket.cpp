@@ -0,0 +1,292 @@
+/*   socket.cpp - A virtual device served on a Unix socket.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "virtual.h"
+
+namespace picad {
+
+/**
+ * WriteAll(), ReadAll() -      Move len bytes, false if the peer is gone
+ **/
+static bool WriteAll(int fd, const uint8_t *p, size_t len)
+{
+  ssize_t n;
+
+  while (len) {
+    n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool ReadAll(int fd, uint8_t *p, size_t len)
+{
+  ssize_t n;
+
+  while (len) {
+    n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static void Put(uint8_t *p, uint32_t value, int n)
+{
+  while (n--) {
+    *p++ = (uint8_t) value;
+    value >>= 8;
+  }
+}
+
+static uint32_t Get(const uint8_t *p, int n)
+{
+  uint32_t v = 0;
+
+  while (n--)
+    v = (v << 8) | p[n];
+  return v;
+}
+
+static sockaddr_un Address(const std::string &path)
+{
+  sockaddr_un a;
+
+  memset(&a, 0, sizeof(a));
+  a.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(a.sun_path))
+    throw Error("socket path too long: " + path);
+  strcpy(a.sun_path, path.c_str());
+  return a;
+}
+
+SocketTransport::SocketTransport(const std::string &path)
+  : path(path), fd(-1)
+{
+}
+
+SocketTransport::~SocketTransport()
+{
+  Close();
+}
+
+/**
+ * SocketTransport::Open() -    Connect and select the configuration
+ **/
+void SocketTransport::Open()
+{
+  sockaddr_un a = Address(path);
+
+  Close();
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    throw Error(path + ": " + strerror(errno));
+  if (connect(fd, (sockaddr *) &a, sizeof(a)) < 0) {
+    int e = errno;
+    Close();
+    throw Error(path + ": " + strerror(e));
+  }
+  if (Control(0x00, 9, 1, 0, 0, 0, 0) < 0) {    /* SET_CONFIGURATION */
+    Close();
+    throw Error(path + ": no answer");
+  }
+}
+
+void SocketTransport::Close()
+{
+  if (fd >= 0)
+    close(fd);
+  fd = -1;
+  Forget();
+}
+
+/**
+ * SocketTransport::Call() -    Send a request and read the result word
+ *
+ * The caller holds io and reads the rest of the answer.
+ **/
+int SocketTransport::Call(const uint8_t *request, const uint8_t *out, size_t outLen)
+{
+  uint8_t result[4];
+
+  if (fd < 0)
+    return ERROR_NO_DEVICE;
+  if (!WriteAll(fd, request, SOCKET_REQUEST_BYTES) ||
+      (outLen && !WriteAll(fd, out, outLen)) ||
+      !ReadAll(fd, result, 4))
+    return ERROR_NO_DEVICE;
+  return (int32_t) Get(result, 4);
+}
+
+int SocketTransport::Control(uint8_t requestType, uint8_t request, uint16_t value,
+                             uint16_t index, uint8_t *data, uint16_t len,
+                             unsigned int timeout)
+{
+  std::lock_guard<std::mutex> hold(io);
+  uint8_t r[SOCKET_REQUEST_BYTES] = { SOCKET_CONTROL, requestType, request };
+  bool in = requestType & 0x80;
+  int n;
+
+  (void) timeout;
+  Put(r + 4, value, 2);
+  Put(r + 6, index, 2);
+  Put(r + 8, len, 4);
+  n = Call(r, data, in ? 0 : len);
+  if (in && n > 0 && !ReadAll(fd, data, n))
+    return ERROR_NO_DEVICE;
+  return n;
+}
+
+int SocketTransport::Send(uint8_t endpoint, const uint8_t *data, size_t len)
+{
+  std::lock_guard<std::mutex> hold(io);
+  uint8_t r[SOCKET_REQUEST_BYTES] = { SOCKET_BULK_OUT, endpoint };
+
+  Put(r + 8, len, 4);
+  return Call(r, data, len);
+}
+
+int SocketTransport::Fetch(uint8_t endpoint, unsigned int maxPackets,
+                           std::vector<Packet> &packets, unsigned int waitMs)
+{
+  std::lock_guard<std::mutex> hold(io);
+  uint8_t r[SOCKET_REQUEST_BYTES] = { SOCKET_BULK_IN, endpoint };
+  Packet p;
+  int i, n;
+
+  Put(r + 8, maxPackets, 4);
+  Put(r + 12, waitMs, 4);
+  n = Call(r, 0, 0);
+  for (i = 0; i < n; i++) {
+    if (!ReadAll(fd, &p.len, 1) || p.len > PACKET_BYTES ||
+        !ReadAll(fd, p.data, p.len))
+      return ERROR_NO_DEVICE;
+    packets.push_back(p);
+  }
+  return n;
+}
+
+/**
+ * VirtualServer() -    Listen on path, replacing a stale socket
+ **/
+VirtualServer::VirtualServer(VirtualDevice &device, const std::string &path)
+  : device(device), path(path), fd(-1)
+{
+  sockaddr_un a = Address(path);
+
+  unlink(path.c_str());
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (sockaddr *) &a, sizeof(a)) < 0 || listen(fd, 1) < 0) {
+    std::string e = strerror(errno);
+    if (fd >= 0)
+      close(fd);
+    throw Error(path + ": " + e);
+  }
+}
+
+VirtualServer::~VirtualServer()
+{
+  close(fd);
+  unlink(path.c_str());
+}
+
+void VirtualServer::Serve()
+{
+  int client;
+
+  for (;;) {
+    client = accept(fd, 0, 0);
+    if (client < 0) {
+      if (errno == EINTR)
+        continue;
+      throw Error(path + ": " + strerror(errno));
+    }
+    while (Answer(client))
+      ;
+    close(client);
+  }
+}
+
+/**
+ * VirtualServer::Answer() -    Carry out one request of a client
+ *
+ * Returns false when the client is gone or sent something wrong.
+ **/
+bool VirtualServer::Answer(int client)
+{
+  uint8_t r[SOCKET_REQUEST_BYTES], result[4];
+  std::vector<uint8_t> data;
+  uint32_t len;
+  size_t i;
+  int n;
+
+  if (!ReadAll(client, r, sizeof(r)))
+    return false;
+  len = Get(r + 8, 4);
+
+  switch (r[0]) {
+  case SOCKET_CONTROL:
+    if (len > 0xFFFF)
+      return false;
+    data.resize(len + 1);
+    if (!(r[1] & 0x80) && !ReadAll(client, &data[0], len))
+      return false;
+    n = device.Control(r[1], r[2], Get(r + 4, 2), Get(r + 6, 2), &data[0], len);
+    Put(result, n, 4);
+    return WriteAll(client, result, 4) &&
+           (!(r[1] & 0x80) || n <= 0 || WriteAll(client, &data[0], n));
+
+  case SOCKET_BULK_OUT:
+    if (len > 0x100000)
+      return false;
+    data.resize(len + 1);
+    if (!ReadAll(client, &data[0], len))
+      return false;
+    n = device.BulkOut(r[1], &data[0], len);
+    Put(result, n, 4);
+    return WriteAll(client, result, 4);
+
+  case SOCKET_BULK_IN:
+    packets.clear();
+    n = device.Poll(r[1], len, packets, Get(r + 12, 4));
+    Put(result, n, 4);
+    data.assign(result, result + 4);
+    for (i = 0; i < packets.size(); i++) {
+      data.push_back(packets[i].len);
+      data.insert(data.end(), packets[i].data, packets[i].data + packets[i].len);
+    }
+    return WriteAll(client, &data[0], data.size());
+  }
+  return false;
+}
+
+} /* namespace picad */
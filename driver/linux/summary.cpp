@@ -0,0 +1,314 @@
+/*   summary.cpp - min/max/mean pyramid of a capture file, for plotting.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include "capfile.h"
+
+namespace picad {
+
+static const char SUMMARY_MAGIC[] = "PICADLOD";
+static const size_t BUCKET_BYTES = 16;
+
+static void Put(uint8_t *p, uint64_t value, int n)
+{
+  while (n--) {
+    *p++ = (uint8_t) value;
+    value >>= 8;
+  }
+}
+
+static uint64_t Get(const uint8_t *p, int n)
+{
+  uint64_t v = 0;
+
+  while (n--)
+    v = (v << 8) | p[n];
+  return v;
+}
+
+SummaryPyramid::SummaryPyramid(unsigned int positions, uint32_t width,
+                               uint32_t fanout)
+  : positions(positions), width(width ? width : SUMMARY_WIDTH * positions),
+    fanout(fanout), run(positions)
+{
+}
+
+uint64_t SummaryPyramid::Width(unsigned int level) const
+{
+  uint64_t w = width;
+
+  while (level--)
+    w *= fanout;
+  return w;
+}
+
+/**
+ * SummaryPyramid::Grow() -     Make room for a level 0 bucket
+ *
+ * Levels are added on top until the top one has a single bucket.
+ **/
+void SummaryPyramid::Grow(uint64_t bucket)
+{
+  std::vector<SummaryBucket> *below;
+  uint64_t b, n;
+  unsigned int l, p;
+
+  if (levels.empty())
+    levels.push_back(std::vector<SummaryBucket>());
+  for (l = 0, b = bucket; l < levels.size(); l++, b /= fanout)
+    if (levels[l].size() < (b + 1) * positions)
+      levels[l].resize((b + 1) * positions);
+
+  while (Buckets(levels.size() - 1) > 1) {
+    n = (Buckets(levels.size() - 1) + fanout - 1) / fanout;
+    levels.push_back(std::vector<SummaryBucket>(n * positions));
+    below = &levels[levels.size() - 2];
+    for (b = 0; b < below->size() / positions; b++)
+      for (p = 0; p < positions; p++)
+        levels.back()[b / fanout * positions + p].Merge((*below)[b * positions + p]);
+  }
+}
+
+/**
+ * SummaryPyramid::Add() -      Take consecutive samples
+ * @first:                      Index of the first one
+ * @position:                   Its scan position
+ *
+ * Each level 0 bucket the samples fall in is worked out once and merged
+ * into the buckets above it.
+ **/
+void SummaryPyramid::Add(uint64_t first, uint8_t position,
+                         const uint16_t *samples, size_t count)
+{
+  uint64_t bucket, b;
+  size_t n, i;
+  unsigned int l, p;
+
+  p = position % positions;
+  while (count) {
+    bucket = first / width;
+    n = (size_t) std::min((uint64_t) count, (bucket + 1) * width - first);
+    std::fill(run.begin(), run.end(), SummaryBucket());
+    for (i = 0; i < n; i++) {
+      run[p].Add(samples[i]);
+      if (++p == positions)
+        p = 0;
+    }
+    Grow(bucket);
+    for (l = 0, b = bucket; l < levels.size(); l++, b /= fanout)
+      for (i = 0; i < positions; i++)
+        levels[l][b * positions + i].Merge(run[i]);
+    first += n;
+    samples += n;
+    count -= n;
+  }
+}
+
+/**
+ * SummaryPyramid::Add() -      Take all the samples of a capture file
+ **/
+void SummaryPyramid::Add(const CaptureReader &reader)
+{
+  std::vector<uint16_t> samples;
+  size_t k;
+
+  for (k = 0; k < reader.Chunks(); k++) {
+    const CaptureChunk &c = reader.Chunk(k);
+    samples.resize(c.count);
+    reader.Read(c.first, c.count, &samples[0]);
+    Add(c.first, c.position, &samples[0], c.count);
+  }
+}
+
+/**
+ * SummaryPyramid::Save() -     Write the summary of a capture file
+ * @chunks, @end:               What it covers of the capture file, see
+ *                              capfile.h
+ **/
+void SummaryPyramid::Save(const std::string &path, uint64_t chunks,
+                          uint64_t end) const
+{
+  std::string tmp = path + ".tmp";
+  std::vector<uint8_t> data(SUMMARY_HEADER_BYTES, 0);
+  uint8_t *p;
+  size_t l, i;
+  FILE *f;
+  bool ok;
+
+  memcpy(&data[0], SUMMARY_MAGIC, 8);
+  Put(&data[8], SUMMARY_VERSION, 2);
+  data[10] = (uint8_t) positions;
+  data[11] = (uint8_t) levels.size();
+  Put(&data[12], width, 4);
+  Put(&data[16], fanout, 4);
+  Put(&data[20], chunks, 8);
+  Put(&data[28], end, 8);
+  for (l = 0; l < levels.size(); l++) {
+    data.resize(data.size() + 8 + levels[l].size() * BUCKET_BYTES);
+    p = &data[data.size() - levels[l].size() * BUCKET_BYTES - 8];
+    Put(p, levels[l].size() / positions, 8);
+    for (i = 0, p += 8; i < levels[l].size(); i++, p += BUCKET_BYTES) {
+      Put(p, levels[l][i].min, 2);
+      Put(p + 2, levels[l][i].max, 2);
+      Put(p + 4, levels[l][i].count, 4);
+      Put(p + 8, levels[l][i].sum, 8);
+    }
+  }
+
+  if ((f = fopen(tmp.c_str(), "wb")) == 0)
+    throw Error(tmp + ": " + strerror(errno));
+  ok = fwrite(&data[0], 1, data.size(), f) == data.size() && fflush(f) == 0 &&
+       fdatasync(fileno(f)) == 0;
+  if (fclose(f) != 0)
+    ok = false;
+  if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+    int e = errno;
+    unlink(tmp.c_str());
+    throw Error(path + ": " + strerror(e));
+  }
+}
+
+/**
+ * SummaryPyramid::Load() -     Read the summary of a capture file
+ *
+ * Returns null if there is none, or it is not the summary of what the
+ * capture file holds now (a writer went on with it, or it was damaged).
+ **/
+std::unique_ptr<SummaryPyramid> SummaryPyramid::Load(const std::string &path,
+                                                     uint64_t chunks,
+                                                     uint64_t end)
+{
+  std::unique_ptr<SummaryPyramid> s;
+  std::vector<uint8_t> data;
+  const uint8_t *p, *e;
+  uint8_t block[65536];
+  size_t n, i;
+  uint64_t buckets;
+  unsigned int l, levels;
+  FILE *f;
+
+  if ((f = fopen(path.c_str(), "rb")) == 0)
+    return s;
+  while ((n = fread(block, 1, sizeof(block), f)) > 0)
+    data.insert(data.end(), block, block + n);
+  fclose(f);
+
+  if (data.size() < SUMMARY_HEADER_BYTES ||
+      memcmp(&data[0], SUMMARY_MAGIC, 8) != 0 ||
+      Get(&data[8], 2) != SUMMARY_VERSION || data[10] == 0 ||
+      Get(&data[12], 4) == 0 || Get(&data[16], 4) < 2 ||
+      Get(&data[20], 8) != chunks || Get(&data[28], 8) != end)
+    return s;
+  s.reset(new SummaryPyramid(data[10], (uint32_t) Get(&data[12], 4),
+                             (uint32_t) Get(&data[16], 4)));
+  levels = data[11];
+  p = &data[SUMMARY_HEADER_BYTES];
+  e = &data[0] + data.size();
+  for (l = 0; l < levels; l++) {
+    if (e - p < 8)
+      return std::unique_ptr<SummaryPyramid>();
+    buckets = Get(p, 8);
+    p += 8;
+    if (buckets > (uint64_t) (e - p) / BUCKET_BYTES / s->positions)
+      return std::unique_ptr<SummaryPyramid>();
+    s->levels.push_back(std::vector<SummaryBucket>(buckets * s->positions));
+    for (i = 0; i < s->levels[l].size(); i++, p += BUCKET_BYTES) {
+      s->levels[l][i].min = (uint16_t) Get(p, 2);
+      s->levels[l][i].max = (uint16_t) Get(p + 2, 2);
+      s->levels[l][i].count = (uint32_t) Get(p + 4, 4);
+      s->levels[l][i].sum = Get(p + 8, 8);
+    }
+  }
+  if (p != e)
+    return std::unique_ptr<SummaryPyramid>();
+  return s;
+}
+
+/**
+ * CaptureReader::Summary() -   The summary, loaded or built the first time
+ **/
+const SummaryPyramid &CaptureReader::Summary() const
+{
+  if (summary)
+    return *summary;
+  summary = SummaryPyramid::Load(path + ".lod", Chunks(), EndSample());
+  if (!summary || summary->Positions() != info.positions) {
+    summary.reset(new SummaryPyramid(info.positions));
+    summary->Add(*this);
+  }
+  return *summary;
+}
+
+/**
+ * CaptureReader::Plot() -      min, max and mean of each column of a plot
+ * @first, @end:                Samples first .. end - 1
+ * @position:                   Of the samples wanted
+ * @columns:                    Of the plot
+ * @out:                        One bucket per column, count 0 if the
+ *                              column has no samples
+ *
+ * A column gets the summary buckets that start in it, so it may take in a
+ * few samples of the next one.  Returns the level used, -1 if the samples
+ * were read.
+ **/
+int CaptureReader::Plot(uint64_t first, uint64_t end, unsigned int position,
+                        size_t columns, std::vector<SummaryBucket> &out) const
+{
+  uint64_t span, w, b, s, from, to;
+  unsigned int l, p;
+  int level = -1;
+  size_t k;
+
+  out.assign(columns, SummaryBucket());
+  if (columns == 0 || end <= first || position >= info.positions)
+    return -1;
+  span = end - first;
+  const SummaryPyramid &summary = Summary();
+  for (l = 0; l < summary.Levels(); l++)
+    if (summary.Width(l) * columns <= span)
+      level = l;
+
+  if (level < 0) {
+    for (k = FindSample(first); k < index.size() && index[k].first < end; k++) {
+      const CaptureChunk &c = index[k];
+      from = std::max(c.first, first);
+      to = std::min(c.first + c.count, end);
+      p = (unsigned int) ((c.position + (from - c.first)) % info.positions);
+      for (s = from; s < to; s++) {
+        if (p == position)
+          out[(s - first) * columns / span].Add(Sample(k, (uint32_t) (s - c.first)));
+        if (++p == info.positions)
+          p = 0;
+      }
+    }
+    return -1;
+  }
+
+  w = summary.Width(level);
+  for (b = first / w; b <= (end - 1) / w && b < summary.Buckets(level); b++) {
+    s = std::max(b * w, first);
+    out[(s - first) * columns / span].Merge(summary.Bucket(level, b, position));
+  }
+  return level;
+}
+
+} /* namespace picad */
@@ -0,0 +1,139 @@
+/*   transport.cpp - Error codes and transport selection.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "picad.h"
+#include "virtual.h"
+
+namespace picad {
+
+/**
+ * ErrorName() -        Name of an ERROR_* code
+ **/
+const char *ErrorName(int code)
+{
+  switch (code) {
+  case 0:                   return "SUCCESS";
+  case ERROR_IO:            return "ERROR_IO";
+  case ERROR_INVALID_PARAM: return "ERROR_INVALID_PARAM";
+  case ERROR_ACCESS:        return "ERROR_ACCESS";
+  case ERROR_NO_DEVICE:     return "ERROR_NO_DEVICE";
+  case ERROR_NOT_FOUND:     return "ERROR_NOT_FOUND";
+  case ERROR_BUSY:          return "ERROR_BUSY";
+  case ERROR_TIMEOUT:       return "ERROR_TIMEOUT";
+  case ERROR_OVERFLOW:      return "ERROR_OVERFLOW";
+  case ERROR_PIPE:          return "ERROR_PIPE";
+  case ERROR_INTERRUPTED:   return "ERROR_INTERRUPTED";
+  case ERROR_NO_MEM:        return "ERROR_NO_MEM";
+  case ERROR_NOT_SUPPORTED: return "ERROR_NOT_SUPPORTED";
+  default:                  return "ERROR_OTHER";
+  }
+}
+
+Error::Error(const std::string &what, int code)
+  : std::runtime_error(code ? what + ": " + ErrorName(code) : what),
+    code(code)
+{
+}
+
+/**
+ * Transport::SetInterface() -  SET_INTERFACE on interface 0
+ **/
+int Transport::SetInterface(uint8_t alt)
+{
+  return Control(0x01, 11, alt, 0, 0, 0, 1000);
+}
+
+int IsoPackets(size_t length)
+{
+  return (length < PACKET_BYTES) ? ERROR_INVALID_PARAM
+                                 : (int) (length / PACKET_BYTES);
+}
+
+size_t IsoCompact(uint8_t *buffer, const size_t *lengths, unsigned int packets)
+{
+  size_t bytes = 0;
+  unsigned int i;
+
+  for (i = 0; i < packets; i++) {
+    memmove(buffer + bytes, buffer + i * PACKET_BYTES, lengths[i]);
+    bytes += lengths[i];
+  }
+  return bytes;
+}
+
+#if !defined(PICAD_NO_LIBUSB)
+/**
+ * ParseIds() -         "vid:pid" in hex
+ **/
+static void ParseIds(const std::string &ids, uint16_t &vid, uint16_t &pid)
+{
+  char *end;
+
+  vid = (uint16_t) strtoul(ids.c_str(), &end, 16);
+  if (*end != ':')
+    throw Error("bad usb ids: " + ids);
+  pid = (uint16_t) strtoul(end + 1, &end, 16);
+  if (*end)
+    throw Error("bad usb ids: " + ids);
+}
+#endif
+
+std::unique_ptr<Transport> CreateTransport(const std::string &spec)
+{
+  std::string name = spec.substr(0, spec.find(':'));
+  std::string arg, serial;
+  size_t at;
+
+  /* A Unix socket path may hold an '@' */
+  if (name != "unix" && (at = spec.rfind('@')) != std::string::npos) {
+    serial = spec.substr(at + 1);
+    name = spec.substr(0, std::min(at, spec.find(':')));
+    if (!ValidSerial(serial))
+      throw Error("bad serial number: " + spec);
+  }
+  else
+    at = spec.size();
+  if (name.size() < at)
+    arg = spec.substr(name.size() + 1, at - name.size() - 1);
+
+  if (name == "usb") {
+#if defined(PICAD_NO_LIBUSB)
+    throw Error("built without libusb");
+#else
+    uint16_t vid = VENDOR_ID, pid = PRODUCT_ID;
+    if (!arg.empty())
+      ParseIds(arg, vid, pid);
+    return std::unique_ptr<Transport>(new UsbTransport(vid, pid, serial));
+#endif
+  }
+  if (name == "virtual") {
+    VirtualDevice::Options options;
+    if (!arg.empty())
+      options.speed = atof(arg.c_str());
+    options.serial = serial;
+    return std::unique_ptr<Transport>(new VirtualTransport(options));
+  }
+  if (name == "unix" && !arg.empty())
+    return std::unique_ptr<Transport>(new SocketTransport(arg));
+  throw Error("unknown transport: " + spec);
+}
+
+} /* namespace picad */
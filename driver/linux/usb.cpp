@@ -0,0 +1,288 @@
+/*   usb.cpp - Transport to the board through libusb.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <libusb.h>
+#include "picad.h"
+
+namespace picad {
+
+static_assert(ERROR_PIPE == (int) LIBUSB_ERROR_PIPE &&
+              ERROR_NO_DEVICE == (int) LIBUSB_ERROR_NO_DEVICE &&
+              ERROR_TIMEOUT == (int) LIBUSB_ERROR_TIMEOUT,
+              "error codes must be the libusb ones");
+static_assert(TRANSFER_STALL == (int) LIBUSB_TRANSFER_STALL &&
+              TRANSFER_CANCELLED == (int) LIBUSB_TRANSFER_CANCELLED &&
+              TRANSFER_OVERFLOW == (int) LIBUSB_TRANSFER_OVERFLOW,
+              "transfer status must be the libusb one");
+
+UsbTransport::UsbTransport(uint16_t vid, uint16_t pid, const std::string &serial)
+  : vid(vid), pid(pid), serial(serial), context(0), handle(0), alt(ALT_BULK)
+{
+}
+
+UsbTransport::~UsbTransport()
+{
+  Close();
+}
+
+/**
+ * SerialOf() -         Serial number of an open board, empty if none
+ **/
+static std::string SerialOf(libusb_device *device, libusb_device_handle *handle)
+{
+  libusb_device_descriptor d;
+  unsigned char text[SERIAL_MAX + 1];
+  int n;
+
+  if (libusb_get_device_descriptor(device, &d) < 0 || d.iSerialNumber == 0)
+    return "";
+  n = libusb_get_string_descriptor_ascii(handle, d.iSerialNumber, text, sizeof(text));
+  return (n > 0) ? std::string((char *) text, n) : "";
+}
+
+/**
+ * Matches() -          Whether a device has these ids
+ **/
+static bool Matches(libusb_device *device, uint16_t vid, uint16_t pid)
+{
+  libusb_device_descriptor d;
+
+  return libusb_get_device_descriptor(device, &d) == 0 &&
+         d.idVendor == vid && d.idProduct == pid;
+}
+
+/**
+ * UsbTransport::Serials() -    Serial numbers of the boards plugged in
+ *
+ * Boards that cannot be opened are left out.
+ **/
+std::vector<std::string> UsbTransport::Serials(uint16_t vid, uint16_t pid)
+{
+  std::vector<std::string> serials;
+  libusb_context *context;
+  libusb_device **list;
+  libusb_device_handle *handle;
+  ssize_t n, i;
+
+  if (libusb_init(&context) < 0)
+    return serials;
+  n = libusb_get_device_list(context, &list);
+  for (i = 0; i < n; i++) {
+    if (!Matches(list[i], vid, pid) || libusb_open(list[i], &handle) < 0)
+      continue;
+    serials.push_back(SerialOf(list[i], handle));
+    libusb_close(handle);
+  }
+  if (n >= 0)
+    libusb_free_device_list(list, 1);
+  libusb_exit(context);
+  return serials;
+}
+
+/**
+ * UsbTransport::Open() -       Open the board, see the class comment
+ *
+ * The firmware has a single configuration and interface (0) holding EP1
+ * and EP2, in ALT_BULK once configured.  A board whose interface cannot
+ * be claimed is in use by another transport or program, and the next one
+ * is tried.
+ **/
+void UsbTransport::Open()
+{
+  libusb_device **list;
+  ssize_t n, i;
+  int r, last = ERROR_NOT_FOUND;
+
+  Close();
+  r = libusb_init(&context);
+  if (r < 0) {
+    context = 0;
+    throw Error("libusb_init", r);
+  }
+  n = libusb_get_device_list(context, &list);
+  if (n < 0) {
+    Close();
+    throw Error("libusb_get_device_list", (int) n);
+  }
+  for (i = 0; i < n && handle == 0; i++) {
+    if (!Matches(list[i], vid, pid))
+      continue;
+    r = libusb_open(list[i], &handle);
+    if (r < 0) {
+      last = r;
+      handle = 0;
+      continue;
+    }
+    if (!serial.empty() && SerialOf(list[i], handle) != serial) {
+      libusb_close(handle);
+      handle = 0;
+      continue;
+    }
+    libusb_set_auto_detach_kernel_driver(handle, 1);
+    r = libusb_set_configuration(handle, 1);
+    if (r == 0)
+      r = libusb_claim_interface(handle, 0);
+    if (r < 0) {
+      last = r;
+      libusb_close(handle);
+      handle = 0;
+    }
+  }
+  libusb_free_device_list(list, 1);
+  if (handle == 0) {
+    Close();
+    if (last == ERROR_NOT_FOUND)
+      throw Error(serial.empty() ? "device not found"
+                                 : "device " + serial + " not found");
+    throw Error("cannot claim the interface", last);
+  }
+}
+
+/**
+ * UsbTransport::Close() -      Release the board, no-op if not open
+ **/
+void UsbTransport::Close()
+{
+  if (handle) {
+    libusb_release_interface(handle, 0);
+    libusb_close(handle);
+    handle = 0;
+  }
+  if (context) {
+    libusb_exit(context);
+    context = 0;
+  }
+  alt = ALT_BULK;
+}
+
+int UsbTransport::Control(uint8_t requestType, uint8_t request, uint16_t value,
+                          uint16_t index, uint8_t *data, uint16_t len,
+                          unsigned int timeout)
+{
+  return libusb_control_transfer(handle, requestType, request, value, index,
+                                 data, len, timeout);
+}
+
+int UsbTransport::Bulk(uint8_t endpoint, uint8_t *data, size_t len,
+                       unsigned int timeout)
+{
+  int done, r;
+
+  if (endpoint == EP1_IN && alt == ALT_ISO)
+    return ERROR_NOT_SUPPORTED;
+  r = libusb_bulk_transfer(handle, endpoint, data, (int) len, &done, timeout);
+  return (r < 0 && (r != LIBUSB_ERROR_TIMEOUT || done == 0)) ? r : done;
+}
+
+/**
+ * UsbTransport::SetInterface() -       Through libusb, which resets the
+ *                                      host side of the endpoints too
+ **/
+int UsbTransport::SetInterface(uint8_t alt)
+{
+  int r = libusb_set_interface_alt_setting(handle, 0, alt);
+
+  if (r == 0)
+    this->alt = alt;
+  return r;
+}
+
+/**
+ * UsbTransport::Submit() -     Queue an asynchronous transfer
+ *
+ * The libusb transfer is kept in transfer->priv until Release().  It has
+ * room for an isochronous packet per PACKET_BYTES of the first length
+ * submitted, which must not grow afterwards.
+ **/
+int UsbTransport::Submit(Transfer *transfer)
+{
+  libusb_transfer *t = static_cast<libusb_transfer *>(transfer->priv);
+  int packets = IsoPackets(transfer->length);
+
+  if (t == 0) {
+    t = libusb_alloc_transfer(std::max(packets, 0));
+    if (t == 0)
+      return ERROR_NO_MEM;
+    transfer->priv = t;
+  }
+  if (transfer->endpoint == EP1_IN && alt == ALT_ISO) {
+    if (packets < 0)
+      return packets;
+    libusb_fill_iso_transfer(t, handle, transfer->endpoint, transfer->buffer,
+                             packets * (int) PACKET_BYTES, packets, Callback,
+                             transfer, 0);
+    libusb_set_iso_packet_lengths(t, PACKET_BYTES);
+  }
+  else
+    libusb_fill_bulk_transfer(t, handle, transfer->endpoint, transfer->buffer,
+                              (int) transfer->length, Callback, transfer, 0);
+  transfer->actual = 0;
+  return libusb_submit_transfer(t);
+}
+
+int UsbTransport::Cancel(Transfer *transfer)
+{
+  if (transfer->priv == 0)
+    return ERROR_NOT_FOUND;
+  return libusb_cancel_transfer(static_cast<libusb_transfer *>(transfer->priv));
+}
+
+void UsbTransport::Release(Transfer *transfer)
+{
+  libusb_free_transfer(static_cast<libusb_transfer *>(transfer->priv));
+  transfer->priv = 0;
+}
+
+void UsbTransport::HandleEvents(unsigned int timeoutMs)
+{
+  struct timeval tv;
+
+  tv.tv_sec = timeoutMs / 1000;
+  tv.tv_usec = (timeoutMs % 1000) * 1000;
+  libusb_handle_events_timeout_completed(context, &tv, 0);
+}
+
+/**
+ * UsbTransport::Callback() -   A libusb transfer is back
+ *
+ * The packets of an isochronous one are moved together (IsoCompact()),
+ * the ones lost on the bus are left out as well.
+ **/
+void UsbTransport::Callback(libusb_transfer *t)
+{
+  Transfer *transfer = static_cast<Transfer *>(t->user_data);
+  int i;
+
+  if (t->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+    std::vector<size_t> lengths(t->num_iso_packets);
+    for (i = 0; i < t->num_iso_packets; i++) {
+      const libusb_iso_packet_descriptor &p = t->iso_packet_desc[i];
+      if (p.status == LIBUSB_TRANSFER_COMPLETED)
+        lengths[i] = p.actual_length;
+    }
+    transfer->actual = IsoCompact(transfer->buffer, &lengths[0],
+                                  t->num_iso_packets);
+  }
+  else
+    transfer->actual = t->actual_length;
+  transfer->status = (TransferStatus) t->status;
+  transfer->callback(transfer);
+}
+
+} /* namespace picad */
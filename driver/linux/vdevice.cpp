@@ -0,0 +1,85 @@
+/*   vdevice.cpp - Serve a virtual board on a Unix socket.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * vdevice [-x speed] [-u] [-S serial]
+ *         [-g ch=shape[,freq[,amp[,offset[,noise]]]]]... path
+ *
+ * Clients connect with the "unix:path" transport.  -x is the speed of the
+ * simulated clock (0: as fast as the client reads), -u lifts the limit of
+ * the A/D module on the rate, -S sets the serial number and -g the signal
+ * of a channel.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "virtual.h"
+
+static void Usage()
+{
+  fprintf(stderr, "usage: vdevice [-x speed] [-u] [-S serial] "
+                  "[-g ch=shape[,freq[,amp[,offset[,noise]]]]]... path\n");
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  picad::VirtualDevice::Options options;
+  std::vector<std::pair<unsigned int, picad::Signal> > signals;
+  picad::Signal signal;
+  unsigned int channel;
+  size_t i;
+  int c;
+
+  while ((c = getopt(argc, argv, "x:uS:g:")) != -1) {
+    switch (c) {
+    case 'x': options.speed = atof(optarg); break;
+    case 'u': options.clampRate = false; break;
+    case 'S':
+      if (!picad::ValidSerial(optarg)) {
+        fprintf(stderr, "vdevice: bad serial number '%s'\n", optarg);
+        return 2;
+      }
+      options.serial = optarg;
+      break;
+    case 'g':
+      if (!picad::Signal::Parse(optarg, channel, signal)) {
+        fprintf(stderr, "vdevice: bad signal '%s'\n", optarg);
+        return 2;
+      }
+      signals.push_back(std::make_pair(channel, signal));
+      break;
+    default: Usage();
+    }
+  }
+  if (optind != argc - 1)
+    Usage();
+
+  try {
+    picad::VirtualDevice device(options);
+    for (i = 0; i < signals.size(); i++)
+      device.SetSignal(signals[i].first, signals[i].second);
+    picad::VirtualServer server(device, argv[optind]);
+    server.Serve();
+  } catch (const picad::Error &e) {
+    fprintf(stderr, "vdevice: %s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
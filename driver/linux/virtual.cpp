@@ -0,0 +1,1349 @@
+/*   virtual.cpp - A model of the A/D firmware for running without a board.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * The firmware sources in pic/18f4550 are the reference: every function
+ * here names the one it follows.  Only what the host can see is modeled,
+ * the register level is left to the simulator in pic/18f4550/sim.
+ **/
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include "virtual.h"
+
+namespace picad {
+
+/**
+ * Firmware constants (usb.h, adc.h, stream.h, rate.h, decim.h)
+ **/
+#define FCY               12000000UL    /* 48 MHz / 4 */
+#define ADC_DIV           64            /* Default Fosc divider at 48 MHz */
+#define ADC_ADCS          6
+#define ADC_MAX_CHANNEL   12
+#define ADC_SCAN_MAX      16
+#define FIFO_SIZE         255           /* 256, one entry kept free */
+#define HEADER_BYTES      STREAM_HEADER_BYTES
+#define PACKED10_SAMPLES  ((PACKET_BYTES - HEADER_BYTES) / 5 * 4)
+#define WORD16_SAMPLES    ((PACKET_BYTES - HEADER_BYTES - 2) / 2)
+#define RATE_SET          'R'
+#define RATE_REPLY_BYTES  13
+#define ADC_SCAN_LIST     'L'
+#define DECIM_MAX_FACTOR  64
+#define DECIM_MAX_BITS    3
+#define VR_COUNTERS_BYTES 34
+#define VR_BUFFER_BYTES   VR_COUNTERS_BYTES
+#define SIE_BUFFERS       2             /* EP1 IN ping-pong BDs */
+#define ISO_RATE          40000
+#define ISO_FRAMES        1             /* 40 samples a packet */
+
+/**
+ * Standard requests (USB 2.0, chapter 9.4)
+ **/
+#define GET_STATUS          0
+#define CLEAR_FEATURE       1
+#define SET_FEATURE         3
+#define SET_ADDRESS         5
+#define GET_DESCRIPTOR      6
+#define GET_CONFIGURATION   8
+#define SET_CONFIGURATION   9
+#define GET_INTERFACE       10
+#define SET_INTERFACE       11
+#define DEVICE_REMOTE_WAKEUP 1
+#define ENDPOINT_HALT       0
+
+/**
+ * Descriptors, as in usb.c
+ **/
+static const uint8_t deviceDescriptor[] = {
+  0x12, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 64,
+  0xD8, 0x04, 0x31, 0x75, 0x01, 0x00, 0x01, 0x02, SERIAL_STRING_INDEX, 0x01
+};
+
+static const uint8_t configDescriptor[] = {
+  0x09, 0x02, 0x4C, 0x00, 0x01, 0x01, 0x00, 0xA0, 0x32,
+  0x09, 0x04, 0x00, ALT_BULK, 0x04, 0x07, 0x01, 0x00, 0x00,
+  0x07, 0x05, 0x81, 0x02, 64, 0x00, 0x01,
+  0x07, 0x05, 0x01, 0x02, 64, 0x00, 0x01,
+  0x07, 0x05, 0x82, 0x02, 7, 0x00, 0x01,
+  0x07, 0x05, 0x02, 0x02, 1, 0x00, 0x01,
+  0x09, 0x04, 0x00, ALT_ISO, 0x03, 0x07, 0x01, 0x00, 0x00,
+  0x07, 0x05, 0x81, 0x05, 64, 0x00, 0x01,
+  0x07, 0x05, 0x82, 0x02, 7, 0x00, 0x01,
+  0x07, 0x05, 0x02, 0x02, 1, 0x00, 0x01
+};
+
+static const uint8_t stringDescriptor0[] = { 0x04, 0x03, 0x09, 0x04 };
+
+static const uint8_t stringDescriptor1[] = {
+  0x1A, 0x03, 'E', 0, 'm', 0, 'b', 0, 'o', 0, 's', 0, 's', 0, 'e', 0, 'r', 0,
+  ' ', 0, ' ', 0, ' ', 0, ' ', 0
+};
+
+static const uint8_t stringDescriptor2[] = {
+  0x20, 0x03, 'U', 0, 'S', 0, 'B', 0, ' ', 0, 'B', 0, 'r', 0, 'a', 0, 'i', 0,
+  'l', 0, 'l', 0, 'e', 0, ' ', 0, '0', 0, '.', 0, '1', 0
+};
+
+static const uint8_t adcsDiv[8] = { 2, 8, 32, 0, 4, 16, 64, 0 };
+
+/**
+ * Answer() -   Copy the answer to an IN request, as much as was asked for
+ **/
+static int Answer(uint8_t *data, uint16_t len, const uint8_t *answer, size_t size)
+{
+  size_t n = std::min((size_t) len, size);
+
+  memcpy(data, answer, n);
+  return (int) n;
+}
+
+/**
+ * SerialDescriptor() - SerialDescribe() (serial.c)
+ **/
+static std::vector<uint8_t> SerialDescriptor(const std::string &serial)
+{
+  std::vector<uint8_t> d(2 + 2 * serial.size());
+  size_t i;
+
+  d[0] = (uint8_t) d.size();
+  d[1] = 0x03;
+  for (i = 0; i < serial.size(); i++)
+    d[2 + 2 * i] = serial[i];
+  return d;
+}
+
+static void PutLong(uint8_t *p, uint32_t value)
+{
+  p[0] = (uint8_t) value;
+  p[1] = (uint8_t) (value >> 8);
+  p[2] = (uint8_t) (value >> 16);
+  p[3] = (uint8_t) (value >> 24);
+}
+
+static uint32_t FrameNumber(double t)
+{
+  return (uint32_t) (unsigned long long) (t * 1000);
+}
+
+/**
+ * Signal::Value() -    Input at time t
+ * @random:             State of the noise generator (xorshift)
+ **/
+uint16_t Signal::Value(double t, uint32_t &random) const
+{
+  double phase = t * frequency - floor(t * frequency);
+  double u, v = 0;
+
+  random ^= random << 13;
+  random ^= random >> 17;
+  random ^= random << 5;
+  u = random / 2147483648.0 - 1;
+
+  switch (shape) {
+  case DC:       v = 0; break;
+  case SINE:     v = sin(2 * M_PI * phase); break;
+  case SQUARE:   v = (phase < 0.5) ? 1 : -1; break;
+  case TRIANGLE: v = 4 * fabs(phase - 0.5) - 1; break;
+  case SAWTOOTH: v = 2 * phase - 1; break;
+  case NOISE:    v = u; break;
+  }
+  v = offset + amplitude * v + noise * u;
+  if (v < 0)
+    return 0;
+  if (v > 1023)
+    return 1023;
+  return (uint16_t) (v + 0.5);
+}
+
+/**
+ * Signal::Parse() -    "ch=shape[,frequency[,amplitude[,offset[,noise]]]]"
+ *
+ * shape is dc, sine, square, triangle, sawtooth or noise.  Returns false
+ * if the spec is not valid.
+ **/
+bool Signal::Parse(const std::string &spec, unsigned int &channel, Signal &signal)
+{
+  static const char *shapes[] = { "dc", "sine", "square", "triangle",
+                                  "sawtooth", "noise" };
+  double *fields[] = { &signal.frequency, &signal.amplitude, &signal.offset,
+                       &signal.noise };
+  const char *p = spec.c_str();
+  char *end;
+  size_t len, i;
+
+  channel = strtoul(p, &end, 10);
+  if (end == p || *end != '=' || channel > ADC_MAX_CHANNEL)
+    return false;
+  p = end + 1;
+  len = strcspn(p, ",");
+  for (i = 0; i < 6; i++)
+    if (strlen(shapes[i]) == len && strncmp(p, shapes[i], len) == 0)
+      break;
+  if (i == 6)
+    return false;
+  signal = Signal((Shape) i);
+  p += len;
+  for (i = 0; (i < 4) && (*p == ','); i++) {
+    *fields[i] = strtod(p + 1, &end);
+    if (end == p + 1)
+      return false;
+    p = end;
+  }
+  return *p == 0;
+}
+
+VirtualDevice::VirtualDevice(const Options &options)
+  : options(options), random(0x2545F491), realStart(std::chrono::steady_clock::now()),
+    now(0), configuration(0), altSetting(ALT_BULK), isoNext(0),
+    serial(options.serial), remoteWakeup(false),
+    scanIndex(0),
+    adcs(ADC_ADCS), adcDiv(ADC_DIV), rateHz(0), rateCycles(0),
+    decimMode(DECIM_OFF), decimFactor(1), decimShift(0), decimRound(0),
+    streaming(false), fill(0), keep(true), flags(0), sampleIndex(0),
+    sequence(0), streamPackets(0), streamLost(0), streamOverruns(0),
+    streamHigh(0), overrun(false), refused(false), usbStalls(0),
+    usbInBusy(0), convStart(0), convTime(0), convCount(0), conversions(0)
+{
+  unsigned int i;
+
+  for (i = 0; i <= ADC_MAX_CHANNEL; i++)
+    signals[i] = Signal(Signal::SINE, i + 1);
+  for (i = 0; i < 3; i++)
+    haltIn[i] = haltOut[i] = false;
+  scan.push_back(6 | (1 << 4));         /* AdcInit(): AN6, 2 TAD */
+  if (!ValidSerial(serial))             /* SerialLoad() */
+    serial = SERIAL_DEFAULT;
+  DecimReset();
+}
+
+void VirtualDevice::SetSignal(unsigned int channel, const Signal &signal)
+{
+  std::lock_guard<std::mutex> hold(lock);
+
+  if (channel <= ADC_MAX_CHANNEL)
+    signals[channel] = signal;
+}
+
+unsigned long long VirtualDevice::Conversions()
+{
+  std::lock_guard<std::mutex> hold(lock);
+
+  return conversions;
+}
+
+/**
+ * VirtualDevice::Clock() -     Simulated time, in seconds
+ *
+ * With speed 0 the clock only moves with the conversions.
+ **/
+double VirtualDevice::Clock()
+{
+  std::chrono::duration<double> real;
+
+  if (options.speed > 0) {
+    real = std::chrono::steady_clock::now() - realStart;
+    now = real.count() * options.speed;
+  }
+  return now;
+}
+
+/**
+ * VirtualDevice::TadCycles() - ADC_TAD_CYCLES() (adc.h)
+ **/
+unsigned long VirtualDevice::TadCycles(unsigned int n) const
+{
+  return ((unsigned long) n * adcDiv + 3) / 4;
+}
+
+/**
+ * VirtualDevice::ConversionRate() -    Conversions per second
+ *
+ * Untimed conversions run back to back, at the shortest period.
+ **/
+double VirtualDevice::ConversionRate() const
+{
+  if (rateCycles == 0)
+    return (double) FCY / TadCycles(2 + 11 + 2);
+  if (!options.clampRate)
+    return rateHz;
+  return (double) FCY / rateCycles;
+}
+
+/**
+ * VirtualDevice::Convert() -   One conversion of the scan list round-robin
+ *
+ * As Acquire() (main.c).
+ **/
+void VirtualDevice::Convert()
+{
+  uint8_t pos = scanIndex;
+  uint16_t sample;
+
+  convTime = convStart + ++convCount / ConversionRate();
+  conversions++;
+  sample = signals[scan[pos] & 0x0F].Value(convTime, random);
+  if (++scanIndex == scan.size())
+    scanIndex = 0;
+  if (DecimPut(pos, sample))
+    StreamPut(pos, sample);
+}
+
+/**
+ * VirtualDevice::Slot() -      Whether EP1 IN may send a packet at a time
+ * @t:                          Simulated seconds
+ *
+ * In ALT_ISO the host asks once every ISO_FRAMES frames, and an interval
+ * with nothing to send is lost (Idle()).  Bulk packets go whenever the
+ * host has room, and so does everything with speed 0, whose clock only
+ * follows the conversions.
+ **/
+bool VirtualDevice::Slot(double t)
+{
+  unsigned long long slot;
+
+  if (altSetting != ALT_ISO || options.speed <= 0)
+    return true;
+  slot = FrameNumber(t) / ISO_FRAMES;
+  if (slot < isoNext)
+    return false;
+  isoNext = slot + 1;
+  return true;
+}
+
+/**
+ * VirtualDevice::Idle() -      The ALT_ISO intervals before a time that had
+ *                              nothing to send
+ * @t:                          Simulated seconds
+ *
+ * The host gets an empty packet for each of them, as many as it has room
+ * for: its isochronous transfers use up one interval per packet whether
+ * data comes or not.  Those it had no room for go by unseen.
+ **/
+void VirtualDevice::Idle(double t, unsigned int maxPackets,
+                         std::vector<Packet> &packets, unsigned int &n)
+{
+  unsigned long long slot;
+  Packet empty;
+
+  if (altSetting != ALT_ISO || options.speed <= 0 || !sie.empty())
+    return;
+  slot = FrameNumber(t) / ISO_FRAMES;
+  empty.len = 0;
+  for (; isoNext < slot && n < maxPackets; isoNext++, n++)
+    packets.push_back(empty);
+  isoNext = std::max(isoNext, slot);
+}
+
+/**
+ * VirtualDevice::Advance() -   Run the acquisition up to a time
+ * @until:                      Simulated time, below 0 for as long as the
+ *                              host wants packets (speed 0)
+ * @maxPackets:                 Packets the host can take
+ * @packets:                    Where they go
+ * @n:                          Packets taken so far, updated
+ *
+ * Packets built while the host has no room are left with the SIE, and
+ * the FIFO fills behind them.
+ **/
+void VirtualDevice::Advance(double until, unsigned int maxPackets,
+                            std::vector<Packet> &packets, unsigned int &n)
+{
+  double t = streaming ? convTime : until;
+
+  for (;;) {
+    while ((n < maxPackets) && !sie.empty() && Slot(t)) {
+      packets.push_back(sie.front());
+      sie.pop_front();
+      n++;
+    }
+    Idle(t, maxPackets, packets, n);
+    if (!streaming)
+      return;
+    if (until < 0) {
+      if (n >= maxPackets)
+        break;
+    }
+    else if (convStart + (convCount + 1) / ConversionRate() > until) {
+      if (t < until) {
+        t = until;
+        continue;
+      }
+      return;
+    }
+    Convert();
+    t = convTime;
+    StreamService(SIE_BUFFERS);
+  }
+  now = convTime;
+}
+
+/**
+ * VirtualDevice::CatchUp() -   Bring the acquisition up to now
+ *
+ * Called before a request changes it.  The host is taken to be reading
+ * meanwhile, so the packets are all kept for it.
+ **/
+void VirtualDevice::CatchUp()
+{
+  double until;
+
+  if (!streaming || options.speed <= 0)
+    return;
+  until = Clock();
+  while (convStart + (convCount + 1) / ConversionRate() <= until) {
+    Convert();
+    StreamService(sie.size() + 1);
+  }
+}
+
+/**
+ * VirtualDevice::Poll() -      Packets of a bulk IN endpoint
+ * @endpoint:                   Its address
+ * @maxPackets:                 The most to take
+ * @packets:                    Where they are appended
+ * @waitMs:                     How long to wait for the first one
+ *
+ * Returns the number of packets, or ERROR_PIPE if the endpoint is halted.
+ **/
+int VirtualDevice::Poll(uint8_t endpoint, unsigned int maxPackets,
+                        std::vector<Packet> &packets, unsigned int waitMs)
+{
+  std::chrono::steady_clock::time_point deadline =
+    std::chrono::steady_clock::now() + std::chrono::milliseconds(waitMs);
+  double due = 0.0005;
+  unsigned int n;
+
+  for (;;) {
+    {
+      std::lock_guard<std::mutex> hold(lock);
+
+      if (configuration == 0)
+        return ERROR_IO;
+      if ((endpoint != EP1_IN) && (endpoint != 0x82))
+        return ERROR_NOT_FOUND;
+      if (haltIn[endpoint & 0x0F])
+        return ERROR_PIPE;
+      n = 0;
+      if (endpoint == EP1_IN && maxPackets > 0)
+        Advance(options.speed > 0 ? Clock() : -1, maxPackets, packets, n);
+      if (n > 0)
+        return n;
+      /* Sleep until the next packet is due, the FIFO may not last long */
+      if (streaming && options.speed > 0 && fifo.size() < PacketSamples())
+        due = std::min(0.0005, (double) (PacketSamples() - fifo.size()) *
+                               decimFactor / ConversionRate() / options.speed);
+    }
+    if (std::chrono::steady_clock::now() >= deadline)
+      return 0;
+    std::this_thread::sleep_for(std::chrono::duration<double>(due));
+  }
+}
+
+/**
+ * VirtualDevice::Control() -   A control transfer on EP0
+ *
+ * Returns the number of bytes of the data stage, or ERROR_PIPE where the
+ * firmware stalls.
+ **/
+int VirtualDevice::Control(uint8_t requestType, uint8_t request, uint16_t value,
+                           uint16_t index, uint8_t *data, uint16_t len)
+{
+  std::lock_guard<std::mutex> hold(lock);
+  int r = ERROR_PIPE;
+
+  CatchUp();
+  if ((requestType & 0x60) == 0x00)
+    r = Standard(requestType, request, value, index, data, len);
+  else if ((requestType & 0x60) == 0x40)
+    r = Vendor(requestType, request, value, index, data, len);
+  if (r == ERROR_PIPE)
+    usbStalls++;
+  return r;
+}
+
+/**
+ * VirtualDevice::Standard() -  ProcessStandardRequest() (usb.c)
+ **/
+int VirtualDevice::Standard(uint8_t requestType, uint8_t request, uint16_t value,
+                            uint16_t index, uint8_t *data, uint16_t len)
+{
+  uint8_t recipient = requestType & 0x1F;
+  uint8_t ep = index & 0x0F;
+  uint8_t answer[2] = { 0, 0 };
+
+  switch (request) {
+  case SET_ADDRESS:
+    return 0;
+
+  case SET_INTERFACE:                   /* SetAltSetting() */
+    if (configuration == 0 || index != 0 || value > ALT_ISO)
+      break;
+    altSetting = (uint8_t) value;
+    for (ep = 0; ep < 3; ep++)
+      haltIn[ep] = haltOut[ep] = false;
+    sie.clear();
+    isoNext = FrameNumber(Clock()) / ISO_FRAMES;
+    RateSet(rateHz);                    /* VendorApply(), VENDOR_ALT */
+    if (streaming)
+      Restart();
+    return 0;
+
+  case GET_DESCRIPTOR:
+    if (requestType != 0x80)
+      break;
+    if ((value >> 8) == 1)
+      return Answer(data, len, deviceDescriptor, sizeof(deviceDescriptor));
+    if ((value >> 8) == 2)
+      return Answer(data, len, configDescriptor, sizeof(configDescriptor));
+    if ((value >> 8) == 3) {
+      if ((value & 0xFF) == 0)
+        return Answer(data, len, stringDescriptor0, sizeof(stringDescriptor0));
+      if ((value & 0xFF) == 1)
+        return Answer(data, len, stringDescriptor1, sizeof(stringDescriptor1));
+      if ((value & 0xFF) == SERIAL_STRING_INDEX)
+        return Answer(data, len, &SerialDescriptor(serial)[0], 2 + 2 * serial.size());
+      return Answer(data, len, stringDescriptor2, sizeof(stringDescriptor2));
+    }
+    break;
+
+  case SET_CONFIGURATION:
+    configuration = (uint8_t) value;
+    altSetting = ALT_BULK;
+    for (ep = 0; ep < 3; ep++)          /* InitEndpoint() */
+      haltIn[ep] = haltOut[ep] = false;
+    RateSet(rateHz);
+    return 0;
+
+  case GET_CONFIGURATION:
+    return Answer(data, len, &configuration, 1);
+
+  case GET_STATUS:
+    if (recipient == 0)
+      answer[0] = remoteWakeup ? 0x02 : 0x00;
+    else if ((recipient == 2) && (ep < 3))
+      answer[0] = ((index & 0x80) ? haltIn[ep] : haltOut[ep]) ? 0x01 : 0x00;
+    else if (recipient != 1)
+      break;
+    return Answer(data, len, answer, 2);
+
+  case CLEAR_FEATURE:
+  case SET_FEATURE:
+    if ((recipient == 0) && (value == DEVICE_REMOTE_WAKEUP)) {
+      remoteWakeup = (request == SET_FEATURE);
+      return 0;
+    }
+    if ((recipient == 2) && (value == ENDPOINT_HALT) && (ep != 0) && (ep < 3)) {
+      if (index & 0x80)
+        haltIn[ep] = (request == SET_FEATURE);
+      else
+        haltOut[ep] = (request == SET_FEATURE);
+      return 0;
+    }
+    break;
+
+  case GET_INTERFACE:
+    if (configuration == 0 || index != 0)
+      break;
+    return Answer(data, len, &altSetting, 1);
+  }
+  return ERROR_PIPE;
+}
+
+/**
+ * VirtualDevice::Vendor() -    ProcessVendorRequest() and VendorApply()
+ *                              (main.c)
+ *
+ * The settings are applied straight away, in the firmware order.
+ **/
+int VirtualDevice::Vendor(uint8_t requestType, uint8_t request, uint16_t value,
+                          uint16_t index, uint8_t *data, uint16_t len)
+{
+  uint8_t answer[VR_BUFFER_BYTES];
+  size_t size;
+
+  if ((requestType & 0x1F) != 0)
+    return ERROR_PIPE;
+
+  if (requestType & 0x80) {
+    switch (request) {
+    case VR_GET_RATE:
+      size = RateReport(answer);
+      break;
+    case VR_GET_SCAN:
+      size = scan.size();
+      std::copy(scan.begin(), scan.end(), answer);
+      break;
+    case VR_GET_ADC_CLOCK:
+      answer[0] = adcs;
+      answer[1] = adcDiv;
+      size = 2;
+      break;
+    case VR_GET_COUNTERS:
+      std::fill(answer, answer + VR_COUNTERS_BYTES, 0);
+      PutLong(answer, streamPackets);
+      PutLong(answer + 4, streamLost);
+      PutLong(answer + 8, streamOverruns);
+      PutLong(answer + 12, usbInBusy);
+      PutLong(answer + 16, usbStalls);
+      answer[33] = streamHigh;
+      if (value & 1)
+        streamHigh = 0;
+      size = VR_COUNTERS_BYTES;
+      break;
+    case VR_GET_DECIM:
+      answer[0] = decimMode;
+      answer[1] = decimFactor;
+      size = 2;
+      break;
+    default:
+      return ERROR_PIPE;
+    }
+    return Answer(data, len, answer, size);
+  }
+
+  if (request == VR_SET_SCAN) {
+    if ((len == 0) || (len > ADC_SCAN_MAX))
+      return ERROR_PIPE;
+    SetScan(data, len);                 /* Ignored if not valid */
+  }
+  else if (request == VR_SET_SERIAL) {
+    if ((len == 0) || (len > SERIAL_MAX))
+      return ERROR_PIPE;
+    std::string s((const char *) data, len);
+    if (ValidSerial(s))                 /* SerialSet() */
+      serial = s;
+    return (int) len;                   /* Not an acquisition setting */
+  }
+  else if (len != 0)
+    return ERROR_PIPE;
+  else if (request == VR_SET_RATE)
+    RateSet(((uint32_t) index << 16) | value);
+  else if (request == VR_SET_ADC_CLOCK) {
+    if ((value > 7) || (adcsDiv[value] < ADC_DIV))
+      return ERROR_PIPE;
+    adcs = (uint8_t) value;
+    adcDiv = adcsDiv[value];
+    RateSet(rateHz);                  /* The shortest period depends on TAD */
+  }
+  else if (request == VR_SET_DECIM) {
+    if ((value > 0xFF) || (index > 0xFF) || (DecimFactor(value, index) == 0))
+      return ERROR_PIPE;
+    decimMode = (uint8_t) value;
+    decimFactor = DecimFactor(value, index);
+    decimShift = (uint8_t) index;
+  }
+  else if (request == VR_START) {
+    Start();
+    return 0;
+  }
+  else if (request == VR_STOP) {
+    Stop();
+    return 0;
+  }
+  else
+    return ERROR_PIPE;
+
+  if (streaming)
+    Restart();
+  return (int) len;
+}
+
+/**
+ * VirtualDevice::BulkOut() -   Packets sent to a bulk OUT endpoint
+ *
+ * Every EP1 OUT packet is a command, see Command().  EP2 takes anything.
+ * ALT_ISO has no EP1 OUT.
+ **/
+int VirtualDevice::BulkOut(uint8_t endpoint, const uint8_t *data, size_t len)
+{
+  std::lock_guard<std::mutex> hold(lock);
+  size_t i;
+
+  if (configuration == 0)
+    return ERROR_IO;
+  if ((endpoint != EP1_OUT) && (endpoint != 0x02))
+    return ERROR_NOT_FOUND;
+  if (endpoint == EP1_OUT && altSetting == ALT_ISO)
+    return ERROR_NOT_FOUND;
+  if (haltOut[endpoint])
+    return ERROR_PIPE;
+  CatchUp();
+  if (endpoint == EP1_OUT)
+    for (i = 0; i < len; i += PACKET_BYTES)
+      Command(data + i, std::min(len - i, PACKET_BYTES));
+  return (int) len;
+}
+
+/**
+ * VirtualDevice::Command() -   Command() (main.c)
+ **/
+void VirtualDevice::Command(const uint8_t *data, size_t len)
+{
+  uint8_t reply[2 * ADC_SCAN_MAX];
+  size_t i;
+
+  if (len == 0)
+    return;
+  if (data[0] == STREAM_START)
+    Start();
+  else if (data[0] == STREAM_STOP)
+    Stop();
+  else if (data[0] == RATE_SET) {
+    if (!streaming && (len >= 5)) {
+      RateSet(data[1] | (data[2] << 8) | (data[3] << 16) | ((uint32_t) data[4] << 24));
+      Reply(reply, RateReport(reply));
+    }
+  }
+  else if (data[0] == ADC_SCAN_LIST) {
+    if (!streaming && (len >= 2) && (data[1] <= len - 2))
+      SetScan(data + 2, data[1]);
+  }
+  else if (!streaming) {
+    /* Sample(): one blocking conversion of every entry, high byte first */
+    for (i = 0; i < scan.size(); i++) {
+      uint16_t v = signals[scan[i] & 0x0F].Value(Clock(), random);
+      reply[2 * i] = (uint8_t) (v >> 8);
+      reply[2 * i + 1] = (uint8_t) v;
+    }
+    Reply(reply, 2 * scan.size());
+  }
+}
+
+/**
+ * VirtualDevice::Reply() -     Reply() (main.c): an answer on EP1 IN
+ **/
+void VirtualDevice::Reply(const uint8_t *data, size_t len)
+{
+  Packet p;
+
+  p.len = (uint8_t) len;
+  memcpy(p.data, data, len);
+  sie.push_back(p);
+}
+
+/**
+ * VirtualDevice::SetScan() -   AdcSetScan() (adc.c)
+ **/
+bool VirtualDevice::SetScan(const uint8_t *list, size_t count)
+{
+  size_t i;
+
+  if ((count == 0) || (count > ADC_SCAN_MAX))
+    return false;
+  for (i = 0; i < count; i++)
+    if ((list[i] & 0x0F) > ADC_MAX_CHANNEL)
+      return false;
+  scan.clear();
+  for (i = 0; i < count; i++)
+    scan.push_back(list[i] & 0x7F);
+  scanIndex = 0;
+  return true;
+}
+
+/**
+ * VirtualDevice::RateSet() -   RateSet() (rate.c)
+ *
+ * Without clampRate the rate asked for is used as it is, but for the
+ * ISO_RATE limit of ALT_ISO.
+ **/
+void VirtualDevice::RateSet(uint32_t hz)
+{
+  unsigned long cycles, counts, min = TadCycles(2 + 11 + 2);
+  unsigned int ps;
+
+  rateHz = hz;
+  if ((altSetting == ALT_ISO) && ((hz == 0) || (hz > ISO_RATE)))
+    hz = ISO_RATE;
+  rateCycles = 0;
+  if (hz == 0)
+    return;
+
+  cycles = (FCY + hz / 2) / hz;
+  if (!options.clampRate) {
+    rateCycles = cycles ? cycles : 1;
+    return;
+  }
+  if (cycles < min)
+    cycles = min;
+  ps = 0;
+  while ((ps < 3) && ((cycles >> ps) > 65536UL))
+    ps++;
+  counts = (cycles + (1 << ps) / 2) >> ps;
+  if (counts > 65536UL)
+    counts = 65536UL;
+  if ((counts << ps) < min)
+    counts++;
+  rateCycles = counts << ps;
+}
+
+/**
+ * VirtualDevice::RateReport() -        RateReport() (rate.c)
+ **/
+size_t VirtualDevice::RateReport(uint8_t *buffer) const
+{
+  unsigned long long mhz = 0;
+  unsigned long min = TadCycles(2 + 11 + 2);
+
+  if (rateCycles)
+    mhz = options.clampRate ?
+          (FCY / rateCycles) * 1000ULL + ((FCY % rateCycles) * 1000ULL) / rateCycles :
+          rateHz * 1000ULL;
+  buffer[0] = RATE_SET;
+  PutLong(buffer + 1, rateCycles);
+  PutLong(buffer + 5, (uint32_t) std::min(mhz, 0xFFFFFFFFULL));
+  PutLong(buffer + 9, (FCY / min) * 1000 + ((FCY % min) * 1000) / min);
+  return RATE_REPLY_BYTES;
+}
+
+/**
+ * VirtualDevice::DecimFactor() -       DecimFactor() (decim.c)
+ **/
+uint8_t VirtualDevice::DecimFactor(uint8_t mode, uint8_t arg) const
+{
+  if (mode == DECIM_OFF)
+    return 1;
+  if (mode == DECIM_OVERSAMPLE)
+    return ((arg == 0) || (arg > DECIM_MAX_BITS)) ? 0 : 1 << (2 * arg);
+  if ((mode > DECIM_OVERSAMPLE) || (arg > DECIM_MAX_FACTOR))
+    return 0;
+  return arg;
+}
+
+void VirtualDevice::DecimReset()
+{
+  memset(decimSum, 0, sizeof(decimSum));
+  decimRound = 0;
+}
+
+/**
+ * VirtualDevice::DecimPut() -  DecimPut() (decim.c)
+ **/
+bool VirtualDevice::DecimPut(uint8_t pos, uint16_t &sample)
+{
+  uint16_t sum;
+  bool last;
+
+  if (decimMode == DECIM_OFF)
+    return true;
+
+  sum = decimSum[pos] + sample;
+  last = (decimRound == decimFactor - 1);
+  if (pos == scan.size() - 1)
+    decimRound = last ? 0 : decimRound + 1;
+  if (!last) {
+    decimSum[pos] = sum;
+    return false;
+  }
+  decimSum[pos] = 0;
+
+  if (decimMode == DECIM_BOXCAR)
+    sum = sum / decimFactor;
+  else if (decimMode == DECIM_OVERSAMPLE)
+    sum = sum >> decimShift;
+  sample = sum;
+  return true;
+}
+
+/**
+ * VirtualDevice::Start() -     Start() (main.c) and StreamStart() (stream.c)
+ **/
+void VirtualDevice::Start()
+{
+  fifo.clear();
+  stamps.clear();
+  fill = 0;
+  sampleIndex = 0;
+  sequence = 0;
+  flags = 0;
+  keep = true;
+  overrun = false;
+  refused = false;
+  streaming = true;
+  DecimReset();
+  scanIndex = 0;
+  convStart = Clock();
+  convCount = 0;
+}
+
+/**
+ * VirtualDevice::Restart() -   StreamRestart() (stream.c), with the A/D
+ *                              scan and the sample clock started again
+ **/
+void VirtualDevice::Restart()
+{
+  streamLost += fifo.size();
+  fifo.clear();
+  stamps.clear();
+  fill = 0;
+  keep = true;
+  overrun = false;
+  flags = STREAM_RESTART;
+  DecimReset();
+  scanIndex = 0;
+  convStart = Clock();
+  convCount = 0;
+}
+
+void VirtualDevice::Stop()
+{
+  streaming = false;
+}
+
+unsigned int VirtualDevice::PacketSamples() const
+{
+  return (decimMode == DECIM_OFF) ? PACKED10_SAMPLES : WORD16_SAMPLES;
+}
+
+/**
+ * VirtualDevice::StreamPut() - StreamPut() (stream.c)
+ **/
+void VirtualDevice::StreamPut(uint8_t pos, uint16_t sample)
+{
+  Stamp s;
+
+  if (pos == 0)
+    keep = FIFO_SIZE - fifo.size() >= scan.size();
+  if (!keep) {
+    flags |= STREAM_DROPPED;
+    sampleIndex++;
+    streamLost += 1 + fill;
+    if (!overrun)
+      streamOverruns++;
+    overrun = true;
+    if (fill) {
+      fifo.resize(fifo.size() - fill);
+      flags |= stamps.back().flags;
+      stamps.pop_back();
+      fill = 0;
+    }
+    return;
+  }
+  if (fill == 0) {
+    s.frame = FrameNumber(convTime);
+    s.index = sampleIndex;
+    s.flags = flags;
+    s.pos = pos;
+    stamps.push_back(s);
+    flags = 0;
+  }
+  if (++fill == PacketSamples())
+    fill = 0;
+  fifo.push_back(sample);
+  sampleIndex++;
+  streamHigh = std::max(streamHigh, (uint8_t) fifo.size());
+}
+
+/**
+ * VirtualDevice::StreamService() -     StreamService() (stream.c)
+ * @limit:                              Packets the SIE can hold
+ **/
+void VirtualDevice::StreamService(size_t limit)
+{
+  unsigned int i, n = PacketSamples();
+  uint8_t low = 0, *p;
+  uint16_t sample;
+  Packet packet;
+
+  if (fifo.size() < n)
+    return;
+  if (sie.size() >= limit) {
+    if (!refused)               /* Once per packet, as stream.c */
+      usbInBusy++;
+    refused = true;
+    return;
+  }
+  refused = false;
+
+  packet.data[1] = (uint8_t) n;
+  packet.data[2] = stamps.front().flags;
+  packet.data[3] = stamps.front().pos;
+  packet.data[4] = (uint8_t) sequence;
+  packet.data[5] = (uint8_t) (sequence >> 8);
+  PutLong(&packet.data[6], stamps.front().frame);
+  PutLong(&packet.data[10], stamps.front().index);
+  stamps.pop_front();
+  sequence++;
+
+  if (decimMode == DECIM_OFF) {
+    packet.data[0] = STREAM_PACKED10;
+    p = &packet.data[HEADER_BYTES];
+    for (i = 0; i < n; i++) {
+      sample = fifo.front();
+      fifo.pop_front();
+      *p++ = (uint8_t) (sample >> 2);
+      low = (low >> 2) | (uint8_t) (sample << 6);
+      if ((i & 3) == 3)
+        *p++ = low;
+    }
+    packet.len = (uint8_t) (HEADER_BYTES + n / 4 * 5);
+  }
+  else {
+    packet.data[0] = STREAM_WORD16;
+    packet.data[HEADER_BYTES] = decimMode;
+    packet.data[HEADER_BYTES + 1] = decimFactor;
+    p = &packet.data[HEADER_BYTES + 2];
+    for (i = 0; i < n; i++) {
+      sample = fifo.front();
+      fifo.pop_front();
+      *p++ = (uint8_t) sample;
+      *p++ = (uint8_t) (sample >> 8);
+    }
+    packet.len = (uint8_t) (HEADER_BYTES + 2 + n * 2);
+  }
+  sie.push_back(packet);
+  overrun = false;
+  streamPackets++;
+}
+
+/**
+ * Transfer completion for the packet transports.  A transfer is complete
+ * when it is full or a short packet comes in, as on the bus.
+ **/
+
+/**
+ * Fill() -     Move packets into a transfer
+ *
+ * Returns true when the transfer is complete.
+ **/
+static bool Fill(Transfer *t, std::deque<Packet> &packets)
+{
+  size_t room, len;
+
+  while (!packets.empty()) {
+    len = packets.front().len;
+    room = t->length - t->actual;
+    if (len > room) {
+      memcpy(t->buffer + t->actual, packets.front().data, room);
+      t->actual += room;
+      packets.pop_front();
+      t->status = TRANSFER_OVERFLOW;
+      return true;
+    }
+    memcpy(t->buffer + t->actual, packets.front().data, len);
+    t->actual += len;
+    packets.pop_front();
+    if ((len < PACKET_BYTES) || (t->actual == t->length)) {
+      t->status = TRANSFER_COMPLETED;
+      return true;
+    }
+  }
+  return false;
+}
+
+static TransferStatus Status(int error)
+{
+  if (error == ERROR_PIPE)
+    return TRANSFER_STALL;
+  if (error == ERROR_NO_DEVICE)
+    return TRANSFER_NO_DEVICE;
+  if (error == ERROR_OVERFLOW)
+    return TRANSFER_OVERFLOW;
+  return TRANSFER_ERROR;
+}
+
+/**
+ * PacketTransport::Bulk() -    Synchronous bulk transfer
+ *
+ * A timeout of 0 waits for ever.
+ **/
+int PacketTransport::Bulk(uint8_t endpoint, uint8_t *data, size_t len,
+                          unsigned int timeout)
+{
+  std::chrono::steady_clock::time_point deadline =
+    std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+  std::vector<Packet> packets;
+  std::deque<Packet> other;
+  std::deque<Packet> &queue = (endpoint == EP1_IN) ? spill : other;
+  Transfer t;
+  long ms;
+  int r;
+
+  if (!(endpoint & 0x80))
+    return Send(endpoint, data, len);
+  {
+    std::lock_guard<std::mutex> hold(lock);
+    if (endpoint == EP1_IN && alt == ALT_ISO)
+      return ERROR_NOT_SUPPORTED;
+  }
+
+  t.buffer = data;
+  t.length = len;
+  for (;;) {
+    {
+      std::lock_guard<std::mutex> hold(lock);
+      if (Fill(&t, queue))
+        break;
+    }
+    ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+           deadline - std::chrono::steady_clock::now()).count();
+    if (timeout && ms <= 0)
+      return t.actual ? (int) t.actual : ERROR_TIMEOUT;
+    packets.clear();
+    {
+      std::lock_guard<std::mutex> hold(fetching);
+      r = Fetch(endpoint, (len - t.actual + PACKET_BYTES - 1) / PACKET_BYTES, packets,
+                (!timeout || ms > 10) ? 10 : ms);
+    }
+    if (r < 0)
+      return r;
+    std::lock_guard<std::mutex> hold(lock);
+    queue.insert(queue.end(), packets.begin(), packets.end());
+  }
+  return (t.status == TRANSFER_OVERFLOW) ? ERROR_OVERFLOW : (int) t.actual;
+}
+
+/**
+ * PacketTransport::SetInterface() -    SET_INTERFACE, then EP1 IN is read
+ *                                      the way the setting has it
+ *
+ * The packets fetched and not taken yet are dropped, as by the SIE.
+ **/
+int PacketTransport::SetInterface(uint8_t alt)
+{
+  int r = Transport::SetInterface(alt);
+
+  if (r == 0) {
+    std::lock_guard<std::mutex> hold(lock);
+    this->alt = alt;
+    spill.clear();
+  }
+  return r;
+}
+
+int PacketTransport::Submit(Transfer *transfer)
+{
+  if (transfer->endpoint != EP1_IN)
+    return ERROR_NOT_SUPPORTED;
+  transfer->actual = 0;
+  {
+    std::lock_guard<std::mutex> hold(lock);
+    if (alt == ALT_ISO) {
+      if (IsoPackets(transfer->length) < 0)
+        return ERROR_INVALID_PARAM;
+      iso[transfer].clear();
+    }
+    /* A cancel that came after the transfer had completed is void; left
+       there it would cancel whatever is submitted next at that address */
+    cancels.erase(std::remove(cancels.begin(), cancels.end(), transfer),
+                  cancels.end());
+    pending.push_back(transfer);
+  }
+  wake.notify_all();
+  return 0;
+}
+
+/**
+ * PacketTransport::Cancel() -  Ask for a transfer to be cancelled
+ *
+ * It completes with TRANSFER_CANCELLED from HandleEvents().
+ **/
+int PacketTransport::Cancel(Transfer *transfer)
+{
+  {
+    std::lock_guard<std::mutex> hold(lock);
+    if (std::find(pending.begin(), pending.end(), transfer) == pending.end())
+      return ERROR_NOT_FOUND;
+    cancels.push_back(transfer);
+  }
+  wake.notify_all();
+  return 0;
+}
+
+/**
+ * PacketTransport::Forget() -  Drop the packets not taken yet (on Close())
+ *
+ * The next Open() selects the configuration again, in ALT_BULK.
+ **/
+void PacketTransport::Forget()
+{
+  std::lock_guard<std::mutex> hold(lock);
+
+  spill.clear();
+  alt = ALT_BULK;
+}
+
+/**
+ * PacketTransport::Take() -    Move the packets fetched into a transfer
+ *
+ * Returns true when it is complete.  An isochronous one is when all its
+ * slots are used, with a packet or without.
+ **/
+bool PacketTransport::Take(Transfer *transfer)
+{
+  std::map<Transfer *, std::vector<size_t> >::iterator i = iso.find(transfer);
+  size_t slots;
+
+  if (i == iso.end())
+    return Fill(transfer, spill);
+  slots = IsoPackets(transfer->length);
+  while (!spill.empty() && i->second.size() < slots) {
+    memcpy(transfer->buffer + i->second.size() * PACKET_BYTES,
+           spill.front().data, spill.front().len);
+    i->second.push_back(spill.front().len);
+    spill.pop_front();
+  }
+  transfer->actual = i->second.size() * PACKET_BYTES;
+  if (i->second.size() < slots)
+    return false;
+  transfer->status = TRANSFER_COMPLETED;
+  return true;
+}
+
+/**
+ * PacketTransport::Retire() -  A transfer is no longer pending
+ *
+ * An isochronous one keeps the packets it got, back to back.
+ **/
+void PacketTransport::Retire(Transfer *transfer)
+{
+  std::map<Transfer *, std::vector<size_t> >::iterator i = iso.find(transfer);
+
+  if (i == iso.end())
+    return;
+  transfer->actual = IsoCompact(transfer->buffer, i->second.data(),
+                                (unsigned int) i->second.size());
+  iso.erase(i);
+}
+
+/**
+ * PacketTransport::HandleEvents() -    Fill the pending transfers
+ *
+ * Fetches as many packets as the pending transfers have room for and
+ * runs the callbacks of the ones that complete, without the lock held so
+ * they can submit again.  Returns after running some, or after timeoutMs.
+ **/
+void PacketTransport::HandleEvents(unsigned int timeoutMs)
+{
+  std::chrono::steady_clock::time_point deadline =
+    std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+  std::vector<Transfer *> done;
+  std::vector<Packet> packets;
+  size_t room, i;
+  long ms;
+  int r;
+
+  for (;;) {
+    room = 0;
+    {
+      std::unique_lock<std::mutex> hold(lock);
+
+      for (i = 0; i < cancels.size(); i++) {
+        std::deque<Transfer *>::iterator t =
+          std::find(pending.begin(), pending.end(), cancels[i]);
+        if (t != pending.end()) {
+          (*t)->status = TRANSFER_CANCELLED;
+          Retire(*t);
+          done.push_back(*t);
+          pending.erase(t);
+        }
+      }
+      cancels.clear();
+      while (!pending.empty() && Take(pending.front())) {
+        Retire(pending.front());
+        done.push_back(pending.front());
+        pending.pop_front();
+      }
+      if (done.empty()) {
+        for (i = 0; i < pending.size(); i++)
+          room += pending[i]->length - pending[i]->actual;
+        if (room == 0 &&
+            wake.wait_until(hold, deadline) == std::cv_status::timeout)
+          return;
+      }
+    }
+
+    if (done.empty() && room) {
+      ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+             deadline - std::chrono::steady_clock::now()).count();
+      packets.clear();
+      {
+        std::lock_guard<std::mutex> hold(fetching);
+        r = Fetch(EP1_IN, (room + PACKET_BYTES - 1) / PACKET_BYTES, packets,
+                  ms <= 0 ? 0 : (ms > 10 ? 10 : ms));
+      }
+      std::lock_guard<std::mutex> hold(lock);
+      if (r < 0) {
+        while (!pending.empty()) {
+          pending.front()->status = Status(r);
+          Retire(pending.front());
+          done.push_back(pending.front());
+          pending.pop_front();
+        }
+      }
+      spill.insert(spill.end(), packets.begin(), packets.end());
+      while (!pending.empty() && Take(pending.front())) {
+        Retire(pending.front());
+        done.push_back(pending.front());
+        pending.pop_front();
+      }
+    }
+
+    if (!done.empty()) {
+      for (i = 0; i < done.size(); i++)
+        done[i]->callback(done[i]);
+      return;
+    }
+    if (std::chrono::steady_clock::now() >= deadline)
+      return;
+  }
+}
+
+VirtualTransport::VirtualTransport(const VirtualDevice::Options &options)
+  : device(options), open(false)
+{
+}
+
+/**
+ * VirtualTransport::Open() -   Select the configuration, as the libusb
+ *                              transport does
+ **/
+void VirtualTransport::Open()
+{
+  device.Control(0x00, SET_CONFIGURATION, 1, 0, 0, 0);
+  open = true;
+}
+
+void VirtualTransport::Close()
+{
+  open = false;
+  Forget();
+}
+
+int VirtualTransport::Control(uint8_t requestType, uint8_t request, uint16_t value,
+                              uint16_t index, uint8_t *data, uint16_t len,
+                              unsigned int timeout)
+{
+  (void) timeout;
+  return device.Control(requestType, request, value, index, data, len);
+}
+
+int VirtualTransport::Send(uint8_t endpoint, const uint8_t *data, size_t len)
+{
+  return device.BulkOut(endpoint, data, len);
+}
+
+int VirtualTransport::Fetch(uint8_t endpoint, unsigned int maxPackets,
+                            std::vector<Packet> &packets, unsigned int waitMs)
+{
+  return device.Poll(endpoint, maxPackets, packets, waitMs);
+}
+
+} /* namespace picad */
@@ -0,0 +1,333 @@
+/*   virtual.h - A model of the A/D firmware for running without a board.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PICAD_VIRTUAL_H
+#define PICAD_VIRTUAL_H
+
+#include <chrono>
+#include <map>
+#include "picad.h"
+
+namespace picad {
+
+/**
+ * Signal - Synthetic input of one analog channel, in A/D counts
+ *
+ * offset + amplitude * shape(t * frequency) + uniform noise of the given
+ * amplitude, clipped to 0..1023.
+ **/
+struct Signal {
+  enum Shape { DC, SINE, SQUARE, TRIANGLE, SAWTOOTH, NOISE };
+
+  Signal(Shape shape = SINE, double frequency = 1, double amplitude = 400,
+         double offset = 512, double noise = 0)
+    : shape(shape), frequency(frequency), amplitude(amplitude),
+      offset(offset), noise(noise) {}
+
+  uint16_t Value(double t, uint32_t &random) const;
+  static bool Parse(const std::string &spec, unsigned int &channel,
+                    Signal &signal);
+
+  Shape shape;
+  double frequency;           /* Hz */
+  double amplitude;
+  double offset;
+  double noise;
+};
+
+/**
+ * Packet - One packet of a bulk IN endpoint
+ **/
+struct Packet {
+  uint8_t len;
+  uint8_t data[PACKET_BYTES];
+};
+
+/**
+ * VirtualDevice - The firmware, as seen from the bus
+ *
+ * Answers the same standard and vendor requests on EP0 as usb.c and
+ * main.c, with the same descriptors, takes the EP1 OUT commands and
+ * produces the EP1 IN stream packets: same FIFO size, decimation, drops,
+ * restarts and header fields.  EP2 is there but, as on the board, unused.
+ * The A/D inputs are Signals.  In ALT_ISO the host gets one EP1 IN
+ * packet per service interval of the simulated clock, an empty one when
+ * there was nothing to send.
+ *
+ * Conversions follow a simulated clock.  With speed 1 it runs in real
+ * time, with speed s it runs s times faster; the packets the host does not
+ * take in time fill the FIFO and samples are dropped as on the board.  With
+ * speed 0 conversions are made only when the host asks for packets, as
+ * fast as it reads, and nothing is dropped.  clampRate false lets the rate
+ * go above what the A/D module can do.  serial is the serial number in
+ * the EEPROM, SERIAL_DEFAULT if empty.
+ *
+ * All the calls may come from different threads.
+ **/
+class VirtualDevice {
+ public:
+  struct Options {
+    Options() : speed(1), clampRate(true) {}
+    double speed;               /* Simulated seconds per second, or 0 */
+    bool clampRate;
+    std::string serial;
+  };
+
+  explicit VirtualDevice(const Options &options = Options());
+
+  void SetSignal(unsigned int channel, const Signal &signal);
+
+  int Control(uint8_t requestType, uint8_t request, uint16_t value,
+              uint16_t index, uint8_t *data, uint16_t len);
+  int BulkOut(uint8_t endpoint, const uint8_t *data, size_t len);
+  int Poll(uint8_t endpoint, unsigned int maxPackets,
+           std::vector<Packet> &packets, unsigned int waitMs);
+
+  unsigned long long Conversions();
+
+ private:
+  VirtualDevice(const VirtualDevice &);
+  VirtualDevice &operator=(const VirtualDevice &);
+
+  struct Stamp {
+    uint32_t frame;
+    uint32_t index;
+    uint8_t flags;
+    uint8_t pos;
+  };
+
+  double Clock();
+  double ConversionRate() const;
+  unsigned long TadCycles(unsigned int n) const;
+  void CatchUp();
+  bool Slot(double t);
+  void Idle(double t, unsigned int maxPackets, std::vector<Packet> &packets,
+            unsigned int &n);
+  void Advance(double until, unsigned int maxPackets,
+               std::vector<Packet> &packets, unsigned int &n);
+  void Convert();
+  void Reply(const uint8_t *data, size_t len);
+
+  int Standard(uint8_t requestType, uint8_t request, uint16_t value,
+               uint16_t index, uint8_t *data, uint16_t len);
+  int Vendor(uint8_t requestType, uint8_t request, uint16_t value,
+             uint16_t index, uint8_t *data, uint16_t len);
+  void Command(const uint8_t *data, size_t len);
+
+  bool SetScan(const uint8_t *list, size_t count);
+  void RateSet(uint32_t hz);
+  size_t RateReport(uint8_t *buffer) const;
+  uint8_t DecimFactor(uint8_t mode, uint8_t arg) const;
+  void DecimReset();
+  bool DecimPut(uint8_t pos, uint16_t &sample);
+
+  void Start();
+  void Restart();
+  void Stop();
+  void StreamPut(uint8_t pos, uint16_t sample);
+  void StreamService(size_t limit);
+  unsigned int PacketSamples() const;
+
+  std::mutex lock;
+  Options options;
+  Signal signals[13];
+  uint32_t random;
+  std::chrono::steady_clock::time_point realStart;
+  double now;                   /* Simulated seconds */
+
+  /* usb.c, serial.c */
+  uint8_t configuration;
+  uint8_t altSetting;
+  unsigned long long isoNext;   /* First service interval not used yet */
+  std::string serial;
+  bool remoteWakeup;
+  bool haltIn[3], haltOut[3];
+  std::deque<Packet> sie;       /* EP1 IN packets handed to the SIE */
+
+  /* adc.c, rate.c, decim.c */
+  std::vector<uint8_t> scan;
+  unsigned int scanIndex;
+  uint8_t adcs, adcDiv;
+  uint32_t rateHz;
+  unsigned long rateCycles;
+  uint8_t decimMode, decimFactor, decimShift, decimRound;
+  uint16_t decimSum[16];
+
+  /* stream.c */
+  bool streaming;
+  std::deque<uint16_t> fifo;
+  std::deque<Stamp> stamps;
+  unsigned int fill;
+  bool keep;
+  uint8_t flags;
+  uint32_t sampleIndex;
+  uint16_t sequence;
+  uint32_t streamPackets, streamLost, streamOverruns;
+  uint8_t streamHigh;
+  bool overrun;
+  bool refused;
+
+  /* usb.c: only the STALLs and the IN refused are modeled */
+  uint32_t usbStalls, usbInBusy;
+  double convStart, convTime;       /* Simulated seconds */
+  unsigned long long convCount, conversions;
+};
+
+/**
+ * PacketTransport - Transfers on top of whole packets
+ *
+ * Asynchronous and synchronous transfers for the transports that get
+ * EP1 IN packets in batches: Fetch() brings at most maxPackets packets,
+ * waiting up to waitMs for the first one.  In ALT_ISO each packet, empty
+ * for an interval with nothing to send, takes a PACKET_BYTES slot of a
+ * transfer, as an isochronous one of UsbTransport.
+ **/
+class PacketTransport : public Transport {
+ public:
+  PacketTransport() : alt(ALT_BULK) {}
+
+  int Bulk(uint8_t endpoint, uint8_t *data, size_t len, unsigned int timeout);
+  int SetInterface(uint8_t alt);
+  int Submit(Transfer *transfer);
+  int Cancel(Transfer *transfer);
+  void HandleEvents(unsigned int timeoutMs);
+
+ protected:
+  virtual int Send(uint8_t endpoint, const uint8_t *data, size_t len) = 0;
+  virtual int Fetch(uint8_t endpoint, unsigned int maxPackets,
+                    std::vector<Packet> &packets, unsigned int waitMs) = 0;
+  void Forget();
+
+ private:
+  bool Take(Transfer *transfer);
+  void Retire(Transfer *transfer);
+
+  std::mutex lock;
+  std::mutex fetching;
+  std::condition_variable wake;
+  std::deque<Transfer *> pending;
+  std::vector<Transfer *> cancels;
+  std::deque<Packet> spill;     /* Fetched, not taken by a transfer yet */
+  uint8_t alt;
+  std::map<Transfer *, std::vector<size_t> > iso;   /* Bytes in each slot */
+};
+
+/**
+ * VirtualTransport - A VirtualDevice in the same process
+ **/
+class VirtualTransport : public PacketTransport {
+ public:
+  explicit VirtualTransport(const VirtualDevice::Options &options = VirtualDevice::Options());
+
+  void Open();
+  void Close();
+  bool IsOpen() const { return open; }
+  int Control(uint8_t requestType, uint8_t request, uint16_t value,
+              uint16_t index, uint8_t *data, uint16_t len, unsigned int timeout);
+
+  VirtualDevice &Model() { return device; }
+
+ protected:
+  int Send(uint8_t endpoint, const uint8_t *data, size_t len);
+  int Fetch(uint8_t endpoint, unsigned int maxPackets,
+            std::vector<Packet> &packets, unsigned int waitMs);
+
+ private:
+  VirtualDevice device;
+  bool open;
+};
+
+/**
+ * Unix socket protocol between SocketTransport and VirtualServer.  Every
+ * request gets one answer, numbers are least significant byte first.
+ *
+ *   request  byte 0      SOCKET_CONTROL, SOCKET_BULK_OUT or SOCKET_BULK_IN
+ *            byte 1      bmRequestType, or the endpoint
+ *            byte 2      bRequest
+ *            byte 4..5   wValue
+ *            byte 6..7   wIndex
+ *            byte 8..11  wLength, bytes sent, or packets wanted (BULK_IN)
+ *            byte 12..15 ms to wait for a packet (BULK_IN)
+ *            byte 16..   data of an OUT control request or of BULK_OUT
+ *
+ *   answer   byte 0..3   bytes or packets, or an ERROR_* code
+ *            byte 4..    data of an IN control request, or the packets,
+ *                        each one its length byte and then its data
+ **/
+const uint8_t SOCKET_CONTROL  = 1;
+const uint8_t SOCKET_BULK_OUT = 2;
+const uint8_t SOCKET_BULK_IN  = 3;
+const size_t  SOCKET_REQUEST_BYTES = 16;
+
+/**
+ * SocketTransport - A VirtualDevice served by another process
+ **/
+class SocketTransport : public PacketTransport {
+ public:
+  explicit SocketTransport(const std::string &path);
+  ~SocketTransport();
+
+  void Open();
+  void Close();
+  bool IsOpen() const { return fd >= 0; }
+  int Control(uint8_t requestType, uint8_t request, uint16_t value,
+              uint16_t index, uint8_t *data, uint16_t len, unsigned int timeout);
+
+ protected:
+  int Send(uint8_t endpoint, const uint8_t *data, size_t len);
+  int Fetch(uint8_t endpoint, unsigned int maxPackets,
+            std::vector<Packet> &packets, unsigned int waitMs);
+
+ private:
+  SocketTransport(const SocketTransport &);
+  SocketTransport &operator=(const SocketTransport &);
+
+  int Call(const uint8_t *request, const uint8_t *out, size_t outLen);
+
+  std::string path;
+  int fd;
+  std::mutex io;
+};
+
+/**
+ * VirtualServer - Serve a VirtualDevice on a Unix socket
+ *
+ * Serve() never returns: clients are taken one at a time, in turn.
+ **/
+class VirtualServer {
+ public:
+  VirtualServer(VirtualDevice &device, const std::string &path);
+  ~VirtualServer();
+
+  void Serve();
+
+ private:
+  VirtualServer(const VirtualServer &);
+  VirtualServer &operator=(const VirtualServer &);
+
+  bool Answer(int client);
+
+  VirtualDevice &device;
+  std::string path;
+  int fd;
+  std::vector<Packet> packets;
+};
+
+} /* namespace picad */
+
+#endif /* PICAD_VIRTUAL_H */
@@ -0,0 +1,245 @@
+/*   adc.c - A/D scan sequencer.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pic18fregs.h>
+#include "usb.h"
+#include "adc.h"
+#include "prof.h"
+
+byte scanCount;
+byte acqtMax = 7;
+byte adcDiv = ADC_DIV;
+
+static byte scanList[ADC_SCAN_MAX];
+static byte scanIndex;
+static byte scanTimed;
+
+/**
+ * Pin of each analog channel: port in the high nibble (0 PORTA, 1 PORTB,
+ * 2 PORTE) and bit in the low nibble (PIC18F4550 datasheet, table 10-1).
+ **/
+static code byte anPin[ADC_MAX_CHANNEL + 1] = {
+  0x00, 0x01, 0x02, 0x03,       /* AN0..AN3  RA0..RA3     */
+  0x05,                         /* AN4       RA5          */
+  0x20, 0x21, 0x22,             /* AN5..AN7  RE0..RE2     */
+  0x12, 0x13, 0x11, 0x14, 0x10  /* AN8..AN12 RB2, RB3, RB1, RB4, RB0 */
+};
+
+/**
+ * Fosc divider of each ADCS code, 0 for the RC clock
+ **/
+static code byte adcsDiv[8] = { 2, 8, 32, 0, 4, 16, 64, 0 };
+
+/**
+ * The scan list used until the host loads one: AN6 only, with the 2 TAD
+ * acquisition time the firmware always had.
+ **/
+static code byte defaultScan[] = { ADC_ENTRY(6, 1) };
+
+/**
+ * AdcInit() -  Set the conversion clock and load the default scan list
+ **/
+void AdcInit(void)
+{
+  AdcSetClock(ADC_ADCS);
+  AdcSetScan((byte *) defaultScan, sizeof(defaultScan));
+}
+
+/**
+ * AdcClockDivider() -  Fosc divider of a conversion clock
+ * @adcs:               ADCS code (ADCON2 bits 2..0)
+ *
+ * Returns 0 if the clock cannot be used: the RC clock, whose TAD is not
+ * known, and dividers that would make TAD too short.
+ **/
+byte AdcClockDivider(byte adcs)
+{
+  if ((adcs > 7) || (adcsDiv[adcs] < ADC_DIV))
+    return 0;
+  return adcsDiv[adcs];
+}
+
+/**
+ * AdcSetClock() -      Select the conversion clock
+ * @adcs:               ADCS code (ADCON2 bits 2..0)
+ *
+ * Returns 0 and keeps the old clock if it cannot be used, see
+ * AdcClockDivider().  Must not be called while a conversion is running.
+ **/
+byte AdcSetClock(byte adcs)
+{
+  byte div;
+
+  div = AdcClockDivider(adcs);
+  if (div == 0)
+    return 0;
+  adcDiv = div;
+  ADCON2 = (ADCON2 & 0xF8) | adcs;
+  return 1;
+}
+
+/**
+ * AdcGetClock() -      ADCS code of the conversion clock
+ **/
+byte AdcGetClock(void)
+{
+  return ADCON2 & 0x07;
+}
+
+/**
+ * AdcSetScan() -       Load a new scan list
+ * @list:               Entries, see ADC_ENTRY()
+ * @count:              Number of entries
+ *
+ * The pins of the listed channels are made inputs and PCFG is set so that
+ * every channel up to the highest one listed is analog; AN0..ANn is the
+ * only choice the hardware offers.  Pins of channels dropped from a
+ * previous list are left as inputs.  Returns 0 and keeps the old list if
+ * the new one is not valid.
+ **/
+byte AdcSetScan(byte *list, byte count)
+{
+  byte i, ch, top, pin, mask;
+
+  if ((count == 0) || (count > ADC_SCAN_MAX))
+    return 0;
+
+  top = 0;
+  for (i = 0; i < count; i++) {
+    ch = ADC_ENTRY_CH(list[i]);
+    if (ch > ADC_MAX_CHANNEL)
+      return 0;
+    if (ch > top)
+      top = ch;
+  }
+
+  for (i = 0; i < count; i++) {
+    scanList[i] = list[i] & 0x7F;
+    pin = anPin[ADC_ENTRY_CH(list[i])];
+    mask = 1 << (pin & 0x0F);
+    if ((pin >> 4) == 0)
+      TRISA |= mask;
+    else if ((pin >> 4) == 1)
+      TRISB |= mask;
+    else
+      TRISE |= mask;
+  }
+  scanCount = count;
+  scanIndex = 0;
+
+  /* Keep VCFG, PCFG = 14 - top leaves AN0..ANtop analog */
+  ADCON1 = (ADCON1 & 0x30) | (14 - top);
+  return 1;
+}
+
+/**
+ * AdcGetScan() -       Copy the scan list
+ * @list:               At least ADC_SCAN_MAX bytes long
+ *
+ * Returns the number of entries.
+ **/
+byte AdcGetScan(byte *list)
+{
+  byte i;
+
+  for (i = 0; i < scanCount; i++)
+    list[i] = scanList[i];
+  return scanCount;
+}
+
+/**
+ * AdcSelect() -        Set up the A/D module for one scan list entry
+ * @index:              Position in the scan list
+ *
+ * Must not be called while a conversion is running.
+ **/
+void AdcSelect(byte index)
+{
+  byte e = scanList[index];
+  byte acqt = ADC_ENTRY_ACQT(e);
+
+  if (acqt > acqtMax)
+    acqt = acqtMax;
+  ADCON0 = (ADCON0 & 0x03) | (ADC_ENTRY_CH(e) << 2);
+  ADCON2 = (ADCON2 & 0xC7) | (acqt << 3);
+}
+
+/**
+ * AdcConvert() -       Blocking conversion of the selected channel
+ *
+ * The module must be on (ADON).  Returns the right justified result.
+ **/
+word AdcConvert(void)
+{
+  PROF_START(PROF_ADC);
+  ADCON0bits.GO = 1;
+  while (ADCON0bits.GO);
+  PROF_STOP(PROF_ADC);
+  return ((word) ADRESH << 8) | ADRESL;
+}
+
+/**
+ * AdcScanStart() -     Start converting the scan list round-robin
+ * @timed:              Non zero if the conversions are started by the
+ *                      CCP2 special event trigger (see rate.c), otherwise
+ *                      each one is started as soon as the last finishes
+ **/
+void AdcScanStart(byte timed)
+{
+  scanIndex = 0;
+  scanTimed = timed;
+  AdcSelect(0);
+  PIR1bits.ADIF = 0;
+  ADCON0bits.ADON = 1;
+  if (!timed)
+    ADCON0bits.GO = 1;
+}
+
+/**
+ * AdcScanPoll() -      Collect a finished conversion
+ * @sample:             Where the tagged result goes
+ *
+ * Never waits: returns 0 if no conversion has finished.  Otherwise the
+ * result is tagged (ADC_TAG()), the next entry of the list selected and,
+ * unless the trigger does it, its conversion started, and 1 is returned.
+ * The result must be collected within one sample period.
+ **/
+byte AdcScanPoll(word *sample)
+{
+  if (!PIR1bits.ADIF)
+    return 0;
+  PIR1bits.ADIF = 0;
+
+  *sample = ((word) ADRESH << 8) | ADRESL | ((word) scanIndex << 12);
+  if (++scanIndex == scanCount)
+    scanIndex = 0;
+  if (scanCount > 1)
+    AdcSelect(scanIndex);
+  if (!scanTimed)
+    ADCON0bits.GO = 1;
+  return 1;
+}
+
+/**
+ * AdcScanStop() -      Let the last conversion finish and power down
+ **/
+void AdcScanStop(void)
+{
+  while (ADCON0bits.GO);
+  ADCON0bits.ADON = 0;
+}
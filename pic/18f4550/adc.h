@@ -0,0 +1,118 @@
+/*   adc.h - A/D scan sequencer.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ADC_H
+#define ADC_H
+
+/**
+ * Command sent by the host as the first byte of an EP1 OUT packet to load
+ * a new scan list (only while not streaming):
+ *
+ *   byte 0      ADC_SCAN_LIST
+ *   byte 1      number of entries (1..ADC_SCAN_MAX)
+ *   byte 2..    one byte per entry, see ADC_ENTRY()
+ *
+ * A list that is too long or names a channel above AN12 is ignored.
+ **/
+#define ADC_SCAN_LIST 'L'
+
+/**
+ * Scan list entry: channel (AN0..AN12) in bits 3..0 and the acquisition
+ * time (ADCON2 ACQT, 0..7) used for it in bits 6..4.
+ **/
+#define ADC_ENTRY(ch, acqt)  ((ch) | ((acqt) << 4))
+#define ADC_ENTRY_CH(e)      ((e) & 0x0F)
+#define ADC_ENTRY_ACQT(e)    (((e) >> 4) & 0x07)
+
+#define ADC_MAX_CHANNEL 12
+#define ADC_SCAN_MAX    16
+
+/**
+ * Oscillator frequency set by the fuses in main.c (96 MHz PLL / 2)
+ **/
+#ifndef FOSC
+#define FOSC 48000000UL
+#endif
+#define FCY  (FOSC / 4)          /* Instruction cycles per second */
+
+/**
+ * Default conversion clock: the fastest Fosc divider that keeps TAD above
+ * the 0.7 us minimum (PIC18F4550 datasheet, table 21-1), and its ADCS
+ * code.  The host may pick a slower one, see AdcSetClock().
+ **/
+#if FOSC <= 2857000UL
+#define ADC_DIV   2
+#define ADC_ADCS  0
+#elif FOSC <= 5714000UL
+#define ADC_DIV   4
+#define ADC_ADCS  4
+#elif FOSC <= 11428000UL
+#define ADC_DIV   8
+#define ADC_ADCS  1
+#elif FOSC <= 22857000UL
+#define ADC_DIV   16
+#define ADC_ADCS  5
+#elif FOSC <= 45714000UL
+#define ADC_DIV   32
+#define ADC_ADCS  2
+#else
+#define ADC_DIV   64
+#define ADC_ADCS  6
+#endif
+
+/**
+ * Instruction cycles taken by n TAD
+ **/
+#define ADC_TAD_CYCLES(n) (((unsigned long) (n) * adcDiv + 3) / 4)
+
+/**
+ * Results are tagged with the position in the scan list of the entry that
+ * produced them, in the bits above the 10 bit result.
+ **/
+#define ADC_TAG(s)      ((byte) ((s) >> 12))
+#define ADC_VALUE(s)    ((s) & 0x03FF)
+
+/**
+ * Number of entries in the scan list
+ **/
+extern byte scanCount;
+
+/**
+ * Longest ACQT any entry may use, lowered by the sample rate engine so
+ * that a conversion fits in the sample period
+ **/
+extern byte acqtMax;
+
+/**
+ * Fosc divider selected by ADCS
+ **/
+extern byte adcDiv;
+
+void AdcInit(void);
+byte AdcSetScan(byte *list, byte count);
+byte AdcGetScan(byte *list);
+byte AdcClockDivider(byte adcs);
+byte AdcSetClock(byte adcs);
+byte AdcGetClock(void);
+void AdcSelect(byte index);
+word AdcConvert(void);
+void AdcScanStart(byte timed);
+byte AdcScanPoll(word *sample);
+void AdcScanStop(void);
+
+#endif /* ADC_H */
@@ -0,0 +1,183 @@
+/*   copy.c - Copy kernels for the USB data paths.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * The operands go through static variables, read with MOVFF, so the
+ * assembly does not depend on how SDCC passes arguments or which bank
+ * they are in.  The count is kept in WREG, which neither MOVFF nor TBLRD
+ * touch.  FSR1 is the SDCC stack pointer and is left alone; FSR2 is saved
+ * and put back.
+ *
+ * Instruction cycles, counted by hand from the listings below (n = 8 *
+ * blocks + rest).  They are estimates: the kernels have not been timed.
+ *
+ *   CopyRam()   COPY_CALL + 27 + 5 * rest + 19 * blocks
+ *   CopyCode()  COPY_CALL + 21 + 7 * rest + 35 * blocks
+ *
+ * COPY_CALL is the call, the arguments and the C part, guessed at 30.
+ * The generic pointer loop they replace is put at about 60 a byte, from
+ * the cost of __gptrget1() and __gptrput1().  The host build copies in C
+ * and hands these estimates to the simulator, which adds them up next to
+ * the estimate for the generic loop.  On a board, only the InDataStage
+ * probe of a PROFILE build (fwprof) has a copy in it, with the rest of
+ * the stage around it: the stream builds its packets in place.
+ **/
+
+#include <pic18fregs.h>
+#include "usb.h"
+#include "copy.h"
+
+#if defined(SIM)
+
+#define COPY_CALL           30
+#define COPY_RAM_CYCLES(n)  (COPY_CALL + 27 + 5 * ((n) & 7) + 19 * ((n) >> 3))
+#define COPY_CODE_CYCLES(n) (COPY_CALL + 21 + 7 * ((n) & 7) + 35 * ((n) >> 3))
+#define COPY_GENERIC(n)     (10 + 60 * (n))
+
+void CopyRam(byte *dst, const byte *src, byte n)
+{
+  byte i;
+
+  for (i = 0; i < n; i++)
+    dst[i] = src[i];
+  sim_copy(n, COPY_RAM_CYCLES(n), COPY_GENERIC(n));
+}
+
+void CopyCode(byte *dst, code byte *src, byte n)
+{
+  byte i;
+
+  for (i = 0; i < n; i++)
+    dst[i] = src[i];
+  sim_copy(n, COPY_CODE_CYCLES(n), COPY_GENERIC(n));
+}
+
+#else
+
+static word copyDst;
+static word copySrc;
+static byte copySrcU;
+static byte copyCount;
+static word copySave;
+
+/**
+ * CopyRam() -  Copy data memory
+ * @dst:        Destination
+ * @src:        Source
+ * @n:          Number of bytes
+ **/
+void CopyRam(byte *dst, const byte *src, byte n)
+{
+  copyDst = PTR16(dst);
+  copySrc = PTR16(src);
+  copyCount = n;
+  __asm
+        movff   _FSR2L, _copySave
+        movff   _FSR2H, _copySave + 1
+        movff   _copySrc, _FSR0L
+        movff   _copySrc + 1, _FSR0H
+        movff   _copyDst, _FSR2L
+        movff   _copyDst + 1, _FSR2H
+        movff   _copyCount, _WREG
+        andlw   0x07
+        bz      copy_ram_blocks
+copy_ram_byte:
+        movff   _POSTINC0, _POSTINC2
+        decfsz  _WREG, 1, 0
+        bra     copy_ram_byte
+copy_ram_blocks:
+        movff   _copyCount, _WREG
+        rrncf   _WREG, 1, 0
+        rrncf   _WREG, 1, 0
+        rrncf   _WREG, 1, 0
+        andlw   0x1f
+        bz      copy_ram_done
+copy_ram_block:
+        movff   _POSTINC0, _POSTINC2
+        movff   _POSTINC0, _POSTINC2
+        movff   _POSTINC0, _POSTINC2
+        movff   _POSTINC0, _POSTINC2
+        movff   _POSTINC0, _POSTINC2
+        movff   _POSTINC0, _POSTINC2
+        movff   _POSTINC0, _POSTINC2
+        movff   _POSTINC0, _POSTINC2
+        decfsz  _WREG, 1, 0
+        bra     copy_ram_block
+copy_ram_done:
+        movff   _copySave, _FSR2L
+        movff   _copySave + 1, _FSR2H
+  __endasm;
+}
+
+/**
+ * CopyCode() - Copy program memory to data memory
+ * @dst:        Destination
+ * @src:        Source, in program memory
+ * @n:          Number of bytes
+ **/
+void CopyCode(byte *dst, code byte *src, byte n)
+{
+  copyDst = PTR16(dst);
+  copySrc = (word) (unsigned long) src;
+  copySrcU = (byte) ((unsigned long) src >> 16);
+  copyCount = n;
+  __asm
+        movff   _copySrc, _TBLPTRL
+        movff   _copySrc + 1, _TBLPTRH
+        movff   _copySrcU, _TBLPTRU
+        movff   _copyDst, _FSR0L
+        movff   _copyDst + 1, _FSR0H
+        movff   _copyCount, _WREG
+        andlw   0x07
+        bz      copy_code_blocks
+copy_code_byte:
+        tblrd*+
+        movff   _TABLAT, _POSTINC0
+        decfsz  _WREG, 1, 0
+        bra     copy_code_byte
+copy_code_blocks:
+        movff   _copyCount, _WREG
+        rrncf   _WREG, 1, 0
+        rrncf   _WREG, 1, 0
+        rrncf   _WREG, 1, 0
+        andlw   0x1f
+        bz      copy_code_done
+copy_code_block:
+        tblrd*+
+        movff   _TABLAT, _POSTINC0
+        tblrd*+
+        movff   _TABLAT, _POSTINC0
+        tblrd*+
+        movff   _TABLAT, _POSTINC0
+        tblrd*+
+        movff   _TABLAT, _POSTINC0
+        tblrd*+
+        movff   _TABLAT, _POSTINC0
+        tblrd*+
+        movff   _TABLAT, _POSTINC0
+        tblrd*+
+        movff   _TABLAT, _POSTINC0
+        tblrd*+
+        movff   _TABLAT, _POSTINC0
+        decfsz  _WREG, 1, 0
+        bra     copy_code_block
+copy_code_done:
+  __endasm;
+}
+
+#endif
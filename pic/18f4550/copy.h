@@ -0,0 +1,49 @@
+/*   copy.h - Copy kernels for the USB data paths.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COPY_H
+#define COPY_H
+
+/**
+ * A '*d++ = *s++' loop over SDCC generic pointers calls __gptrget1() and
+ * __gptrput1() for every byte, which test the address space each time.
+ * The caller of these knows where its source is and picks the kernel for
+ * it:
+ *
+ *   CopyRam()  data memory to data memory, FSR0 to FSR2 with POSTINC
+ *   CopyCode() program memory to data memory, TBLRD*+ into FSR0
+ *
+ * Both move the odd bytes one at a time, then 8 bytes per loop pass.
+ * n may be 0.
+ *
+ * The kernel is named where the source is known, except in the data
+ * stage of a control transfer: GetDescriptor() knows, but the copy is
+ * made packet by packet in InDataStage(), on later IN tokens, so it sets
+ * outCode (usb.h) for InDataStage() to test.  There are no fixed size
+ * variants: a 64 byte packet is 8 passes of the unrolled loop, and
+ * unrolling the rest would save 24 of the about 210 estimated cycles of
+ * CopyRam() for a few hundred bytes of code per kernel.
+ *
+ * Neither is reentrant: their operands are static (copy.c).  The data
+ * stages copy from the USB interrupt with USB_INTERRUPT, so a copy made
+ * anywhere else holds USBLock() around it, as BulkOut() does.
+ **/
+void CopyRam(byte *dst, const byte *src, byte n);
+void CopyCode(byte *dst, code byte *src, byte n);
+
+#endif /* COPY_H */
@@ -0,0 +1,122 @@
+/*   decim.c - Decimation of the A/D results before streaming.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pic18fregs.h>
+#include "usb.h"
+#include "adc.h"
+#include "decim.h"
+
+byte decimMode = DECIM_OFF;
+byte decimFactor = 1;
+
+/**
+ * The scan list is converted round-robin, so every entry gets its N-th
+ * conversion in the same round: one round counter is enough, and the
+ * decimated samples come out as whole rounds in scan order.
+ **/
+static word decimSum[ADC_SCAN_MAX];
+static byte decimRound;
+static byte decimShift;         /* DECIM_OVERSAMPLE: k */
+
+/**
+ * DecimFactor() -      Conversions behind each sample of a decimation
+ * @mode:               DECIM_*
+ * @arg:                N, or k for DECIM_OVERSAMPLE (see decim.h)
+ *
+ * Returns N, or 0 if the arguments are out of range.
+ **/
+byte DecimFactor(byte mode, byte arg)
+{
+  if (mode == DECIM_OFF)
+    return 1;
+  if (mode == DECIM_OVERSAMPLE)
+    return ((arg == 0) || (arg > DECIM_MAX_BITS)) ? 0 : 1 << (2 * arg);
+  if ((mode > DECIM_OVERSAMPLE) || (arg > DECIM_MAX_FACTOR))
+    return 0;
+  return arg;
+}
+
+/**
+ * DecimSet() - Select the decimation
+ * @mode:       DECIM_*
+ * @arg:        N, or k for DECIM_OVERSAMPLE (see decim.h)
+ *
+ * Returns 0 and keeps the old setting if the arguments are out of range.
+ * Must not be called while streaming.
+ **/
+byte DecimSet(byte mode, byte arg)
+{
+  byte n;
+
+  n = DecimFactor(mode, arg);
+  if (n == 0)
+    return 0;
+  decimMode = mode;
+  decimFactor = n;
+  decimShift = arg;
+  DecimReset();
+  return 1;
+}
+
+/**
+ * DecimReset() - Forget the partial sums, the next round starts afresh
+ **/
+void DecimReset(void)
+{
+  byte i;
+
+  for (i = 0; i < ADC_SCAN_MAX; i++)
+    decimSum[i] = 0;
+  decimRound = 0;
+}
+
+/**
+ * DecimPut() - Add a conversion to the sum of its scan list entry
+ * @pos:        Position in the scan list
+ * @sample:     A/D result, replaced by the decimated sample
+ *
+ * Returns 1 when *sample is ready to be queued, 0 while the sum is still
+ * building up.  With DECIM_OFF every result is passed on untouched.
+ **/
+byte DecimPut(byte pos, word *sample)
+{
+  word sum;
+  byte last;
+
+  if (decimMode == DECIM_OFF) {
+    *sample = ADC_VALUE(*sample);
+    return 1;
+  }
+
+  sum = decimSum[pos] + ADC_VALUE(*sample);
+  last = (decimRound == decimFactor - 1);
+  if (pos == scanCount - 1)
+    decimRound = last ? 0 : decimRound + 1;
+  if (!last) {
+    decimSum[pos] = sum;
+    return 0;
+  }
+  decimSum[pos] = 0;
+
+  if (decimMode == DECIM_BOXCAR)
+    sum = sum / decimFactor;
+  else if (decimMode == DECIM_OVERSAMPLE)
+    sum = sum >> decimShift;
+  *sample = sum;
+  return 1;
+}
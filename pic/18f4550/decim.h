@@ -0,0 +1,56 @@
+/*   decim.h - Decimation of the A/D results before streaming.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DECIM_H
+#define DECIM_H
+
+/**
+ * Every scan list entry can be decimated by N before it is queued, which
+ * trades bandwidth for resolution on slow signals.  The decimated samples
+ * are 16 bits wide and go out in STREAM_WORD16 packets (stream.h).
+ *
+ *   DECIM_OFF          raw 10 bit conversions, STREAM_PACKED10 packets
+ *   DECIM_BOXCAR       average of N conversions (N = 1..64), 10 bits
+ *   DECIM_CIC          integrate and dump, a one stage CIC: the sum of N
+ *                      conversions (N = 1..64), gain N, up to 16 bits
+ *   DECIM_OVERSAMPLE   4^k conversions summed and shifted right by k
+ *                      (k = 1..3, N = 4, 16 or 64), 10 + k bits
+ *
+ * Set with VR_SET_DECIM (vendor.h), wValue is the mode and wIndex N, or k
+ * for DECIM_OVERSAMPLE.
+ **/
+#define DECIM_OFF         0
+#define DECIM_BOXCAR      1
+#define DECIM_CIC         2
+#define DECIM_OVERSAMPLE  3
+
+#define DECIM_MAX_FACTOR  64    /* 64 * 1023 still fits in 16 bits */
+#define DECIM_MAX_BITS    3
+
+/**
+ * Mode in use and the number of conversions behind each sample
+ **/
+extern byte decimMode;
+extern byte decimFactor;
+
+byte DecimFactor(byte mode, byte arg);
+byte DecimSet(byte mode, byte arg);
+void DecimReset(void);
+byte DecimPut(byte pos, word *sample);
+
+#endif /* DECIM_H */
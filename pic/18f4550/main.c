@@ -19,6 +19,13 @@
 #include <pic18fregs.h>
 #include <stdio.h>
 #include "usb.h"
+#include "stream.h"
+#include "adc.h"
+#include "rate.h"
+#include "vendor.h"
+#include "decim.h"
+#include "serial.h"
+#include "prof.h"
 
 /**
  *
@@ -56,11 +63,6 @@ code char at 0x30000C CONFIG7L = 0xff;	/* No table read protection      */
 code char at 0x30000D CONFIG7H = 0xff;	/* No boot table protection      */
 #endif
 
-/**
- * Buffers for Enpoint 1 (Data bus)
- **/
-volatile byte rxBuffer[OUTPUT_BYTES];
-volatile byte txBuffer[INPUT_BYTES];
 //unsigned int adval; //ADC Value
 char adval; //ADC Value
 
@@ -190,35 +192,353 @@ void print_line(byte * p, byte * e)
 }
 
 /**
- * USB(void) -  Main function to process usb transactions      
+ * ReplyBuffer() -      Wait for an EP1 IN buffer to write an answer in
+ *
+ * The answer is written in place and sent with BulkInCommit().
  **/
+static byte *ReplyBuffer(void)
+{
+  byte *buffer;
 
-static void USB(void)
+  do {
+    buffer = BulkInLease(1);
+  } while (buffer == 0);
+  return buffer;
+}
+
+/**
+ * Sample() -   Blocking conversion of every channel in the scan list
+ *
+ * Used for the one sample per request protocol: the answer has 2 bytes
+ * (high, low) per scan list entry, in list order.
+ **/
+static void Sample(void)
 {
-  byte rxCnt;
-  //byte tmpBuff;
-  rxCnt = BulkOut(1, rxBuffer, INPUT_BYTES);
-  if (rxCnt == 0)
-    return;
+  byte i, n;
+  byte *reply;
+  word value;
 
+  reply = ReplyBuffer();
   ADCON0bits.ADON=1;  //switch on the adc module
-  ADCON0bits.GO=1;//Start conversion
-  while(ADCON0bits.GO); //wait for the conversion to finish
+  n = 0;
+  for (i = 0; i < scanCount; i++) {
+    AdcSelect(i);
+    value = AdcConvert();
+    reply[n++] = (byte) (value >> 8);
+    reply[n++] = (byte) value;
+  }
   ADCON0bits.ADON=0;  //switch off adc
 
-  //tmpBuff = (byte) ADRESH;
-  txBuffer[0] = (byte) ADRESH;
-  txBuffer[1] = (byte) ADRESL;
+  BulkInCommit(1, n);
+  status();
+}
 
-  do {
-    //rxCnt = BulkIn(1, &tmpBuff, 1);
-    rxCnt = BulkIn(1, txBuffer, 2);
-  } while (rxCnt == 0); 
-  
-  while (ep1Bi.Stat & UOWN)
-    ProcessUSBTransactions();
+/**
+ * Acquire() -  Keep the A/D module scanning while streaming
+ *
+ * Never waits: a finished conversion is queued and the next one started,
+ * otherwise it returns straight away.
+ **/
+static void Acquire(void)
+{
+  word sample;
+  byte pos;
 
-  status();
+  if (AdcScanPoll(&sample)) {
+    PROF_START(PROF_SAMPLE);
+    pos = ADC_TAG(sample);
+    if (DecimPut(pos, &sample))
+      StreamPut(pos, sample);
+    PROF_STOP(PROF_SAMPLE);
+  }
+}
+
+/**
+ * Start() -    Start streaming the scan list
+ **/
+static void Start(void)
+{
+  StreamStart();
+  DecimReset();
+  AdcScanStart(rateCycles != 0);    /* Results are queued by Acquire() */
+  RateStart();
+}
+
+/**
+ * Stop() -     Stop streaming
+ **/
+static void Stop(void)
+{
+  StreamStop();
+  RateStop();
+  AdcScanStop();
+}
+
+/**
+ * Command() -  Act on a packet received on EP1 OUT
+ * @cmd:        The packet, still in the dual port RAM
+ * @len:        Bytes received
+ **/
+static void Command(byte *cmd, byte len)
+{
+  byte *reply;
+
+  if (cmd[0] == STREAM_START)
+    Start();
+  else if (cmd[0] == STREAM_STOP)
+    Stop();
+  else if (cmd[0] == RATE_SET) {
+    if (!streaming && (len >= 5)) {
+      RateSet(((unsigned long) cmd[4] << 24) |
+              ((unsigned long) cmd[3] << 16) |
+              ((unsigned long) cmd[2] << 8) | cmd[1]);
+      reply = ReplyBuffer();
+      BulkInCommit(1, RateReport(reply));
+    }
+  }
+  else if (cmd[0] == ADC_SCAN_LIST) {
+    if (!streaming && (len >= 2) && (cmd[1] <= len - 2))
+      AdcSetScan(&cmd[2], cmd[1]);
+  }
+  else if (!streaming)
+    Sample();
+}
+
+/**
+ * Vendor requests (vendor.h) are answered from the control transfer code,
+ * which may run in the interrupt.  The ones that change the acquisition
+ * are only recorded there and carried out by VendorApply() from the main
+ * loop, so they never cut into Acquire() or StreamService().
+ **/
+#define VENDOR_RATE   0x01
+#define VENDOR_SCAN   0x02
+#define VENDOR_CLOCK  0x04
+#define VENDOR_DECIM  0x08
+#define VENDOR_SERIAL 0x10              /* Not an acquisition setting */
+#define VENDOR_ALT    0x20              /* SET_INTERFACE, see RateSet()  */
+
+static byte vendorBuffer[VR_BUFFER_BYTES];
+static byte vendorScan[ADC_SCAN_MAX];
+static byte vendorSerial[SERIAL_MAX];
+static volatile byte vendorPending;  /* VENDOR_* settings to apply       */
+static volatile byte vendorRun;      /* VR_START, VR_STOP or 0           */
+static unsigned long vendorRate;
+static byte vendorScanCount;
+static byte vendorSerialLen;
+static byte vendorClock;
+static byte vendorDecimMode;
+static byte vendorDecimArg;
+static byte vendorAlt;               /* Setting the rate was set for     */
+
+/**
+ * VendorLong() -       Store a 32 bit number, least significant byte first
+ **/
+static void VendorLong(byte *buffer, unsigned long value)
+{
+  byte i;
+
+  for (i = 0; i < 4; i++)
+    buffer[i] = (byte) (value >> (8 * i));
+}
+
+/**
+ * ProcessVendorRequest() -     Set up the data stage of a vendor request
+ *
+ * Called by the control transfer code, see usb.h.
+ **/
+byte ProcessVendorRequest(void)
+{
+  byte request = SetupPacket.bRequest;
+  byte in = SetupPacket.bmRequestType & 0x80;
+
+  if ((SetupPacket.bmRequestType & 0x1F) != 0)   /* Recipient: device */
+    return 0;
+
+  if (in) {
+    if (request == VR_GET_RATE)
+      wCount = RateReport(vendorBuffer);
+    else if (request == VR_GET_SCAN)
+      wCount = AdcGetScan(vendorBuffer);
+    else if (request == VR_GET_ADC_CLOCK) {
+      vendorBuffer[0] = AdcGetClock();
+      vendorBuffer[1] = adcDiv;
+      wCount = 2;
+    }
+    else if (request == VR_GET_COUNTERS) {
+      VendorLong(vendorBuffer, streamPackets);
+      VendorLong(vendorBuffer + 4, streamLost);
+      VendorLong(vendorBuffer + 8, streamOverruns);
+      VendorLong(vendorBuffer + 12, usbInBusy);
+      VendorLong(vendorBuffer + 16, usbStalls);
+      VendorLong(vendorBuffer + 20, usbResets);
+      VendorLong(vendorBuffer + 24, usbSuspends);
+      VendorLong(vendorBuffer + 28, usbErrors);
+      vendorBuffer[32] = usbErrorBits;
+      vendorBuffer[33] = streamHigh;
+      if (SetupPacket.wValue0 & 1)
+        streamHigh = 0;
+      wCount = VR_COUNTERS_BYTES;
+    }
+    else if (request == VR_GET_DECIM) {
+      vendorBuffer[0] = decimMode;
+      vendorBuffer[1] = decimFactor;
+      wCount = 2;
+    }
+#if defined(PROFILE)
+    else if (request == VR_GET_PROFILE) {
+      if (SetupPacket.wIndex1 != 0)
+        return 0;
+      wCount = ProfReport(SetupPacket.wIndex0, SetupPacket.wValue0 & 1,
+                          vendorBuffer);
+      if (wCount == 0)
+        return 0;
+    }
+#endif
+    else
+      return 0;
+    outPtr = vendorBuffer;
+    return 1;
+  }
+
+  if (request == VR_SET_SCAN) {
+    if ((SetupPacket.wLength == 0) || (SetupPacket.wLength > ADC_SCAN_MAX))
+      return 0;
+    inPtr = vendorScan;
+    return 1;
+  }
+  if (request == VR_SET_SERIAL) {
+    if ((SetupPacket.wLength == 0) || (SetupPacket.wLength > SERIAL_MAX))
+      return 0;
+    inPtr = vendorSerial;
+    return 1;
+  }
+  if (SetupPacket.wLength != 0)
+    return 0;
+
+  if (request == VR_SET_RATE) {
+    vendorRate = ((unsigned long) SetupPacket.wIndex1 << 24) |
+                 ((unsigned long) SetupPacket.wIndex0 << 16) |
+                 ((word) SetupPacket.wValue1 << 8) | SetupPacket.wValue0;
+    vendorPending |= VENDOR_RATE;
+  }
+  else if (request == VR_SET_ADC_CLOCK) {
+    if ((SetupPacket.wValue1 != 0) ||
+        (AdcClockDivider(SetupPacket.wValue0) == 0))
+      return 0;
+    vendorClock = SetupPacket.wValue0;
+    vendorPending |= VENDOR_CLOCK;
+  }
+  else if (request == VR_SET_DECIM) {
+    if ((SetupPacket.wValue1 != 0) || (SetupPacket.wIndex1 != 0) ||
+        (DecimFactor(SetupPacket.wValue0, SetupPacket.wIndex0) == 0))
+      return 0;
+    vendorDecimMode = SetupPacket.wValue0;
+    vendorDecimArg = SetupPacket.wIndex0;
+    vendorPending |= VENDOR_DECIM;
+  }
+  else if ((request == VR_START) || (request == VR_STOP))
+    vendorRun = request;
+  else
+    return 0;
+  return 1;
+}
+
+/**
+ * VendorDataReceived() -       The data stage of VR_SET_SCAN or
+ *                              VR_SET_SERIAL is complete
+ **/
+void VendorDataReceived(void)
+{
+  if (SetupPacket.bRequest == VR_SET_SCAN) {
+    vendorScanCount = (byte) SetupPacket.wLength;
+    vendorPending |= VENDOR_SCAN;
+  }
+  else if (SetupPacket.bRequest == VR_SET_SERIAL) {
+    vendorSerialLen = (byte) SetupPacket.wLength;
+    vendorPending |= VENDOR_SERIAL;
+  }
+}
+
+/**
+ * VendorApply() -      Carry out the vendor requests received
+ *
+ * Settings changed while streaming restart the acquisition, the first
+ * packet after the change has STREAM_RESTART set.
+ **/
+static void VendorApply(void)
+{
+  byte pending, run;
+
+  USBLock();
+  pending = vendorPending;
+  run = vendorRun;
+  vendorPending = 0;
+  vendorRun = 0;
+  if (vendorAlt != currentAltSetting) {
+    vendorAlt = currentAltSetting;
+    pending |= VENDOR_ALT;
+  }
+  USBUnlock();
+
+  if (run == VR_STOP)
+    Stop();
+
+  if (pending & VENDOR_SERIAL) {
+    SerialSet(vendorSerial, vendorSerialLen);
+    pending &= ~VENDOR_SERIAL;
+  }
+
+  if (pending) {
+    if (streaming) {
+      RateStop();
+      AdcScanStop();
+    }
+    if (pending & VENDOR_SCAN)
+      AdcSetScan(vendorScan, vendorScanCount);
+    if (pending & VENDOR_CLOCK)
+      AdcSetClock(vendorClock);
+    if (pending & VENDOR_RATE)
+      RateSet(vendorRate);
+    else if (pending & (VENDOR_CLOCK | VENDOR_ALT))
+      RateSet(rateHz);              /* The shortest period depends on TAD,
+                                       the longest one on the setting */
+    if (pending & VENDOR_DECIM)
+      DecimSet(vendorDecimMode, vendorDecimArg);
+    if (streaming) {
+      StreamRestart();
+      DecimReset();
+      AdcScanStart(rateCycles != 0);
+      RateStart();
+    }
+  }
+
+  if (run == VR_START)
+    Start();
+}
+
+/**
+ * USB(void) -  Main function to process usb transactions      
+ **/
+
+static void USB(void)
+{
+  byte len;
+  byte *cmd;
+
+  if (vendorPending || vendorRun || (vendorAlt != currentAltSetting))
+    VendorApply();
+
+  cmd = BulkOutLease(1, &len);
+  if (cmd != 0) {
+    if (len != 0)
+      Command(cmd, len);
+    BulkOutRelease(1);
+  }
+
+  if (streaming) {
+    Acquire();
+    StreamService();
+  }
 }
 
 
@@ -236,20 +556,35 @@ void ProcessIO(void)
   USB();
 }
 
+#if defined(USB_INTERRUPT)
+/**
+ * HighPriorityISR() -  High priority interrupt vector
+ *
+ * Only the USB module is given high priority, so control transfers and
+ * the bulk endpoints are serviced however long the main loop takes.
+ * USBIF is cleared first: an event that comes in while the transactions
+ * are processed raises it again.
+ **/
+void HighPriorityISR(void) ISR_HIGH
+{
+  if (PIR2bits.USBIF) {
+    PIR2bits.USBIF = 0;
+    ProcessUSBTransactions();
+  }
+}
 
-//Function to Read given ADC channel (0-13)
-unsigned int ADCRead(unsigned char ch)
+/**
+ * EnableUSBInterrupt() -       Route the USB module to HighPriorityISR()
+ **/
+static void EnableUSBInterrupt(void)
 {
-  if(ch>13) return 0;  //Invalid Channel
-  
-  ADCON0=0x00;
-  ADCON0=(ch<<2);   //Select ADC Channel
-  ADCON0bits.ADON=1;  //switch on the adc module
-  ADCON0bits.GO=1;//Start conversion
-  while(ADCON0bits.GO); //wait for the conversion to finish
-  ADCON0bits.ADON=0;  //switch off adc
-  return ADRESH;
+  RCONbits.IPEN = 1;          /* Two interrupt priorities             */
+  IPR2bits.USBIP = 1;         /* USB at high priority                 */
+  PIR2bits.USBIF = 0;
+  PIE2bits.USBIE = 1;
+  INTCONbits.GIEH = 1;
 }
+#endif
 
 /**
  * main(void) - Main entry point of the firmware
@@ -265,41 +600,57 @@ void main(void)
   /**
    * Inits the USB
    *
-   * Full-speed mode and sets pull-up internal resistances of PORTB
+   * Full-speed mode and sets pull-up internal resistances of PORTB,
+   * ping-pong buffers on every endpoint but EP0.
    * Starts the USB DEATACHED, no wake ups, and no configured.
    * Configuring the USB is the job of the host.
    **/
-  UCFG = 0x14;
+  UCFG = 0x14 | UCFG_PPB;
   deviceState = DETACHED;
   remoteWakeup = 0x00;
   currentConfiguration = 0x00;
   
   adval = 'b';
 
+  /**
+   * A/D off, the channels come from the scan list (AN6 until the host
+   * loads another one)
+   **/
   ADCON0=0x00;
-  ADCON0bits.CHS0=0;   //Select ADC Channel
-  ADCON0bits.CHS1=1;   //Select ADC Channel
-  ADCON0bits.CHS2=1;   //Select ADC Channel
-  ADCON0bits.CHS3=0;   //Select ADC Channel
+  AdcInit();
+
+  /**
+   * Serial number string descriptor, from the EEPROM
+   **/
+  SerialLoad();
+
+#if defined(PROFILE)
+  ProfInit();
+#endif
+#if defined(USB_INTERRUPT)
+  EnableUSBInterrupt();
+#endif
   
   while (1) {
     /** 
      * Make sure the USB is available 
      **/
     EnableUSBModule();
+#if !defined(USB_INTERRUPT)
     /**
      * As soon as we get out of test mode (UTEYE)
      * we process USB transactions
      **/
     if (UCFGbits.UTEYE != 1)
       ProcessUSBTransactions();
+#endif
     
     /**
      * Now we can make our work
      **/
     ProcessIO();
+    SerialService();
     
-    //adval=ADCRead(7);   //Read Channel 7
     //delay(100);
 
     //status();
@@ -0,0 +1,147 @@
+/*   prof.c - Cycle counts of the hot paths, for profiling builds.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Timer1 counts instruction cycles from ProfInit() on and is never written
+ * again, so any number of probes can read it.  With RD16 set, reading
+ * TMR1L latches TMR1H, and the two make one consistent 16 bit count
+ * (PIC18F4550 datasheet, section 12.2).  The USB interrupt is kept out
+ * while a probe reads the timer or updates its counts: it has probes of
+ * its own, and its TMR1L read would load the latch again.
+ **/
+
+#include <pic18fregs.h>
+#include "usb.h"
+#include "prof.h"
+
+#define T1CON_RUN 0x81          /* RD16, Fosc/4, no prescaler, TMR1ON */
+
+typedef struct {
+  unsigned long calls;
+  unsigned long total;
+  word min;
+  word max;
+  word start;                   /* Timer1 at PROF_START() */
+} ProfProbe;
+
+static ProfProbe probes[PROF_PROBES];
+
+/**
+ * Now() -      Timer1 count
+ **/
+static word Now(void)
+{
+  word t;
+
+  t = TMR1L;                    /* Latches TMR1H */
+  t |= (word) TMR1H << 8;
+  return t;
+}
+
+/**
+ * Clear() -    Forget what a probe has seen
+ **/
+static void Clear(ProfProbe *p)
+{
+  p->calls = 0;
+  p->total = 0;
+  p->min = 0xFFFF;
+  p->max = 0;
+}
+
+/**
+ * ProfInit() - Start Timer1, clear every probe and measure PROF_EMPTY
+ **/
+void ProfInit(void)
+{
+  byte i;
+
+  for (i = 0; i < PROF_PROBES; i++)
+    Clear(&probes[i]);
+  T1CON = T1CON_RUN;
+  for (i = 0; i < PROF_CALIBRATE; i++) {
+    ProfStart(PROF_EMPTY);
+    ProfStop(PROF_EMPTY);
+  }
+}
+
+/**
+ * ProfStart() -        Note the time a probe is entered
+ * @probe:              PROF_*
+ **/
+void ProfStart(byte probe)
+{
+  byte ie;
+
+  ie = PIE2bits.USBIE;
+  PIE2bits.USBIE = 0;
+  probes[probe].start = Now();
+  PIE2bits.USBIE = ie;
+}
+
+/**
+ * ProfStop() - Account the cycles since ProfStart() to a probe
+ * @probe:      PROF_*
+ **/
+void ProfStop(byte probe)
+{
+  ProfProbe *p = &probes[probe];
+  word t;
+  byte ie;
+
+  ie = PIE2bits.USBIE;
+  PIE2bits.USBIE = 0;
+  t = Now() - p->start;
+  p->calls++;
+  p->total += t;
+  if (t < p->min)
+    p->min = t;
+  if (t > p->max)
+    p->max = t;
+  PIE2bits.USBIE = ie;
+}
+
+/**
+ * ProfReport() -       Answer to VR_GET_PROFILE
+ * @probe:              PROF_*
+ * @clear:              Non zero to start the probe over once read
+ * @buffer:             PROF_REPORT_BYTES, least significant byte first
+ *
+ * Called from the control transfer code.  Returns the number of bytes
+ * stored, 0 if there is no such probe.
+ **/
+byte ProfReport(byte probe, byte clear, byte *buffer)
+{
+  ProfProbe *p;
+  byte i;
+
+  if (probe >= PROF_PROBES)
+    return 0;
+  p = &probes[probe];
+  for (i = 0; i < 4; i++) {
+    buffer[i] = (byte) (p->calls >> (8 * i));
+    buffer[4 + i] = (byte) (p->total >> (8 * i));
+  }
+  buffer[8] = (byte) p->min;
+  buffer[9] = (byte) (p->min >> 8);
+  buffer[10] = (byte) p->max;
+  buffer[11] = (byte) (p->max >> 8);
+  if (clear && (probe != PROF_EMPTY))
+    Clear(p);
+  return PROF_REPORT_BYTES;
+}
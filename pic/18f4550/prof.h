@@ -0,0 +1,64 @@
+/*   prof.h - Cycle counts of the hot paths, for profiling builds.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROF_H
+#define PROF_H
+
+/**
+ * Only built with 'make PROFILE=yes' (-DPROFILE).  Timer1 runs free at
+ * FCY, and each probe keeps the number of times it was passed and the
+ * total, shortest and longest number of instruction cycles between its
+ * PROF_START() and PROF_STOP().  The host reads them with VR_GET_PROFILE
+ * (vendor.h).  Otherwise PROF_START() and PROF_STOP() are empty and
+ * Timer1 is left alone.
+ *
+ * Timer1 wraps every 65536 cycles, so a longer path reads short by a
+ * multiple of that.  PROF_EMPTY is a PROF_START() straight followed by
+ * PROF_STOP(), PROF_CALIBRATE times by ProfInit(): its cycles are the
+ * cost of the probe itself, to be taken off the others.  It is never
+ * cleared.
+ **/
+#define PROF_USB          0     /* ProcessUSBTransactions()             */
+#define PROF_IN_DATA      1     /* InDataStage()                        */
+#define PROF_ADC          2     /* AdcConvert(), GO to the result       */
+#define PROF_SAMPLE       3     /* Acquire() queuing one result         */
+#define PROF_EMPTY        4     /* Nothing at all                       */
+#define PROF_PROBES       5
+
+#define PROF_CALIBRATE    8
+
+/**
+ * Answer to VR_GET_PROFILE: calls and total cycles, 32 bits each, then the
+ * shortest and the longest, 16 bits each
+ **/
+#define PROF_REPORT_BYTES 12
+
+#if defined(PROFILE)
+void ProfInit(void);
+void ProfStart(byte probe);
+void ProfStop(byte probe);
+byte ProfReport(byte probe, byte clear, byte *buffer);
+
+#define PROF_START(p) ProfStart(p)
+#define PROF_STOP(p)  ProfStop(p)
+#else
+#define PROF_START(p)
+#define PROF_STOP(p)
+#endif
+
+#endif /* PROF_H */
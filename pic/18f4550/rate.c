@@ -0,0 +1,152 @@
+/*   rate.c - Hardware timed sampling with Timer3 and CCP2.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Timer3 counts instruction cycles and CCP2, in compare mode with the
+ * special event trigger, resets it and sets GO every period (PIC18F4550
+ * datasheet, section 15.3.4).  Conversions are then started by the
+ * hardware at a fixed rate, whatever the firmware is doing; adc.c only has
+ * to collect each result (ADIF) before the next one is ready.
+ **/
+
+#include <pic18fregs.h>
+#include "usb.h"
+#include "adc.h"
+#include "rate.h"
+
+unsigned long rateCycles;
+unsigned long rateHz;
+
+static word ratePeriod;         /* Timer3 counts per conversion - 1 */
+static byte ratePrescale;       /* T3CKPS                            */
+
+/**
+ * Acquisition time in TAD of each ACQT setting
+ **/
+static code byte acqtTad[8] = { 0, 2, 4, 6, 8, 12, 16, 20 };
+
+/**
+ * MilliHertz() -       Rate of one conversion every cycles
+ * @cycles:             Instruction cycles, not 0
+ *
+ * FCY * 1000 does not fit in 32 bits, so the division is done in two
+ * steps.
+ **/
+static unsigned long MilliHertz(unsigned long cycles)
+{
+  return (FCY / cycles) * 1000 + ((FCY % cycles) * 1000) / cycles;
+}
+
+/**
+ * RateSet() -  Work out the timer setting closest to a rate
+ * @hz:         Conversions per second, 0 for untimed conversions
+ *
+ * Rates above what the A/D module can do are lowered to the highest one.
+ * In ALT_ISO the bus time reserved is for ISO_RATE conversions a second:
+ * untimed conversions or a higher rate run at ISO_RATE instead, rateHz
+ * keeping the one asked for until the setting changes back.
+ * Timer3 counts up to 65536 with a prescaler of 1, 2, 4 or 8, so the
+ * lowest rate is FCY / 524288 (about 23 Hz at 48 MHz).  The acquisition
+ * time of every scan list entry is limited to the longest one that still
+ * fits in the period.
+ **/
+void RateSet(unsigned long hz)
+{
+  unsigned long cycles, counts;
+  byte ps;
+
+  rateHz = hz;
+  if ((currentAltSetting == ALT_ISO) && ((hz == 0) || (hz > ISO_RATE)))
+    hz = ISO_RATE;
+  rateCycles = 0;
+  acqtMax = 7;
+  if (hz == 0)
+    return;
+
+  cycles = (FCY + hz / 2) / hz;
+  if (cycles < RATE_MIN_CYCLES)
+    cycles = RATE_MIN_CYCLES;
+
+  ps = 0;
+  while ((ps < 3) && ((cycles >> ps) > 65536UL))
+    ps++;
+  counts = (cycles + (1 << ps) / 2) >> ps;
+  if (counts > 65536UL)
+    counts = 65536UL;
+  if ((counts << ps) < RATE_MIN_CYCLES)
+    counts++;
+
+  ratePeriod = counts - 1;
+  ratePrescale = ps;
+  rateCycles = counts << ps;
+
+  while ((acqtMax > RATE_MIN_ACQT) &&
+         (ADC_TAD_CYCLES(acqtTad[acqtMax] + 11 + 2) > rateCycles))
+    acqtMax--;
+}
+
+/**
+ * RateReport() -       Fill in the answer to RATE_SET
+ * @buffer:             At least RATE_REPLY_BYTES long
+ *
+ * Returns the number of bytes to send.
+ **/
+byte RateReport(byte *buffer)
+{
+  unsigned long v[3];
+  byte i, j;
+
+  v[0] = rateCycles;
+  v[1] = rateCycles ? MilliHertz(rateCycles) : 0;
+  v[2] = MilliHertz(RATE_MIN_CYCLES);
+
+  buffer[0] = RATE_SET;
+  for (i = 0; i < 3; i++)
+    for (j = 0; j < 4; j++)
+      buffer[1 + i * 4 + j] = (byte) (v[i] >> (8 * j));
+  return RATE_REPLY_BYTES;
+}
+
+/**
+ * RateStart() -        Start the sample clock
+ *
+ * The A/D module must already be on, a trigger that finds it off is lost.
+ * Does nothing if no rate was set.
+ **/
+void RateStart(void)
+{
+  if (rateCycles == 0)
+    return;
+
+  TMR3H = 0;
+  TMR3L = 0;
+  CCPR2H = (byte) (ratePeriod >> 8);
+  CCPR2L = (byte) ratePeriod;
+  T3CON = 0x08 | (ratePrescale << 4);   /* Timer3 for CCP2, Fosc/4 */
+  CCP2CON = 0x0B;                       /* Special event trigger   */
+  T3CONbits.TMR3ON = 1;
+}
+
+/**
+ * RateStop() - Stop the sample clock
+ **/
+void RateStop(void)
+{
+  T3CONbits.TMR3ON = 0;
+  CCP2CON = 0x00;
+}
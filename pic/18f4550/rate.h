@@ -0,0 +1,67 @@
+/*   rate.h - Hardware timed sampling with Timer3 and CCP2.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RATE_H
+#define RATE_H
+
+/**
+ * Command sent by the host as the first byte of an EP1 OUT packet to set
+ * the sample rate used while streaming (only while not streaming):
+ *
+ *   byte 0      RATE_SET
+ *   byte 1..4   rate in Hz, least significant byte first; 0 goes back to
+ *               converting as fast as the firmware can (not timed)
+ *
+ * The firmware answers on EP1 IN with RATE_REPLY_BYTES bytes:
+ *
+ *   byte 0      RATE_SET
+ *   byte 1..4   instruction cycles per conversion (0 when not timed), the
+ *               exact rate is FCY / cycles
+ *   byte 5..8   rate reached, in mHz
+ *   byte 9..12  highest rate the A/D module can keep up with, in mHz
+ *
+ * All conversions count: with n entries in the scan list each channel is
+ * sampled at 1/n of the rate.
+ **/
+#define RATE_SET          'R'
+#define RATE_REPLY_BYTES  13
+
+/**
+ * A conversion is the acquisition time plus 11 TAD, and the module waits
+ * 2 TAD before the next acquisition can start.  The shortest acquisition
+ * used by the rate engine is 2 TAD (ACQT = 1).
+ **/
+#define RATE_MIN_ACQT     1
+#define RATE_MIN_CYCLES   ADC_TAD_CYCLES(2 + 11 + 2)
+
+/**
+ * Instruction cycles per conversion, 0 when not timed
+ **/
+extern unsigned long rateCycles;
+
+/**
+ * Last rate asked for, in Hz
+ **/
+extern unsigned long rateHz;
+
+void RateSet(unsigned long hz);
+byte RateReport(byte *buffer);
+void RateStart(void);
+void RateStop(void);
+
+#endif /* RATE_H */
@@ -0,0 +1,169 @@
+/*   serial.c - Serial number of the board, kept in the data EEPROM.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * An EEPROM byte takes about 4 ms to write (PIC18F4550 datasheet, section
+ * 7.4), far too long to wait for in the main loop while streaming.  A new
+ * serial number is only queued by SerialSet(); SerialService() starts the
+ * write of the next byte whenever the previous one is done.  The length
+ * byte is cleared first and written last, so a reset in between leaves a
+ * blank serial number, never a mix of the old and the new one.
+ **/
+
+#include <pic18fregs.h>
+#include "usb.h"
+#include "serial.h"
+
+#define SERIAL_IDLE   0xFF
+
+byte serialDescriptor[SERIAL_DESCRIPTOR_BYTES];
+
+static byte serialNew[SERIAL_MAX + 1];   /* Length, then the characters */
+static byte serialStep;                  /* Next write, or SERIAL_IDLE  */
+
+/**
+ * EepromRead() -       Read one byte of the data EEPROM
+ **/
+static byte EepromRead(byte addr)
+{
+  EEADR = addr;
+  EECON1 = 0x00;                /* Data EEPROM, not flash or config */
+  EECON1bits.RD = 1;
+  return EEDATA;
+}
+
+/**
+ * EepromWrite() -      Start the write of one byte of the data EEPROM
+ *
+ * EECON1bits.WR stays set until it is done.  Interrupts are held off
+ * during the unlock sequence, which must not be broken.
+ **/
+static void EepromWrite(byte addr, byte value)
+{
+  byte gie;
+
+  EEADR = addr;
+  EEDATA = value;
+  EECON1 = 0x04;                /* WREN */
+  gie = INTCONbits.GIEH;
+  INTCONbits.GIEH = 0;
+  EECON2 = 0x55;
+  EECON2 = 0xAA;
+  EECON1bits.WR = 1;
+  INTCONbits.GIEH = gie;
+  EECON1bits.WREN = 0;          /* The write under way goes on */
+}
+
+/**
+ * SerialValid() -      Whether a string can be a serial number
+ **/
+static byte SerialValid(const byte *serial, byte len)
+{
+  byte i;
+
+  if ((len == 0) || (len > SERIAL_MAX))
+    return 0;
+  for (i = 0; i < len; i++)
+    if ((serial[i] <= ' ') || (serial[i] > '~'))
+      return 0;
+  return 1;
+}
+
+/**
+ * SerialDescribe() -   Build the string descriptor of a serial number
+ **/
+static void SerialDescribe(const byte *serial, byte len)
+{
+  byte i;
+
+  serialDescriptor[0] = 2 + 2 * len;
+  serialDescriptor[1] = STRING_DESCRIPTOR;
+  for (i = 0; i < len; i++) {
+    serialDescriptor[2 + 2 * i] = serial[i];
+    serialDescriptor[3 + 2 * i] = 0;
+  }
+}
+
+/**
+ * SerialLoad() -       Read the serial number from the EEPROM
+ *
+ * Called once at power up, before the USB module is enabled.
+ **/
+void SerialLoad(void)
+{
+  static code byte blank[] = SERIAL_DEFAULT;
+  byte len, i;
+
+  serialStep = SERIAL_IDLE;
+  len = EepromRead(SERIAL_EEPROM);
+  if (len <= SERIAL_MAX)
+    for (i = 0; i < len; i++)
+      serialNew[1 + i] = EepromRead(SERIAL_EEPROM + 1 + i);
+  if (!SerialValid(serialNew + 1, len)) {
+    len = sizeof(blank) - 1;
+    for (i = 0; i < len; i++)
+      serialNew[1 + i] = blank[i];
+  }
+  serialNew[0] = len;
+  SerialDescribe(serialNew + 1, len);
+}
+
+/**
+ * SerialSet() -        Give the board a new serial number
+ * @serial:             The characters, not terminated
+ * @len:                How many, 1..SERIAL_MAX
+ *
+ * Returns 0, and changes nothing, if it is not a valid serial number.  The
+ * EEPROM is written by SerialService() from then on.
+ **/
+byte SerialSet(const byte *serial, byte len)
+{
+  byte i;
+
+  if (!SerialValid(serial, len))
+    return 0;
+  SerialDescribe(serial, len);
+  serialNew[0] = len;
+  for (i = 0; i < len; i++)
+    serialNew[1 + i] = serial[i];
+  serialStep = 0;
+  return 1;
+}
+
+/**
+ * SerialService() -    Go on writing a new serial number to the EEPROM
+ *
+ * Called from the main loop, never waits: step 0 clears the length, steps
+ * 1..len write the characters and step len + 1 the length.
+ **/
+void SerialService(void)
+{
+  byte step = serialStep;
+
+  if ((step == SERIAL_IDLE) || EECON1bits.WR)
+    return;
+  if (step == 0)
+    EepromWrite(SERIAL_EEPROM, 0xFF);
+  else if (step <= serialNew[0])
+    EepromWrite(SERIAL_EEPROM + step, serialNew[step]);
+  else {
+    EepromWrite(SERIAL_EEPROM, serialNew[0]);
+    step = SERIAL_IDLE - 1;
+  }
+  serialStep = step + 1;
+}
@@ -0,0 +1,50 @@
+/*   serial.h - Serial number of the board, kept in the data EEPROM.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SERIAL_H
+#define SERIAL_H
+
+/**
+ * The serial number is string descriptor SERIAL_STRING_INDEX (the
+ * iSerialNumber of the device descriptor), so the host can tell the
+ * boards apart before opening them.  It is kept in the data EEPROM:
+ *
+ *   SERIAL_EEPROM        number of characters, 1..SERIAL_MAX
+ *   SERIAL_EEPROM + 1..  the characters, printable ASCII but space
+ *
+ * A blank EEPROM (0xFF) or anything else that does not read as a serial
+ * number gives SERIAL_DEFAULT.  It is written with VR_SET_SERIAL (vendor.h)
+ * or with the programmer; the new number is in the descriptor at once but
+ * the host only reads it again when the board is enumerated.
+ **/
+#define SERIAL_STRING_INDEX   3
+#define SERIAL_EEPROM         0x00
+#define SERIAL_MAX            16
+#define SERIAL_DEFAULT        "00000000"
+#define SERIAL_DESCRIPTOR_BYTES (2 + 2 * SERIAL_MAX)
+
+/**
+ * String descriptor of the serial number, in RAM
+ **/
+extern byte serialDescriptor[SERIAL_DESCRIPTOR_BYTES];
+
+void SerialLoad(void);
+byte SerialSet(const byte *serial, byte len);
+void SerialService(void);
+
+#endif /* SERIAL_H */
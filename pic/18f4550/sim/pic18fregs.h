@@ -0,0 +1,429 @@
+/*   pic18fregs.h - Host stand-in for the SDCC pic16 register header.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Only used by the host build ('make sim').  The firmware sources include
+ * <pic18fregs.h> as usual and get this file instead of the SDCC one, so the
+ * same usb.c/main.c run on top of the register file model in sim.c.
+ **/
+
+#ifndef PIC18FREGS_H
+#define PIC18FREGS_H
+
+#include "sim.h"
+
+/**
+ * SDCC storage classes that mean nothing to gcc
+ **/
+#define code const
+
+/**
+ * Dual port addresses handed to the SIE
+ **/
+#define PTR16(x) sim_ptr16((const volatile void *)(x))
+
+/**
+ * Every register access is routed through sim_sfr()
+ **/
+#define SIM_SFR(addr, type) (*(volatile type *)sim_sfr(addr))
+#define SIM_BD(addr)        (*(volatile BDT *)sim_bd(addr))
+#define SIM_BDS(addr)       ((volatile BDT *)sim_bd(addr))
+
+/**
+ * The buffers and the FIFO in the dual port RAM (usbmem.h) are plain
+ * memory, at their real addresses
+ **/
+#define SIM_DPRAM(addr)     ((void *)&sim_ram[addr])
+
+/**
+ * Interrupt vectors are plain functions, sim.c calls them
+ **/
+#define ISR_HIGH
+
+/**
+ * Bit definitions, named as in SDCC's pic18f4550.h
+ **/
+typedef struct {
+    unsigned char :1;
+    unsigned char SUSPND:1;
+    unsigned char RESUME:1;
+    unsigned char USBEN:1;
+    unsigned char PKTDIS:1;
+    unsigned char SE0:1;
+    unsigned char PPBRST:1;
+    unsigned char :1;
+} __UCONbits_t;
+
+typedef struct {
+    unsigned char URSTIF:1;
+    unsigned char UERRIF:1;
+    unsigned char ACTVIF:1;
+    unsigned char TRNIF:1;
+    unsigned char IDLEIF:1;
+    unsigned char STALLIF:1;
+    unsigned char SOFIF:1;
+    unsigned char :1;
+} __UIRbits_t;
+
+typedef struct {
+    unsigned char URSTIE:1;
+    unsigned char UERRIE:1;
+    unsigned char ACTVIE:1;
+    unsigned char TRNIE:1;
+    unsigned char IDLEIE:1;
+    unsigned char STALLIE:1;
+    unsigned char SOFIE:1;
+    unsigned char :1;
+} __UIEbits_t;
+
+typedef struct {
+    unsigned char PIDEF:1;
+    unsigned char CRC5EF:1;
+    unsigned char CRC16EF:1;
+    unsigned char DFN8EF:1;
+    unsigned char BTOEF:1;
+    unsigned char :2;
+    unsigned char BTSEF:1;
+} __UEIRbits_t;
+
+typedef struct {
+    unsigned char :1;
+    unsigned char PPBI:1;
+    unsigned char DIR:1;
+    unsigned char ENDP0:1;
+    unsigned char ENDP1:1;
+    unsigned char ENDP2:1;
+    unsigned char ENDP3:1;
+    unsigned char :1;
+} __USTATbits_t;
+
+typedef struct {
+    unsigned char PPB0:1;
+    unsigned char PPB1:1;
+    unsigned char FSEN:1;
+    unsigned char UTRDIS:1;
+    unsigned char UPUEN:1;
+    unsigned char :1;
+    unsigned char UOEMON:1;
+    unsigned char UTEYE:1;
+} __UCFGbits_t;
+
+typedef struct {
+    unsigned char EPSTALL:1;
+    unsigned char EPINEN:1;
+    unsigned char EPOUTEN:1;
+    unsigned char EPCONDIS:1;
+    unsigned char EPHSHK:1;
+    unsigned char :3;
+} __UEPbits_t;
+
+typedef struct {
+    unsigned char ADON:1;
+    unsigned char GO:1;
+    unsigned char CHS0:1;
+    unsigned char CHS1:1;
+    unsigned char CHS2:1;
+    unsigned char CHS3:1;
+    unsigned char :2;
+} __ADCON0bits_t;
+
+typedef struct {
+    unsigned char PCFG0:1;
+    unsigned char PCFG1:1;
+    unsigned char PCFG2:1;
+    unsigned char PCFG3:1;
+    unsigned char VCFG0:1;
+    unsigned char VCFG1:1;
+    unsigned char :2;
+} __ADCON1bits_t;
+
+typedef struct {
+    unsigned char ADCS0:1;
+    unsigned char ADCS1:1;
+    unsigned char ADCS2:1;
+    unsigned char ACQT0:1;
+    unsigned char ACQT1:1;
+    unsigned char ACQT2:1;
+    unsigned char :1;
+    unsigned char ADFM:1;
+} __ADCON2bits_t;
+
+typedef struct {
+    unsigned char RB0:1;
+    unsigned char RB1:1;
+    unsigned char RB2:1;
+    unsigned char RB3:1;
+    unsigned char RB4:1;
+    unsigned char RB5:1;
+    unsigned char RB6:1;
+    unsigned char RB7:1;
+} __PORTBbits_t;
+
+typedef struct {
+    unsigned char RD0:1;
+    unsigned char RD1:1;
+    unsigned char RD2:1;
+    unsigned char RD3:1;
+    unsigned char RD4:1;
+    unsigned char RD5:1;
+    unsigned char RD6:1;
+    unsigned char RD7:1;
+} __PORTDbits_t;
+
+typedef struct {
+    unsigned char TRISA0:1;
+    unsigned char TRISA1:1;
+    unsigned char TRISA2:1;
+    unsigned char TRISA3:1;
+    unsigned char TRISA4:1;
+    unsigned char TRISA5:1;
+    unsigned char TRISA6:1;
+    unsigned char :1;
+} __TRISAbits_t;
+
+typedef struct {
+    unsigned char TRISE0:1;
+    unsigned char TRISE1:1;
+    unsigned char TRISE2:1;
+    unsigned char :5;
+} __TRISEbits_t;
+
+typedef struct {
+    unsigned char RBIF:1;
+    unsigned char INT0IF:1;
+    unsigned char TMR0IF:1;
+    unsigned char RBIE:1;
+    unsigned char INT0IE:1;
+    unsigned char TMR0IE:1;
+    unsigned char GIEL:1;
+    unsigned char GIEH:1;
+} __INTCONbits_t;
+
+typedef struct {
+    unsigned char TMR1IF:1;
+    unsigned char TMR2IF:1;
+    unsigned char CCP1IF:1;
+    unsigned char SSPIF:1;
+    unsigned char TXIF:1;
+    unsigned char RCIF:1;
+    unsigned char ADIF:1;
+    unsigned char SPPIF:1;
+} __PIR1bits_t;
+
+typedef struct {
+    unsigned char TMR1IE:1;
+    unsigned char TMR2IE:1;
+    unsigned char CCP1IE:1;
+    unsigned char SSPIE:1;
+    unsigned char TXIE:1;
+    unsigned char RCIE:1;
+    unsigned char ADIE:1;
+    unsigned char SPPIE:1;
+} __PIE1bits_t;
+
+typedef struct {
+    unsigned char TMR1IP:1;
+    unsigned char TMR2IP:1;
+    unsigned char CCP1IP:1;
+    unsigned char SSPIP:1;
+    unsigned char TXIP:1;
+    unsigned char RCIP:1;
+    unsigned char ADIP:1;
+    unsigned char SPPIP:1;
+} __IPR1bits_t;
+
+typedef struct {
+    unsigned char CCP2IF:1;
+    unsigned char TMR3IF:1;
+    unsigned char HLVDIF:1;
+    unsigned char BCLIF:1;
+    unsigned char EEIF:1;
+    unsigned char USBIF:1;
+    unsigned char CMIF:1;
+    unsigned char OSCFIF:1;
+} __PIR2bits_t;
+
+typedef struct {
+    unsigned char CCP2IE:1;
+    unsigned char TMR3IE:1;
+    unsigned char HLVDIE:1;
+    unsigned char BCLIE:1;
+    unsigned char EEIE:1;
+    unsigned char USBIE:1;
+    unsigned char CMIE:1;
+    unsigned char OSCFIE:1;
+} __PIE2bits_t;
+
+typedef struct {
+    unsigned char CCP2IP:1;
+    unsigned char TMR3IP:1;
+    unsigned char HLVDIP:1;
+    unsigned char BCLIP:1;
+    unsigned char EEIP:1;
+    unsigned char USBIP:1;
+    unsigned char CMIP:1;
+    unsigned char OSCFIP:1;
+} __IPR2bits_t;
+
+typedef struct {
+    unsigned char RD:1;
+    unsigned char WR:1;
+    unsigned char WREN:1;
+    unsigned char WRERR:1;
+    unsigned char FREE:1;
+    unsigned char :1;
+    unsigned char CFGS:1;
+    unsigned char EEPGD:1;
+} __EECON1bits_t;
+
+typedef struct {
+    unsigned char TMR3ON:1;
+    unsigned char TMR3CS:1;
+    unsigned char NOT_T3SYNC:1;
+    unsigned char T3CCP1:1;
+    unsigned char T3CKPS0:1;
+    unsigned char T3CKPS1:1;
+    unsigned char T3CCP2:1;
+    unsigned char RD16:1;
+} __T3CONbits_t;
+
+typedef struct {
+    unsigned char NOT_BOR:1;
+    unsigned char NOT_POR:1;
+    unsigned char NOT_PD:1;
+    unsigned char NOT_TO:1;
+    unsigned char NOT_RI:1;
+    unsigned char :1;
+    unsigned char SBOREN:1;
+    unsigned char IPEN:1;
+} __RCONbits_t;
+
+/**
+ * USB module
+ **/
+#define UFRML       SIM_SFR(SFR_UFRML, unsigned char)
+#define UFRMH       SIM_SFR(SFR_UFRMH, unsigned char)
+#define UIR         SIM_SFR(SFR_UIR, unsigned char)
+#define UIRbits     SIM_SFR(SFR_UIR, __UIRbits_t)
+#define UIE         SIM_SFR(SFR_UIE, unsigned char)
+#define UIEbits     SIM_SFR(SFR_UIE, __UIEbits_t)
+#define UEIR        SIM_SFR(SFR_UEIR, unsigned char)
+#define UEIRbits    SIM_SFR(SFR_UEIR, __UEIRbits_t)
+#define UEIE        SIM_SFR(SFR_UEIE, unsigned char)
+#define USTAT       SIM_SFR(SFR_USTAT, unsigned char)
+#define USTATbits   SIM_SFR(SFR_USTAT, __USTATbits_t)
+#define UCON        SIM_SFR(SFR_UCON, unsigned char)
+#define UCONbits    SIM_SFR(SFR_UCON, __UCONbits_t)
+#define UADDR       SIM_SFR(SFR_UADDR, unsigned char)
+#define UCFG        SIM_SFR(SFR_UCFG, unsigned char)
+#define UCFGbits    SIM_SFR(SFR_UCFG, __UCFGbits_t)
+#define UEP0        SIM_SFR(SFR_UEP0 + 0, unsigned char)
+#define UEP0bits    SIM_SFR(SFR_UEP0 + 0, __UEPbits_t)
+#define UEP1        SIM_SFR(SFR_UEP0 + 1, unsigned char)
+#define UEP1bits    SIM_SFR(SFR_UEP0 + 1, __UEPbits_t)
+#define UEP2        SIM_SFR(SFR_UEP0 + 2, unsigned char)
+#define UEP2bits    SIM_SFR(SFR_UEP0 + 2, __UEPbits_t)
+#define UEP3        SIM_SFR(SFR_UEP0 + 3, unsigned char)
+#define UEP4        SIM_SFR(SFR_UEP0 + 4, unsigned char)
+#define UEP5        SIM_SFR(SFR_UEP0 + 5, unsigned char)
+#define UEP6        SIM_SFR(SFR_UEP0 + 6, unsigned char)
+#define UEP7        SIM_SFR(SFR_UEP0 + 7, unsigned char)
+
+/**
+ * I/O ports
+ **/
+#define PORTA       SIM_SFR(SFR_PORTA, unsigned char)
+#define PORTB       SIM_SFR(SFR_PORTB, unsigned char)
+#define PORTBbits   SIM_SFR(SFR_PORTB, __PORTBbits_t)
+#define PORTC       SIM_SFR(SFR_PORTC, unsigned char)
+#define PORTD       SIM_SFR(SFR_PORTD, unsigned char)
+#define PORTDbits   SIM_SFR(SFR_PORTD, __PORTDbits_t)
+#define PORTE       SIM_SFR(SFR_PORTE, unsigned char)
+#define LATA        SIM_SFR(SFR_LATA, unsigned char)
+#define LATB        SIM_SFR(SFR_LATB, unsigned char)
+#define LATD        SIM_SFR(SFR_LATD, unsigned char)
+#define TRISA       SIM_SFR(SFR_TRISA, unsigned char)
+#define TRISAbits   SIM_SFR(SFR_TRISA, __TRISAbits_t)
+#define TRISB       SIM_SFR(SFR_TRISB, unsigned char)
+#define TRISC       SIM_SFR(SFR_TRISC, unsigned char)
+#define TRISD       SIM_SFR(SFR_TRISD, unsigned char)
+#define TRISE       SIM_SFR(SFR_TRISE, unsigned char)
+#define TRISEbits   SIM_SFR(SFR_TRISE, __TRISEbits_t)
+
+/**
+ * A/D module
+ **/
+#define ADCON0      SIM_SFR(SFR_ADCON0, unsigned char)
+#define ADCON0bits  SIM_SFR(SFR_ADCON0, __ADCON0bits_t)
+#define ADCON1      SIM_SFR(SFR_ADCON1, unsigned char)
+#define ADCON1bits  SIM_SFR(SFR_ADCON1, __ADCON1bits_t)
+#define ADCON2      SIM_SFR(SFR_ADCON2, unsigned char)
+#define ADCON2bits  SIM_SFR(SFR_ADCON2, __ADCON2bits_t)
+#define ADRESH      SIM_SFR(SFR_ADRESH, unsigned char)
+#define ADRESL      SIM_SFR(SFR_ADRESL, unsigned char)
+
+/**
+ * Data EEPROM
+ **/
+#define EECON1      SIM_SFR(SFR_EECON1, unsigned char)
+#define EECON1bits  SIM_SFR(SFR_EECON1, __EECON1bits_t)
+#define EECON2      SIM_SFR(SFR_EECON2, unsigned char)
+#define EEDATA      SIM_SFR(SFR_EEDATA, unsigned char)
+#define EEADR       SIM_SFR(SFR_EEADR, unsigned char)
+
+/**
+ * Timer1
+ **/
+#define T1CON       SIM_SFR(SFR_T1CON, unsigned char)
+#define TMR1L       SIM_SFR(SFR_TMR1L, unsigned char)
+#define TMR1H       SIM_SFR(SFR_TMR1H, unsigned char)
+
+/**
+ * Timer3 and CCP2
+ **/
+#define T3CON       SIM_SFR(SFR_T3CON, unsigned char)
+#define T3CONbits   SIM_SFR(SFR_T3CON, __T3CONbits_t)
+#define TMR3L       SIM_SFR(SFR_TMR3L, unsigned char)
+#define TMR3H       SIM_SFR(SFR_TMR3H, unsigned char)
+#define CCP2CON     SIM_SFR(SFR_CCP2CON, unsigned char)
+#define CCPR2L      SIM_SFR(SFR_CCPR2L, unsigned char)
+#define CCPR2H      SIM_SFR(SFR_CCPR2H, unsigned char)
+
+/**
+ * Interrupt control
+ **/
+#define INTCON      SIM_SFR(SFR_INTCON, unsigned char)
+#define INTCONbits  SIM_SFR(SFR_INTCON, __INTCONbits_t)
+#define INTCON2     SIM_SFR(SFR_INTCON2, unsigned char)
+#define INTCON3     SIM_SFR(SFR_INTCON3, unsigned char)
+#define PIR1        SIM_SFR(SFR_PIR1, unsigned char)
+#define PIR1bits    SIM_SFR(SFR_PIR1, __PIR1bits_t)
+#define PIE1        SIM_SFR(SFR_PIE1, unsigned char)
+#define PIE1bits    SIM_SFR(SFR_PIE1, __PIE1bits_t)
+#define IPR1        SIM_SFR(SFR_IPR1, unsigned char)
+#define IPR1bits    SIM_SFR(SFR_IPR1, __IPR1bits_t)
+#define PIR2        SIM_SFR(SFR_PIR2, unsigned char)
+#define PIR2bits    SIM_SFR(SFR_PIR2, __PIR2bits_t)
+#define PIE2        SIM_SFR(SFR_PIE2, unsigned char)
+#define PIE2bits    SIM_SFR(SFR_PIE2, __PIE2bits_t)
+#define IPR2        SIM_SFR(SFR_IPR2, unsigned char)
+#define IPR2bits    SIM_SFR(SFR_IPR2, __IPR2bits_t)
+#define RCON        SIM_SFR(SFR_RCON, unsigned char)
+#define RCONbits    SIM_SFR(SFR_RCON, __RCONbits_t)
+
+#endif /* PIC18FREGS_H */
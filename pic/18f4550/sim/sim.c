@@ -0,0 +1,1118 @@
+/*   sim.c - Register file, SIE and A/D model for the host build.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * The firmware (usb.c, main.c) is compiled with gcc against the register
+ * shim in this directory and linked with this file.  A scenario script plays
+ * the part of the host: it issues SETUP/IN/OUT tokens, bus resets and A/D
+ * results, and checks what the firmware answers.
+ *
+ * Time is modeled coarsely: every register or BDT access costs
+ * SIM_ACCESS_CYCLES instruction cycles, and a USB frame is 12000 cycles
+ * (1 ms at 48 MHz).  The model is not cycle accurate, it only gives a
+ * repeatable measure of the work done by each firmware entry point.
+ *
+ * Scenario syntax (one command per line, '#' starts a comment):
+ *
+ *   reset                          USB bus reset (waits for the pull-up)
+ *   setup <bmRT> <bReq> <wValue> <wIndex> <wLength>
+ *   in <ep> [bytes | * | stall | nak | none]
+ *   out <ep> [bytes | "text"] [stall | none]
+ *   adc [an<n>] <value> [value ...]  queue A/D conversion results (for
+ *                                  channel n only, otherwise for any)
+ *   wait <frames>                  let the firmware run
+ *   check <register> <value>       compare a register (or 'state', or
+ *                                  'ee<addr>' for an EEPROM byte)
+ *   eeprom <addr> [bytes | "text"] EEPROM contents at power up, blank
+ *                                  (FFh) elsewhere; taken before the
+ *                                  firmware starts, wherever it appears
+ *
+ * An 'in' without data expects a zero length packet, a trailing '*' makes
+ * the listed bytes a prefix match and a lone '*' accepts anything.  A '??'
+ * in place of a byte matches any value (time stamps, for instance).
+ * 'none' expects no answer at all: the endpoint direction is not enabled
+ * in UEPn.  An OUT to a data endpoint whose UEPn has no handshakes fails
+ * the scenario, the host would never know if the packet arrived.
+ *
+ * Firmware built with USB_INTERRUPT gets its high priority vector called
+ * between two register accesses whenever USBIF is pending and enabled.
+ *
+ * Timer1 counts the modeled cycles from Fosc/4 through its prescaler.
+ * With RD16 set, reading TMR1L latches TMR1H as on the chip.  Writes to
+ * the timer are not modeled: it only serves the profiling build.
+ *
+ * A data EEPROM write takes SIM_EEPROM_CYCLES and only starts after the
+ * 55h, AAh unlock sequence on EECON2, with interrupts off, immediately
+ * followed by setting WR; anything else fails the scenario.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include "sim.h"
+
+#define SIM_ACCESS_CYCLES   4
+#define SIM_FRAME_CYCLES    12000UL
+#define SIM_TOKEN_CYCLES    600UL    /* Time on the bus of one transaction */
+#define SIM_TIMEOUT_FRAMES  1000UL
+#define SIM_RESET_FRAMES    20UL     /* Reset signaling plus recovery      */
+
+#define SIM_MAX_CMDS        4096
+#define SIM_MAX_DATA        1024
+#define SIM_MAX_PTRS        32
+#define SIM_ADC_QUEUE       4096
+#define SIM_USTAT_DEPTH     4        /* Entries of the USTAT FIFO          */
+#define SIM_ADC_ANY         16       /* Queue of results for any channel   */
+#define SIM_EEPROM_SIZE     256
+#define SIM_EEPROM_CYCLES   48000UL  /* 4 ms to write a byte               */
+#define SIM_CHECK_EEPROM    0x10000  /* 'check ee<addr>'                   */
+
+/**
+ * Register bits the model needs to know about
+ **/
+#define UIR_URSTIF   0x01
+#define UIR_TRNIF    0x08
+#define UIR_STALLIF  0x20
+#define UIR_SOFIF    0x40
+#define UIE_URSTIE   0x01
+#define UCON_PPBRST  0x40
+#define UCON_PKTDIS  0x10
+#define UCON_USBEN   0x08
+#define UEP_EPSTALL  0x01
+#define UEP_EPINEN   0x02
+#define UEP_EPOUTEN  0x04
+#define UEP_EPHSHK   0x10
+#define ADCON0_ADON  0x01
+#define ADCON0_GO    0x02
+#define PIR1_ADIF    0x40
+#define PIR2_CCP2IF  0x01
+#define PIR2_EEIF    0x10
+#define PIR2_USBIF   0x20
+#define PIE2_USBIE   0x20
+#define IPR2_USBIP   0x20
+#define RCON_IPEN    0x80
+#define INTCON_GIEH  0x80
+#define T1CON_TMR1ON 0x01
+#define T1CON_RD16   0x80
+#define T3CON_TMR3ON 0x01
+#define T3CON_T3CCP1 0x08
+#define T3CON_T3CCP2 0x40
+#define CCP_SPECIAL  0x0B
+#define EECON1_RD    0x01
+#define EECON1_WR    0x02
+#define EECON1_WREN  0x04
+#define EECON1_CFGS  0x40
+#define EECON1_EEPGD 0x80
+
+#define BD_UOWN      0x80
+#define BD_DTS       0x40
+#define BD_DTSEN     0x08
+#define BD_BSTALL    0x04
+
+#define PID_OUT      0x1
+#define PID_IN       0x9
+#define PID_SETUP    0xD
+
+/**
+ * Firmware entry point and probes (main is renamed by the Makefile)
+ **/
+extern void firmware_main(void);
+extern void ProcessUSBTransactions(void);
+extern void EnableUSBModule(void);
+extern unsigned char BulkOut(unsigned char, unsigned char *, unsigned char);
+extern void ProcessControlTransfer(void);
+extern void SetupStage(void);
+extern void InDataStage(void);
+extern void OutDataStage(void);
+extern void ProcessIO(void);
+extern void HighPriorityISR(void) __attribute__((weak));
+extern unsigned char deviceState;
+
+unsigned char sim_ram[SIM_RAM_SIZE];
+
+/**
+ * Script commands
+ **/
+enum { CMD_RESET, CMD_SETUP, CMD_IN, CMD_OUT, CMD_ADC, CMD_WAIT, CMD_CHECK };
+enum { EXP_DATA, EXP_PREFIX, EXP_ANY, EXP_STALL, EXP_NAK, EXP_NONE };
+
+struct cmd {
+    int op;
+    int line;
+    int ep;
+    int expect;
+    unsigned int len;
+    unsigned char data[SIM_MAX_DATA];
+    unsigned char any[SIM_MAX_DATA / 8];  /* '??' bytes of an 'in' */
+    unsigned long arg;
+    unsigned int reg;
+};
+
+static struct cmd *cmds;
+static int ncmds;
+static int pc;                      /* Current command                 */
+static unsigned long long cmdStart; /* Cycle the current command began */
+
+/**
+ * Host side of the bus
+ **/
+static unsigned char hostAddr;
+static unsigned char pendingAddr;
+static unsigned char toggleIn[16];
+static unsigned char toggleOut[16];
+static unsigned char busActive;
+
+/**
+ * SIE state: ping-pong pointers and the USTAT FIFO
+ **/
+static unsigned char ppbi[16][2];
+static unsigned char ustat[SIM_USTAT_DEPTH];
+static int nustat;
+
+/**
+ * Model state
+ **/
+static unsigned long long cycles;
+static unsigned long long nextFrame = SIM_FRAME_CYCLES;
+static unsigned long long nextToken;
+static unsigned int frame;
+static int inSie;
+static int inIsr;
+static int verbose;
+static int failed;
+static jmp_buf finish;
+
+static unsigned short adcQueue[SIM_ADC_ANY + 1][SIM_ADC_QUEUE];
+static unsigned int adcHead[SIM_ADC_ANY + 1], adcTail[SIM_ADC_ANY + 1];
+static unsigned short adcLast;
+static int adcBusy;
+static int adcChannel;
+static unsigned long long adcDone;
+static unsigned long t3Cycles;
+static unsigned long long t1Cycles;
+static unsigned char t1Latch;       /* TMR1H as of the last TMR1L read */
+
+static unsigned char eeprom[SIM_EEPROM_SIZE];
+static int eeUnlock;                /* Steps of the unlock sequence seen */
+static int eeBusy;
+static unsigned long long eeDone;
+static unsigned char eeAddr, eeData;
+
+static const volatile void *ptrs[SIM_MAX_PTRS];
+static int nptrs;
+
+/**
+ * Statistics
+ **/
+static unsigned long long accesses;
+static unsigned long nSetup, nIn, nOut, nNak, nStall, nConv, nIrq;
+static unsigned long nTrigger, nMissed;
+static unsigned long nEeprom;
+static unsigned long nCopy, copyBytes, copyCycles, copyGeneric;
+
+struct probe {
+    const char *name;
+    void *fn;
+    unsigned long calls;
+    unsigned long long total;
+    unsigned long long max;
+};
+
+static struct probe probes[] = {
+    { "ProcessUSBTransactions", (void *) ProcessUSBTransactions },
+    { "EnableUSBModule",        (void *) EnableUSBModule },
+    { "ProcessControlTransfer", (void *) ProcessControlTransfer },
+    { "SetupStage",             (void *) SetupStage },
+    { "InDataStage",            (void *) InDataStage },
+    { "OutDataStage",           (void *) OutDataStage },
+    { "BulkOut",                (void *) BulkOut },
+    { "ProcessIO",              (void *) ProcessIO },
+    { "HighPriorityISR",        (void *) HighPriorityISR },
+};
+
+#define NPROBES (sizeof(probes) / sizeof(probes[0]))
+
+static struct {
+    struct probe *p;
+    unsigned long long start;
+} stack[64];
+static int depth;
+
+static void sim_finish(void);
+
+/**
+ * fail() - Report a scenario failure and stop the run
+ **/
+static void fail(const char *fmt, const char *what)
+{
+    fprintf(stderr, "line %d: ", cmds[pc].line);
+    fprintf(stderr, fmt, what);
+    fputc('\n', stderr);
+    failed = 1;
+    sim_finish();
+}
+
+static void dump(const char *tag, int ep, const unsigned char *p, unsigned int n)
+{
+    unsigned int i;
+
+    if (!verbose)
+        return;
+    printf("%8lu %-6s ep%d", (unsigned long) (cycles / SIM_FRAME_CYCLES), tag, ep);
+    for (i = 0; i < n; i++)
+        printf(" %02x", p[i]);
+    printf("\n");
+}
+
+/**
+ * Dual port address translation
+ **/
+unsigned short sim_ptr16(const volatile void *p)
+{
+    const volatile unsigned char *b = p;
+    int i;
+
+    if (b >= sim_ram && b < sim_ram + SIM_RAM_SIZE)
+        return (unsigned short) (b - sim_ram);
+
+    for (i = 0; i < nptrs; i++)
+        if (ptrs[i] == p)
+            return 0x8000 + (i << 10);
+
+    if (nptrs == SIM_MAX_PTRS) {
+        fprintf(stderr, "sim: too many dual port buffers\n");
+        exit(2);
+    }
+    ptrs[nptrs] = p;
+    return 0x8000 + (nptrs++ << 10);
+}
+
+static volatile unsigned char *sim_mem(unsigned int addr)
+{
+    if (addr < SIM_RAM_SIZE)
+        return &sim_ram[addr];
+    if (addr >= 0x8000 && ((addr - 0x8000) >> 10) < (unsigned int) nptrs)
+        return (volatile unsigned char *) ptrs[(addr - 0x8000) >> 10] + (addr & 0x3FF);
+    fprintf(stderr, "sim: BD points to unknown address 0x%04x\n", addr);
+    exit(2);
+}
+
+/**
+ * A/D module: a conversion started with GO completes after the acquisition
+ * time plus 11 TAD, as selected by ADCON2.
+ **/
+static unsigned int adc_cycles(void)
+{
+    static const unsigned char tosc[8] = { 2, 8, 32, 4, 4, 16, 64, 4 };
+    static const unsigned char acqt[8] = { 0, 2, 4, 6, 8, 12, 16, 20 };
+    unsigned char adcon2 = sim_ram[SFR_ADCON2];
+    unsigned int tad = tosc[adcon2 & 7];
+
+    return ((acqt[(adcon2 >> 3) & 7] + 11) * tad + 3) / 4;
+}
+
+static void adc_step(void)
+{
+    unsigned short v;
+    unsigned int q;
+
+    if (!(sim_ram[SFR_ADCON0] & ADCON0_ADON) || !(sim_ram[SFR_ADCON0] & ADCON0_GO)) {
+        adcBusy = 0;
+        return;
+    }
+    if (!adcBusy) {
+        adcBusy = 1;
+        adcChannel = (sim_ram[SFR_ADCON0] >> 2) & 0x0F;
+        adcDone = cycles + adc_cycles();
+        return;
+    }
+    if (cycles < adcDone)
+        return;
+
+    /* A result queued for the channel, else one for any channel */
+    q = (adcHead[adcChannel] != adcTail[adcChannel]) ? adcChannel : SIM_ADC_ANY;
+    if (adcHead[q] != adcTail[q]) {
+        adcLast = adcQueue[q][adcTail[q]];
+        adcTail[q] = (adcTail[q] + 1) % SIM_ADC_QUEUE;
+    }
+    v = adcLast & 0x3FF;
+    if (sim_ram[SFR_ADCON2] & 0x80) {
+        sim_ram[SFR_ADRESH] = v >> 8;
+        sim_ram[SFR_ADRESL] = v & 0xFF;
+    } else {
+        sim_ram[SFR_ADRESH] = v >> 2;
+        sim_ram[SFR_ADRESL] = (v & 3) << 6;
+    }
+    /* The last timed result was never collected */
+    if ((sim_ram[SFR_PIR1] & PIR1_ADIF) && (sim_ram[SFR_T3CON] & T3CON_TMR3ON))
+        nMissed++;
+    sim_ram[SFR_ADCON0] &= ~ADCON0_GO;
+    sim_ram[SFR_PIR1] |= PIR1_ADIF;
+    adcBusy = 0;
+    nConv++;
+}
+
+/**
+ * Timer1: free running, Fosc/4 only
+ **/
+static void timer1_step(void)
+{
+    unsigned char t1con = sim_ram[SFR_T1CON];
+    unsigned long t;
+
+    if (!(t1con & T1CON_TMR1ON))
+        return;
+    t1Cycles += SIM_ACCESS_CYCLES;
+    t = (unsigned long) (t1Cycles >> ((t1con >> 4) & 3));
+    sim_ram[SFR_TMR1L] = t & 0xFF;
+    sim_ram[SFR_TMR1H] = (t >> 8) & 0xFF;
+}
+
+/**
+ * Timer3 and CCP2: with CCP2 in special event trigger mode on Timer3, the
+ * timer is reset every CCPR2 + 1 counts and GO is set if the A/D module is
+ * on.  Only the Fosc/4 clock is modeled.
+ **/
+static void timer_step(void)
+{
+    unsigned char t3con = sim_ram[SFR_T3CON];
+    unsigned long period;
+
+    if (!(t3con & T3CON_TMR3ON)) {
+        t3Cycles = 0;
+        return;
+    }
+    t3Cycles += SIM_ACCESS_CYCLES;
+    if ((sim_ram[SFR_CCP2CON] & 0x0F) != CCP_SPECIAL ||
+        !(t3con & (T3CON_T3CCP1 | T3CON_T3CCP2)))
+        return;
+
+    period = ((sim_ram[SFR_CCPR2H] << 8) | sim_ram[SFR_CCPR2L]) + 1UL;
+    period <<= (t3con >> 4) & 3;
+    if (t3Cycles < period)
+        return;
+    t3Cycles -= period;
+    sim_ram[SFR_PIR2] |= PIR2_CCP2IF;
+    nTrigger++;
+    if (sim_ram[SFR_ADCON0] & ADCON0_ADON)
+        sim_ram[SFR_ADCON0] |= ADCON0_GO;
+}
+
+/**
+ * Data EEPROM (datasheet, section 7).  EECON2 reads as 0, so a value seen
+ * there was written since the last access: the unlock sequence is 55h and
+ * AAh on two accesses in a row, and WR set on the next one.
+ **/
+static void eeprom_step(void)
+{
+    unsigned char con = sim_ram[SFR_EECON1];
+    unsigned char key = sim_ram[SFR_EECON2];
+
+    sim_ram[SFR_EECON2] = 0;
+    if (con & EECON1_RD) {
+        sim_ram[SFR_EEDATA] = eeprom[sim_ram[SFR_EEADR]];
+        sim_ram[SFR_EECON1] &= ~EECON1_RD;
+    }
+    if ((con & EECON1_WR) && !eeBusy) {
+        if (eeUnlock != 2 || !(con & EECON1_WREN) ||
+            (con & (EECON1_EEPGD | EECON1_CFGS)))
+            fail("EEPROM write without the %s", "unlock sequence");
+        eeBusy = 1;
+        eeDone = cycles + SIM_EEPROM_CYCLES;
+        eeAddr = sim_ram[SFR_EEADR];
+        eeData = sim_ram[SFR_EEDATA];
+    }
+    if (eeBusy && cycles >= eeDone) {
+        eeprom[eeAddr] = eeData;
+        sim_ram[SFR_EECON1] &= ~EECON1_WR;
+        sim_ram[SFR_PIR2] |= PIR2_EEIF;
+        eeBusy = 0;
+        nEeprom++;
+    }
+
+    if (key == 0x55 && (sim_ram[SFR_INTCON] & INTCON_GIEH))
+        fail("EEPROM unlocked with %s", "interrupts on");
+    if (key == 0x55)
+        eeUnlock = 1;
+    else if (key == 0xAA && eeUnlock == 1)
+        eeUnlock = 2;
+    else
+        eeUnlock = 0;
+}
+
+/**
+ * Serial interface engine
+ **/
+static int pingpong(int ep, int in)
+{
+    switch (sim_ram[SFR_UCFG] & 3) {
+    case 1:
+        return ep == 0 && !in;
+    case 2:
+        return 1;
+    case 3:
+        return ep != 0;
+    }
+    return 0;
+}
+
+/**
+ * bd_addr() - BD the SIE uses for the next transaction of an endpoint
+ *
+ * Each endpoint direction takes one BD, or two (even, odd) when ping-pong
+ * buffering is enabled for it by UCFG PPB1:PPB0.
+ **/
+static unsigned int bd_addr(int ep, int in)
+{
+    unsigned int n = 0;
+    int e, d;
+
+    for (e = 0; e < ep; e++)
+        for (d = 0; d < 2; d++)
+            n += 1 + pingpong(e, d);
+    if (in)
+        n += 1 + pingpong(ep, 0);
+    if (pingpong(ep, in))
+        n += ppbi[ep][in];
+    return 0x400 + n * 4;
+}
+
+static void complete(unsigned int bd, int ep, int in, int pid, unsigned int len)
+{
+    volatile unsigned char *b = &sim_ram[bd];
+    unsigned char odd = 0;
+
+    b[0] = (b[0] & BD_DTS) | (pid << 2) | ((len >> 8) & 3);
+    b[1] = len & 0xFF;
+    if (pingpong(ep, in)) {
+        odd = ppbi[ep][in];
+        ppbi[ep][in] ^= 1;
+    }
+    ustat[nustat++] = (ep << 3) | (in ? 0x04 : 0) | (odd ? 0x02 : 0);
+    sim_ram[SFR_USTAT] = ustat[0];
+    sim_ram[SFR_UIR] |= UIR_TRNIF;
+}
+
+/**
+ * ustat_step() - Advance the USTAT FIFO once the firmware clears TRNIF
+ **/
+static void ustat_step(void)
+{
+    if (nustat == 0 || (sim_ram[SFR_UIR] & UIR_TRNIF))
+        return;
+    memmove(ustat, ustat + 1, --nustat);
+    if (nustat) {
+        sim_ram[SFR_USTAT] = ustat[0];
+        sim_ram[SFR_UIR] |= UIR_TRNIF;
+    }
+}
+
+static void stall(int ep)
+{
+    sim_ram[SFR_UEP0 + ep] |= UEP_EPSTALL;
+    sim_ram[SFR_UIR] |= UIR_STALLIF;
+    nStall++;
+}
+
+/**
+ * match() - Compare the data of an IN with what the command expects
+ **/
+static int match(const struct cmd *c, const unsigned char *buf)
+{
+    unsigned int i;
+
+    for (i = 0; i < c->len; i++)
+        if (!(c->any[i / 8] & (1 << (i % 8))) && buf[i] != c->data[i])
+            return 0;
+    return 1;
+}
+
+/**
+ * token() - Run one transaction of the current command
+ *
+ * Returns 1 when the command is done and 0 when it has to be retried
+ * (NAK, or the device is not listening yet).
+ **/
+static int token(struct cmd *c)
+{
+    int in = (c->op == CMD_IN);
+    unsigned int bd = bd_addr(c->ep, in);
+    volatile unsigned char *b = &sim_ram[bd];
+    unsigned int cnt = ((b[0] & 3) << 8) | b[1];
+    unsigned int addr = b[2] | (b[3] << 8);
+    unsigned char uep = sim_ram[SFR_UEP0 + c->ep];
+    unsigned char buf[SIM_MAX_DATA];
+    unsigned int i;
+
+    if (sim_ram[SFR_UADDR] != hostAddr)
+        return 0;
+    if (c->ep != 0 && !(uep & (in ? UEP_EPINEN : UEP_EPOUTEN))) {
+        if (c->expect != EXP_NONE)
+            return 0;
+        dump("NONE", c->ep, NULL, 0);
+        return 1;
+    }
+    if (c->expect == EXP_NONE)
+        fail("expected no answer, endpoint %s", "enabled");
+    if (!in && c->ep != 0 && !(uep & UEP_EPHSHK))
+        fail("OUT to an endpoint without %s", "handshakes");
+
+    if (c->op == CMD_SETUP) {
+        if (!(b[0] & BD_UOWN))
+            return 0;
+        if (cnt < 8)
+            fail("SETUP does not fit in a %s byte buffer", "short");
+        for (i = 0; i < 8; i++)
+            sim_mem(addr)[i] = c->data[i];
+        complete(bd, 0, 0, PID_SETUP, 8);
+        sim_ram[SFR_UCON] |= UCON_PKTDIS;
+        toggleIn[0] = toggleOut[0] = 1;
+        if (c->data[0] == 0x00 && c->data[1] == 5)
+            pendingAddr = c->data[2];
+        /* SET_CONFIGURATION and SET_INTERFACE start the data endpoints
+           over at DATA0, as the host does */
+        if ((c->data[0] == 0x00 && c->data[1] == 9) ||
+            (c->data[0] == 0x01 && c->data[1] == 11)) {
+            memset(toggleIn + 1, 0, sizeof(toggleIn) - 1);
+            memset(toggleOut + 1, 0, sizeof(toggleOut) - 1);
+        }
+        nSetup++;
+        dump("SETUP", 0, c->data, 8);
+        return 1;
+    }
+
+    if ((b[0] & (BD_UOWN | BD_BSTALL)) == (BD_UOWN | BD_BSTALL)) {
+        stall(c->ep);
+        dump("STALL", c->ep, NULL, 0);
+        if (c->expect != EXP_STALL)
+            fail("unexpected %s", "STALL");
+        return 1;
+    }
+
+    if (!(b[0] & BD_UOWN)) {
+        nNak++;
+        if (c->expect == EXP_NAK)
+            return 1;
+        return 0;
+    }
+    if (c->expect == EXP_NAK)
+        fail("expected NAK, device %s", in ? "sent data" : "took data");
+    if (c->expect == EXP_STALL)
+        fail("expected STALL, device %s", "answered");
+
+    if (in) {
+        /* Without handshakes the endpoint is isochronous, always DATA0 */
+        if (c->ep != 0 && !(uep & UEP_EPHSHK)) {
+            if (b[0] & BD_DTS)
+                fail("isochronous IN sent as %s", "DATA1");
+        }
+        else if (((b[0] & BD_DTS) ? 1 : 0) != toggleIn[c->ep])
+            fail("IN data toggle mismatch (%s)", (b[0] & BD_DTS) ? "DATA1" : "DATA0");
+        for (i = 0; i < cnt; i++)
+            buf[i] = sim_mem(addr)[i];
+        dump("IN", c->ep, buf, cnt);
+        if (c->expect == EXP_DATA && cnt != c->len)
+            fail("IN length mismatch%s", "");
+        if ((c->expect == EXP_DATA || c->expect == EXP_PREFIX) &&
+            (cnt < c->len || !match(c, buf)))
+            fail("IN data mismatch%s", "");
+        if (c->ep == 0 || (uep & UEP_EPHSHK))
+            toggleIn[c->ep] ^= 1;
+        complete(bd, c->ep, 1, PID_IN, cnt);
+        nIn++;
+        if (c->ep == 0 && cnt == 0 && pendingAddr) {
+            hostAddr = pendingAddr;
+            pendingAddr = 0;
+        }
+    } else {
+        if ((b[0] & BD_DTSEN) && ((b[0] & BD_DTS) ? 1 : 0) != toggleOut[c->ep])
+            fail("OUT data toggle mismatch (%s)", (b[0] & BD_DTS) ? "DATA1" : "DATA0");
+        if (c->len > cnt)
+            fail("OUT packet larger than the %s buffer", "device");
+        for (i = 0; i < c->len; i++)
+            sim_mem(addr)[i] = c->data[i];
+        dump("OUT", c->ep, c->data, c->len);
+        toggleOut[c->ep] ^= 1;
+        complete(bd, c->ep, 0, PID_OUT, c->len);
+        nOut++;
+    }
+    return 1;
+}
+
+static const struct {
+    const char *name;
+    unsigned int addr;
+} regs[] = {
+    { "uaddr", SFR_UADDR },   { "ucon", SFR_UCON },     { "ucfg", SFR_UCFG },
+    { "uir", SFR_UIR },       { "uie", SFR_UIE },       { "uep0", SFR_UEP0 },
+    { "uep1", SFR_UEP0 + 1 }, { "uep2", SFR_UEP0 + 2 }, { "adcon0", SFR_ADCON0 },
+    { "adcon1", SFR_ADCON1 }, { "adcon2", SFR_ADCON2 }, { "porta", SFR_PORTA },
+    { "portb", SFR_PORTB },   { "portd", SFR_PORTD },   { "trisa", SFR_TRISA },
+    { "trisb", SFR_TRISB },   { "trisd", SFR_TRISD },   { "trise", SFR_TRISE },
+    { "intcon", SFR_INTCON }, { "pie1", SFR_PIE1 },     { "pie2", SFR_PIE2 },
+    { "pir2", SFR_PIR2 },     { "ipr2", SFR_IPR2 },     { "rcon", SFR_RCON },
+    { "t3con", SFR_T3CON },   { "ccp2con", SFR_CCP2CON },
+    { "ccpr2l", SFR_CCPR2L }, { "ccpr2h", SFR_CCPR2H }, { "t1con", SFR_T1CON },
+};
+
+#define NREGS (sizeof(regs) / sizeof(regs[0]))
+
+/**
+ * sie_step() - Let the host side of the model make progress
+ **/
+static void sie_step(void)
+{
+    struct cmd *c;
+
+    if (inSie)
+        return;
+    inSie = 1;
+
+    while (pc < ncmds) {
+        c = &cmds[pc];
+
+        if (c->op == CMD_ADC) {
+            unsigned int i;
+            for (i = 0; i < c->len; i++) {
+                unsigned int q = c->reg ? c->reg - 1 : SIM_ADC_ANY;
+                adcQueue[q][adcHead[q]] = c->data[2 * i] | (c->data[2 * i + 1] << 8);
+                adcHead[q] = (adcHead[q] + 1) % SIM_ADC_QUEUE;
+            }
+        } else if (c->op == CMD_CHECK) {
+            unsigned int v;
+            /* Let the firmware service the last transactions first */
+            if (nustat)
+                break;
+            if (c->reg == 0xFFFF)
+                v = deviceState;
+            else if (c->reg & SIM_CHECK_EEPROM)
+                v = eeprom[c->reg & (SIM_EEPROM_SIZE - 1)];
+            else
+                v = sim_ram[c->reg];
+            if (v != c->arg) {
+                char msg[64];
+                snprintf(msg, sizeof(msg), "0x%02x, expected 0x%02lx", v, c->arg);
+                fail("check failed: %s", msg);
+            }
+        } else if (c->op == CMD_WAIT) {
+            if (cycles - cmdStart < c->arg * SIM_FRAME_CYCLES)
+                break;
+        } else {
+            if (cycles - cmdStart > SIM_TIMEOUT_FRAMES * SIM_FRAME_CYCLES)
+                fail("timeout, device never %s", c->expect == EXP_NAK ? "NAKed" : "answered");
+            /* The SIE NAKs everything while the USTAT FIFO is full */
+            if (cycles < nextToken || nustat == SIM_USTAT_DEPTH)
+                break;
+            if (c->op == CMD_RESET) {
+                /* Hold the reset until the firmware has serviced it */
+                if (c->arg) {
+                    if (sim_ram[SFR_UIR] & UIR_URSTIF)
+                        break;
+                    pc++;
+                    cmdStart = cycles;
+                    continue;
+                }
+                if (!(sim_ram[SFR_UCON] & UCON_USBEN) || !(sim_ram[SFR_UIE] & UIE_URSTIE))
+                    break;
+                c->arg = 1;
+                nextToken = cycles + SIM_RESET_FRAMES * SIM_FRAME_CYCLES;
+                sim_ram[SFR_UIR] |= UIR_URSTIF;
+                hostAddr = pendingAddr = 0;
+                memset(toggleIn, 0, sizeof(toggleIn));
+                memset(toggleOut, 0, sizeof(toggleOut));
+                busActive = 1;
+                dump("RESET", 0, NULL, 0);
+                continue;
+            } else {
+                nextToken = cycles + SIM_TOKEN_CYCLES;
+                if (!token(c))
+                    break;
+            }
+        }
+        pc++;
+        cmdStart = cycles;
+    }
+
+    if (pc == ncmds)
+        sim_finish();
+    inSie = 0;
+}
+/**
+ * irq_step() - Raise USBIF and take the high priority interrupt
+ *
+ * USBIF is set whenever an enabled UIR flag is; the firmware clears it.
+ * As on the core, GIEH is cleared while the vector runs so it is not
+ * entered again, and set back on return.
+ **/
+static void irq_step(void)
+{
+    if (sim_ram[SFR_UIR] & sim_ram[SFR_UIE])
+        sim_ram[SFR_PIR2] |= PIR2_USBIF;
+
+    if (inIsr || inSie || HighPriorityISR == NULL)
+        return;
+    if (!(sim_ram[SFR_PIR2] & sim_ram[SFR_PIE2] & PIR2_USBIF))
+        return;
+    if (!(sim_ram[SFR_RCON] & RCON_IPEN) || !(sim_ram[SFR_IPR2] & IPR2_USBIP) ||
+        !(sim_ram[SFR_INTCON] & INTCON_GIEH))
+        return;
+
+    inIsr = 1;
+    nIrq++;
+    sim_ram[SFR_INTCON] &= ~INTCON_GIEH;
+    HighPriorityISR();
+    sim_ram[SFR_INTCON] |= INTCON_GIEH;
+    inIsr = 0;
+}
+
+/**
+ * tick() - Advance the model by one register access
+ **/
+static void tick(void)
+{
+    accesses++;
+    cycles += SIM_ACCESS_CYCLES;
+
+    if (cycles >= nextFrame) {
+        nextFrame += SIM_FRAME_CYCLES;
+        if (busActive) {
+            frame = (frame + 1) & 0x7FF;
+            sim_ram[SFR_UFRML] = frame & 0xFF;
+            sim_ram[SFR_UFRMH] = frame >> 8;
+            sim_ram[SFR_UIR] |= UIR_SOFIF;
+        }
+    }
+    if (sim_ram[SFR_UCON] & UCON_PPBRST)
+        memset(ppbi, 0, sizeof(ppbi));
+    ustat_step();
+    timer1_step();
+    timer_step();
+    adc_step();
+    eeprom_step();
+    sie_step();
+    irq_step();
+}
+
+volatile void *sim_sfr(unsigned int addr)
+{
+    tick();
+    if (addr == SFR_TMR1L)
+        t1Latch = sim_ram[SFR_TMR1H];
+    else if (addr == SFR_TMR1H && (sim_ram[SFR_T1CON] & T1CON_RD16))
+        return &t1Latch;
+    return &sim_ram[addr];
+}
+
+volatile void *sim_bd(unsigned int addr)
+{
+    tick();
+    return &sim_ram[addr];
+}
+
+void sim_copy(unsigned int bytes, unsigned int cycles, unsigned int generic)
+{
+    nCopy++;
+    copyBytes += bytes;
+    copyCycles += cycles;
+    copyGeneric += generic;
+}
+
+/**
+ * Probes: the firmware objects are built with -finstrument-functions
+ **/
+void __cyg_profile_func_enter(void *fn, void *site)
+    __attribute__((no_instrument_function));
+void __cyg_profile_func_exit(void *fn, void *site)
+    __attribute__((no_instrument_function));
+
+void __cyg_profile_func_enter(void *fn, void *site)
+{
+    unsigned int i;
+
+    (void) site;
+    if (depth == (int) (sizeof(stack) / sizeof(stack[0])))
+        return;
+    stack[depth].p = NULL;
+    for (i = 0; i < NPROBES; i++)
+        if (probes[i].fn == fn)
+            stack[depth].p = &probes[i];
+    stack[depth].start = accesses;
+    depth++;
+}
+
+void __cyg_profile_func_exit(void *fn, void *site)
+{
+    struct probe *p;
+    unsigned long long n;
+
+    (void) fn;
+    (void) site;
+    if (depth == 0)
+        return;
+    depth--;
+    p = stack[depth].p;
+    if (p == NULL)
+        return;
+    n = accesses - stack[depth].start;
+    p->calls++;
+    p->total += n;
+    if (n > p->max)
+        p->max = n;
+}
+
+static void report(void)
+{
+    unsigned int i;
+
+    printf("%-24s %10s %12s %8s %6s\n", "probe", "calls", "accesses", "avg", "max");
+    for (i = 0; i < NPROBES; i++) {
+        struct probe *p = &probes[i];
+        if (p->calls == 0)
+            continue;
+        printf("%-24s %10lu %12llu %8.1f %6llu\n", p->name, p->calls, p->total,
+               (double) p->total / p->calls, p->max);
+    }
+    printf("frames %llu, accesses %llu, SETUP %lu, IN %lu, OUT %lu, NAK %lu, "
+           "STALL %lu, conversions %lu, interrupts %lu\n",
+           cycles / SIM_FRAME_CYCLES, accesses, nSetup, nIn, nOut, nNak, nStall,
+           nConv, nIrq);
+    if (nTrigger)
+        printf("triggers %lu, results not collected %lu\n", nTrigger, nMissed);
+    if (nEeprom)
+        printf("EEPROM bytes written %lu\n", nEeprom);
+    if (nCopy)
+        printf("copies %lu, %lu bytes in %lu cycles, %lu with generic "
+               "pointers (%.1fx), estimated\n", nCopy, copyBytes, copyCycles,
+               copyGeneric, (double) copyGeneric / copyCycles);
+}
+
+static void sim_finish(void)
+{
+    longjmp(finish, 1);
+}
+
+/**
+ * Script parsing
+ **/
+static unsigned long number(const char *s, int line)
+{
+    char *end;
+    unsigned long v = strtoul(s, &end, 0);
+
+    if (*s == '\0' || *end != '\0') {
+        fprintf(stderr, "line %d: bad number '%s'\n", line, s);
+        exit(2);
+    }
+    return v;
+}
+
+static void parse_data(struct cmd *c, char *s)
+{
+    char *tok;
+
+    c->expect = EXP_DATA;
+    c->len = 0;
+    while (*s == ' ' || *s == '\t')
+        s++;
+    if (*s == '"') {
+        char *end = strchr(s + 1, '"');
+        if (end == NULL) {
+            fprintf(stderr, "line %d: unterminated string\n", c->line);
+            exit(2);
+        }
+        c->len = end - s - 1;
+        memcpy(c->data, s + 1, c->len);
+        s = end + 1;            /* Then 'stall' or 'none' */
+    }
+    for (tok = strtok(s, " \t"); tok; tok = strtok(NULL, " \t")) {
+        if (!strcmp(tok, "*"))
+            c->expect = c->len ? EXP_PREFIX : EXP_ANY;
+        else if (!strcmp(tok, "stall"))
+            c->expect = EXP_STALL;
+        else if (!strcmp(tok, "nak"))
+            c->expect = EXP_NAK;
+        else if (!strcmp(tok, "none"))
+            c->expect = EXP_NONE;
+        else if (c->len < SIM_MAX_DATA) {
+            if (!strcmp(tok, "??"))
+                c->any[c->len / 8] |= 1 << (c->len % 8);
+            c->data[c->len++] = strtoul(tok, NULL, 16);
+        }
+    }
+}
+
+static void load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    char line[4096];
+    int n = 0;
+
+    if (f == NULL) {
+        perror(path);
+        exit(2);
+    }
+    cmds = calloc(SIM_MAX_CMDS, sizeof(*cmds));
+
+    while (fgets(line, sizeof(line), f)) {
+        struct cmd *c = &cmds[ncmds];
+        char *hash = strchr(line, '#');
+        char op[16], a[32], b[32];
+        char *rest;
+        int used = 0;
+
+        n++;
+        if (hash)
+            *hash = '\0';
+        line[strcspn(line, "\r\n")] = '\0';
+        if (sscanf(line, " %15s%n", op, &used) != 1)
+            continue;
+        if (ncmds == SIM_MAX_CMDS) {
+            fprintf(stderr, "%s: too many commands\n", path);
+            exit(2);
+        }
+        rest = line + used;
+        c->line = n;
+
+        if (!strcmp(op, "reset")) {
+            c->op = CMD_RESET;
+        } else if (!strcmp(op, "setup")) {
+            unsigned long f[5];
+            char s[5][32];
+            int i;
+            c->op = CMD_SETUP;
+            if (sscanf(rest, "%31s %31s %31s %31s %31s", s[0], s[1], s[2], s[3], s[4]) != 5) {
+                fprintf(stderr, "line %d: setup needs 5 fields\n", n);
+                exit(2);
+            }
+            for (i = 0; i < 5; i++)
+                f[i] = number(s[i], n);
+            c->data[0] = f[0];
+            c->data[1] = f[1];
+            c->data[2] = f[2] & 0xFF;
+            c->data[3] = f[2] >> 8;
+            c->data[4] = f[3] & 0xFF;
+            c->data[5] = f[3] >> 8;
+            c->data[6] = f[4] & 0xFF;
+            c->data[7] = f[4] >> 8;
+            c->len = 8;
+        } else if (!strcmp(op, "in") || !strcmp(op, "out")) {
+            int used2 = 0;
+            c->op = (op[0] == 'i') ? CMD_IN : CMD_OUT;
+            if (sscanf(rest, " %31s%n", a, &used2) != 1) {
+                fprintf(stderr, "line %d: missing endpoint\n", n);
+                exit(2);
+            }
+            c->ep = number(a, n) & 0x0F;
+            parse_data(c, rest + used2);
+        } else if (!strcmp(op, "adc")) {
+            char *tok;
+            c->op = CMD_ADC;
+            for (tok = strtok(rest, " \t"); tok; tok = strtok(NULL, " \t")) {
+                if (!strncmp(tok, "an", 2)) {
+                    c->reg = number(tok + 2, n) % SIM_ADC_ANY + 1;
+                    continue;
+                }
+                unsigned long v = number(tok, n);
+                c->data[2 * c->len] = v & 0xFF;
+                c->data[2 * c->len + 1] = v >> 8;
+                c->len++;
+            }
+        } else if (!strcmp(op, "wait")) {
+            c->op = CMD_WAIT;
+            if (sscanf(rest, "%31s", a) != 1) {
+                fprintf(stderr, "line %d: wait needs a frame count\n", n);
+                exit(2);
+            }
+            c->arg = number(a, n);
+        } else if (!strcmp(op, "check")) {
+            unsigned int i;
+            c->op = CMD_CHECK;
+            if (sscanf(rest, "%31s %31s", a, b) != 2) {
+                fprintf(stderr, "line %d: check needs a register and a value\n", n);
+                exit(2);
+            }
+            c->reg = 0;
+            if (!strcmp(a, "state"))
+                c->reg = 0xFFFF;
+            else if (!strncmp(a, "ee", 2))
+                c->reg = SIM_CHECK_EEPROM | (number(a + 2, n) % SIM_EEPROM_SIZE);
+            for (i = 0; i < NREGS; i++)
+                if (!strcmp(a, regs[i].name))
+                    c->reg = regs[i].addr;
+            if (c->reg == 0) {
+                fprintf(stderr, "line %d: unknown register '%s'\n", n, a);
+                exit(2);
+            }
+            c->arg = number(b, n);
+        } else if (!strcmp(op, "eeprom")) {
+            unsigned long addr;
+            unsigned int i;
+            int used2 = 0;
+            if (sscanf(rest, " %31s%n", a, &used2) != 1) {
+                fprintf(stderr, "line %d: eeprom needs an address\n", n);
+                exit(2);
+            }
+            addr = number(a, n);
+            parse_data(c, rest + used2);
+            if (addr + c->len > SIM_EEPROM_SIZE) {
+                fprintf(stderr, "line %d: past the end of the EEPROM\n", n);
+                exit(2);
+            }
+            for (i = 0; i < c->len; i++)
+                eeprom[addr + i] = c->data[i];
+            memset(c, 0, sizeof(*c));
+            continue;
+        } else {
+            fprintf(stderr, "line %d: unknown command '%s'\n", n, op);
+            exit(2);
+        }
+        ncmds++;
+    }
+    fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    const char *script = NULL;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-v"))
+            verbose = 1;
+        else
+            script = argv[i];
+    }
+    if (script == NULL) {
+        fprintf(stderr, "usage: %s [-v] scenario.sim\n", argv[0]);
+        return 2;
+    }
+    memset(eeprom, 0xFF, sizeof(eeprom));
+    load(script);
+
+    /* Power on values that matter to the firmware */
+    sim_ram[SFR_UEP0] = 0;
+    sim_ram[SFR_ADCON1] = 0x00;
+
+    if (setjmp(finish) == 0)
+        firmware_main();
+
+    report();
+    printf("%s: %s\n", script, failed ? "FAILED" : "ok");
+    return failed;
+}
@@ -0,0 +1,123 @@
+/*   sim.h - Register file and SIE model for the host build of the firmware.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+/**
+ * The whole 4 KB data space of the 18F4550 is modeled as a flat array, so
+ * SFRs and the BDT (0x0400) live at their real addresses.
+ **/
+#define SIM_RAM_SIZE 0x1000
+
+extern unsigned char sim_ram[SIM_RAM_SIZE];
+
+/**
+ * Register addresses (PIC18F4550 datasheet, table 5-1)
+ **/
+#define SFR_UFRML   0xF66
+#define SFR_UFRMH   0xF67
+#define SFR_UIR     0xF68
+#define SFR_UIE     0xF69
+#define SFR_UEIR    0xF6A
+#define SFR_UEIE    0xF6B
+#define SFR_USTAT   0xF6C
+#define SFR_UCON    0xF6D
+#define SFR_UADDR   0xF6E
+#define SFR_UCFG    0xF6F
+#define SFR_UEP0    0xF70
+
+#define SFR_PORTA   0xF80
+#define SFR_PORTB   0xF81
+#define SFR_PORTC   0xF82
+#define SFR_PORTD   0xF83
+#define SFR_PORTE   0xF84
+#define SFR_LATA    0xF89
+#define SFR_LATB    0xF8A
+#define SFR_LATC    0xF8B
+#define SFR_LATD    0xF8C
+#define SFR_LATE    0xF8D
+#define SFR_TRISA   0xF92
+#define SFR_TRISB   0xF93
+#define SFR_TRISC   0xF94
+#define SFR_TRISD   0xF95
+#define SFR_TRISE   0xF96
+
+#define SFR_PIE1    0xF9D
+#define SFR_PIR1    0xF9E
+#define SFR_IPR1    0xF9F
+#define SFR_PIE2    0xFA0
+#define SFR_PIR2    0xFA1
+#define SFR_IPR2    0xFA2
+
+#define SFR_EECON1  0xFA6
+#define SFR_EECON2  0xFA7
+#define SFR_EEDATA  0xFA8
+#define SFR_EEADR   0xFA9
+
+#define SFR_T3CON   0xFB1
+#define SFR_TMR3L   0xFB2
+#define SFR_TMR3H   0xFB3
+#define SFR_CCP2CON 0xFBA
+#define SFR_CCPR2L  0xFBB
+#define SFR_CCPR2H  0xFBC
+
+#define SFR_ADCON2  0xFC0
+#define SFR_ADCON1  0xFC1
+#define SFR_ADCON0  0xFC2
+#define SFR_ADRESL  0xFC3
+#define SFR_ADRESH  0xFC4
+
+#define SFR_T1CON   0xFCD
+#define SFR_TMR1L   0xFCE
+#define SFR_TMR1H   0xFCF
+
+#define SFR_RCON    0xFD0
+#define SFR_INTCON3 0xFF0
+#define SFR_INTCON2 0xFF1
+#define SFR_INTCON  0xFF2
+
+/**
+ * Hooks called by the register shim (pic18fregs.h).  Every access from the
+ * firmware goes through one of them so the model can count the work done
+ * and let the SIE and the A/D module make progress.
+ **/
+volatile void *sim_sfr(unsigned int addr);
+volatile void *sim_bd(unsigned int addr);
+
+/**
+ * sim_copy() - Account one call of a copy kernel (copy.c)
+ * @bytes:      Bytes copied
+ * @cycles:     Instruction cycles the kernel is estimated to take on the PIC
+ * @generic:    The same estimate for the generic pointer loop it replaces
+ *
+ * Only added up for the report, the clock does not move.
+ **/
+void sim_copy(unsigned int bytes, unsigned int cycles, unsigned int generic);
+
+/**
+ * sim_ptr16() - 16 bit data address of a firmware object
+ * @p:           Pointer to the object
+ *
+ * The firmware stores buffer addresses into the BDT with PTR16().  Objects
+ * inside sim_ram keep their real address; anything else gets a synthetic
+ * address above 0x8000 that the SIE model resolves back to the host object.
+ **/
+unsigned short sim_ptr16(const volatile void *p);
+
+#endif /* SIM_H */
@@ -0,0 +1,284 @@
+/*   stream.c - Continuous acquisition to the host through EP1 IN.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pic18fregs.h>
+#include "usb.h"
+#include "stream.h"
+#include "adc.h"
+#include "decim.h"
+
+#define FIFO_MASK (STREAM_FIFO_SIZE - 1)
+
+/**
+ * head and tail are bytes, so one entry of a 256 sample FIFO stays empty:
+ * a full one would look empty
+ **/
+#define FIFO_ROOM (STREAM_FIFO_SIZE - STREAM_FIFO_SIZE / 256)
+
+#if STREAM_FIFO_SIZE > 256 || (STREAM_FIFO_SIZE & FIFO_MASK)
+#error "STREAM_FIFO_SIZE must be a power of two for byte indexes"
+#endif
+#if STREAM_FIFO_SIZE * 2 > USB_FIFO_BYTES
+#error "STREAM_FIFO_SIZE does not fit in the dual port USB RAM"
+#endif
+
+byte streaming;
+unsigned long streamPackets;
+unsigned long streamLost;
+unsigned long streamOverruns;
+byte streamHigh;
+
+/**
+ * Samples are queued here by the acquisition code and taken out a packet at
+ * a time.  head and tail run freely, only their difference matters.
+ **/
+#if defined(SIM)
+#define fifo (*(word (*)[STREAM_FIFO_SIZE]) SIM_DPRAM(USB_FIFO))
+#else
+static word at USB_FIFO fifo[STREAM_FIFO_SIZE];
+#endif
+static byte head;
+static byte tail;
+static byte flags;
+static byte keep;
+static byte overrun;            /* Dropped since the last packet was sent */
+static byte refused;            /* The SIE held the packet waiting back   */
+
+/**
+ * Header fields of every packet in the FIFO, taken when its first sample
+ * is queued.  fill counts the samples queued towards the last packet;
+ * whole packets only ever leave the FIFO, and the samples of a packet
+ * are always consecutive.
+ **/
+#define STAMPS      16
+#define STAMP_MASK  (STAMPS - 1)
+
+#if STREAM_FIFO_SIZE / STREAM_PACKET16_SAMPLES + 1 > STAMPS
+#error "STAMPS too small for the FIFO"
+#endif
+
+static unsigned long stampFrame[STAMPS];
+static unsigned long stampIndex[STAMPS];
+static byte stampFlags[STAMPS];
+static byte stampPos[STAMPS];
+static byte stampHead;
+static byte stampTail;
+static byte fill;
+static unsigned long sampleIndex;
+static word sequence;
+
+/**
+ * PacketSamples() - Samples in a packet of the layout in use
+ **/
+static byte PacketSamples(void)
+{
+  return (decimMode == DECIM_OFF) ? STREAM_PACKET_SAMPLES : STREAM_PACKET16_SAMPLES;
+}
+
+/**
+ * PutLong() -  Store a 32 bit number, least significant byte first
+ **/
+static void PutLong(byte *p, unsigned long value)
+{
+  p[0] = (byte) value;
+  p[1] = (byte) (value >> 8);
+  p[2] = (byte) (value >> 16);
+  p[3] = (byte) (value >> 24);
+}
+
+/**
+ * StreamStart() - Empty the FIFO and start sending samples
+ **/
+void StreamStart(void)
+{
+  head = 0;
+  tail = 0;
+  stampHead = 0;
+  stampTail = 0;
+  fill = 0;
+  sampleIndex = 0;
+  sequence = 0;
+  flags = 0;
+  keep = 1;
+  overrun = 0;
+  refused = 0;
+  streaming = 1;
+}
+
+/**
+ * StreamRestart() - Drop the queued samples after a change of settings
+ *
+ * The next packet carries STREAM_RESTART so the host knows where the new
+ * settings start.  Sequence numbers and sample indexes carry on, the
+ * dropped samples show as a gap.
+ **/
+void StreamRestart(void)
+{
+  USBLock();
+  streamLost += (byte) (head - tail);
+  USBUnlock();
+  head = 0;
+  tail = 0;
+  stampHead = 0;
+  stampTail = 0;
+  fill = 0;
+  keep = 1;
+  overrun = 0;
+  flags = STREAM_RESTART;
+}
+
+/**
+ * StreamStop() - Stop sending samples
+ *
+ * Whatever is still in the FIFO is dropped.  A packet already handed to the
+ * SIE is still delivered to the host.
+ **/
+void StreamStop(void)
+{
+  streaming = 0;
+}
+
+/**
+ * StreamPut() - Queue one sample
+ * @pos:         Position in the scan list of the entry it comes from
+ * @sample:      Right justified A/D result or decimated sample
+ *
+ * Samples are dropped when the FIFO is full, the host is not reading fast
+ * enough and there is nowhere else to keep them.  A scan round is queued
+ * whole or not at all, and so is the packet being filled when it happens,
+ * so the scan position in a packet header is enough to tell the channel
+ * of every sample and the gap in the sample indexes is the loss.
+ **/
+void StreamPut(byte pos, word sample)
+{
+  if (pos == 0)
+    keep = (byte) (FIFO_ROOM - (byte) (head - tail)) >= scanCount;
+  if (!keep) {
+    flags |= STREAM_DROPPED;
+    sampleIndex++;
+    USBLock();
+    streamLost += 1 + fill;
+    if (!overrun)
+      streamOverruns++;
+    USBUnlock();
+    overrun = 1;
+    if (fill) {
+      head -= fill;
+      stampHead--;
+      flags |= stampFlags[stampHead & STAMP_MASK];
+      fill = 0;
+    }
+    return;
+  }
+  if (fill == 0) {
+    stampFrame[stampHead & STAMP_MASK] = FrameNumber();
+    stampIndex[stampHead & STAMP_MASK] = sampleIndex;
+    stampFlags[stampHead & STAMP_MASK] = flags;
+    stampPos[stampHead & STAMP_MASK] = pos;
+    stampHead++;
+    flags = 0;
+  }
+  if (++fill == PacketSamples())
+    fill = 0;
+  fifo[head & FIFO_MASK] = sample;
+  head++;
+  sampleIndex++;
+  USBLock();                    /* GET_COUNTERS may clear it meanwhile */
+  if ((byte) (head - tail) > streamHigh)
+    streamHigh = (byte) (head - tail);
+  USBUnlock();
+}
+
+/**
+ * StreamService() - Send a packet if there is one ready
+ *
+ * Called from the main loop.  A packet is only built when there are enough
+ * samples to fill it and one of the EP1 IN buffers is free, so the function
+ * never waits.  With ping-pong BDs the next packet is built while the SIE
+ * is still sending the previous one.
+ *
+ * The packet is built straight in the dual port RAM (BulkInLease()), there
+ * is no copy on the way to the SIE.  A packet that has to wait for the
+ * SIE to free a BD counts once in usbInBusy.
+ **/
+void StreamService(void)
+{
+  byte i, low, n, len;
+  byte *packet, *p;
+  word sample;
+
+  if (!streaming)
+    return;
+  n = PacketSamples();
+  if ((byte) (head - tail) < n)
+    return;
+  packet = BulkInLease(1);
+  if (packet == 0) {
+    if (!refused) {             /* Once per packet, not per pass */
+      refused = 1;
+      USBLock();
+      usbInBusy++;
+      USBUnlock();
+    }
+    return;
+  }
+  refused = 0;
+
+  packet[1] = n;
+  packet[2] = stampFlags[stampTail & STAMP_MASK];
+  packet[3] = stampPos[stampTail & STAMP_MASK];
+  packet[4] = (byte) sequence;
+  packet[5] = (byte) (sequence >> 8);
+  PutLong(&packet[6], stampFrame[stampTail & STAMP_MASK]);
+  PutLong(&packet[10], stampIndex[stampTail & STAMP_MASK]);
+  stampTail++;
+  sequence++;
+
+  if (decimMode == DECIM_OFF) {
+    packet[0] = STREAM_PACKED10;
+    p = &packet[STREAM_HEADER_BYTES];
+    low = 0;
+    for (i = 0; i < n; i++) {
+      sample = fifo[tail & FIFO_MASK];
+      tail++;
+      *p++ = (byte) (sample >> 2);
+      low = (low >> 2) | ((byte) sample << 6);
+      if ((i & 3) == 3)
+        *p++ = low;
+    }
+    len = STREAM_PACKET_BYTES;
+  }
+  else {
+    packet[0] = STREAM_WORD16;
+    packet[STREAM_HEADER_BYTES] = decimMode;
+    packet[STREAM_HEADER_BYTES + 1] = decimFactor;
+    p = &packet[STREAM_HEADER16_BYTES];
+    for (i = 0; i < n; i++) {
+      sample = fifo[tail & FIFO_MASK];
+      tail++;
+      *p++ = (byte) sample;
+      *p++ = (byte) (sample >> 8);
+    }
+    len = STREAM_PACKET16_BYTES;
+  }
+  BulkInCommit(1, len);
+  overrun = 0;
+  USBLock();
+  streamPackets++;
+  USBUnlock();
+}
@@ -0,0 +1,95 @@
+/*   stream.h - Continuous acquisition to the host through EP1 IN.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+/**
+ * Commands sent by the host as the first byte of an EP1 OUT packet.
+ * Any other byte keeps the old behaviour: one conversion per request.
+ **/
+#define STREAM_START 'S'
+#define STREAM_STOP  'E'
+
+/**
+ * Samples waiting to be sent, as many as the dual port RAM the endpoints
+ * leave free holds (usbmem.h)
+ **/
+#define STREAM_FIFO_SIZE USB_FIFO_SAMPLES
+
+/**
+ * EP1 IN packet layout, raw conversions (DECIM_OFF).  Numbers wider than
+ * a byte are sent least significant byte first.
+ *
+ *   byte 0      STREAM_PACKED10
+ *   byte 1      number of samples in the packet
+ *   byte 2      flags (STREAM_DROPPED, STREAM_RESTART)
+ *   byte 3      position in the scan list of the first sample, the
+ *               following samples go round the list in order
+ *   byte 4..5   sequence number, 0 for the first packet after STREAM_START
+ *   byte 6..9   USB frame number (FrameNumber()) when the first sample
+ *               was queued
+ *   byte 10..13 index of the first sample: samples queued or dropped since
+ *               STREAM_START.  Consecutive packets have consecutive
+ *               indexes unless samples were lost.
+ *   byte 14..   samples, packed 4 in 5 bytes: the high 8 bits of each of
+ *               the 4 samples, then one byte with their low 2 bits
+ *               (sample 0 in bits 1..0, sample 3 in bits 7..6)
+ **/
+#define STREAM_HEADER_BYTES   14
+#define STREAM_PACKED10       0x0A
+#define STREAM_DROPPED        0x01  /* Samples were lost before this packet */
+#define STREAM_RESTART        0x02  /* Acquisition reconfigured, this is the
+                                       first packet with the new settings  */
+
+#define STREAM_PACKET_SAMPLES (((OUTPUT_BYTES - STREAM_HEADER_BYTES) / 5) * 4)
+#define STREAM_PACKET_BYTES   (STREAM_HEADER_BYTES + STREAM_PACKET_SAMPLES / 4 * 5)
+
+/**
+ * EP1 IN packet layout, decimated samples (decim.h)
+ *
+ *   byte 0..13  as above, with STREAM_WORD16 in byte 0
+ *   byte 14     decimation mode (DECIM_*)
+ *   byte 15     conversions behind each sample (N)
+ *   byte 16..   samples, 16 bits each
+ **/
+#define STREAM_WORD16         0x10
+#define STREAM_HEADER16_BYTES (STREAM_HEADER_BYTES + 2)
+#define STREAM_PACKET16_SAMPLES ((OUTPUT_BYTES - STREAM_HEADER16_BYTES) / 2)
+#define STREAM_PACKET16_BYTES (STREAM_HEADER16_BYTES + STREAM_PACKET16_SAMPLES * 2)
+
+/**
+ * Set while the firmware is streaming
+ **/
+extern byte streaming;
+
+/**
+ * Stream events since power up, for VR_GET_COUNTERS (vendor.h)
+ **/
+extern unsigned long streamPackets;   /* Packets handed to the SIE         */
+extern unsigned long streamLost;      /* Samples dropped                   */
+extern unsigned long streamOverruns;  /* Times the FIFO filled up          */
+extern byte streamHigh;               /* Most samples held, until cleared  */
+
+void StreamStart(void);
+void StreamRestart(void);
+void StreamStop(void);
+void StreamPut(byte pos, word sample);
+void StreamService(void);
+
+#endif /* STREAM_H */
@@ -20,6 +20,10 @@
 #include <string.h>
 #include <stdio.h>
 #include "usb.h"
+#include "serial.h"
+#include "prof.h"
+#include "copy.h"
+#include "stream.h"
 
 
 /**
@@ -33,10 +37,11 @@
  **/
 #define DEVICE_DESCRIPTOR_SIZE  0x12
 #define CONFIG_HEADER_SIZE      0x09
-#define CONFIG_DESCRIPTOR_SIZE  0x25
+#define CONFIG_DESCRIPTOR_SIZE  0x43
 /**
- * The total size of the configuration descriptor
- * 0x09	 +  0x09  +  0x07  +  0x07  =  0x20 
+ * The total size of the configuration descriptor, the header and two
+ * alternate settings of one interface, with four endpoints and three
+ * 0x09  +  (0x09  +  4 * 0x07)  +  (0x09  +  3 * 0x07)  =  0x4C
  **/
 
 #define CFSZ CONFIG_HEADER_SIZE+CONFIG_DESCRIPTOR_SIZE
@@ -64,6 +69,17 @@ byte remoteWakeup;
 byte deviceAddress;
 byte selfPowered;
 byte currentConfiguration;
+byte currentAltSetting;
+
+/**
+ * Bus events since power up, see usb.h
+ **/
+unsigned long usbInBusy;
+unsigned long usbStalls;
+unsigned long usbResets;
+unsigned long usbSuspends;
+unsigned long usbErrors;
+byte usbErrorBits;
 
 /* Control Transfer Stages - see USB spec chapter 5                          */
 /* Start of a control transfer (followed by 0 or more data stages)           */
@@ -76,10 +92,14 @@ byte ctrlTransferStage; /* Holds the current stage in a control transfer     */
 byte requestHandled;    /* Set to 1 if request was understood and processed. */
 
 byte *outPtr;           /* Data to send to the host                          */
+byte outCode;           /* Set if outPtr is in program memory                */
 byte *inPtr;            /* Data from the host                                */
 word wCount;            /* Number of bytes of data                           */
 byte RxLen;             /* # de bytes colocados dentro del buffer            */
 
+static word frameLast;  /* UFRM when it was last read                        */
+static word frameEpoch; /* Times UFRM has wrapped round                      */
+
 /**
  * Device Descriptor
  **/
@@ -92,12 +112,28 @@ code byte deviceDescriptor[] = {
     0x31, 0x75,                   /* idProduct (LB), idProduct (HB)          */
     0x01, 0x00,                   /* bcdDevice (LB), bcdDevice (HB)          */
     0x01, 0x02,                   /* iManufacturer, iProduct                 */
-    0x00, 0x01                    /* iSerialNumber (none), bNumConfigurations*/
+    SERIAL_STRING_INDEX, 0x01     /* iSerialNumber, bNumConfigurations       */
 };
 
-#define ISZ 7                /* wMaxPacketSize (low) of endopoint1IN         */
-#define OSZ 7                /* wMaxPacketSize (low) of endopoint1OUT        */
-#define OSZ2 1               /* wMaxPacketSize (low) of endopoint2OUT        */
+#define ISZ OUTPUT_BYTES     /* wMaxPacketSize (low) of endopoint1IN         */
+#define OSZ INPUT_BYTES      /* wMaxPacketSize (low) of endopoint1OUT        */
+#define ISZ2 OUTPUT_BYTES2   /* wMaxPacketSize (low) of endopoint2IN         */
+#define OSZ2 INPUT_BYTES2    /* wMaxPacketSize (low) of endopoint2OUT        */
+
+/**
+ * In ALT_ISO the host polls EP1 IN every ISO_FRAMES frames, the largest
+ * power of two, up to 32, at which a stream packet (stream.h) still
+ * carries ISO_RATE conversions a second.  bInterval is log2 of it plus one
+ * (USB 2.0, table 9-13).
+ **/
+#define ISO_FRAMES (STREAM_PACKET_SAMPLES * 1000UL / ISO_RATE)
+#define ISO_INTERVAL (ISO_FRAMES >= 32 ? 6 : ISO_FRAMES >= 16 ? 5 : \
+                      ISO_FRAMES >= 8 ? 4 : ISO_FRAMES >= 4 ? 3 : \
+                      ISO_FRAMES >= 2 ? 2 : 1)
+
+#if ISO_FRAMES < 1
+#error "ISO_RATE needs more than one stream packet a frame"
+#endif
 
 /**
  * Configuration Descriptor
@@ -112,9 +148,9 @@ code ConfigStruct configDescriptor = {
     0x32,                     /* bMaxPower (100 mA)                          */
     },
     {
-    /* Interface Descriptor   */
+    /* Interface Descriptor, ALT_BULK */
     0x09, 0x04,               /* bLength, bDescriptorType (Interface)        */
-    0x00, 0x00,               /* bInterfaceNumber, bAlternateSetting         */
+    0x00, ALT_BULK,           /* bInterfaceNumber, bAlternateSetting         */
     0x04, 0x07,               /* bNumEndpoints, bInterfaceClass (Printer)    */
     0x01, 0x00,               /* bInterfaceSubclass, bInterfaceProtocol      */
     0x00,                     /* iInterface                                  */
@@ -131,7 +167,29 @@ code ConfigStruct configDescriptor = {
     /* EP2 IN */
     0x07, 0x05,               /* bLength, bDescriptorType (Endpoint)         */
     0x82, 0x02,               /* bEndpointAddress, bmAttributes (Bulk)       */
+    ISZ2, 0x00,               /* wMaxPacketSize (L), wMaxPacketSize (H)      */
+    0x01,                     /* bInterval (1 millisecond)                   */
+    /* EP2 OUT */
+    0x07, 0x05,               /* bLength, bDescriptorType (Endpoint)         */
+    0x02, 0x02,               /* bEndpointAddress, bmAttributes (Bulk)       */
+    OSZ2, 0x00,               /* wMaxPacketSize (L), wMaxPacketSize (H)      */
+    0x01,                     /* bInterval (1 millisecond)                   */
+    /* Interface Descriptor, ALT_ISO: EP1 IN isochronous, no EP1 OUT */
+    0x09, 0x04,               /* bLength, bDescriptorType (Interface)        */
+    0x00, ALT_ISO,            /* bInterfaceNumber, bAlternateSetting         */
+    0x03, 0x07,               /* bNumEndpoints, bInterfaceClass (Printer)    */
+    0x01, 0x00,               /* bInterfaceSubclass, bInterfaceProtocol      */
+    0x00,                     /* iInterface                                  */
+    /* EP1 IN */
+    0x07, 0x05,               /* bLength, bDescriptorType (Endpoint)         */
+    0x81, 0x05,               /* bEndpointAddress, bmAttributes (Isochronous,
+                                 asynchronous)                               */
     ISZ, 0x00,                /* wMaxPacketSize (L), wMaxPacketSize (H)      */
+    ISO_INTERVAL,             /* bInterval (every ISO_FRAMES milliseconds)   */
+    /* EP2 IN */
+    0x07, 0x05,               /* bLength, bDescriptorType (Endpoint)         */
+    0x82, 0x02,               /* bEndpointAddress, bmAttributes (Bulk)       */
+    ISZ2, 0x00,               /* wMaxPacketSize (L), wMaxPacketSize (H)      */
     0x01,                     /* bInterval (1 millisecond)                   */
     /* EP2 OUT */
     0x07, 0x05,               /* bLength, bDescriptorType (Endpoint)         */
@@ -165,131 +223,300 @@ code byte stringDescriptor2[] = {
     '0', 0x00, '.', 0x00, '1', 0x00,
 };
 
-volatile BDT at 0x0400 ep0Bo; /* Endpoint #0 BD OUT     */
-volatile BDT at 0x0404 ep0Bi; /* Endpoint #0 BD IN      */
-volatile BDT at 0x0408 ep1Bo; /* Endpoint #1 BD OUT     */
-volatile BDT at 0x040C ep1Bi; /* Endpoint #1 BD IN      */
-volatile BDT at 0x0410 ep2Bo; /* Endpoint #2 BD OUT     */
-volatile BDT at 0x0414 ep2Bi; /* Endpoint #2 BD IN      */
+#if !defined(SIM)
+/**
+ * Everything the SIE sees goes where usbmem.h says
+ **/
+volatile BDT at USB_BD0_OUT ep0Bo;    /* Endpoint #0 BD OUT     */
+volatile BDT at USB_BD0_IN ep0Bi;     /* Endpoint #0 BD IN      */
+volatile BDT at USB_BD(1, 0) ep1Bo[2]; /* Endpoint #1 BDs OUT (even, odd) */
+volatile BDT at USB_BD(1, 1) ep1Bi[2]; /* Endpoint #1 BDs IN  (even, odd) */
+volatile BDT at USB_BD(2, 0) ep2Bo[2]; /* Endpoint #2 BDs OUT (even, odd) */
+volatile BDT at USB_BD(2, 1) ep2Bi[2]; /* Endpoint #2 BDs IN  (even, odd) */
 
 /*
- * Put endpoint 0 buffers into dual port RAM
+ * Endpoint 0 buffers
  **/
-#pragma udata usbram5 SetupPacket controlTransferBuffer
-volatile setupPacketStruct SetupPacket;
-volatile byte controlTransferBuffer[E0SZ];
+volatile setupPacketStruct at USB_SETUP SetupPacket;
+volatile byte at USB_CTRL controlTransferBuffer[E0SZ];
 
 /**
- * Put I/O buffersinto dual port USB RAM
+ * Every bulk endpoint direction has an even and an odd buffer
  **/
-#pragma udata usbram5 RxBuffer TxBuffer 
-#pragma udata usbram6 RxBuffer2 TxBuffer2
+volatile byte at USB_EP1_OUT RxBuffer[2][OSZ];
+volatile byte at USB_EP1_IN TxBuffer[2][ISZ];
+volatile byte at USB_EP2_OUT RxBuffer2[2][OSZ2];
+volatile byte at USB_EP2_IN TxBuffer2[2][ISZ2];
+#endif
 
-/** 
- * Specific Buffers
+/**
+ * Endpoint table, indexed by endpoint number and direction (0 OUT, 1 IN).
+ * Where the BDs and buffers are comes from usbmem.h, what the endpoint is
+ * from the sizes in usb.h; pp and dts are the state the firmware keeps:
+ * the BD (EVEN/ODD) it uses next and the data toggle of the next IN
+ * packet.  The SIE walks the BDs in the same order, so pp always matches
+ * its own ping-pong pointer.  A direction with size 0 is not enabled;
+ * EP0 is only here for its BDs, the control transfer code drives it.
+ *
+ * Adding a data endpoint is a line here, its sizes in usb.h, its place in
+ * usbmem.h and its descriptors.
+ **/
+#if UCFG_PPB != 0x03
+#error "EP0 needs a single BD per direction and the others an even and an odd one"
+#endif
+
+#define USB_EPS (USB_DATA_EPS + 1)
+
+typedef struct {
+        volatile BDT *bd;       /* Even BD, the odd one follows          */
+        byte *buffer[2];        /* Even and odd buffers                  */
+        byte size;              /* wMaxPacketSize                        */
+        byte type;              /* EP_* (usb.h)                          */
+        byte pp;                /* EVEN/ODD, next BD to use              */
+        byte dts;               /* DTS of the next IN packet             */
+} Endpoint;
+
+#define EP_DIR(bd, buf, size, type) \
+        { USB_PTR(volatile BDT, bd), \
+          { USB_PTR(byte, buf), USB_PTR(byte, (buf) + (size)) }, \
+          size, type, EVEN, 0 }
+
+static Endpoint endpoints[USB_EPS][2] = {
+        { EP_DIR(USB_BD0_OUT, USB_SETUP, 0, EP_CONTROL),
+          EP_DIR(USB_BD0_IN, USB_CTRL, 0, EP_CONTROL) },
+        { EP_DIR(USB_BD(1, 0), USB_EP1_OUT, OSZ, EP_BULK),
+          EP_DIR(USB_BD(1, 1), USB_EP1_IN, ISZ, EP_BULK) },
+        { EP_DIR(USB_BD(2, 0), USB_EP2_OUT, OSZ2, EP_BULK),
+          EP_DIR(USB_BD(2, 1), USB_EP2_IN, ISZ2, EP_BULK) },
+};
+
+/**
+ * DataEndpoint() - Table entry of a data endpoint
+ * @ep_num:         Endpoint number
+ * @in:             Non zero for the IN direction
+ *
+ * Returns 0 for EP0, an endpoint that does not exist or a direction it
+ * does not have.
+ **/
+static Endpoint *DataEndpoint(byte ep_num, byte in)
+{
+        Endpoint *e;
+
+        if (ep_num == 0 || ep_num >= USB_EPS)
+                return 0;
+        e = &endpoints[ep_num][in ? 1 : 0];
+        return e->size ? e : 0;
+}
+
+/**
+ * Isochronous endpoints have neither handshakes nor data toggles
  **/
-volatile byte RxBuffer[OSZ];
-volatile byte TxBuffer[ISZ];
-volatile byte RxBuffer2;
-volatile byte TxBuffer2[ISZ];
+#define EP_SYNC(e) ((e)->type == EP_ISO ? 0 : DTSEN)
+
+/**
+ * EndpointBD() - Even buffer descriptor of an endpoint
+ * @num:          Endpoint number, below USB_EPS
+ * @dir:          Non zero for the IN direction
+ **/
+#define EndpointBD(num, dir) (endpoints[num][(dir) ? 1 : 0].bd)
 
 /** 
  * Enpoints Initialization
+ *
+ * Loads the BDs of every endpoint in the table and enables it: both OUT
+ * BDs wait for data (the even one gets the DATA0 packets, the odd one the
+ * DATA1 packets), the IN BDs stay with the CPU until there is something
+ * to send.
  **/
 void InitEndpoint(void)
 {
-    	/* Turn on both IN and OUT for this endpoints (EP1 & EP2)       */
-        UEP1 = 0x1E;  /* See PIC datasheet, page 169 (USB E1 Control)   */
-        UEP2 = 0x1E;  /* Same as above for EP2                          */
-	/** 
-         * Load EP1's BDT
-         **/
-        ep1Bo.Cnt = sizeof(RxBuffer);
-	ep1Bo.ADDR = PTR16(&RxBuffer);
-	ep1Bo.Stat = UOWN | DTSEN;
-	ep1Bi.ADDR = PTR16(&TxBuffer);
-	ep1Bi.Stat = DTS;
-	/** 
-         * Load de EP2's BDT
+        Endpoint *e;
+        byte n, uep;
+
+        /**
+         * Point the SIE back to the even BDs
          **/
-        ep2Bo.Cnt = RxBuffer2;
-	ep2Bo.ADDR = PTR16(&RxBuffer2);
-	ep2Bo.Stat = UOWN | DTSEN;
-	ep2Bi.ADDR = PTR16(&TxBuffer2);
-	ep2Bi.Stat = DTS;
+        UCONbits.PPBRST = 1;
+        UCONbits.PPBRST = 0;
+        for (n = 1; n < USB_EPS; n++) {
+                uep = UEP_HSHK | UEP_CONDIS;
+                e = &endpoints[n][0];
+                if (e->size) {
+                        e->bd[EVEN].ADDR = PTR16(e->buffer[EVEN]);
+                        e->bd[EVEN].Cnt = e->size;
+                        e->bd[EVEN].Stat = UOWN | EP_SYNC(e);
+                        e->bd[ODD].ADDR = PTR16(e->buffer[ODD]);
+                        e->bd[ODD].Cnt = e->size;
+                        e->bd[ODD].Stat = UOWN | DTS | EP_SYNC(e);
+                        e->pp = EVEN;
+                        uep |= UEP_OUTEN;
+                }
+                e = &endpoints[n][1];
+                if (e->size) {
+                        e->bd[EVEN].ADDR = PTR16(e->buffer[EVEN]);
+                        e->bd[EVEN].Stat = 0;
+                        e->bd[ODD].ADDR = PTR16(e->buffer[ODD]);
+                        e->bd[ODD].Stat = 0;
+                        e->pp = EVEN;
+                        e->dts = 0;
+                        uep |= UEP_INEN;
+                        /**
+                         * UEPn holds both directions: an isochronous IN
+                         * endpoint has no OUT direction (SetAltSetting())
+                         **/
+                        if (e->type == EP_ISO)
+                                uep &= ~UEP_HSHK;
+                }
+                /* See PIC datasheet, page 169 (USB E1 Control)        */
+                (&UEP0)[n] = uep;
+        }
+}
+
+/**
+ * SetAltSetting() - Switch interface 0 to an alternate setting
+ * @alt:             ALT_BULK or ALT_ISO
+ *
+ * Only EP1 changes: in ALT_ISO its IN direction is isochronous and its
+ * OUT direction is gone, as UEP1 turns the handshakes off for both.
+ * Every endpoint of the interface then starts over, as after
+ * SET_CONFIGURATION (USB 2.0, chapter 9.1.1.5): packets the SIE was
+ * holding are lost and the data toggles go back to DATA0.
+ **/
+static void SetAltSetting(byte alt)
+{
+        currentAltSetting = alt;
+        endpoints[1][1].type = (alt == ALT_ISO) ? EP_ISO : EP_BULK;
+        endpoints[1][0].size = (alt == ALT_ISO) ? 0 : OSZ;
+        InitEndpoint();
 }
 
 /**
- * BulkIn() - Makes an IN and returns the amount of bytes transfered
- * @ep_num:   Number of the endpoint to be used (only EP1 & EP2)
- * @buffer:   Buffer of the data to be transfered
- * @len:      Lenght of the bytes transfered
+ * BulkInLease() - Hands out the next IN buffer of an endpoint
+ * @ep_num:        Number of the endpoint
+ *
+ * Returns a pointer into the dual port RAM, as long as the endpoint's
+ * wMaxPacketSize, for the packet to be written in place, or 0 if the SIE
+ * still owns that BD.  Nothing goes to the host until BulkInCommit(); a
+ * lease that is never committed is handed out again by the next call.
+ * There is only one IN lease per endpoint at a time.
  *
- * The function checks if the BD is owned by the CPU retunrning 0 if so.
- * (PIC 18F4550 datasheet page 171 section 17.4.1.1 - Buffer Ownership)
+ * The BD belongs to the CPU until then, so the buffer needs neither the
+ * USB interrupt masked nor volatile accesses to be written.
  *
- * Send up to len bytes to the host.  The actual number of bytes sent is returned
- * to the caller.  If the send failed (usually because a send was attempted while
- * the SIE was busy processing the last request), then 0 is returned.
- **/ 
-byte BulkIn(byte ep_num, byte *buffer, byte len)
+ * Works the same for bulk, interrupt and isochronous endpoints, as do
+ * BulkInCommit() and the BulkOut functions.
+ **/
+byte *BulkInLease(byte ep_num)
 {
-	byte i;
-        /**
-         * If slelected EP1
-         **/
-        if (ep_num == 1) {        
-        /** 
-         * If SIE owns the BD do not try to send anything and return 0. 
-         **/
-	        if (ep1Bi.Stat & UOWN)
-		        return 0;
-	/**
-         * Truncate requests that are too large 
-         **/
-	        if(len > ISZ)       
-		        len = ISZ;
-        /**
-        * Copy data from user's buffer to dual-port ram buffer
-        **/
-	        for (i = 0; i < len; i++)
-		        TxBuffer[i] = buffer[i];
-        /**
-         * Toggle the data bit and give control to the SIE
-         **/
-	        ep1Bi.Cnt = len;
-	        if(ep1Bi.Stat & DTS)
-		        ep1Bi.Stat = UOWN | DTSEN;
-        	else
-	        	ep1Bi.Stat = UOWN | DTS | DTSEN;
+        Endpoint *e;
+        byte *tx;
+
+        e = DataEndpoint(ep_num, 1);
+        if (e == 0)
+                return 0;
+        tx = 0;
+        USBLock();
+        if (!(e->bd[e->pp].Stat & UOWN))
+                tx = e->buffer[e->pp];
+        USBUnlock();
+        return tx;
+}
 
-	        return len;
+/**
+ * BulkInCommit() - Gives the leased IN buffer to the SIE
+ * @ep_num:         Endpoint of the BulkInLease()
+ * @len:            Bytes written into the buffer
+ *
+ * Sets the byte count and the data toggle of the BD, hands it over with
+ * UOWN and moves on to the other BD.  Returns the number of bytes that
+ * will be sent, len cut to the size of the endpoint, or 0 if there was
+ * no lease to commit.  Isochronous packets are all DATA0 at full speed.
+ **/
+byte BulkInCommit(byte ep_num, byte len)
+{
+        Endpoint *e;
+        volatile BDT *bd;
+
+        e = DataEndpoint(ep_num, 1);
+        if (e == 0)
+                return 0;
+        if (len > e->size)
+                len = e->size;
+
+        USBLock();
+        bd = e->bd + e->pp;
+        if (bd->Stat & UOWN) {
+                USBUnlock();
+                return 0;
         }
-        /**
-        * If selected EP2 (same as above)
-        **/
-        else if (ep_num == 2) {
-	        if (ep2Bi.Stat & UOWN)
-		        return 0;
-	
-	        if(len > ISZ)
-		        len = ISZ;
-	
-        	for (i = 0; i < len; i++)
-	        	TxBuffer2[i] = buffer[i];
-	
-        	ep2Bi.Cnt = len;
-	        if(ep2Bi.Stat & DTS)
-		        ep2Bi.Stat = UOWN | DTSEN;
-        	else
-	        	ep2Bi.Stat = UOWN | DTS | DTSEN;
-
-        	return len;
+        bd->Cnt = len;
+        bd->Stat = UOWN | EP_SYNC(e) | e->dts;
+        if (e->type != EP_ISO)
+                e->dts ^= DTS;
+        e->pp ^= 1;
+        USBUnlock();
+
+        return len;
+}
+
+/**
+ * BulkOutLease() - Hands out the packet an OUT endpoint received
+ * @ep_num:         Number of the endpoint
+ * @len:            Gets the number of bytes in the packet
+ *
+ * Returns a pointer to the packet in the dual port RAM, to be read in
+ * place, or 0 (and *len 0) if nothing arrived.  The BD stays with the
+ * CPU, so the host can not send the next packet into it, until
+ * BulkOutRelease().  Asking again before that gives the same packet.
+ **/
+byte *BulkOutLease(byte ep_num, byte *len)
+{
+        Endpoint *e;
+        volatile BDT *bd;
+        byte *rx;
+
+        *len = 0;
+        e = DataEndpoint(ep_num, 0);
+        if (e == 0)
+                return 0;
+        rx = 0;
+        USBLock();
+        bd = e->bd + e->pp;
+        if (!(bd->Stat & UOWN)) {
+                *len = bd->Cnt;
+                rx = e->buffer[e->pp];
         }
+        USBUnlock();
+        return rx;
+}
+
+/**
+ * BulkOutRelease() - Gives the leased OUT buffer back to the SIE
+ * @ep_num:           Endpoint of the BulkOutLease()
+ *
+ * Does nothing if there is no packet to release.
+ **/
+void BulkOutRelease(byte ep_num)
+{
+        Endpoint *e;
+        volatile BDT *bd;
+
+        e = DataEndpoint(ep_num, 0);
+        if (e == 0)
+                return;
+        USBLock();
+        bd = e->bd + e->pp;
+        if (!(bd->Stat & UOWN)) {
         /**
-         * In case of error (ep_num != 1|2) return 0
+         * Resets the OUT buffer descriptor so the host can send more data.
+         * The next packet for this BD comes two toggles later, so it
+         * keeps the same DTS.
          **/
-        return 0;
+                bd->Cnt = e->size;
+                bd->Stat = UOWN | EP_SYNC(e) | (bd->Stat & DTS);
+                e->pp ^= 1;
+        }
+        USBUnlock();
 }
 
 /**
@@ -302,59 +529,32 @@ byte BulkIn(byte ep_num, byte *buffer, byte len)
  * If there are fewer than len bytes, then only the available
  * bytes will be returned.  Any bytes in the buffer beyond len 
  * will be discarded.
+ *
+ * BulkOutLease() and BulkOutRelease() with a copy in between.
  **/
 byte BulkOut(byte ep_num, byte *buffer, byte len) 
 {
+        byte size;
+        byte *rx;
+
         RxLen = 0;
-        /**
-        * If selected EP1
-        **/
-        if (ep_num == 1) {
-        /**
-        * If the SIE doesn't own the output buffer descriptor, 
-        * then it is safe to pull data from it
-        **/
-	        if(!(ep1Bo.Stat & UOWN)) {
+        rx = BulkOutLease(ep_num, &size);
+        if (rx == 0)
+                return 0;
         /**
          * See if the host sent fewer bytes that we asked for.
          **/
-		        if(len > ep1Bo.Cnt)
-			        len = ep1Bo.Cnt;
+        if (len > size)
+                len = size;
         /**
-         * Copy data from dual-ram buffer to user's buffer
+         * Copy data from dual-ram buffer to user's buffer, with the
+         * interrupt held off: the data stages copy from it too
          **/
-		for (RxLen = 0; RxLen < len; RxLen++)
-			buffer[RxLen] = RxBuffer[RxLen];
-        /**
-         * Resets the OUT buffer descriptor so the host can send more data
-         **/
-		ep1Bo.Cnt = sizeof(RxBuffer);
-		if (ep1Bo.Stat & DTS)
-			ep1Bo.Stat = UOWN | DTSEN;
-		else
-			ep1Bo.Stat = UOWN | DTS | DTSEN;
-                } 
-        }
-        /**
-        * The same that above but for EP2. In this case the 'len'
-        * is hardcoded to '1' because only 1 byte is needed for
-        * instructions for the printer.
-        **/
-        else if (ep_num == 2) {
-	        if (!(ep2Bo.Stat & UOWN)) {
-		        if (len > ep2Bo.Cnt)
-			        len = ep2Bo.Cnt;
-
-        		buffer[0] = RxBuffer2;
-                        RxLen = 1;
-        
-	        	ep2Bo.Cnt = 1;
-		        if (ep2Bo.Stat & DTS)
-			        ep2Bo.Stat = UOWN | DTSEN;
-	        	else
-		        	ep2Bo.Stat = UOWN | DTS | DTSEN;
-	        }       
-        }       
+        USBLock();
+        CopyRam(buffer, rx, len);
+        USBUnlock();
+        RxLen = len;
+        BulkOutRelease(ep_num);
         /**
         * Retunrs the lenght of the data recived
         **/
@@ -392,6 +592,7 @@ static void GetDescriptor(void)
                          * Points to device descriptor's address 
                          **/
                         outPtr = (byte *) &deviceDescriptor;
+                        outCode = 1;
                         wCount = DEVICE_DESCRIPTOR_SIZE; 
                 }
                 /**
@@ -400,6 +601,7 @@ static void GetDescriptor(void)
 	        else if (descriptorType == CONFIGURATION_DESCRIPTOR) {
                         requestHandled = 1;
                         outPtr = (byte *) &configDescriptor;
+                        outCode = 1;
                         wCount = configDescriptor.configHeader[2]; 
                         /*** Note: SDCC may generate bad code with this ***/
                 }
@@ -408,12 +610,18 @@ static void GetDescriptor(void)
                  **/
 	        else if (descriptorType == STRING_DESCRIPTOR) {
                         requestHandled = 1;
+                        outCode = 1;
                         if (descriptorIndex == 0)
                                 /* Language encoding */
                                 outPtr = (byte *) &stringDescriptor0;
                         else if (descriptorIndex == 1)  
                                 /* Author name */
                                 outPtr = (byte *) &stringDescriptor1;
+                        else if (descriptorIndex == SERIAL_STRING_INDEX) {
+                                /* Serial number, from the EEPROM */
+                                outPtr = serialDescriptor;
+                                outCode = 0;
+                        }
                         else
                                 /* Device name */
                                 outPtr = (byte *) &stringDescriptor2;
@@ -467,22 +675,16 @@ static void GetStatus(void)
         /**
          * Requested for Endpoint
          **/
-        else if (recipient == 0x02) { 
+        else if ((recipient == 0x02) && ((SetupPacket.wIndex0 & 0x0F) < USB_EPS)) {
                 byte endpointNum = SetupPacket.wIndex0 & 0x0F;
                 byte endpointDir = SetupPacket.wIndex0 & 0x80;
                 requestHandled = 1;
         /**
-         * Endpoint descriptors are 8 bytes long, with each in and out 
-         * taking 4 bytes within the endpoint 
-         * (See PIC18F4550 'Buffer Descriptors and the Buffer Descriptor 
-         * Table' chapter 17.4)
+         * Both BDs of a halted endpoint are stalled, checking the even one
+         * is enough (See PIC18F4550 'Buffer Descriptors and the Buffer
+         * Descriptor Table' chapter 17.4)
          **/
-                inPtr = (byte *)&ep0Bo + (endpointNum * 8); 
-
-                if (endpointDir) 
-                        inPtr += 4;
-
-                if (*inPtr & BSTALL)
+                if (EndpointBD(endpointNum, endpointDir)->Stat & BSTALL)
                         controlTransferBuffer[0] = 0x01;
         }
         /**
@@ -523,20 +725,27 @@ static void SetFeature(void)
                 byte endpointNum = SetupPacket.wIndex0 & 0x0F;
                 byte endpointDir = SetupPacket.wIndex0 & 0x80;
 
-                if ((feature == ENDPOINT_HALT) && (endpointNum != 0)) {
-                        requestHandled = 1;
-                        inPtr = (byte *) &ep0Bo + (endpointNum * 8); 
+                Endpoint *e = DataEndpoint(endpointNum, endpointDir);
 
-                        if (endpointDir)
-                                inPtr += 4;
+                if ((feature == ENDPOINT_HALT) && e) {
+                        volatile BDT *bd = e->bd;
+                        requestHandled = 1;
 
-                        if (SetupPacket.bRequest == SET_FEATURE)
-                                *inPtr = 0x84;
+                        if (SetupPacket.bRequest == SET_FEATURE) {
+                                bd[EVEN].Stat = UOWN | BSTALL;
+                                bd[ODD].Stat = UOWN | BSTALL;
+                        }
+                /**
+                 * Clearing a halt resets the data toggle to DATA0
+                 **/
+                        else if (endpointDir) {
+                                bd[EVEN].Stat = 0x00;
+                                bd[ODD].Stat = 0x00;
+                                e->dts = 0;
+                        }
                         else {
-                                if (endpointDir == 1)
-                                        *inPtr = 0x00;
-                                else
-                                        *inPtr = 0x88;
+                                bd[e->pp].Stat = UOWN | EP_SYNC(e);
+                                bd[e->pp ^ 1].Stat = UOWN | DTS | EP_SYNC(e);
                         }
                 }
         }
@@ -556,7 +765,7 @@ void ProcessStandardRequest(void)
         /**
          * Only attend Standar requests D6..5 == 00b
          **/
-        if ((SetupPacket.bmRequestType & 0x60) != 0x00)
+        if ((SetupPacket.bmRequestType & REQUEST_TYPE_MASK) != STANDARD_REQUEST)
 	        return;
 
         if (request == SET_ADDRESS) {
@@ -590,7 +799,7 @@ void ProcessStandardRequest(void)
                         deviceState = ADDRESS;
                 else {
                         deviceState = CONFIGURED;
-   		        InitEndpoint();
+                        SetAltSetting(ALT_BULK);
                 }
         }
 
@@ -610,20 +819,21 @@ void ProcessStandardRequest(void)
 
         else if (request == GET_INTERFACE) {
             /**
-             * No support for alternate interfaces.  Send
-             * zero back to the host.
+             * Interface 0 is the only one, and only there once configured
              **/
-                requestHandled = 1;
-                controlTransferBuffer[0] = 0;
-                outPtr = (byte *) &controlTransferBuffer;
-                wCount = 1;
+                if (deviceState == CONFIGURED && SetupPacket.wIndex0 == 0) {
+                        requestHandled = 1;
+                        outPtr = (byte *) &currentAltSetting;
+                        wCount = 1;
+                }
         }
         
         else if (request == SET_INTERFACE) {
-            /**
-             * No support for alternate interfaces - just ignore.
-             **/
-                requestHandled = 1;
+                if (deviceState == CONFIGURED && SetupPacket.wIndex0 == 0 &&
+                    SetupPacket.wValue0 <= ALT_ISO) {
+                        requestHandled = 1;
+                        SetAltSetting(SetupPacket.wValue0);
+                }
         }
     /* else if (request == SET_DESCRIPTOR)      */
     /* else if (request == SYNCH_FRAME)         */
@@ -637,8 +847,9 @@ void ProcessStandardRequest(void)
  **/
 void InDataStage(void)
 {
-        byte i;
         word bufferSize;
+
+        PROF_START(PROF_IN_DATA);
         /* Determine how many bytes are going to the host */
         if (wCount < E0SZ)
                 bufferSize = wCount;
@@ -658,12 +869,17 @@ void InDataStage(void)
         **/
         wCount = wCount - bufferSize;
         /**
-        * Move data to the USB output buffer from wherever it sits now.
+        * Move data to the USB output buffer from wherever it sits now,
+        * with the kernel for that address space.
         **/
-        inPtr = (byte *)&controlTransferBuffer;
-
-        for (i=0;i<bufferSize;i++)
-                *inPtr++ = *outPtr++; 
+        if (outCode)
+                CopyCode((byte *) &controlTransferBuffer,
+                         (code byte *) outPtr, (byte) bufferSize);
+        else
+                CopyRam((byte *) &controlTransferBuffer, outPtr,
+                        (byte) bufferSize);
+        outPtr += bufferSize;
+        PROF_STOP(PROF_IN_DATA);
 }
 
 /**
@@ -673,18 +889,22 @@ void InDataStage(void)
  **/
 void OutDataStage(void)
 {
-        word i, bufferSize;
+        word bufferSize;
 
         bufferSize = ((0x03 & ep0Bo.Stat) << 8) | ep0Bo.Cnt;
         /**
+        * Take no more than wLength announced, the size of the buffer at
+        * inPtr
+        **/
+        if (bufferSize > SetupPacket.wLength - wCount)
+                bufferSize = SetupPacket.wLength - wCount;
+        /**
         * Accumulate total number of bytes read
         **/
         wCount = wCount + bufferSize;
 
-        outPtr = (byte*)&controlTransferBuffer;
-
-        for (i=0;i<bufferSize;i++)
-                *inPtr++ = *outPtr++; 
+        CopyRam(inPtr, (byte *) &controlTransferBuffer, (byte) bufferSize);
+        inPtr += bufferSize;
 }
 
 /**
@@ -707,10 +927,16 @@ void SetupStage(void)
         ctrlTransferStage = SETUP_STAGE;
         requestHandled = 0; /* Default is that request hasn't been handled */
         wCount = 0;         /* No bytes transferred */
+        outCode = 0;        /* Answers are in RAM unless said otherwise */
         /**
         * See if this is a standard (as definded in USB chapter 9) request
         **/
         ProcessStandardRequest();
+        /**
+        * Vendor requests are up to the application
+        **/
+        if ((SetupPacket.bmRequestType & REQUEST_TYPE_MASK) == VENDOR_REQUEST)
+                requestHandled = ProcessVendorRequest();
 
         if (!requestHandled) {
         /**
@@ -813,10 +1039,21 @@ void ProcessControlTransfer(void)
         * passed from host to device before servicing it.
         **/
                         OutDataStage();
+                        if (wCount >= SetupPacket.wLength) {
+                                if ((SetupPacket.bmRequestType & REQUEST_TYPE_MASK) == VENDOR_REQUEST)
+                                        VendorDataReceived();
+        /**
+         * All of wLength is in: a packet past it is stalled, the next
+         * SETUP still gets through
+         **/
+                                ep0Bo.Cnt = E0SZ;
+                                ep0Bo.ADDR = PTR16(&SetupPacket);
+                                ep0Bo.Stat = UOWN | BSTALL;
+                        }
         /**
          * Turn control over to the SIE and toggle the data bit
          **/
-                if(ep0Bo.Stat & DTS)
+                else if(ep0Bo.Stat & DTS)
                         ep0Bo.Stat = UOWN | DTSEN;
                 else
                         ep0Bo.Stat = UOWN | DTS | DTSEN;
@@ -883,11 +1120,15 @@ void EnableUSBModule(void)
         * we can move to the Powered state.
         **/
         if ((deviceState == ATTACHED) && !UCONbits.SE0) {
+                /**
+                 * The state goes first: once URSTIE is set a reset may
+                 * be serviced from the interrupt straight away.
+                 **/
+                deviceState = POWERED;
                 UIR = 0;
                 UIE = 0;
                 UIEbits.URSTIE = 1;
                 UIEbits.IDLEIE = 1;
-                deviceState = POWERED;
         }
 }
 
@@ -902,17 +1143,67 @@ void UnSuspend(void)
         UIRbits.ACTVIF = 0;
 }
 
+/**
+ * Suspend(void) -
+ *
+ * The bus has been idle for 3 ms.  Only bus activity (ACTVIF) is left to
+ * wake the device up again, see UnSuspend().
+ **/
+void Suspend(void)
+{
+        usbSuspends++;
+        UIEbits.ACTVIE = 1;
+        UIRbits.IDLEIF = 0;
+        UCONbits.SUSPND = 1;
+}
+
+/**
+ * FrameUpdate(void) - Extend the 11 bit frame number
+ *
+ * UFRM wraps round every 2048 frames, which is noticed here.  It must be
+ * called at least that often, StartOfFrame() sees to it.
+ **/
+static unsigned long FrameUpdate(void)
+{
+        byte h, l;
+        word f;
+
+        do {
+                h = UFRMH;
+                l = UFRML;
+        } while (h != UFRMH);
+        f = ((word) (h & 0x07) << 8) | l;
+        if (f < frameLast)
+                frameEpoch++;
+        frameLast = f;
+        return ((unsigned long) frameEpoch << 11) | f;
+}
+
+/**
+ * FrameNumber(void) - Frames since the device was powered up
+ *
+ * Full speed frames are 1 ms long, so this is also a time stamp that the
+ * host can match with its own frame counter.
+ **/
+unsigned long FrameNumber(void)
+{
+        unsigned long f;
+
+        USBLock();
+        f = FrameUpdate();
+        USBUnlock();
+        return f;
+}
+
 /**
  * StartOfFrame(void) - 
  *
  * Full speed devices get a Start Of Frame (SOF) packet every 1 millisecond.
- * Nothing is currently done with this interrupt (it is simply masked out).
+ * It keeps the extended frame number going.
  **/
 void StartOfFrame(void)
 {
-        /** 
-        * TBD: Add a callback routine to do something
-        **/
+        FrameUpdate();
         UIRbits.SOFIF = 0;
 }
 
@@ -923,6 +1214,7 @@ void StartOfFrame(void)
  **/
 void Stall(void)
 {
+        usbStalls++;
         if (UEP0bits.EPSTALL == 1) {
         /**
          * Prepare for the Setup stage of a control transfer
@@ -940,6 +1232,7 @@ void Stall(void)
  **/
 void BusReset()
 {
+        usbResets++;
         UEIR  = 0x00;
         UIR   = 0x00;
         UEIE  = 0x9f;
@@ -965,6 +1258,7 @@ void BusReset()
         remoteWakeup = 0;               /* Remote wakeup is off by default */ 
         selfPowered = 0;                /* Self powered is off by default  */
         currentConfiguration = 0;       /* Clear active configuration      */
+        currentAltSetting = ALT_BULK;
         deviceState = DEFAULT;
 }
 
@@ -973,8 +1267,24 @@ void BusReset()
  *
  * Main entry point for USB tasks.  
  * Checks interrupts, then checks for transactions.
+ * Called from the main loop, or from the high priority interrupt when the
+ * firmware is built with USB_INTERRUPT.  Profiling builds time it as a
+ * whole, whichever way it returns (prof.h).
  **/
+#if defined(PROFILE)
+static void USBTransactions(void);
+
 void ProcessUSBTransactions(void)
+{
+        PROF_START(PROF_USB);
+        USBTransactions();
+        PROF_STOP(PROF_USB);
+}
+#else
+#define USBTransactions ProcessUSBTransactions
+#endif
+
+void USBTransactions(void)
 {
         /**
          * See if the device is connected yet.
@@ -1001,6 +1311,7 @@ void ProcessUSBTransactions(void)
          * Process a suspend
          **/
         if (UIRbits.IDLEIF && UIEbits.IDLEIE)
+                Suspend();
         /**
          * Process a SOF
          **/
@@ -1012,11 +1323,14 @@ void ProcessUSBTransactions(void)
         if (UIRbits.STALLIF && UIEbits.STALLIE)
                 Stall();
         /**
-         * Process error - Clear errors
-         * TBD: See where it came from.
+         * Process error - Count it, keep what it was and clear it
          **/
-        if (UIRbits.UERRIF && UIEbits.UERRIE)
+        if (UIRbits.UERRIF && UIEbits.UERRIE) {
+                usbErrors++;
+                usbErrorBits |= UEIR;
+                UEIR = 0x00;
                 UIRbits.UERRIF = 0;
+        }
         /**
          *  Unless we have been reset by the host, no need to keep processing
          **/
@@ -21,14 +21,26 @@
 
 /**
  * Convert pointers to fit PIC memory type 
+ * (the host build provides its own version in sim/pic18fregs.h)
  **/
+#ifndef PTR16
 #define PTR16(x) ((unsigned int)(((unsigned long)x) & 0xFFFF))
+#endif
+
+/**
+ * SDCC marks the high priority interrupt vector this way
+ * (the host build calls the vector from its own model)
+ **/
+#ifndef ISR_HIGH
+#define ISR_HIGH interrupt 1
+#endif
 
 /**
  * Define two new types of variables
+ * word is 16 bits wide on both SDCC and the host build.
  **/
-typedef unsigned char byte; 
-typedef unsigned int  word;
+typedef unsigned char  byte; 
+typedef unsigned short word;
 
 /**
  * Separate words into 2 varialbes type byte
@@ -36,6 +48,14 @@ typedef unsigned int  word;
 #define LSB(x) (x & 0xFF)
 #define MSB(x) ((x & 0xFF00) >> 8)
 
+/**
+ * Request types, bmRequestType D6..5 (USB 2.0 Spec Ref Table 9-2)
+ **/
+#define REQUEST_TYPE_MASK  0x60
+#define STANDARD_REQUEST   0x00
+#define CLASS_REQUEST      0x20
+#define VENDOR_REQUEST     0x40
+
 /**
  * Standard Request Codes USB 2.0 Spec Ref Table 9-4
  **/
@@ -78,6 +98,22 @@ typedef unsigned int  word;
 #define BC9    0x02 /* Byte count bit 9                         */
 #define BC8    0x01 /* Byte count bit 8                         */
 
+/**
+ * UEPn bit masks (from PIC datasheet)
+ **/
+#define UEP_HSHK   0x10 /* Handshake Enable Bit                 */
+#define UEP_CONDIS 0x08 /* Control Disable Bit (no SETUP)       */
+#define UEP_OUTEN  0x04 /* OUT Enable Bit                       */
+#define UEP_INEN   0x02 /* IN Enable Bit                        */
+
+/**
+ * Endpoint types, as in bmAttributes of the endpoint descriptor
+ **/
+#define EP_CONTROL   0x00
+#define EP_ISO       0x01
+#define EP_BULK      0x02
+#define EP_INTERRUPT 0x03
+
 /**
  *  Device states (USB spec Chap 9.1.1)
  **/
@@ -110,13 +146,16 @@ extern byte deviceState; /* Visible device states (from USB 2.0, chap 9.1.1) */
 extern byte selfPowered;
 extern byte remoteWakeup;
 extern byte currentConfiguration;
+extern byte currentAltSetting;  /* Of interface 0, ALT_BULK or ALT_ISO */
 
-extern volatile BDT at 0x0400 ep0Bo; /* Endpoint #0 BD Out      */
-extern volatile BDT at 0x0404 ep0Bi; /* Endpoint #0 BD In       */      
-extern volatile BDT at 0x0408 ep1Bo; /* Endpoint #1 BD Out      */
-extern volatile BDT at 0x040C ep1Bi; /* Endpoint #1 BD In       */      
-extern volatile BDT at 0x0410 ep2Bo; /* Endpoint #2 BD Out      */
-extern volatile BDT at 0x0414 ep2Bi; /* Endpoint #2 BD In       */
+/**
+ * Ping-pong buffering is on for every endpoint but EP0 (UCFG PPB = 11),
+ * so EP1 and EP2 have an even and an odd BD per direction
+ * (PIC18F4550 datasheet, figure 17-7).
+ **/
+#define UCFG_PPB  0x03
+#define EVEN      0
+#define ODD       1
 
 /**
  * setupPacketStruct - 
@@ -136,11 +175,6 @@ typedef struct _setupPacketStruct {
     byte extra[56];     /* Fill out to same size as Endpoint 0 max buffer    */
 } setupPacketStruct;
 
-/**
- * Variable for Setup Packets
- **/
-extern volatile setupPacketStruct SetupPacket;
-
 /**
  * Size of the buffer for endpoint 0
  **/
@@ -148,26 +182,82 @@ extern volatile setupPacketStruct SetupPacket;
 
 /**
  * Size of data for BulkIN and BulkOut
+ * EP1 uses the full-speed bulk maximum in both directions.
+ **/
+#define INPUT_BYTES     64
+#define OUTPUT_BYTES    64
+#define INPUT_BYTES2    1
+#define OUTPUT_BYTES2   7
+
+/**
+ * Alternate settings of interface 0.  EP1 IN is bulk in ALT_BULK, best
+ * effort, and isochronous in ALT_ISO: one OUTPUT_BYTES packet of bus time
+ * is reserved for it at a fixed interval, sized when the firmware is
+ * built for ISO_RATE conversions a second ('make ISO_RATE=hz').  A rate
+ * set above it, or untimed conversions, run at ISO_RATE there (RateSet()).
+ * ALT_ISO has no EP1 OUT, UEP1 having no handshakes for it: the stream
+ * is set up, started and stopped with the vendor requests (vendor.h).
  **/
-#define INPUT_BYTES     7 
-#define OUTPUT_BYTES    7
+#define ALT_BULK        0
+#define ALT_ISO         1
+#ifndef ISO_RATE
+#define ISO_RATE        40000UL
+#endif
+
+#include "usbmem.h"
 
+#if defined(SIM)
 /**
- * IN/OUT Buffers
+ * The host build maps the BDT and the buffers onto the register file
+ * model (sim/sim.c), at the same addresses
+ **/
+#define ep0Bo SIM_BD(USB_BD0_OUT)   /* Endpoint #0 BD Out      */
+#define ep0Bi SIM_BD(USB_BD0_IN)    /* Endpoint #0 BD In       */
+#define ep1Bo SIM_BDS(USB_BD(1, 0)) /* Endpoint #1 BDs Out     */
+#define ep1Bi SIM_BDS(USB_BD(1, 1)) /* Endpoint #1 BDs In      */
+#define ep2Bo SIM_BDS(USB_BD(2, 0)) /* Endpoint #2 BDs Out     */
+#define ep2Bi SIM_BDS(USB_BD(2, 1)) /* Endpoint #2 BDs In      */
+
+#define SetupPacket \
+        (*(volatile setupPacketStruct *) SIM_DPRAM(USB_SETUP))
+#define controlTransferBuffer \
+        (*(volatile byte (*)[E0SZ]) SIM_DPRAM(USB_CTRL))
+#define RxBuffer  (*(volatile byte (*)[2][INPUT_BYTES]) SIM_DPRAM(USB_EP1_OUT))
+#define TxBuffer  (*(volatile byte (*)[2][OUTPUT_BYTES]) SIM_DPRAM(USB_EP1_IN))
+#define RxBuffer2 (*(volatile byte (*)[2][INPUT_BYTES2]) SIM_DPRAM(USB_EP2_OUT))
+#define TxBuffer2 (*(volatile byte (*)[2][OUTPUT_BYTES2]) SIM_DPRAM(USB_EP2_IN))
+#else
+extern volatile BDT at USB_BD0_OUT ep0Bo;    /* Endpoint #0 BD Out      */
+extern volatile BDT at USB_BD0_IN ep0Bi;     /* Endpoint #0 BD In       */
+extern volatile BDT at USB_BD(1, 0) ep1Bo[2]; /* Endpoint #1 BDs Out    */
+extern volatile BDT at USB_BD(1, 1) ep1Bi[2]; /* Endpoint #1 BDs In     */
+extern volatile BDT at USB_BD(2, 0) ep2Bo[2]; /* Endpoint #2 BDs Out    */
+extern volatile BDT at USB_BD(2, 1) ep2Bi[2]; /* Endpoint #2 BDs In     */
+
+/**
+ * Variable for Setup Packets
+ **/
+extern volatile setupPacketStruct SetupPacket;
+extern volatile byte controlTransferBuffer[E0SZ];
+
+/**
+ * IN/OUT Buffers, [EVEN] and [ODD] for each BD
  * RxBuffer2 is only 1 byte long.
  **/
-extern volatile byte TxBuffer[OUTPUT_BYTES];
-extern volatile byte RxBuffer[INPUT_BYTES];
-extern volatile byte TxBuffer2[OUTPUT_BYTES];
-extern volatile byte RxBuffer2;
+extern volatile byte TxBuffer[2][OUTPUT_BYTES];
+extern volatile byte RxBuffer[2][INPUT_BYTES];
+extern volatile byte TxBuffer2[2][OUTPUT_BYTES2];
+extern volatile byte RxBuffer2[2][INPUT_BYTES2];
+#endif
 
 /**
  * Pointers inPtr and outPtr are used to move data between buffers from user
  * memory to dual port buffers of the USB module
  **/
 extern byte *outPtr;        
+extern byte outCode;        /* Set if outPtr is in program memory */
 extern byte *inPtr;         
-extern unsigned int wCount; /* Total number of bytes to move */
+extern word wCount;         /* Total number of bytes to move */
 
 // Funciones para uso del USB
 /**
@@ -176,10 +266,65 @@ extern unsigned int wCount; /* Total number of bytes to move */
 void EnableUSBModule(void);
 void ProcessUSBTransactions(void);
 
+/**
+ * Vendor requests on the default control pipe are handed to the
+ * application, which provides these two functions.
+ *
+ * ProcessVendorRequest() is called from the setup stage and returns 0 to
+ * stall the request.  For a device to host request it points outPtr at
+ * the answer and sets wCount.  For a host to device request with a data
+ * stage it points inPtr at a buffer of at least wLength bytes.
+ *
+ * VendorDataReceived() is called once that data stage is complete.
+ **/
+byte ProcessVendorRequest(void);
+void VendorDataReceived(void);
+
+/**
+ * With USB_INTERRUPT defined the USB is serviced from the high priority
+ * interrupt instead of the main loop.  Code outside the interrupt that
+ * touches the BDs masks the USB interrupt while doing so.
+ **/
+#if defined(USB_INTERRUPT)
+#define USBLock()   (PIE2bits.USBIE = 0)
+#define USBUnlock() (PIE2bits.USBIE = 1)
+#else
+#define USBLock()
+#define USBUnlock()
+#endif
+
 /**
  * Functions to read and write bulk endpoints
+ *
+ * BulkOut() copies the received packet into the caller's buffer.  The
+ * leases skip that copy: BulkInLease() gives the next IN buffer to be
+ * written in place and BulkInCommit() sends it,
+ * BulkOutLease() gives the received packet to be read in place and
+ * BulkOutRelease() lets the host fill the buffer again.  A lease is 0
+ * when the SIE owns the BD.  A bus reset while a lease is held starts
+ * the endpoint over, and the commit then sends on the first BD.
  **/
 byte BulkOut(byte ep_num, byte *buffer, byte len);
-byte BulkIn(byte ep_num, byte *buffer, byte len);
+byte *BulkInLease(byte ep_num);
+byte BulkInCommit(byte ep_num, byte len);
+byte *BulkOutLease(byte ep_num, byte *len);
+void BulkOutRelease(byte ep_num);
+
+/**
+ * USB frame number extended to 32 bits, see usb.c
+ **/
+unsigned long FrameNumber(void);
+
+/**
+ * Bus events since power up, for VR_GET_COUNTERS (vendor.h).  The USB
+ * code writes them, but usbInBusy: StreamService() (stream.c) does, with
+ * the USB interrupt masked.
+ **/
+extern unsigned long usbInBusy;     /* Stream packets the SIE held back  */
+extern unsigned long usbStalls;     /* STALL handshakes sent (STALLIF)       */
+extern unsigned long usbResets;     /* Bus resets                            */
+extern unsigned long usbSuspends;   /* Idle bus for 3 ms                     */
+extern unsigned long usbErrors;     /* UERRIF, for any of the UEIR errors    */
+extern byte usbErrorBits;           /* UEIR bits seen in them                */
 
 #endif /* USB_H */
@@ -0,0 +1,133 @@
+/*   usbmem.h - Layout of the dual port USB RAM.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef USBMEM_H
+#define USBMEM_H
+
+/**
+ * The SIE sees the 1 KB from 0x400 to 0x7FF (banks 4 to 7).  Everything
+ * in there is placed at the addresses worked out below from the endpoint
+ * set of usb.h (E0SZ, INPUT_BYTES, OUTPUT_BYTES, INPUT_BYTES2,
+ * OUTPUT_BYTES2) and the ping-pong mode (UCFG_PPB), none of it by the
+ * linker:
+ *
+ *   the BDT, where the SIE expects it (PIC18F4550 datasheet, figure 17-7)
+ *   the EP0 setup packet and control transfer buffer
+ *   the EP1 and EP2 buffers, OUT then IN, even then odd
+ *   the stream FIFO (stream.c), in whatever is left
+ *
+ * Changing a packet size or the ping-pong mode moves everything after it.
+ * A layout that does not fit, or whose pieces overlap, stops the build.
+ **/
+#define USB_RAM_START     0x400
+#define USB_RAM_END       0x800
+
+/**
+ * Endpoints besides EP0, and how many BDs (and buffers) each direction
+ * takes in the ping-pong mode.
+ **/
+#define USB_DATA_EPS      2
+#define USB_EP0_OUT_BDS   ((UCFG_PPB == 0x01 || UCFG_PPB == 0x02) ? 2 : 1)
+#define USB_EP0_IN_BDS    ((UCFG_PPB == 0x02) ? 2 : 1)
+#define USB_EPN_BDS       ((UCFG_PPB >= 0x02) ? 2 : 1)
+
+/**
+ * USB_BD() - Address of the first BD of an endpoint direction
+ * @ep:       Endpoint number, 1 or more
+ * @in:       1 for IN, 0 for OUT
+ **/
+#define USB_BDT           USB_RAM_START
+#define USB_BD(ep, in)    (USB_BDT + 4 * (USB_EP0_OUT_BDS + USB_EP0_IN_BDS + \
+                           ((ep) - 1) * 2 * USB_EPN_BDS + (in) * USB_EPN_BDS))
+#define USB_BD0_OUT       USB_BDT
+#define USB_BD0_IN        (USB_BDT + 4 * USB_EP0_OUT_BDS)
+#define USB_BDT_END       USB_BD(USB_DATA_EPS + 1, 0)
+
+/**
+ * Buffers, one after the other.  The setup packet is read as a
+ * setupPacketStruct, which is E0SZ long.
+ **/
+#define USB_SETUP         USB_BDT_END
+#define USB_CTRL          (USB_SETUP + E0SZ)
+#define USB_EP1_OUT       (USB_CTRL + E0SZ)
+#define USB_EP1_IN        (USB_EP1_OUT + USB_EPN_BDS * INPUT_BYTES)
+#define USB_EP2_OUT       (USB_EP1_IN + USB_EPN_BDS * OUTPUT_BYTES)
+#define USB_EP2_IN        (USB_EP2_OUT + USB_EPN_BDS * INPUT_BYTES2)
+#define USB_BUF_END       (USB_EP2_IN + USB_EPN_BDS * OUTPUT_BYTES2)
+
+/**
+ * The rest goes to the stream FIFO, word aligned.  The FIFO (stream.h)
+ * holds the largest power of two of samples that fits, 256 at most: its
+ * byte indexes then wrap on their own and a mask finds the entry, so
+ * StreamPut() and StreamService() stay in 8 bit arithmetic.  Going past
+ * 256 would take 16 bit indexes on every sample and a wider high-water
+ * mark in VR_GET_COUNTERS.  With the endpoints above, 512 of the 584 free
+ * bytes are used.
+ **/
+#define USB_FIFO          ((USB_BUF_END + 1) & ~1)
+#define USB_FIFO_BYTES    (USB_RAM_END - USB_FIFO)
+#define USB_FIFO_SAMPLES  (USB_FIFO_BYTES >= 512 ? 256 : \
+                           USB_FIFO_BYTES >= 256 ? 128 : \
+                           USB_FIFO_BYTES >= 128 ? 64 : 0)
+
+/**
+ * USB_ONE_BANK() - True if an object does not cross a 256 byte bank
+ *
+ * The setup packet and the control transfer buffer are read and written
+ * with banked instructions, they must each sit in a single bank.  The
+ * bulk buffers and the FIFO are only reached through pointers.
+ **/
+#define USB_ONE_BANK(addr, len) (((addr) >> 8) == (((addr) + (len) - 1) >> 8))
+
+/**
+ * USB_PTR() - Pointer to an object of the layout, fit for a static table
+ * @type:      What it points to
+ * @addr:      One of the addresses above
+ **/
+#if defined(SIM)
+#define USB_PTR(type, addr) ((type *) SIM_DPRAM(addr))
+#else
+#define USB_PTR(type, addr) ((type *) (addr))
+#endif
+
+#if USB_DATA_EPS > 15
+#error "The SIE has 15 endpoints besides EP0"
+#endif
+#if USB_BDT != 0x400
+#error "The SIE expects the BDT at 0x400"
+#endif
+#if USB_BDT_END > USB_SETUP || USB_SETUP + E0SZ > USB_CTRL || \
+    USB_CTRL + E0SZ > USB_EP1_OUT || \
+    USB_EP1_OUT + USB_EPN_BDS * INPUT_BYTES > USB_EP1_IN || \
+    USB_EP1_IN + USB_EPN_BDS * OUTPUT_BYTES > USB_EP2_OUT || \
+    USB_EP2_OUT + USB_EPN_BDS * INPUT_BYTES2 > USB_EP2_IN || \
+    USB_EP2_IN + USB_EPN_BDS * OUTPUT_BYTES2 > USB_BUF_END || \
+    USB_BUF_END > USB_FIFO
+#error "Dual port USB RAM objects overlap"
+#endif
+#if USB_FIFO > USB_RAM_END
+#error "The endpoint buffers do not fit in the dual port USB RAM"
+#endif
+#if USB_FIFO_SAMPLES == 0
+#error "No room left for the stream FIFO"
+#endif
+#if !USB_ONE_BANK(USB_SETUP, E0SZ) || !USB_ONE_BANK(USB_CTRL, E0SZ)
+#error "EP0 buffers cross a bank boundary"
+#endif
+
+#endif /* USBMEM_H */
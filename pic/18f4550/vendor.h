@@ -0,0 +1,82 @@
+/*   vendor.h - Vendor requests on the default control pipe.
+ *
+ *  Copyright (C) 2010  Rosales Victor (todoesverso@gmail.com)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VENDOR_H
+#define VENDOR_H
+
+/**
+ * Acquisition set up through EP0, so it never shares EP1 with the sample
+ * stream and can be changed while streaming.  bmRequestType is 0x40 for
+ * the OUT requests and 0xC0 for the IN ones, anything else is stalled.
+ * Numbers are sent least significant byte first.
+ *
+ * VR_SET_RATE         wValue: rate in Hz bits 15..0, wIndex: bits 31..16
+ *                     (0 for untimed conversions, see rate.h); in ALT_ISO
+ *                     untimed or above ISO_RATE runs at ISO_RATE (usb.h)
+ * VR_GET_RATE         RATE_REPLY_BYTES, as the answer to RATE_SET
+ * VR_SET_SCAN         data stage: 1..ADC_SCAN_MAX scan list entries, a
+ *                     list naming a channel above AN12 is ignored
+ * VR_GET_SCAN         the scan list entries
+ * VR_SET_ADC_CLOCK    wValue: ADCS code, stalled if TAD would be too short
+ * VR_GET_ADC_CLOCK    ADCS code, then the Fosc divider it selects
+ * VR_START            start streaming on EP1 IN, as STREAM_START
+ * VR_STOP             stop streaming, as STREAM_STOP
+ * VR_GET_COUNTERS     since power up, 32 bits each: packets sent,
+ *                     samples lost, FIFO overruns, stream packets held
+ *                     back because the SIE owned both BDs, STALLs, bus
+ *                     resets, suspends and bus errors (stream.h, usb.h);
+ *                     then the UEIR bits seen and the FIFO high-water
+ *                     mark, a byte each.  wValue: 1 to clear the mark
+ *                     once read.
+ *                     A shorter wLength gets the first ones only.
+ * VR_SET_DECIM        wValue: DECIM_* mode, wIndex: N, or k for
+ *                     DECIM_OVERSAMPLE (see decim.h)
+ * VR_GET_DECIM        mode, then N
+ * VR_SET_SERIAL       data stage: the new serial number, 1..SERIAL_MAX
+ *                     characters (serial.h); one that is not valid is
+ *                     ignored.  It does not touch the acquisition.
+ * VR_GET_PROFILE      wIndex: PROF_* probe, wValue: 1 to clear it once
+ *                     read; PROF_REPORT_BYTES (prof.h).  Stalled past the
+ *                     last probe, and always unless built with PROFILE.
+ *
+ * Changing the rate, the scan list, the A/D clock or the decimation while
+ * streaming restarts the acquisition: samples not yet sent are dropped
+ * and the next packet has STREAM_RESTART set.
+ **/
+#define VR_SET_RATE       0x01
+#define VR_GET_RATE       0x02
+#define VR_SET_SCAN       0x03
+#define VR_GET_SCAN       0x04
+#define VR_SET_ADC_CLOCK  0x05
+#define VR_GET_ADC_CLOCK  0x06
+#define VR_START          0x07
+#define VR_STOP           0x08
+#define VR_GET_COUNTERS   0x09
+#define VR_SET_DECIM      0x0A
+#define VR_GET_DECIM      0x0B
+#define VR_SET_SERIAL     0x0C
+#define VR_GET_PROFILE    0x0D
+
+#define VR_COUNTERS_BYTES 34
+
+/**
+ * Longest answer to an IN request
+ **/
+#define VR_BUFFER_BYTES   VR_COUNTERS_BYTES
+
+#endif /* VENDOR_H */